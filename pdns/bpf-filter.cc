@@ -23,8 +23,13 @@
 
 #ifdef HAVE_EBPF
 
+#include <fstream>
+#include <net/if.h>
 #include <sys/syscall.h>
 #include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "ext/libbpf/libbpf.h"
 
@@ -186,6 +191,39 @@ BPFFilter::BPFFilter(uint32_t maxV4Addresses, uint32_t maxV6Addresses, uint32_t
   }
 }
 
+BPFFilter::~BPFFilter()
+{
+  std::unique_lock<std::mutex> lock(d_mutex);
+  while (!d_xdpInterfaces.empty()) {
+    try {
+      detachXDPLocked(d_xdpInterfaces.begin()->first);
+    }
+    catch (...) {
+      d_xdpInterfaces.erase(d_xdpInterfaces.begin());
+    }
+  }
+}
+
+/* the XDP program only looks at packets sent to one of the (protocol, port)
+   our sockets are bound to, so that backend responses and unrelated traffic
+   reaching the same interface are left alone */
+static uint32_t getXDPPortKey(int sock)
+{
+  ComboAddress local;
+  socklen_t addrLen = sizeof(local.sin6);
+  if (getsockname(sock, reinterpret_cast<struct sockaddr*>(&local.sin6), &addrLen) != 0) {
+    throw std::runtime_error("Error getting the local address of a socket: " + std::string(strerror(errno)));
+  }
+
+  int protocol = 0;
+  socklen_t protocolLen = sizeof(protocol);
+  if (getsockopt(sock, SOL_SOCKET, SO_PROTOCOL, &protocol, &protocolLen) != 0) {
+    throw std::runtime_error("Error getting the protocol of a socket: " + std::string(strerror(errno)));
+  }
+
+  return (static_cast<uint32_t>(protocol) << 16) | ntohs(local.sin4.sin_port);
+}
+
 void BPFFilter::addSocket(int sock)
 {
   int res = setsockopt(sock, SOL_SOCKET, SO_ATTACH_BPF, &d_mainfilter.fd, sizeof(d_mainfilter.fd));
@@ -193,6 +231,10 @@ void BPFFilter::addSocket(int sock)
   if (res != 0) {
     throw std::runtime_error("Error attaching BPF filter to this socket: " + std::string(strerror(errno)));
   }
+
+  uint32_t key = getXDPPortKey(sock);
+  std::unique_lock<std::mutex> lock(d_mutex);
+  updateXDPPort(key, true);
 }
 
 void BPFFilter::removeSocket(int sock)
@@ -202,6 +244,48 @@ void BPFFilter::removeSocket(int sock)
   if (res != 0) {
     throw std::runtime_error("Error detaching BPF filter from this socket: " + std::string(strerror(errno)));
   }
+
+  uint32_t key = getXDPPortKey(sock);
+  std::unique_lock<std::mutex> lock(d_mutex);
+  updateXDPPort(key, false);
+}
+
+/* needs to be called with d_mutex held */
+void BPFFilter::updateXDPPort(uint32_t key, bool add)
+{
+  if (add) {
+    if (d_ports[key]++ > 0) {
+      return;
+    }
+  }
+  else {
+    auto it = d_ports.find(key);
+    if (it == d_ports.end()) {
+      return;
+    }
+    if (--(it->second) > 0) {
+      return;
+    }
+    d_ports.erase(it);
+  }
+
+  if (d_xdpportsmap.fd == -1) {
+    /* the XDP filter has not been loaded yet */
+    return;
+  }
+
+  int res = 0;
+  if (add) {
+    uint8_t value = 1;
+    res = bpf_update_elem(d_xdpportsmap.fd, &key, &value, BPF_ANY);
+  }
+  else {
+    res = bpf_delete_elem(d_xdpportsmap.fd, &key);
+  }
+
+  if (res != 0) {
+    throw std::runtime_error("Error updating the BPF XDP ports map: " + std::string(strerror(errno)));
+  }
 }
 
 void BPFFilter::block(const ComboAddress& addr)
@@ -413,4 +497,247 @@ std::vector<std::tuple<DNSName, uint16_t, uint64_t> > BPFFilter::getQNameStats()
   }
   return result;
 }
+
+/* the kernel expects a value buffer large enough for every possible CPU
+   when looking up an entry in a per-CPU map */
+static size_t getPossibleCPUsCount()
+{
+  size_t result = 0;
+  std::ifstream ifs("/sys/devices/system/cpu/possible");
+  std::string ranges;
+  if (ifs && std::getline(ifs, ranges)) {
+    /* "0-7", "0,2-3" */
+    size_t pos = ranges.find_last_of(",-");
+    try {
+      result = std::stoul(pos == std::string::npos ? ranges : ranges.substr(pos + 1)) + 1;
+    }
+    catch (const std::exception& e) {
+      result = 0;
+    }
+  }
+
+  if (result == 0) {
+    long count = sysconf(_SC_NPROCESSORS_CONF);
+    result = count > 0 ? count : 1;
+  }
+
+  return result;
+}
+
+#ifdef XDP_FLAGS_SKB_MODE
+static void setXDPProgram(int ifindex, int progFD, uint32_t flags)
+{
+  int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (sock == -1) {
+    throw std::runtime_error("Error creating a netlink socket: " + std::string(strerror(errno)));
+  }
+
+  struct {
+    struct nlmsghdr nh;
+    struct ifinfomsg ifinfo;
+    char attrbuf[64];
+  } req;
+  memset(&req, 0, sizeof(req));
+  req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+  req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  req.nh.nlmsg_type = RTM_SETLINK;
+  req.nh.nlmsg_seq = 1;
+  req.ifinfo.ifi_family = AF_UNSPEC;
+  req.ifinfo.ifi_index = ifindex;
+
+  /* IFLA_XDP is a nested attribute holding the program FD and the flags */
+  struct nlattr* xdp = reinterpret_cast<struct nlattr*>(reinterpret_cast<char*>(&req) + NLMSG_ALIGN(req.nh.nlmsg_len));
+  xdp->nla_type = NLA_F_NESTED | IFLA_XDP;
+  xdp->nla_len = NLA_HDRLEN;
+
+  struct nlattr* attr = reinterpret_cast<struct nlattr*>(reinterpret_cast<char*>(xdp) + xdp->nla_len);
+  attr->nla_type = IFLA_XDP_FD;
+  attr->nla_len = NLA_HDRLEN + sizeof(progFD);
+  memcpy(reinterpret_cast<char*>(attr) + NLA_HDRLEN, &progFD, sizeof(progFD));
+  xdp->nla_len += NLA_ALIGN(attr->nla_len);
+
+  if (flags != 0) {
+    attr = reinterpret_cast<struct nlattr*>(reinterpret_cast<char*>(xdp) + xdp->nla_len);
+    attr->nla_type = IFLA_XDP_FLAGS;
+    attr->nla_len = NLA_HDRLEN + sizeof(flags);
+    memcpy(reinterpret_cast<char*>(attr) + NLA_HDRLEN, &flags, sizeof(flags));
+    xdp->nla_len += NLA_ALIGN(attr->nla_len);
+  }
+  req.nh.nlmsg_len += NLA_ALIGN(xdp->nla_len);
+
+  if (send(sock, &req, req.nh.nlmsg_len, 0) < 0) {
+    int err = errno;
+    close(sock);
+    throw std::runtime_error("Error sending a netlink message: " + std::string(strerror(err)));
+  }
+
+  char buffer[4096];
+  ssize_t got = recv(sock, buffer, sizeof(buffer), 0);
+  int err = errno;
+  close(sock);
+  if (got < 0) {
+    throw std::runtime_error("Error reading the netlink answer: " + std::string(strerror(err)));
+  }
+
+  for (struct nlmsghdr* nh = reinterpret_cast<struct nlmsghdr*>(buffer); NLMSG_OK(nh, static_cast<size_t>(got)); nh = NLMSG_NEXT(nh, got)) {
+    if (nh->nlmsg_type == NLMSG_ERROR) {
+      const struct nlmsgerr* nlerr = reinterpret_cast<const struct nlmsgerr*>(NLMSG_DATA(nh));
+      if (nlerr->error != 0) {
+        throw std::runtime_error(std::string(strerror(-nlerr->error)));
+      }
+      return;
+    }
+  }
+
+  throw std::runtime_error("No acknowledgement received from netlink");
+}
+
+/* needs to be called with d_mutex held */
+void BPFFilter::loadXDPFilter()
+{
+  if (d_xdpportsmap.fd == -1) {
+    d_xdpportsmap.fd = bpf_create_map(BPF_MAP_TYPE_HASH, sizeof(uint32_t), sizeof(uint8_t), 1024);
+    if (d_xdpportsmap.fd == -1) {
+      throw std::runtime_error("Error creating a BPF XDP ports map: " + std::string(strerror(errno)));
+    }
+
+    for (const auto& port : d_ports) {
+      uint32_t key = port.first;
+      uint8_t value = 1;
+      if (bpf_update_elem(d_xdpportsmap.fd, &key, &value, BPF_ANY) != 0) {
+        throw std::runtime_error("Error updating the BPF XDP ports map: " + std::string(strerror(errno)));
+      }
+    }
+  }
+
+  if (d_xdpcountersmap.fd == -1) {
+    d_xdpcountersmap.fd = bpf_create_map(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32_t), sizeof(uint64_t), 3);
+    if (d_xdpcountersmap.fd == -1) {
+      throw std::runtime_error("Error creating a BPF XDP counters map: " + std::string(strerror(errno)));
+    }
+  }
+
+  if (d_xdpfilter.fd == -1) {
+    struct bpf_insn xdp_filter[] = {
+#include "bpf-filter.xdp.ebpf"
+    };
+
+    d_xdpfilter.fd = bpf_prog_load(BPF_PROG_TYPE_XDP,
+                                   xdp_filter,
+                                   sizeof(xdp_filter),
+                                   "GPL",
+                                   0);
+    if (d_xdpfilter.fd == -1) {
+      throw std::runtime_error("Error loading BPF XDP filter: " + std::string(strerror(errno)));
+    }
+  }
+}
+
+void BPFFilter::attachXDP(const std::string& interface, XDPMode mode)
+{
+  int ifindex = if_nametoindex(interface.c_str());
+  if (ifindex == 0) {
+    throw std::runtime_error("Error looking up interface '" + interface + "': " + std::string(strerror(errno)));
+  }
+
+  std::unique_lock<std::mutex> lock(d_mutex);
+  if (d_xdpInterfaces.count(interface) > 0) {
+    throw std::runtime_error("The XDP filter is already attached to interface '" + interface + "'");
+  }
+
+  loadXDPFilter();
+
+  /* never replace a program someone else attached to this interface */
+  uint32_t flags = XDP_FLAGS_UPDATE_IF_NOEXIST;
+  try {
+    if (mode == XDPMode::Generic) {
+      flags |= XDP_FLAGS_SKB_MODE;
+      setXDPProgram(ifindex, d_xdpfilter.fd, flags);
+    }
+    else {
+      try {
+        setXDPProgram(ifindex, d_xdpfilter.fd, flags | XDP_FLAGS_DRV_MODE);
+        flags |= XDP_FLAGS_DRV_MODE;
+      }
+      catch (const std::runtime_error& e) {
+        if (mode == XDPMode::Native) {
+          throw;
+        }
+        /* the driver does not support XDP, fall back to the generic mode */
+        flags |= XDP_FLAGS_SKB_MODE;
+        setXDPProgram(ifindex, d_xdpfilter.fd, flags);
+      }
+    }
+  }
+  catch (const std::runtime_error& e) {
+    throw std::runtime_error("Error attaching the BPF XDP filter to interface '" + interface + "': " + e.what());
+  }
+
+  d_xdpInterfaces[interface] = std::make_pair(ifindex, flags & ~XDP_FLAGS_UPDATE_IF_NOEXIST);
+}
+
+/* needs to be called with d_mutex held */
+void BPFFilter::detachXDPLocked(const std::string& interface)
+{
+  auto it = d_xdpInterfaces.find(interface);
+  if (it == d_xdpInterfaces.end()) {
+    throw std::runtime_error("The XDP filter is not attached to interface '" + interface + "'");
+  }
+
+  try {
+    setXDPProgram(it->second.first, -1, it->second.second);
+  }
+  catch (const std::runtime_error& e) {
+    throw std::runtime_error("Error detaching the BPF XDP filter from interface '" + interface + "': " + e.what());
+  }
+  d_xdpInterfaces.erase(it);
+}
+#else /* XDP_FLAGS_SKB_MODE */
+void BPFFilter::attachXDP(const std::string& interface, XDPMode mode)
+{
+  throw std::runtime_error("XDP support is not available in this build");
+}
+
+void BPFFilter::detachXDPLocked(const std::string& interface)
+{
+  throw std::runtime_error("XDP support is not available in this build");
+}
+#endif /* XDP_FLAGS_SKB_MODE */
+
+void BPFFilter::detachXDP(const std::string& interface)
+{
+  std::unique_lock<std::mutex> lock(d_mutex);
+  detachXDPLocked(interface);
+}
+
+std::vector<std::string> BPFFilter::getXDPInterfaces()
+{
+  std::vector<std::string> result;
+  std::unique_lock<std::mutex> lock(d_mutex);
+  for (const auto& entry : d_xdpInterfaces) {
+    result.push_back(entry.first);
+  }
+  return result;
+}
+
+uint64_t BPFFilter::getXDPDrops(MapType type)
+{
+  static const size_t cpus = getPossibleCPUsCount();
+  std::unique_lock<std::mutex> lock(d_mutex);
+  if (d_xdpcountersmap.fd == -1) {
+    return 0;
+  }
+
+  uint32_t key = static_cast<uint32_t>(type);
+  std::vector<uint64_t> values(cpus, 0);
+  if (bpf_lookup_elem(d_xdpcountersmap.fd, &key, values.data()) != 0) {
+    return 0;
+  }
+
+  uint64_t result = 0;
+  for (const auto value : values) {
+    result += value;
+  }
+  return result;
+}
 #endif /* HAVE_EBPF */
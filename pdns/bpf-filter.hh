@@ -22,6 +22,7 @@
 #pragma once
 #include "config.h"
 
+#include <map>
 #include <mutex>
 
 #include "iputils.hh"
@@ -31,7 +32,11 @@
 class BPFFilter
 {
 public:
+  enum class XDPMode { Auto, Native, Generic };
+  enum class MapType { V4 = 0, V6 = 1, QNames = 2 };
+
   BPFFilter(uint32_t maxV4Addresses, uint32_t maxV6Addresses, uint32_t maxQNames);
+  ~BPFFilter();
   void addSocket(int sock);
   void removeSocket(int sock);
   void block(const ComboAddress& addr);
@@ -40,7 +45,18 @@ public:
   void unblock(const DNSName& qname, uint16_t qtype=255);
   std::vector<std::pair<ComboAddress, uint64_t> > getAddrStats();
   std::vector<std::tuple<DNSName, uint16_t, uint64_t> > getQNameStats();
+  /* attach the XDP version of the filter to this interface, so that blocked
+     queries are dropped by the driver before any socket buffer is allocated.
+     The socket filter stays in place, catching whatever XDP does not see. */
+  void attachXDP(const std::string& interface, XDPMode mode=XDPMode::Auto);
+  void detachXDP(const std::string& interface);
+  std::vector<std::string> getXDPInterfaces();
+  /* number of packets dropped by the XDP program, per map */
+  uint64_t getXDPDrops(MapType type);
 private:
+  void loadXDPFilter();
+  void detachXDPLocked(const std::string& interface);
+  void updateXDPPort(uint32_t key, bool add);
   struct FDWrapper
   {
     ~FDWrapper()
@@ -58,12 +74,19 @@ private:
   uint32_t d_v4Count{0};
   uint32_t d_v6Count{0};
   uint32_t d_qNamesCount{0};
+  /* (protocol << 16 | port) of the sockets we are attached to, with a reference count */
+  std::map<uint32_t, size_t> d_ports;
+  /* interface name -> (index, XDP flags used to attach) */
+  std::map<std::string, std::pair<int, uint32_t> > d_xdpInterfaces;
   FDWrapper d_v4map;
   FDWrapper d_v6map;
   FDWrapper d_qnamemap;
   FDWrapper d_filtermap;
   FDWrapper d_mainfilter;
   FDWrapper d_qnamefilter;
+  FDWrapper d_xdpportsmap;
+  FDWrapper d_xdpcountersmap;
+  FDWrapper d_xdpfilter;
 };
 
 #endif /* HAVE_EBPF */
@@ -0,0 +1,126 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <thread>
+
+#include "dnsdist.hh"
+#include "dnsdist-cache.hh"
+#include "dnswriter.hh"
+#include "gettime.hh"
+
+/* Compares the lookup throughput of the regular and compact shard layouts of the
+   packet cache, for an increasing number of threads. Not built by default,
+   run 'make dnsdist-cache-bench' */
+
+bool g_console{true};
+bool g_syslog{false};
+bool g_verbose{false};
+
+static void benchmarkPacketCache(DNSDistPacketCache& cache, const std::string& description, size_t threadsCount, unsigned int durationMS)
+{
+  const size_t namesCount = 100000;
+  struct timespec queryTime;
+  gettime(&queryTime);
+  ComboAddress remote;
+
+  vector<vector<uint8_t>> queries(namesCount);
+  vector<DNSName> names;
+  names.reserve(namesCount);
+  for (size_t idx = 0; idx < namesCount; idx++) {
+    names.push_back(DNSName("bench") + DNSName(std::to_string(idx)));
+    DNSPacketWriter pwQ(queries[idx], names[idx], QType::A, QClass::IN, 0);
+
+    vector<uint8_t> response;
+    DNSPacketWriter pwR(response, names[idx], QType::A, QClass::IN, 0);
+    pwR.getHeader()->qr = 1;
+    pwR.startRecord(names[idx], QType::A, 3600, QClass::IN, DNSResourceRecord::ANSWER);
+    pwR.xfr32BitInt(idx);
+    pwR.commit();
+
+    char responseBuf[4096];
+    uint16_t responseBufSize = sizeof(responseBuf);
+    uint32_t key = 0;
+    DNSQuestion dq(&names[idx], QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) queries[idx].data(), queries[idx].size(), queries[idx].size(), false, &queryTime);
+    cache.get(dq, names[idx].wirelength(), 0, responseBuf, &responseBufSize, &key);
+    cache.insert(key, names[idx], QType::A, QClass::IN, (const char*) response.data(), response.size(), false, 0, boost::none);
+  }
+
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> lookups{0};
+  vector<std::thread> threads;
+  for (size_t threadIdx = 0; threadIdx < threadsCount; threadIdx++) {
+    threads.push_back(std::thread([&,threadIdx]() {
+      uint64_t done = 0;
+      size_t idx = threadIdx * 7919;
+      char responseBuf[4096];
+      while (!stop) {
+        idx = (idx + 104729) % namesCount;
+        /* get() does not modify the query */
+        auto& query = queries[idx];
+        uint16_t responseBufSize = sizeof(responseBuf);
+        DNSQuestion dq(&names[idx], QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false, &queryTime);
+        cache.get(dq, names[idx].wirelength(), 0, responseBuf, &responseBufSize, nullptr);
+        done++;
+      }
+      lookups += done;
+    }));
+  }
+
+  usleep(durationMS * 1000);
+  stop = true;
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  cout<<description<<", "<<threadsCount<<" thread(s): "<<(lookups * 1000 / durationMS)<<" lookups/s, "<<cache.getDeferredLookups()<<" deferred"<<endl;
+}
+
+int main(int argc, char** argv)
+try
+{
+  unsigned int durationMS = 1000;
+  if (argc > 1) {
+    durationMS = std::max(1, atoi(argv[1]));
+  }
+
+  for (const size_t threadsCount : { 1, 4, 16 }) {
+    DNSDistPacketCache regular(200000, 86400, 0, 60, 60, false, 16);
+    benchmarkPacketCache(regular, "regular shards", threadsCount, durationMS);
+    DNSDistPacketCache compact(200000, 86400, 0, 60, 60, false, 16, true, 512);
+    benchmarkPacketCache(compact, "compact shards", threadsCount, durationMS);
+  }
+
+  return EXIT_SUCCESS;
+}
+catch(const std::exception& e)
+{
+  cerr<<"Fatal: "<<e.what()<<endl;
+  return EXIT_FAILURE;
+}
+catch(const PDNSException& e)
+{
+  cerr<<"Fatal: "<<e.reason<<endl;
+  return EXIT_FAILURE;
+}
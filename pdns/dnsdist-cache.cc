@@ -24,8 +24,55 @@
 #include "dnsparser.hh"
 #include "dnsdist-cache.hh"
 
-DNSDistPacketCache::DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL, uint32_t minTTL, uint32_t tempFailureTTL, uint32_t staleTTL, bool dontAge, uint32_t shards, bool deferrableInsertLock): d_maxEntries(maxEntries), d_shardCount(shards), d_maxTTL(maxTTL), d_tempFailureTTL(tempFailureTTL), d_minTTL(minTTL), d_staleTTL(staleTTL), d_dontAge(dontAge), d_deferrableInsertLock(deferrableInsertLock)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+std::atomic<uint64_t> DNSDistPacketCache::s_nextId{0};
+
+DNSDistPacketCache::DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL, uint32_t minTTL, uint32_t tempFailureTTL, uint32_t staleTTL, bool dontAge, uint32_t shards, bool deferrableInsertLock, uint16_t inlineEntrySize, uint8_t prefetchPercentage, size_t l1Entries, uint16_t l1EntrySize, const std::string& sharedMemoryFile): d_sharedMemoryFile(sharedMemoryFile), d_maxEntries(maxEntries), d_l1Entries(0), d_shardCount(shards), d_maxTTL(maxTTL), d_tempFailureTTL(tempFailureTTL), d_minTTL(minTTL), d_staleTTL(staleTTL), d_inlineEntrySize(inlineEntrySize), d_l1EntrySize(l1EntrySize), d_prefetchPercentage(prefetchPercentage), d_dontAge(dontAge), d_deferrableInsertLock(deferrableInsertLock)
 {
+  if (d_shardCount == 0) {
+    throw std::runtime_error("The number of shards of a packet cache should be larger than 0");
+  }
+
+  if (l1Entries > 0) {
+    if (d_l1EntrySize < sizeof(dnsheader) || d_l1EntrySize > s_maxInlineEntrySize) {
+      throw std::runtime_error("The size of L1 cache entries should be between " + std::to_string(sizeof(dnsheader)) + " and " + std::to_string(s_maxInlineEntrySize));
+    }
+    /* the L1 cache is direct-mapped using the lower bits of the key */
+    d_l1Entries = 1;
+    while (d_l1Entries < l1Entries) {
+      d_l1Entries <<= 1;
+    }
+  }
+
+  if (d_prefetchPercentage >= 100) {
+    throw std::runtime_error("The prefetch percentage of a packet cache should be lower than 100");
+  }
+
+  if (!d_sharedMemoryFile.empty() && d_inlineEntrySize == 0) {
+    throw std::runtime_error("Storing a packet cache in shared memory requires the compact layout, and thus an inline entry size larger than 0");
+  }
+
+  if (d_inlineEntrySize > 0) {
+    if (d_inlineEntrySize < sizeof(dnsheader) || d_inlineEntrySize > s_maxInlineEntrySize) {
+      throw std::runtime_error("The size of inline cache entries should be between " + std::to_string(sizeof(dnsheader)) + " and " + std::to_string(s_maxInlineEntrySize));
+    }
+
+    d_compactShards.resize(d_shardCount);
+    if (!d_sharedMemoryFile.empty()) {
+      attachSharedMemory(d_sharedMemoryFile, CompactCacheShard::getSlotsCount(maxEntries / d_shardCount));
+      return;
+    }
+
+    for (auto& shard : d_compactShards) {
+      shard.setSize(maxEntries / d_shardCount, d_inlineEntrySize);
+    }
+    return;
+  }
+
   d_shards.resize(d_shardCount);
 
   /* we reserve maxEntries + 1 to avoid rehashing from occurring
@@ -39,12 +86,119 @@ DNSDistPacketCache::~DNSDistPacketCache()
 {
   try {
     vector<std::unique_ptr<WriteLock>> locks;
-    for (uint32_t shardIndex = 0; shardIndex < d_shardCount; shardIndex++) {
-      locks.push_back(std::unique_ptr<WriteLock>(new WriteLock(&d_shards.at(shardIndex).d_lock)));
+    for (auto& shard : d_shards) {
+      locks.push_back(std::unique_ptr<WriteLock>(new WriteLock(&shard.d_lock)));
     }
   }
   catch(...) {
   }
+
+  if (d_sharedMemory != nullptr) {
+    munmap(d_sharedMemory, d_sharedMemorySize);
+  }
+}
+
+/* Maps the compact shards from a file, usually on a tmpfs, so that the entries survive
+   a restart and can be shared by several processes. The file is reused if its layout
+   matches ours, and replaced otherwise. Processes that still have the old file mapped
+   keep using it until they are restarted, which is safe since it is only unlinked. */
+void DNSDistPacketCache::attachSharedMemory(const std::string& path, size_t slotsCount)
+{
+  const size_t slotSize = CompactCacheShard::getSlotSize(d_inlineEntrySize);
+  const size_t headerSize = CompactCacheShard::s_cacheLineSize * ((sizeof(SharedMemoryHeader) + CompactCacheShard::s_cacheLineSize - 1) / CompactCacheShard::s_cacheLineSize);
+  const size_t shardSize = CompactCacheShard::getStorageSize(slotsCount, slotSize);
+  const size_t totalSize = headerSize + d_shardCount * shardSize;
+
+  /* only a few attempts, in case another process replaces the file at the same time */
+  for (size_t attempt = 0; attempt < 3; attempt++) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+      throw std::runtime_error("Unable to open the shared memory file '" + path + "' of a packet cache: " + stringerror());
+    }
+
+    /* serializes the creation and the initialization of the file. The lock belongs to the open
+       file description, which our mapping keeps alive, so it has to be released explicitly */
+    struct stat st;
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0) {
+      const std::string error = stringerror();
+      close(fd);
+      throw std::runtime_error("Unable to lock the shared memory file '" + path + "' of a packet cache: " + error);
+    }
+
+    if (st.st_nlink == 0) {
+      /* replaced by another process while we were waiting for the lock */
+      close(fd);
+      continue;
+    }
+
+    const bool created = st.st_size == 0;
+    if (!created && static_cast<size_t>(st.st_size) != totalSize) {
+      warnlog("Replacing the shared memory file '%s' of a packet cache, its size does not match the cache settings", path);
+      unlink(path.c_str());
+      close(fd);
+      continue;
+    }
+
+    if (created && ftruncate(fd, totalSize) != 0) {
+      const std::string error = stringerror();
+      unlink(path.c_str());
+      close(fd);
+      throw std::runtime_error("Unable to resize the shared memory file '" + path + "' of a packet cache: " + error);
+    }
+
+    void* memory = mmap(nullptr, totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+      const std::string error = stringerror();
+      close(fd);
+      throw std::runtime_error("Unable to map the shared memory file '" + path + "' of a packet cache: " + error);
+    }
+
+    auto header = reinterpret_cast<SharedMemoryHeader*>(memory);
+    if (!created && (header->d_magic != s_sharedMemoryMagic || header->d_version != s_sharedMemoryVersion || header->d_shardCount != d_shardCount || header->d_inlineEntrySize != d_inlineEntrySize || header->d_slotsCount != slotsCount || header->d_slotSize != slotSize)) {
+      warnlog("Replacing the shared memory file '%s' of a packet cache, its layout does not match the cache settings", path);
+      munmap(memory, totalSize);
+      unlink(path.c_str());
+      close(fd);
+      continue;
+    }
+
+    try {
+      char* storage = reinterpret_cast<char*>(memory) + headerSize;
+      for (auto& shard : d_compactShards) {
+        shard.setStorage(storage, slotsCount, slotSize, created, true);
+        storage += shardSize;
+      }
+    }
+    catch (...) {
+      munmap(memory, totalSize);
+      close(fd);
+      throw;
+    }
+
+    if (created) {
+      new (&header->d_generation) std::atomic<uint64_t>(0);
+      header->d_version = s_sharedMemoryVersion;
+      header->d_shardCount = d_shardCount;
+      header->d_inlineEntrySize = d_inlineEntrySize;
+      header->d_slotsCount = slotsCount;
+      header->d_slotSize = slotSize;
+      /* last, so that a file we did not completely initialize is never used */
+      header->d_magic = s_sharedMemoryMagic;
+    }
+
+    d_generation = &header->d_generation;
+    d_sharedMemory = memory;
+    d_sharedMemorySize = totalSize;
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    if (!created) {
+      infolog("Reusing %d entries from the shared memory file '%s' of a packet cache", getSize(), path);
+    }
+    return;
+  }
+
+  throw std::runtime_error("Unable to attach the shared memory file '" + path + "' of a packet cache, it keeps being replaced");
 }
 
 bool DNSDistPacketCache::cachedValueMatches(const CacheValue& cachedValue, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool tcp)
@@ -59,6 +213,7 @@ void DNSDistPacketCache::insertLocked(CacheShard& shard, uint32_t key, const DNS
   auto& map = shard.d_map;
   /* check again now that we hold the lock to prevent a race */
   if (map.size() >= (d_maxEntries / d_shardCount)) {
+    d_fullInserts++;
     return;
   }
 
@@ -91,6 +246,10 @@ void DNSDistPacketCache::insertLocked(CacheShard& shard, uint32_t key, const DNS
 
 void DNSDistPacketCache::insert(uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, bool tcp, uint8_t rcode, boost::optional<uint32_t> tempFailureTTL)
 {
+  if (d_prefetchPercentage > 0) {
+    prefetchDone(key);
+  }
+
   if (responseLen < sizeof(dnsheader))
     return;
 
@@ -120,14 +279,21 @@ void DNSDistPacketCache::insert(uint32_t key, const DNSName& qname, uint16_t qty
     }
   }
 
+  const time_t now = time(NULL);
+  time_t newValidity = now + minTTL;
+
+  if (d_inlineEntrySize > 0) {
+    insertCompact(key, qname, qtype, qclass, response, responseLen, tcp, now, newValidity);
+    return;
+  }
+
   uint32_t shardIndex = getShardIndex(key);
 
   if (d_shards.at(shardIndex).d_entriesCount >= (d_maxEntries / d_shardCount)) {
+    d_fullInserts++;
     return;
   }
 
-  const time_t now = time(NULL);
-  time_t newValidity = now + minTTL;
   CacheValue newValue;
   newValue.qname = qname;
   newValue.qtype = qtype;
@@ -156,16 +322,182 @@ void DNSDistPacketCache::insert(uint32_t key, const DNSName& qname, uint16_t qty
   }
 }
 
-bool DNSDistPacketCache::get(const DNSQuestion& dq, uint16_t consumed, uint16_t queryId, char* response, uint16_t* responseLen, uint32_t* keyOut, uint32_t allowExpired, bool skipAging)
+bool DNSDistPacketCache::isInPrefetchWindow(time_t now, time_t added, time_t validity) const
+{
+  if (d_prefetchPercentage == 0 || validity < now || validity <= added) {
+    return false;
+  }
+
+  const time_t window = ((validity - added) * d_prefetchPercentage) / 100;
+  return (validity - now) <= window;
+}
+
+/* Called on a cache hit. Returns true if the entry is in the last d_prefetchPercentage percent
+   of its TTL and no refresh query is already in flight for it, in which case the caller
+   is expected to send one. */
+bool DNSDistPacketCache::shouldPrefetch(uint32_t key, time_t now, time_t added, time_t validity)
 {
-  std::string dnsQName(dq.qname->toDNSString());
-  uint32_t key = getKey(dnsQName, consumed, (const unsigned char*)dq.dh, dq.len, dq.tcp);
+  if (!isInPrefetchWindow(now, added, validity)) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(d_prefetchLock);
+  auto it = d_prefetchesInFlight.find(key);
+  if (it != d_prefetchesInFlight.end()) {
+    if ((now - it->second) < s_prefetchTimeout) {
+      d_prefetchDeduplicated++;
+      return false;
+    }
+    /* the previous refresh has been lost, try again */
+    d_prefetchMisses++;
+    it->second = now;
+  }
+  else {
+    d_prefetchesInFlight.insert({key, now});
+    d_prefetchesInFlightCount++;
+  }
+
+  d_prefetches++;
+  return true;
+}
+
+void DNSDistPacketCache::prefetchDone(uint32_t key)
+{
+  if (d_prefetchesInFlightCount == 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(d_prefetchLock);
+  if (d_prefetchesInFlight.erase(key) > 0) {
+    d_prefetchesInFlightCount--;
+    d_prefetchHits++;
+  }
+}
+
+void DNSDistPacketCache::expirePrefetchesInFlight(time_t now)
+{
+  if (d_prefetchesInFlightCount == 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(d_prefetchLock);
+  for (auto it = d_prefetchesInFlight.begin(); it != d_prefetchesInFlight.end(); ) {
+    if ((now - it->second) >= s_prefetchTimeout) {
+      it = d_prefetchesInFlight.erase(it);
+      d_prefetchesInFlightCount--;
+      d_prefetchMisses++;
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
+DNSDistPacketCache::L1Cache& DNSDistPacketCache::getL1Cache()
+{
+  /* a thread only ever uses a handful of caches, so a linear scan is fine */
+  static thread_local std::vector<std::pair<uint64_t, std::unique_ptr<L1Cache>>> t_l1Caches;
+  for (auto& l1 : t_l1Caches) {
+    if (l1.first == d_id) {
+      return *l1.second;
+    }
+  }
+
+  t_l1Caches.push_back({d_id, std::unique_ptr<L1Cache>(new L1Cache(d_l1Entries, d_l1EntrySize))});
+  return *t_l1Caches.back().second;
+}
+
+bool DNSDistPacketCache::getFromL1(L1Cache& l1, const DNSQuestion& dq, const QNameView& dnsQName, uint32_t key, uint64_t generation, uint16_t queryId, char* response, uint16_t* responseLen, bool skipAging, bool prefetch)
+{
+  const auto& entry = l1.getEntry(key);
+  const time_t now = time(nullptr);
+  if (!entry.d_used || entry.d_key != key || entry.d_generation != generation || entry.d_qtype != dq.qtype || entry.d_qclass != dq.qclass || entry.d_validity < now || *responseLen < entry.d_len) {
+    d_l1Misses++;
+    return false;
+  }
+
+  /* the shared entry might already have been refreshed, and otherwise the shared
+     cache takes care of sending the refresh query */
+  if (prefetch && isInPrefetchWindow(now, entry.d_added, entry.d_validity)) {
+    d_l1Misses++;
+    return false;
+  }
+
+  const char* data = l1.getData(key);
+  if (!qnameMatches(data, entry.d_len, dnsQName)) {
+    d_l1Misses++;
+    return false;
+  }
+
+  const size_t dnsQNameLen = dnsQName.d_size;
+  memcpy(response, &queryId, sizeof(queryId));
+  memcpy(response + sizeof(queryId), data + sizeof(queryId), sizeof(dnsheader) - sizeof(queryId));
+  /* keep the case of the qname from the query, which might already be in place */
+  memmove(response + sizeof(dnsheader), dnsQName.d_data, dnsQNameLen);
+  if (entry.d_len > (sizeof(dnsheader) + dnsQNameLen)) {
+    memcpy(response + sizeof(dnsheader) + dnsQNameLen, data + sizeof(dnsheader) + dnsQNameLen, entry.d_len - (sizeof(dnsheader) + dnsQNameLen));
+  }
+  *responseLen = entry.d_len;
+
+  if (!d_dontAge && !skipAging) {
+    ageDNSPacket(response, *responseLen, now - entry.d_added);
+  }
+
+  d_l1Hits++;
+  return true;
+}
+
+void DNSDistPacketCache::storeInL1(L1Cache* l1, uint32_t key, uint64_t generation, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, time_t added, time_t validity)
+{
+  if (responseLen > d_l1EntrySize) {
+    return;
+  }
+
+  auto& entry = l1->getEntry(key);
+  memcpy(l1->getData(key), response, responseLen);
+  entry.d_generation = generation;
+  entry.d_added = added;
+  entry.d_validity = validity;
+  entry.d_key = key;
+  entry.d_qtype = qtype;
+  entry.d_qclass = qclass;
+  entry.d_len = responseLen;
+  entry.d_used = true;
+}
+
+bool DNSDistPacketCache::get(const DNSQuestion& dq, uint16_t consumed, uint16_t queryId, char* response, uint16_t* responseLen, uint32_t* keyOut, uint32_t allowExpired, bool skipAging, bool* prefetch)
+{
+  uint32_t key = getKey(consumed, (const unsigned char*)dq.dh, dq.len, dq.tcp);
+  /* the qname has been parsed from the query, and getKey() checked that it fits in there */
+  const QNameView dnsQName{reinterpret_cast<const char*>(dq.dh) + sizeof(dnsheader), consumed};
   if (keyOut)
     *keyOut = key;
 
+  if (prefetch) {
+    *prefetch = false;
+  }
+
+  L1Cache* l1 = nullptr;
+  /* read before looking into the shared cache, so that an entry removed by expunge()
+     while we copy it can't make it into the L1 cache with a valid generation */
+  uint64_t generation = 0;
+  if (d_l1Entries > 0 && !dq.tcp) {
+    generation = d_generation->load();
+    l1 = &getL1Cache();
+    if (getFromL1(*l1, dq, dnsQName, key, generation, queryId, response, responseLen, skipAging, prefetch != nullptr)) {
+      return true;
+    }
+  }
+
+  if (d_inlineEntrySize > 0) {
+    return getCompact(dq, dnsQName, key, queryId, response, responseLen, allowExpired, skipAging, prefetch, l1, generation);
+  }
+
   uint32_t shardIndex = getShardIndex(key);
   time_t now = time(NULL);
   time_t age;
+  time_t added;
+  time_t validity;
   bool stale = false;
   auto& shard = d_shards.at(shardIndex);
   auto& map = shard.d_map;
@@ -213,12 +545,13 @@ bool DNSDistPacketCache::get(const DNSQuestion& dq, uint16_t consumed, uint16_t
       return true;
     }
 
-    const size_t dnsQNameLen = dnsQName.length();
+    const size_t dnsQNameLen = dnsQName.d_size;
     if (value.len < (sizeof(dnsheader) + dnsQNameLen)) {
       return false;
     }
 
-    memcpy(response + sizeof(dnsheader), dnsQName.c_str(), dnsQNameLen);
+    /* the response buffer is usually the query one, in which case the qname is already in place */
+    memmove(response + sizeof(dnsheader), dnsQName.d_data, dnsQNameLen);
     if (value.len > (sizeof(dnsheader) + dnsQNameLen)) {
       memcpy(response + sizeof(dnsheader) + dnsQNameLen, value.value.c_str() + sizeof(dnsheader) + dnsQNameLen, value.len - (sizeof(dnsheader) + dnsQNameLen));
     }
@@ -229,12 +562,22 @@ bool DNSDistPacketCache::get(const DNSQuestion& dq, uint16_t consumed, uint16_t
     else {
       age = (value.validity - value.added) - d_staleTTL;
     }
+    added = value.added;
+    validity = value.validity;
+  }
+
+  if (l1 && !stale) {
+    storeInL1(l1, key, generation, dq.qtype, dq.qclass, response, *responseLen, added, validity);
   }
 
   if (!d_dontAge && !skipAging) {
     ageDNSPacket(response, *responseLen, age);
   }
 
+  if (prefetch && !stale) {
+    *prefetch = shouldPrefetch(key, now, added, validity);
+  }
+
   d_hits++;
   return true;
 }
@@ -247,12 +590,19 @@ void DNSDistPacketCache::purgeExpired(size_t upTo)
   time_t now = time(NULL);
   uint64_t size = getSize();
 
+  expirePrefetchesInFlight(now);
+
   if (upTo >= size) {
     return;
   }
 
   size_t toRemove = size - upTo;
 
+  if (d_inlineEntrySize > 0) {
+    purgeExpiredCompact(toRemove, now);
+    return;
+  }
+
   size_t scannedMaps = 0;
 
   do {
@@ -288,6 +638,13 @@ void DNSDistPacketCache::expunge(size_t upTo)
   }
 
   size_t toRemove = size - upTo;
+  (*d_generation)++;
+
+  if (d_inlineEntrySize > 0) {
+    expungeCompact(toRemove);
+    return;
+  }
+
   size_t removed = 0;
 
   for (uint32_t shardIndex = 0; shardIndex < d_shardCount; shardIndex++) {
@@ -312,6 +669,13 @@ void DNSDistPacketCache::expunge(size_t upTo)
 
 void DNSDistPacketCache::expungeByName(const DNSName& name, uint16_t qtype, bool suffixMatch)
 {
+  (*d_generation)++;
+
+  if (d_inlineEntrySize > 0) {
+    expungeByNameCompact(name, qtype, suffixMatch);
+    return;
+  }
+
   for (uint32_t shardIndex = 0; shardIndex < d_shardCount; shardIndex++) {
     WriteLock w(&d_shards.at(shardIndex).d_lock);
     auto& map = d_shards[shardIndex].d_map;
@@ -329,6 +693,470 @@ void DNSDistPacketCache::expungeByName(const DNSName& name, uint16_t qtype, bool
   }
 }
 
+DNSDistPacketCache::CompactCacheShard::~CompactCacheShard()
+{
+  /* the mutex of a shared memory mapping might still be used by other processes */
+  if (d_storage && d_header != nullptr) {
+    pthread_mutex_destroy(&d_header->d_writeLock);
+  }
+}
+
+size_t DNSDistPacketCache::CompactCacheShard::getSlotsCount(size_t maxEntries)
+{
+  /* we allocate twice as many slots as entries to keep buckets from filling up too quickly,
+     rounded up to a complete bucket */
+  size_t slotsCount = std::max(maxEntries * 2, s_bucketSize);
+  slotsCount += (s_bucketSize - (slotsCount % s_bucketSize)) % s_bucketSize;
+  return slotsCount;
+}
+
+size_t DNSDistPacketCache::CompactCacheShard::getSlotSize(uint16_t entrySize)
+{
+  /* each slot starts on a cache line boundary */
+  size_t slotSize = sizeof(SlotHeader) + entrySize;
+  slotSize += (s_cacheLineSize - (slotSize % s_cacheLineSize)) % s_cacheLineSize;
+  return slotSize;
+}
+
+size_t DNSDistPacketCache::CompactCacheShard::getStorageSize(size_t slotsCount, size_t slotSize)
+{
+  const size_t headerSize = s_cacheLineSize * ((sizeof(ShardHeader) + s_cacheLineSize - 1) / s_cacheLineSize);
+  return headerSize + (slotsCount * slotSize);
+}
+
+void DNSDistPacketCache::CompactCacheShard::setSize(size_t maxEntries, uint16_t entrySize)
+{
+  const size_t slotsCount = getSlotsCount(maxEntries);
+  const size_t slotSize = getSlotSize(entrySize);
+
+  d_storage = std::unique_ptr<char[]>(new char[getStorageSize(slotsCount, slotSize) + s_cacheLineSize]);
+  const uintptr_t misalignment = reinterpret_cast<uintptr_t>(d_storage.get()) % s_cacheLineSize;
+  setStorage(d_storage.get() + ((s_cacheLineSize - misalignment) % s_cacheLineSize), slotsCount, slotSize, true, false);
+}
+
+void DNSDistPacketCache::CompactCacheShard::setStorage(char* storage, size_t slotsCount, size_t slotSize, bool initialize, bool processShared)
+{
+  d_header = reinterpret_cast<ShardHeader*>(storage);
+  d_slots = storage + (getStorageSize(slotsCount, slotSize) - (slotsCount * slotSize));
+  d_slotsCount = slotsCount;
+  d_slotSize = slotSize;
+
+  if (!initialize) {
+    return;
+  }
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  if (processShared) {
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  }
+  int res = pthread_mutex_init(&d_header->d_writeLock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (res != 0) {
+    throw std::runtime_error("Error initializing the lock of a packet cache shard: " + std::string(strerror(res)));
+  }
+  new (&d_header->d_entriesCount) std::atomic<uint64_t>(0);
+
+  for (size_t idx = 0; idx < d_slotsCount; idx++) {
+    new (getSlot(idx)) SlotHeader();
+  }
+}
+
+void DNSDistPacketCache::CompactCacheShard::lock()
+{
+  int res = pthread_mutex_lock(&d_header->d_writeLock);
+  if (res == EOWNERDEAD) {
+    recoverLocked();
+    pthread_mutex_consistent(&d_header->d_writeLock);
+  }
+  else if (res != 0) {
+    throw std::runtime_error("Error acquiring the lock of a packet cache shard: " + std::string(strerror(res)));
+  }
+}
+
+bool DNSDistPacketCache::CompactCacheShard::try_lock()
+{
+  int res = pthread_mutex_trylock(&d_header->d_writeLock);
+  if (res == 0) {
+    return true;
+  }
+  if (res == EOWNERDEAD) {
+    recoverLocked();
+    pthread_mutex_consistent(&d_header->d_writeLock);
+    return true;
+  }
+  if (res == EBUSY) {
+    return false;
+  }
+  throw std::runtime_error("Error acquiring the lock of a packet cache shard: " + std::string(strerror(res)));
+}
+
+void DNSDistPacketCache::CompactCacheShard::unlock()
+{
+  pthread_mutex_unlock(&d_header->d_writeLock);
+}
+
+/* the process holding the lock died, possibly in the middle of an update: discard the slots
+   that were being written to, which readers would otherwise never be able to read, and
+   count the remaining entries again */
+void DNSDistPacketCache::CompactCacheShard::recoverLocked()
+{
+  uint64_t count = 0;
+  for (size_t idx = 0; idx < d_slotsCount; idx++) {
+    SlotHeader* slot = getSlot(idx);
+    if (slot->d_seq.load(std::memory_order_relaxed) & 1) {
+      slot->d_used = false;
+      slot->d_key.store(0, std::memory_order_relaxed);
+      endWrite(slot);
+    }
+    if (slot->d_used) {
+      count++;
+    }
+  }
+  d_header->d_entriesCount.store(count);
+}
+
+bool DNSDistPacketCache::CompactCacheShard::readSlot(SlotHeader* slot, SlotContent& content, char* buffer, size_t bufferSize)
+{
+  static const size_t maxAttempts = 4;
+
+  for (size_t attempt = 0; attempt < maxAttempts; attempt++) {
+    const uint32_t before = slot->d_seq.load(std::memory_order_acquire);
+    if (before & 1) {
+      /* a writer is busy with this slot */
+      continue;
+    }
+
+    content.d_key = slot->d_key.load(std::memory_order_relaxed);
+    content.d_added = slot->d_added;
+    content.d_validity = slot->d_validity;
+    content.d_qtype = slot->d_qtype;
+    content.d_qclass = slot->d_qclass;
+    content.d_len = slot->d_len;
+    content.d_tcp = slot->d_tcp;
+    content.d_used = slot->d_used;
+
+    if (buffer != nullptr && content.d_used) {
+      /* the length might be bogus if we raced with a writer, we will know below */
+      memcpy(buffer, getData(slot), std::min(static_cast<size_t>(content.d_len), bufferSize));
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->d_seq.load(std::memory_order_relaxed) == before) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void DNSDistPacketCache::CompactCacheShard::beginWrite(SlotHeader* slot)
+{
+  slot->d_seq.store(slot->d_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void DNSDistPacketCache::CompactCacheShard::endWrite(SlotHeader* slot)
+{
+  slot->d_seq.store(slot->d_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void DNSDistPacketCache::CompactCacheShard::removeLocked(SlotHeader* slot)
+{
+  beginWrite(slot);
+  slot->d_used = false;
+  slot->d_key.store(0, std::memory_order_relaxed);
+  endWrite(slot);
+  d_header->d_entriesCount--;
+}
+
+bool DNSDistPacketCache::compactValueMatches(const CompactCacheShard::SlotContent& content, const char* data, const QNameView& dnsQName, uint16_t qtype, uint16_t qclass, bool tcp)
+{
+  if (content.d_tcp != tcp || content.d_qtype != qtype || content.d_qclass != qclass) {
+    return false;
+  }
+
+  return qnameMatches(data, content.d_len, dnsQName);
+}
+
+/* the qname is not stored separately, but we only store responses whose question
+   section starts with the qname, so we can compare against it directly */
+bool DNSDistPacketCache::qnameMatches(const char* packet, uint16_t packetLen, const QNameView& dnsQName)
+{
+  const size_t qnameLen = dnsQName.d_size;
+  if (packetLen < sizeof(dnsheader) + qnameLen) {
+    return false;
+  }
+
+  const char* cachedQName = packet + sizeof(dnsheader);
+  for (size_t idx = 0; idx < qnameLen; idx++) {
+    if (cachedQName[idx] != dnsQName.d_data[idx] && dns_tolower(cachedQName[idx]) != dns_tolower(dnsQName.d_data[idx])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void DNSDistPacketCache::insertCompactLocked(CompactCacheShard& shard, uint32_t key, const QNameView& dnsQName, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, bool tcp, time_t now, time_t newValidity)
+{
+  const size_t bucketStart = shard.getBucketStart(key, d_shardCount);
+  CompactCacheShard::SlotHeader* target = nullptr;
+  CompactCacheShard::SlotHeader* firstFree = nullptr;
+  CompactCacheShard::SlotHeader* firstExpired = nullptr;
+
+  /* we hold the write lock, so we can read the slots directly */
+  for (size_t idx = bucketStart; idx < bucketStart + CompactCacheShard::s_bucketSize; idx++) {
+    CompactCacheShard::SlotHeader* slot = shard.getSlot(idx);
+    if (!slot->d_used) {
+      if (firstFree == nullptr) {
+        firstFree = slot;
+      }
+      continue;
+    }
+
+    if (slot->d_key.load(std::memory_order_relaxed) == key) {
+      target = slot;
+      break;
+    }
+
+    if (firstExpired == nullptr && slot->d_validity <= now) {
+      firstExpired = slot;
+    }
+  }
+
+  if (target != nullptr) {
+    /* in case of collision, don't override the existing entry
+       except if it has expired */
+    bool wasExpired = target->d_validity <= now;
+    CompactCacheShard::SlotContent content;
+    content.d_tcp = target->d_tcp;
+    content.d_qtype = target->d_qtype;
+    content.d_qclass = target->d_qclass;
+    content.d_len = target->d_len;
+
+    if (!wasExpired && !compactValueMatches(content, CompactCacheShard::getData(target), dnsQName, qtype, qclass, tcp)) {
+      d_insertCollisions++;
+      return;
+    }
+
+    /* if the existing entry had a longer TTD, keep it */
+    if (newValidity <= target->d_validity) {
+      return;
+    }
+  }
+  else {
+    /* check again now that we hold the lock to prevent a race */
+    if (firstFree != nullptr && shard.d_header->d_entriesCount < (d_maxEntries / d_shardCount)) {
+      target = firstFree;
+      shard.d_header->d_entriesCount++;
+    }
+    else if (firstExpired != nullptr) {
+      target = firstExpired;
+    }
+    else {
+      /* the shard is full, or every slot of this bucket holds a valid entry for a different key */
+      d_fullInserts++;
+      return;
+    }
+  }
+
+  CompactCacheShard::beginWrite(target);
+  target->d_key.store(key, std::memory_order_relaxed);
+  target->d_added = now;
+  target->d_validity = newValidity;
+  target->d_qtype = qtype;
+  target->d_qclass = qclass;
+  target->d_len = responseLen;
+  target->d_tcp = tcp;
+  target->d_used = true;
+  memcpy(CompactCacheShard::getData(target), response, responseLen);
+  CompactCacheShard::endWrite(target);
+}
+
+void DNSDistPacketCache::insertCompact(uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, bool tcp, time_t now, time_t newValidity)
+{
+  if (responseLen > d_inlineEntrySize) {
+    d_inlineTooLarges++;
+    return;
+  }
+
+  const std::string storage(qname.toDNSString());
+  const QNameView dnsQName{storage.c_str(), storage.size()};
+  if (responseLen < sizeof(dnsheader) + dnsQName.d_size) {
+    /* we rely on the qname being present in the response to detect collisions */
+    return;
+  }
+
+  uint32_t shardIndex = getShardIndex(key);
+  auto& shard = d_compactShards.at(shardIndex);
+
+  if (d_deferrableInsertLock) {
+    std::unique_lock<CompactCacheShard> lock(shard, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      d_deferredInserts++;
+      return;
+    }
+    insertCompactLocked(shard, key, dnsQName, qtype, qclass, response, responseLen, tcp, now, newValidity);
+  }
+  else {
+    std::lock_guard<CompactCacheShard> lock(shard);
+    insertCompactLocked(shard, key, dnsQName, qtype, qclass, response, responseLen, tcp, now, newValidity);
+  }
+}
+
+bool DNSDistPacketCache::getCompact(const DNSQuestion& dq, const QNameView& dnsQName, uint32_t key, uint16_t queryId, char* response, uint16_t* responseLen, uint32_t allowExpired, bool skipAging, bool* prefetch, L1Cache* l1, uint64_t generation)
+{
+  uint32_t shardIndex = getShardIndex(key);
+  auto& shard = d_compactShards.at(shardIndex);
+  const size_t bucketStart = shard.getBucketStart(key, d_shardCount);
+  /* the response buffer usually holds the query, so we can't use it until we know we have a hit */
+  char buffer[s_maxInlineEntrySize];
+  CompactCacheShard::SlotContent content;
+  bool found = false;
+
+  for (size_t idx = bucketStart; idx < bucketStart + CompactCacheShard::s_bucketSize; idx++) {
+    CompactCacheShard::SlotHeader* slot = shard.getSlot(idx);
+    if (slot->d_key.load(std::memory_order_relaxed) != key) {
+      continue;
+    }
+
+    if (!CompactCacheShard::readSlot(slot, content, buffer, d_inlineEntrySize)) {
+      d_deferredLookups++;
+      return false;
+    }
+
+    if (content.d_used && content.d_key == key) {
+      found = true;
+      break;
+    }
+  }
+
+  if (!found) {
+    d_misses++;
+    return false;
+  }
+
+  time_t now = time(NULL);
+  time_t age;
+  bool stale = false;
+
+  if (content.d_validity < now) {
+    if ((now - content.d_validity) >= static_cast<time_t>(allowExpired)) {
+      d_misses++;
+      return false;
+    }
+    else {
+      stale = true;
+    }
+  }
+
+  /* the length might come from another process sharing the same memory, check it against the slot size */
+  if (*responseLen < content.d_len || content.d_len < sizeof(dnsheader) || content.d_len > d_inlineEntrySize) {
+    return false;
+  }
+
+  /* check for collision */
+  if (!compactValueMatches(content, buffer, dnsQName, dq.qtype, dq.qclass, dq.tcp)) {
+    d_lookupCollisions++;
+    return false;
+  }
+
+  memcpy(response, &queryId, sizeof(queryId));
+  memcpy(response + sizeof(queryId), buffer + sizeof(queryId), sizeof(dnsheader) - sizeof(queryId));
+
+  const size_t dnsQNameLen = dnsQName.d_size;
+  memmove(response + sizeof(dnsheader), dnsQName.d_data, dnsQNameLen);
+  if (content.d_len > (sizeof(dnsheader) + dnsQNameLen)) {
+    memcpy(response + sizeof(dnsheader) + dnsQNameLen, buffer + sizeof(dnsheader) + dnsQNameLen, content.d_len - (sizeof(dnsheader) + dnsQNameLen));
+  }
+  *responseLen = content.d_len;
+
+  if (!stale) {
+    age = now - content.d_added;
+  }
+  else {
+    age = (content.d_validity - content.d_added) - d_staleTTL;
+  }
+
+  if (l1 && !stale) {
+    storeInL1(l1, key, generation, dq.qtype, dq.qclass, response, *responseLen, content.d_added, content.d_validity);
+  }
+
+  if (!d_dontAge && !skipAging) {
+    ageDNSPacket(response, *responseLen, age);
+  }
+
+  if (prefetch && !stale) {
+    *prefetch = shouldPrefetch(key, now, content.d_added, content.d_validity);
+  }
+
+  d_hits++;
+  return true;
+}
+
+void DNSDistPacketCache::purgeExpiredCompact(size_t toRemove, time_t now)
+{
+  size_t scannedShards = 0;
+
+  do {
+    uint32_t shardIndex = (d_expungeIndex++ % d_shardCount);
+    auto& shard = d_compactShards.at(shardIndex);
+    std::lock_guard<CompactCacheShard> lock(shard);
+
+    for (size_t idx = 0; toRemove > 0 && idx < shard.d_slotsCount; idx++) {
+      CompactCacheShard::SlotHeader* slot = shard.getSlot(idx);
+      if (slot->d_used && slot->d_validity < now) {
+        shard.removeLocked(slot);
+        --toRemove;
+      }
+    }
+
+    scannedShards++;
+  }
+  while (toRemove > 0 && scannedShards < d_shardCount);
+}
+
+void DNSDistPacketCache::expungeCompact(size_t toRemove)
+{
+  size_t removed = 0;
+
+  for (uint32_t shardIndex = 0; shardIndex < d_shardCount; shardIndex++) {
+    auto& shard = d_compactShards.at(shardIndex);
+    std::lock_guard<CompactCacheShard> lock(shard);
+    size_t removeFromThisShard = (toRemove - removed) / (d_shardCount - shardIndex);
+
+    for (size_t idx = 0; removeFromThisShard > 0 && idx < shard.d_slotsCount; idx++) {
+      CompactCacheShard::SlotHeader* slot = shard.getSlot(idx);
+      if (slot->d_used) {
+        shard.removeLocked(slot);
+        --removeFromThisShard;
+        removed++;
+      }
+    }
+  }
+}
+
+void DNSDistPacketCache::expungeByNameCompact(const DNSName& name, uint16_t qtype, bool suffixMatch)
+{
+  for (auto& shard : d_compactShards) {
+    std::lock_guard<CompactCacheShard> lock(shard);
+
+    for (size_t idx = 0; idx < shard.d_slotsCount; idx++) {
+      CompactCacheShard::SlotHeader* slot = shard.getSlot(idx);
+      if (!slot->d_used || (qtype != QType::ANY && qtype != slot->d_qtype)) {
+        continue;
+      }
+
+      DNSName qname(CompactCacheShard::getData(slot), slot->d_len, sizeof(dnsheader), false);
+      if (qname == name || (suffixMatch && qname.isPartOf(name))) {
+        shard.removeLocked(slot);
+      }
+    }
+  }
+}
+
 bool DNSDistPacketCache::isFull()
 {
     return (getSize() >= d_maxEntries);
@@ -338,8 +1166,12 @@ uint64_t DNSDistPacketCache::getSize()
 {
   uint64_t count = 0;
 
-  for (uint32_t shardIndex = 0; shardIndex < d_shardCount; shardIndex++) {
-    count += d_shards.at(shardIndex).d_entriesCount;
+  for (const auto& shard : d_shards) {
+    count += shard.d_entriesCount;
+  }
+
+  for (const auto& shard : d_compactShards) {
+    count += shard.d_header->d_entriesCount;
   }
 
   return count;
@@ -350,18 +1182,18 @@ uint32_t DNSDistPacketCache::getMinTTL(const char* packet, uint16_t length)
   return getDNSPacketMinTTL(packet, length);
 }
 
-uint32_t DNSDistPacketCache::getKey(const std::string& qname, uint16_t consumed, const unsigned char* packet, uint16_t packetLen, bool tcp)
+uint32_t DNSDistPacketCache::getKey(uint16_t consumed, const unsigned char* packet, uint16_t packetLen, bool tcp)
 {
   uint32_t result = 0;
   /* skip the query ID */
   if (packetLen < sizeof(dnsheader))
     throw std::range_error("Computing packet cache key for an invalid packet size");
-  result = burtle(packet + 2, sizeof(dnsheader) - 2, result);
-  string lc(toLower(qname));
-  result = burtle((const unsigned char*) lc.c_str(), lc.length(), result);
   if (packetLen < sizeof(dnsheader) + consumed) {
     throw std::range_error("Computing packet cache key for an invalid packet");
   }
+  result = burtle(packet + 2, sizeof(dnsheader) - 2, result);
+  /* same value as hashing a lowercase copy of the qname, without the copy */
+  result = burtleCI(packet + sizeof(dnsheader), consumed, result);
   if (packetLen > ((sizeof(dnsheader) + consumed))) {
     result = burtle(packet + sizeof(dnsheader) + consumed, packetLen - (sizeof(dnsheader) + consumed), result);
   }
@@ -22,37 +22,58 @@
 #pragma once
 
 #include <atomic>
+#include <mutex>
 #include <unordered_map>
 #include "lock.hh"
+#include "sharded-counter.hh"
 
 struct DNSQuestion;
 
 class DNSDistPacketCache : boost::noncopyable
 {
 public:
-  DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL=86400, uint32_t minTTL=0, uint32_t tempFailureTTL=60, uint32_t staleTTL=60, bool dontAge=false, uint32_t shards=1, bool deferrableInsertLock=true);
+  DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL=86400, uint32_t minTTL=0, uint32_t tempFailureTTL=60, uint32_t staleTTL=60, bool dontAge=false, uint32_t shards=1, bool deferrableInsertLock=true, uint16_t inlineEntrySize=0, uint8_t prefetchPercentage=0, size_t l1Entries=0, uint16_t l1EntrySize=512, const std::string& sharedMemoryFile="");
   ~DNSDistPacketCache();
 
   void insert(uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, bool tcp, uint8_t rcode, boost::optional<uint32_t> tempFailureTTL);
-  bool get(const DNSQuestion& dq, uint16_t consumed, uint16_t queryId, char* response, uint16_t* responseLen, uint32_t* keyOut, uint32_t allowExpired=0, bool skipAging=false);
+  bool get(const DNSQuestion& dq, uint16_t consumed, uint16_t queryId, char* response, uint16_t* responseLen, uint32_t* keyOut, uint32_t allowExpired=0, bool skipAging=false, bool* prefetch=nullptr);
   void purgeExpired(size_t upTo=0);
   void expunge(size_t upTo=0);
   void expungeByName(const DNSName& name, uint16_t qtype=QType::ANY, bool suffixMatch=false);
   bool isFull();
   string toString();
   uint64_t getSize();
-  uint64_t getHits() const { return d_hits; }
+  /* includes the L1 hits */
+  uint64_t getHits() const { return d_hits + d_l1Hits.load(); }
   uint64_t getMisses() const { return d_misses; }
   uint64_t getDeferredLookups() const { return d_deferredLookups; }
   uint64_t getDeferredInserts() const { return d_deferredInserts; }
   uint64_t getLookupCollisions() const { return d_lookupCollisions; }
   uint64_t getInsertCollisions() const { return d_insertCollisions; }
+  uint64_t getFullInserts() const { return d_fullInserts; }
   uint64_t getMaxEntries() const { return d_maxEntries; }
   uint64_t getTTLTooShorts() const { return d_ttlTooShorts; }
+  uint64_t getInlineTooLarges() const { return d_inlineTooLarges; }
+  uint64_t getPrefetches() const { return d_prefetches; }
+  uint64_t getPrefetchHits() const { return d_prefetchHits; }
+  uint64_t getPrefetchMisses() const { return d_prefetchMisses; }
+  uint64_t getPrefetchesInFlight() const { return d_prefetchesInFlightCount; }
+  uint64_t getPrefetchDeduplicated() const { return d_prefetchDeduplicated; }
+  uint64_t getL1Hits() const { return d_l1Hits.load(); }
+  uint64_t getL1Misses() const { return d_l1Misses.load(); }
   uint64_t getEntriesCount();
+  size_t getL1Entries() const { return d_l1Entries; }
+  uint16_t getInlineEntrySize() const { return d_inlineEntrySize; }
+  uint8_t getPrefetchPercentage() const { return d_prefetchPercentage; }
+  const std::string& getSharedMemoryFile() const { return d_sharedMemoryFile; }
 
   static uint32_t getMinTTL(const char* packet, uint16_t length);
 
+  /* largest response that can be stored in the compact shard layout */
+  static const uint16_t s_maxInlineEntrySize{4096};
+  /* number of seconds after which a refresh query still in flight is considered lost */
+  static const time_t s_prefetchTimeout{5};
+
 private:
 
   struct CacheValue
@@ -90,28 +111,244 @@ private:
     std::atomic<uint64_t> d_entriesCount;
   };
 
-  static uint32_t getKey(const std::string& qname, uint16_t consumed, const unsigned char* packet, uint16_t packetLen, bool tcp);
+  /* Alternative shard layout, used when inlineEntrySize is larger than 0.
+     Entries are stored in a contiguous array of fixed-size, cache-line aligned slots,
+     grouped in small buckets (open addressing), each slot holding the key, the TTD
+     and the response itself. Lookups do not take any lock: every slot has a sequence
+     counter (seqlock) that is odd while a writer is updating it, and readers copy
+     the entry then check that the counter did not change in the meantime.
+     Writers are serialized by a per-shard mutex, stored along with the number of
+     entries in a header placed before the slots.
+     The whole shard can live in a shared memory mapping, in which case the mutex is
+     shared between processes and robust: if a process dies while holding it, the next
+     one to get it discards the slots that were being updated. */
+  class CompactCacheShard
+  {
+  public:
+    struct ShardHeader
+    {
+      pthread_mutex_t d_writeLock;
+      std::atomic<uint64_t> d_entriesCount;
+    };
+
+    struct SlotHeader
+    {
+      std::atomic<uint32_t> d_seq{0};
+      std::atomic<uint32_t> d_key{0};
+      time_t d_added{0};
+      time_t d_validity{0};
+      uint16_t d_qtype{0};
+      uint16_t d_qclass{0};
+      uint16_t d_len{0};
+      bool d_tcp{false};
+      bool d_used{false};
+    };
+
+    /* the content of a slot, as seen by a reader */
+    struct SlotContent
+    {
+      time_t d_added;
+      time_t d_validity;
+      uint32_t d_key;
+      uint16_t d_qtype;
+      uint16_t d_qclass;
+      uint16_t d_len;
+      bool d_tcp;
+      bool d_used;
+    };
+
+    CompactCacheShard()
+    {
+    }
+    CompactCacheShard(const CompactCacheShard& old)
+    {
+    }
+    ~CompactCacheShard();
+
+    /* allocates private storage for that many entries and initializes it */
+    void setSize(size_t maxEntries, uint16_t entrySize);
+    /* uses externally-managed storage of getStorageSize() bytes, aligned on a cache line,
+       which is initialized only if requested */
+    void setStorage(char* storage, size_t slotsCount, size_t slotSize, bool initialize, bool processShared);
+
+    static size_t getSlotsCount(size_t maxEntries);
+    static size_t getSlotSize(uint16_t entrySize);
+    static size_t getStorageSize(size_t slotsCount, size_t slotSize);
+
+    /* so that std::lock_guard and std::unique_lock can be used */
+    void lock();
+    bool try_lock();
+    void unlock();
+
+    SlotHeader* getSlot(size_t idx) const
+    {
+      return reinterpret_cast<SlotHeader*>(d_slots + (idx * d_slotSize));
+    }
+    static char* getData(SlotHeader* slot)
+    {
+      return reinterpret_cast<char*>(slot) + sizeof(SlotHeader);
+    }
+    size_t getBucketStart(uint32_t key, uint32_t shardCount) const
+    {
+      return ((key / shardCount) % (d_slotsCount / s_bucketSize)) * s_bucketSize;
+    }
+    /* copies the slot content and up to bufferSize bytes of the response,
+       returns false if a consistent copy could not be obtained */
+    static bool readSlot(SlotHeader* slot, SlotContent& content, char* buffer, size_t bufferSize);
+    static void beginWrite(SlotHeader* slot);
+    static void endWrite(SlotHeader* slot);
+    void removeLocked(SlotHeader* slot);
+
+    static const size_t s_bucketSize{4};
+    static const size_t s_cacheLineSize{64};
+
+    std::unique_ptr<char[]> d_storage;
+    ShardHeader* d_header{nullptr};
+    char* d_slots{nullptr};
+    size_t d_slotsCount{0};
+    size_t d_slotSize{0};
+
+  private:
+    void recoverLocked();
+  };
+
+  /* Placed at the beginning of the shared memory file, followed by the shards. */
+  struct SharedMemoryHeader
+  {
+    uint32_t d_magic;
+    uint32_t d_version;
+    uint32_t d_shardCount;
+    uint32_t d_inlineEntrySize;
+    uint64_t d_slotsCount;
+    uint64_t d_slotSize;
+    /* shared so that an expunge done by one process invalidates the L1 caches of all of them */
+    std::atomic<uint64_t> d_generation;
+  };
+
+  static const uint32_t s_sharedMemoryMagic{0x44445043};
+  static const uint32_t s_sharedMemoryVersion{1};
+
+  void attachSharedMemory(const std::string& path, size_t slotsCount);
+
+  /* The qname in wire format, without owning it. For lookups it points into the query itself,
+     so that we don't have to copy it out of the DNSName for every query. */
+  struct QNameView
+  {
+    const char* d_data;
+    size_t d_size;
+  };
+
+  static uint32_t getKey(uint16_t consumed, const unsigned char* packet, uint16_t packetLen, bool tcp);
   static bool cachedValueMatches(const CacheValue& cachedValue, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool tcp);
   uint32_t getShardIndex(uint32_t key) const;
+  class L1Cache;
+
   void insertLocked(CacheShard& shard, uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool tcp, CacheValue& newValue, time_t now, time_t newValidity);
+  void insertCompact(uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, bool tcp, time_t now, time_t newValidity);
+  void insertCompactLocked(CompactCacheShard& shard, uint32_t key, const QNameView& dnsQName, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, bool tcp, time_t now, time_t newValidity);
+  bool getCompact(const DNSQuestion& dq, const QNameView& dnsQName, uint32_t key, uint16_t queryId, char* response, uint16_t* responseLen, uint32_t allowExpired, bool skipAging, bool* prefetch, L1Cache* l1, uint64_t generation);
+  void purgeExpiredCompact(size_t toRemove, time_t now);
+  void expungeCompact(size_t toRemove);
+  void expungeByNameCompact(const DNSName& name, uint16_t qtype, bool suffixMatch);
+  bool isInPrefetchWindow(time_t now, time_t added, time_t validity) const;
+  bool shouldPrefetch(uint32_t key, time_t now, time_t added, time_t validity);
+  void prefetchDone(uint32_t key);
+  void expirePrefetchesInFlight(time_t now);
+  static bool qnameMatches(const char* packet, uint16_t packetLen, const QNameView& dnsQName);
+  static bool compactValueMatches(const CompactCacheShard::SlotContent& content, const char* data, const QNameView& dnsQName, uint16_t qtype, uint16_t qclass, bool tcp);
+
+  /* A small direct-mapped cache private to a thread, holding copies of the entries recently
+     hit in the shared cache, so that the hottest names are served without touching the shards.
+     Only used for UDP queries, which means by the UDP client threads. An entry is only valid
+     if its generation matches the one of the cache, which is increased every time entries
+     are removed by expunge() or expungeByName(), while expired entries are simply ignored. */
+  class L1Cache
+  {
+  public:
+    struct Entry
+    {
+      uint64_t d_generation{0};
+      time_t d_added{0};
+      time_t d_validity{0};
+      uint32_t d_key{0};
+      uint16_t d_qtype{0};
+      uint16_t d_qclass{0};
+      uint16_t d_len{0};
+      bool d_used{false};
+    };
+
+    L1Cache(size_t entries, uint16_t entrySize): d_entries(entries), d_data(entries * entrySize), d_mask(entries - 1), d_entrySize(entrySize)
+    {
+    }
+
+    Entry& getEntry(uint32_t key)
+    {
+      return d_entries[key & d_mask];
+    }
+    char* getData(uint32_t key)
+    {
+      return &d_data[(key & d_mask) * d_entrySize];
+    }
+
+  private:
+    std::vector<Entry> d_entries;
+    std::vector<char> d_data;
+    const size_t d_mask;
+    const uint16_t d_entrySize;
+  };
+
+  L1Cache& getL1Cache();
+  bool getFromL1(L1Cache& l1, const DNSQuestion& dq, const QNameView& dnsQName, uint32_t key, uint64_t generation, uint16_t queryId, char* response, uint16_t* responseLen, bool skipAging, bool prefetch);
+  void storeInL1(L1Cache* l1, uint32_t key, uint64_t generation, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen, time_t added, time_t validity);
 
   std::vector<CacheShard> d_shards;
+  std::vector<CompactCacheShard> d_compactShards;
+
+  /* keys for which a refresh query has been sent, and when */
+  std::unordered_map<uint32_t, time_t> d_prefetchesInFlight;
+  std::mutex d_prefetchLock;
 
   std::atomic<uint64_t> d_deferredLookups{0};
   std::atomic<uint64_t> d_deferredInserts{0};
   std::atomic<uint64_t> d_hits{0};
   std::atomic<uint64_t> d_misses{0};
   std::atomic<uint64_t> d_insertCollisions{0};
+  /* insertions skipped because there was no room left for the entry */
+  std::atomic<uint64_t> d_fullInserts{0};
   std::atomic<uint64_t> d_lookupCollisions{0};
   std::atomic<uint64_t> d_ttlTooShorts{0};
+  std::atomic<uint64_t> d_inlineTooLarges{0};
+  std::atomic<uint64_t> d_prefetches{0};
+  std::atomic<uint64_t> d_prefetchHits{0};
+  std::atomic<uint64_t> d_prefetchMisses{0};
+  std::atomic<uint64_t> d_prefetchDeduplicated{0};
+  std::atomic<uint64_t> d_prefetchesInFlightCount{0};
+  /* updated by every UDP client thread for every query, so per-thread */
+  ShardedCounter d_l1Hits{0};
+  ShardedCounter d_l1Misses{0};
+  std::atomic<uint64_t> d_localGeneration{0};
+  /* points to d_localGeneration, or into the shared memory */
+  std::atomic<uint64_t>* d_generation{&d_localGeneration};
+  /* identifies this cache in the per-thread list of L1 caches, unlike its address
+     which might be reused once it has been destroyed */
+  const uint64_t d_id{s_nextId++};
+  static std::atomic<uint64_t> s_nextId;
+
+  std::string d_sharedMemoryFile;
+  void* d_sharedMemory{nullptr};
+  size_t d_sharedMemorySize{0};
 
   size_t d_maxEntries;
+  size_t d_l1Entries;
   uint32_t d_expungeIndex{0};
   uint32_t d_shardCount;
   uint32_t d_maxTTL;
   uint32_t d_tempFailureTTL;
   uint32_t d_minTTL;
   uint32_t d_staleTTL;
+  uint16_t d_inlineEntrySize;
+  uint16_t d_l1EntrySize;
+  uint8_t d_prefetchPercentage;
   bool d_dontAge;
   bool d_deferrableInsertLock;
 };
@@ -90,8 +90,26 @@ try
           str<<base<<"queries" << ' ' << state->queries.load() << " " << now << "\r\n";
           str<<base<<"drops" << ' ' << state->reuseds.load() << " " << now << "\r\n";
           str<<base<<"latency" << ' ' << (state->availability != DownstreamState::Availability::Down ? state->latencyUsec/1000.0 : 0) << " " << now << "\r\n";
+          const auto percentiles = state->latencyHistogram.getPercentiles();
+          const bool down = state->availability == DownstreamState::Availability::Down;
+          str<<base<<"latency-p50" << ' ' << (down ? 0 : percentiles.p50/1000.0) << " " << now << "\r\n";
+          str<<base<<"latency-p99" << ' ' << (down ? 0 : percentiles.p99/1000.0) << " " << now << "\r\n";
+          str<<base<<"latency-p999" << ' ' << (down ? 0 : percentiles.p999/1000.0) << " " << now << "\r\n";
           str<<base<<"senderrors" << ' ' << state->sendErrors.load() << " " << now << "\r\n";
           str<<base<<"outstanding" << ' ' << state->outstanding.load() << " " << now << "\r\n";
+          str<<base<<"udp-recv-batches" << ' ' << state->udpRecvBatches.load() << " " << now << "\r\n";
+          str<<base<<"udp-recv-batched-responses" << ' ' << state->udpRecvBatchedResponses.load() << " " << now << "\r\n";
+          str<<base<<"udp-send-batches" << ' ' << state->udpSendBatches.load() << " " << now << "\r\n";
+          str<<base<<"udp-send-batched-responses" << ' ' << state->udpSendBatchedResponses.load() << " " << now << "\r\n";
+          str<<base<<"tcp-current-connections" << ' ' << state->tcpCurrentConnections.load() << " " << now << "\r\n";
+          str<<base<<"tcp-died-sending-query" << ' ' << state->tcpDiedSendingQuery.load() << " " << now << "\r\n";
+          str<<base<<"tcp-died-reading-response" << ' ' << state->tcpDiedReadingResponse.load() << " " << now << "\r\n";
+          str<<base<<"tcp-gave-up" << ' ' << state->tcpGaveUp.load() << " " << now << "\r\n";
+          str<<base<<"tcp-read-timeouts" << ' ' << state->tcpReadTimeouts.load() << " " << now << "\r\n";
+          str<<base<<"tcp-write-timeouts" << ' ' << state->tcpWriteTimeouts.load() << " " << now << "\r\n";
+          str<<base<<"tcp-new-connections" << ' ' << state->tcpNewConnections.load() << " " << now << "\r\n";
+          str<<base<<"tcp-reused-connections" << ' ' << state->tcpReusedConnections.load() << " " << now << "\r\n";
+          str<<base<<"tcp-too-many-concurrent-connections" << ' ' << state->tcpTooManyConcurrentConnections.load() << " " << now << "\r\n";
         }
         for(const auto& front : g_frontends) {
           if (front->udpFD == -1 && front->tcpFD == -1)
@@ -101,6 +119,26 @@ try
           boost::replace_all(frontName, ".", "_");
           const string base = "dnsdist." + hostname + ".main.frontends." + frontName + ".";
           str<<base<<"queries" << ' ' << front->queries.load() << " " << now << "\r\n";
+          const auto percentiles = front->latencyHistogram.getPercentiles();
+          str<<base<<"latency-p50" << ' ' << percentiles.p50/1000.0 << " " << now << "\r\n";
+          str<<base<<"latency-p99" << ' ' << percentiles.p99/1000.0 << " " << now << "\r\n";
+          str<<base<<"latency-p999" << ' ' << percentiles.p999/1000.0 << " " << now << "\r\n";
+          if (front->udpFD >= 0) {
+            str<<base<<"udp-recv-batches" << ' ' << front->udpRecvBatches.load() << " " << now << "\r\n";
+            str<<base<<"udp-recv-batched-queries" << ' ' << front->udpRecvBatchedQueries.load() << " " << now << "\r\n";
+            str<<base<<"udp-send-batches" << ' ' << front->udpSendBatches.load() << " " << now << "\r\n";
+            str<<base<<"udp-send-batched-responses" << ' ' << front->udpSendBatchedResponses.load() << " " << now << "\r\n";
+          }
+          else {
+            str<<base<<"tcp-current-connections" << ' ' << front->tcpCurrentConnections.load() << " " << now << "\r\n";
+            str<<base<<"tcp-died-reading-query" << ' ' << front->tcpDiedReadingQuery.load() << " " << now << "\r\n";
+            str<<base<<"tcp-died-sending-response" << ' ' << front->tcpDiedSendingResponse.load() << " " << now << "\r\n";
+            str<<base<<"tcp-gave-up" << ' ' << front->tcpGaveUp.load() << " " << now << "\r\n";
+            str<<base<<"tcp-client-timeouts" << ' ' << front->tcpClientTimeouts.load() << " " << now << "\r\n";
+            str<<base<<"tcp-downstream-timeouts" << ' ' << front->tcpDownstreamTimeouts.load() << " " << now << "\r\n";
+            str<<base<<"tcp-avg-queries-per-connection" << ' ' << front->tcpAvgQueriesPerConnection << " " << now << "\r\n";
+            str<<base<<"tcp-avg-connection-duration" << ' ' << front->tcpAvgConnectionDuration << " " << now << "\r\n";
+          }
         }
         const auto localPools = g_pools.getCopy();
         for (const auto& entry : localPools) {
@@ -112,6 +150,10 @@ try
           const string base = "dnsdist." + hostname + ".main.pools." + poolName + ".";
           const std::shared_ptr<ServerPool> pool = entry.second;
           str<<base<<"servers" << " " << pool->servers.size() << " " << now << "\r\n";
+          const auto percentiles = pool->latencyHistogram.getPercentiles();
+          str<<base<<"latency-p50" << " " << percentiles.p50/1000.0 << " " << now << "\r\n";
+          str<<base<<"latency-p99" << " " << percentiles.p99/1000.0 << " " << now << "\r\n";
+          str<<base<<"latency-p999" << " " << percentiles.p999/1000.0 << " " << now << "\r\n";
           if (pool->packetCache != nullptr) {
             const auto& cache = pool->packetCache;
             str<<base<<"cache-size" << " " << cache->getMaxEntries() << " " << now << "\r\n";
@@ -122,7 +164,13 @@ try
             str<<base<<"cache-deferred-lookups" << " " << cache->getDeferredLookups() << " " << now << "\r\n";
             str<<base<<"cache-lookup-collisions" << " " << cache->getLookupCollisions() << " " << now << "\r\n";
             str<<base<<"cache-insert-collisions" << " " << cache->getInsertCollisions() << " " << now << "\r\n";
+            str<<base<<"cache-full-inserts" << " " << cache->getFullInserts() << " " << now << "\r\n";
             str<<base<<"cache-ttl-too-shorts" << " " << cache->getTTLTooShorts() << " " << now << "\r\n";
+            str<<base<<"cache-prefetches" << " " << cache->getPrefetches() << " " << now << "\r\n";
+            str<<base<<"cache-prefetch-hits" << " " << cache->getPrefetchHits() << " " << now << "\r\n";
+            str<<base<<"cache-prefetch-misses" << " " << cache->getPrefetchMisses() << " " << now << "\r\n";
+            str<<base<<"cache-prefetches-in-flight" << " " << cache->getPrefetchesInFlight() << " " << now << "\r\n";
+            str<<base<<"cache-prefetches-deduplicated" << " " << cache->getPrefetchDeduplicated() << " " << now << "\r\n";
           }
         }
 
@@ -0,0 +1,66 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "dnsdist-dynblocks.hh"
+
+void DynBlockExpiryWheel::add(const Netmask& key, time_t until)
+{
+  std::lock_guard<std::mutex> lock(d_lock);
+  /* an entry that should already have expired goes to the next slot to be processed */
+  const time_t second = until < d_nextSecond ? d_nextSecond : until;
+  d_slots[static_cast<size_t>(second) % s_numberOfSlots].push_back({key, until});
+  d_size++;
+}
+
+void DynBlockExpiryWheel::getExpired(time_t now, std::vector<std::pair<Netmask, time_t>>& expired)
+{
+  std::lock_guard<std::mutex> lock(d_lock);
+  if (now <= d_nextSecond) {
+    return;
+  }
+
+  /* if we have not been called for more than a full round, every slot needs to be looked at */
+  const size_t slotsToProcess = static_cast<size_t>(std::min(now - d_nextSecond, static_cast<time_t>(s_numberOfSlots)));
+  for (size_t idx = 0; idx < slotsToProcess; idx++) {
+    auto& slot = d_slots[static_cast<size_t>(d_nextSecond + idx) % s_numberOfSlots];
+    /* entries scheduled more than a round ahead stay there */
+    auto it = slot.begin();
+    while (it != slot.end()) {
+      if (it->second < now) {
+        expired.push_back(std::move(*it));
+        *it = std::move(slot.back());
+        slot.pop_back();
+        d_size--;
+      }
+      else {
+        ++it;
+      }
+    }
+  }
+
+  d_nextSecond = now;
+}
+
+size_t DynBlockExpiryWheel::size() const
+{
+  std::lock_guard<std::mutex> lock(d_lock);
+  return d_size;
+}
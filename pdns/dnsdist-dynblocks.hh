@@ -0,0 +1,336 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "iputils.hh"
+
+/* A netmask to value map doing longest-prefix matches, like NetmaskTree, but persistent:
+   the nodes are immutable and shared between copies, so copying the whole tree is O(1),
+   and inserting or removing an entry only copies the nodes on the path to it (at most 33
+   for IPv4, 129 for IPv6), leaving the other copies untouched. This makes it cheap to
+   publish a new version through a GlobalStateHolder after every change, even with
+   hundreds of thousands of entries, while readers keep using the version they got.
+
+   The trie is path-compressed: a node only exists if it holds a value or if both of its
+   children are set, so the depth is bounded by the number of entries as well. */
+template <typename T>
+class PersistentNetmaskTree
+{
+public:
+  typedef std::pair<Netmask, T> node_type;
+
+  void insert(const Netmask& key, const T& value)
+  {
+    auto entry = std::make_shared<node_type>();
+    entry->first = key;
+    entry->second = value;
+    bool added = false;
+    auto& root = getRoot(key.getNetwork());
+    root = insert(root, getKey(key.getNetwork()), key.getBits(), entry, added);
+    if (added) {
+      d_size++;
+    }
+  }
+
+  /* returns true if the exact key was present */
+  bool erase(const Netmask& key)
+  {
+    bool removed = false;
+    auto& root = getRoot(key.getNetwork());
+    root = erase(root, getKey(key.getNetwork()), key.getBits(), removed);
+    if (removed) {
+      d_size--;
+    }
+    return removed;
+  }
+
+  /* best match for value, using at most max_bits */
+  const node_type* lookup(const ComboAddress& value, int max_bits = 128) const
+  {
+    const Node* node = getRoot(value).get();
+    const Key key = getKey(value);
+    const node_type* ret = nullptr;
+
+    while (node != nullptr && node->d_bits <= max_bits && commonPrefixLength(node->d_key, key) >= node->d_bits) {
+      if (node->d_entry) {
+        ret = node->d_entry.get();
+      }
+      if (node->d_bits >= getMaxBits(value)) {
+        break;
+      }
+      node = node->d_children[getBit(key, node->d_bits)].get();
+    }
+
+    return ret;
+  }
+
+  const node_type* lookup(const Netmask& value) const
+  {
+    return lookup(value.getNetwork(), value.getBits());
+  }
+
+  size_t size() const
+  {
+    return d_size;
+  }
+
+  bool empty() const
+  {
+    return d_size == 0;
+  }
+
+  void clear()
+  {
+    d_root4.reset();
+    d_root6.reset();
+    d_size = 0;
+  }
+
+  /* calls fn(const node_type&) for every entry */
+  template <typename F>
+  void visit(F fn) const
+  {
+    visit(d_root4.get(), fn);
+    visit(d_root6.get(), fn);
+  }
+
+private:
+  /* the address bits, the first one being the most significant bit of d_high */
+  struct Key
+  {
+    uint64_t d_high{0};
+    uint64_t d_low{0};
+  };
+
+  struct Node
+  {
+    Key d_key;
+    int d_bits{0};
+    std::shared_ptr<const Node> d_children[2];
+    std::shared_ptr<const node_type> d_entry{nullptr};
+  };
+  typedef std::shared_ptr<const Node> NodePtr;
+
+  static Key getKey(const ComboAddress& address)
+  {
+    Key key;
+    if (address.sin4.sin_family == AF_INET) {
+      key.d_high = static_cast<uint64_t>(ntohl(address.sin4.sin_addr.s_addr)) << 32;
+    }
+    else {
+      const unsigned char* addr = address.sin6.sin6_addr.s6_addr;
+      for (size_t idx = 0; idx < 8; idx++) {
+        key.d_high = (key.d_high << 8) | addr[idx];
+        key.d_low = (key.d_low << 8) | addr[idx + 8];
+      }
+    }
+    return key;
+  }
+
+  static int getMaxBits(const ComboAddress& address)
+  {
+    return address.sin4.sin_family == AF_INET ? 32 : 128;
+  }
+
+  static unsigned int getBit(const Key& key, int bit)
+  {
+    if (bit < 64) {
+      return (key.d_high >> (63 - bit)) & 1;
+    }
+    return (key.d_low >> (127 - bit)) & 1;
+  }
+
+  static Key maskKey(const Key& key, int bits)
+  {
+    Key result;
+    if (bits >= 64) {
+      result.d_high = key.d_high;
+      result.d_low = bits >= 128 ? key.d_low : (bits == 64 ? 0 : key.d_low & (~static_cast<uint64_t>(0) << (128 - bits)));
+    }
+    else {
+      result.d_high = bits == 0 ? 0 : key.d_high & (~static_cast<uint64_t>(0) << (64 - bits));
+    }
+    return result;
+  }
+
+  static int commonPrefixLength(const Key& a, const Key& b)
+  {
+    uint64_t diff = a.d_high ^ b.d_high;
+    if (diff != 0) {
+      return __builtin_clzll(diff);
+    }
+    diff = a.d_low ^ b.d_low;
+    if (diff != 0) {
+      return 64 + __builtin_clzll(diff);
+    }
+    return 128;
+  }
+
+  static NodePtr makeNode(const Key& key, int bits, const std::shared_ptr<const node_type>& entry)
+  {
+    auto node = std::make_shared<Node>();
+    node->d_key = maskKey(key, bits);
+    node->d_bits = bits;
+    node->d_entry = entry;
+    return node;
+  }
+
+  static NodePtr insert(const NodePtr& node, const Key& key, int bits, const std::shared_ptr<const node_type>& entry, bool& added)
+  {
+    if (!node) {
+      added = true;
+      return makeNode(key, bits, entry);
+    }
+
+    const int common = std::min(commonPrefixLength(node->d_key, key), std::min(node->d_bits, bits));
+
+    if (common == node->d_bits && common == bits) {
+      /* same netmask, replace the value */
+      auto copy = std::make_shared<Node>(*node);
+      added = !node->d_entry;
+      copy->d_entry = entry;
+      return copy;
+    }
+
+    if (common == node->d_bits) {
+      /* the node covers the new netmask, go down */
+      auto copy = std::make_shared<Node>(*node);
+      const unsigned int child = getBit(key, node->d_bits);
+      copy->d_children[child] = insert(node->d_children[child], key, bits, entry, added);
+      return copy;
+    }
+
+    added = true;
+    if (common == bits) {
+      /* the new netmask covers the node */
+      auto newNode = std::make_shared<Node>();
+      newNode->d_key = maskKey(key, bits);
+      newNode->d_bits = bits;
+      newNode->d_entry = entry;
+      newNode->d_children[getBit(node->d_key, bits)] = node;
+      return newNode;
+    }
+
+    /* they diverge, we need a branching node */
+    auto branch = std::make_shared<Node>();
+    branch->d_key = maskKey(key, common);
+    branch->d_bits = common;
+    branch->d_children[getBit(key, common)] = makeNode(key, bits, entry);
+    branch->d_children[getBit(node->d_key, common)] = node;
+    return branch;
+  }
+
+  /* a node without a value only needs to exist if it has two children */
+  static NodePtr compact(const std::shared_ptr<Node>& node)
+  {
+    if (node->d_entry || (node->d_children[0] && node->d_children[1])) {
+      return node;
+    }
+    return node->d_children[0] ? node->d_children[0] : node->d_children[1];
+  }
+
+  static NodePtr erase(const NodePtr& node, const Key& key, int bits, bool& removed)
+  {
+    if (!node || node->d_bits > bits || commonPrefixLength(node->d_key, key) < node->d_bits) {
+      return node;
+    }
+
+    if (node->d_bits == bits) {
+      if (!node->d_entry) {
+        return node;
+      }
+      removed = true;
+      auto copy = std::make_shared<Node>(*node);
+      copy->d_entry.reset();
+      return compact(copy);
+    }
+
+    const unsigned int child = getBit(key, node->d_bits);
+    auto newChild = erase(node->d_children[child], key, bits, removed);
+    if (!removed) {
+      return node;
+    }
+    auto copy = std::make_shared<Node>(*node);
+    copy->d_children[child] = newChild;
+    return compact(copy);
+  }
+
+  template <typename F>
+  static void visit(const Node* node, F& fn)
+  {
+    if (node == nullptr) {
+      return;
+    }
+    if (node->d_entry) {
+      fn(*node->d_entry);
+    }
+    visit(node->d_children[0].get(), fn);
+    visit(node->d_children[1].get(), fn);
+  }
+
+  NodePtr& getRoot(const ComboAddress& address)
+  {
+    return address.sin4.sin_family == AF_INET ? d_root4 : d_root6;
+  }
+
+  const NodePtr& getRoot(const ComboAddress& address) const
+  {
+    return address.sin4.sin_family == AF_INET ? d_root4 : d_root6;
+  }
+
+  NodePtr d_root4{nullptr};
+  NodePtr d_root6{nullptr};
+  size_t d_size{0};
+};
+
+/* Keeps track of when entries expire, with a one-second resolution, in a ring of slots
+   indexed by expiration time (a timing wheel). Scheduling an entry and collecting the
+   expired ones cost O(entries concerned), whatever the total number of entries.
+   An entry scheduled more than s_numberOfSlots seconds in the future stays in its
+   slot for several rounds. */
+class DynBlockExpiryWheel
+{
+public:
+  DynBlockExpiryWheel(): d_slots(s_numberOfSlots)
+  {
+  }
+
+  void add(const Netmask& key, time_t until);
+  /* appends to expired the entries scheduled to expire before now, as (key, until) pairs.
+     The caller should check that the entry still expires at that time, since it might
+     have been extended (and scheduled again) or removed in the meantime. */
+  void getExpired(time_t now, std::vector<std::pair<Netmask, time_t>>& expired);
+  size_t size() const;
+
+  static const size_t s_numberOfSlots{1024};
+
+private:
+  std::vector<std::vector<std::pair<Netmask, time_t>>> d_slots;
+  mutable std::mutex d_lock;
+  /* first second that has not been processed yet */
+  time_t d_nextSecond{0};
+  size_t d_size{0};
+};
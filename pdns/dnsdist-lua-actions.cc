@@ -649,9 +649,7 @@ public:
         (*d_alterFunc)(*dq, &message);
       }
     }
-    std::string data;
-    message.serialize(data);
-    d_logger->queueData(data);
+    d_logger->queueMessage(message);
 #endif /* HAVE_PROTOBUF */
     return Action::None;
   }
@@ -678,16 +676,22 @@ public:
       dq->uniqueId = t_uuidGenerator();
     }
 
+    if (!d_alterFunc) {
+      /* no need to build a DNSDistProtoBufMessage object that Lua could alter,
+         encode directly to a per-thread buffer */
+      static thread_local std::string t_buffer;
+      t_buffer.clear();
+      encodeDNSDistProtoBufMessage(t_buffer, *dq);
+      d_logger->queueData(t_buffer);
+      return Action::None;
+    }
+
     DNSDistProtoBufMessage message(*dq);
     {
-      if (d_alterFunc) {
-        std::lock_guard<std::mutex> lock(g_luamutex);
-        (*d_alterFunc)(*dq, &message);
-      }
+      std::lock_guard<std::mutex> lock(g_luamutex);
+      (*d_alterFunc)(*dq, &message);
     }
-    std::string data;
-    message.serialize(data);
-    d_logger->queueData(data);
+    d_logger->queueMessage(message);
 #endif /* HAVE_PROTOBUF */
     return Action::None;
   }
@@ -765,9 +769,7 @@ public:
         (*d_alterFunc)(*dr, &message);
       }
     }
-    std::string data;
-    message.serialize(data);
-    d_logger->queueData(data);
+    d_logger->queueMessage(message);
 #endif /* HAVE_PROTOBUF */
     return Action::None;
   }
@@ -794,16 +796,20 @@ public:
       dr->uniqueId = t_uuidGenerator();
     }
 
+    if (!d_alterFunc) {
+      static thread_local std::string t_buffer;
+      t_buffer.clear();
+      encodeDNSDistProtoBufMessage(t_buffer, *dr, d_includeCNAME);
+      d_logger->queueData(t_buffer);
+      return Action::None;
+    }
+
     DNSDistProtoBufMessage message(*dr, d_includeCNAME);
     {
-      if (d_alterFunc) {
-        std::lock_guard<std::mutex> lock(g_luamutex);
-        (*d_alterFunc)(*dr, &message);
-      }
+      std::lock_guard<std::mutex> lock(g_luamutex);
+      (*d_alterFunc)(*dr, &message);
     }
-    std::string data;
-    message.serialize(data);
-    d_logger->queueData(data);
+    d_logger->queueMessage(message);
 #endif /* HAVE_PROTOBUF */
     return Action::None;
   }
@@ -919,6 +925,7 @@ static void addAction(GlobalStateHolder<vector<T> > *someRulActions, luadnsrule_
   someRulActions->modify([rule, action, uuid](vector<T>& rulactions){
       rulactions.push_back({rule, action, uuid});
     });
+  refreshRuleChain(someRulActions);
 }
 
 void setupLuaActions()
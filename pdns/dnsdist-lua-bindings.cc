@@ -53,6 +53,7 @@ void setupLuaBindings(bool client)
   g_lua.writeVariable("roundrobin", ServerPolicy{"roundrobin", roundrobin});
   g_lua.writeVariable("wrandom", ServerPolicy{"wrandom", wrandom});
   g_lua.writeVariable("whashed", ServerPolicy{"whashed", whashed});
+  g_lua.writeVariable("chashed", ServerPolicy{"chashed", chashed});
   g_lua.writeVariable("leastOutstanding", ServerPolicy{"leastOutstanding", leastOutstanding});
 
   /* ServerPool */
@@ -95,7 +96,7 @@ void setupLuaBindings(bool client)
   g_lua.registerFunction("getName", &DownstreamState::getName);
   g_lua.registerFunction("getNameWithAddr", &DownstreamState::getNameWithAddr);
   g_lua.registerMember("upStatus", &DownstreamState::upStatus);
-  g_lua.registerMember("weight", &DownstreamState::weight);
+  g_lua.registerMember<int (DownstreamState::*)>("weight", [](const DownstreamState& s) -> int { return s.weight; }, [](DownstreamState& s, int newWeight) { s.setWeight(newWeight); });
   g_lua.registerMember("order", &DownstreamState::order);
   g_lua.registerMember("name", &DownstreamState::name);
 
@@ -192,8 +193,71 @@ void setupLuaBindings(bool client)
 #endif /* HAVE_EBPF */
 
   /* PacketCache */
-  g_lua.writeFunction("newPacketCache", [](size_t maxEntries, boost::optional<uint32_t> maxTTL, boost::optional<uint32_t> minTTL, boost::optional<uint32_t> tempFailTTL, boost::optional<uint32_t> staleTTL, boost::optional<bool> dontAge, boost::optional<size_t> numberOfShards, boost::optional<bool> deferrableInsertLock) {
-      return std::make_shared<DNSDistPacketCache>(maxEntries, maxTTL ? *maxTTL : 86400, minTTL ? *minTTL : 0, tempFailTTL ? *tempFailTTL : 60, staleTTL ? *staleTTL : 60, dontAge ? *dontAge : false, numberOfShards ? *numberOfShards : 1, deferrableInsertLock ? *deferrableInsertLock : true);
+  typedef std::unordered_map<std::string, boost::variant<bool, size_t, std::string> > packetcache_options_t;
+  g_lua.writeFunction("newPacketCache", [](size_t maxEntries, boost::optional<boost::variant<uint32_t, packetcache_options_t>> maxTTLOrOptions, boost::optional<uint32_t> minTTL, boost::optional<uint32_t> tempFailTTL, boost::optional<uint32_t> staleTTL, boost::optional<bool> dontAge, boost::optional<size_t> numberOfShards, boost::optional<bool> deferrableInsertLock) {
+      uint32_t maxTTL = 86400;
+      size_t inlineEntrySize = 0;
+      size_t prefetchPercentage = 0;
+      size_t l1Entries = 0;
+      size_t l1EntrySize = 512;
+      std::string sharedMemoryFile;
+
+      if (maxTTLOrOptions) {
+        if (auto ttl = boost::get<uint32_t>(&*maxTTLOrOptions)) {
+          maxTTL = *ttl;
+        }
+        else {
+          /* newPacketCache(maxEntries, { option=value, ... }) */
+          auto& vars = boost::get<packetcache_options_t>(*maxTTLOrOptions);
+          if (vars.count("maxTTL")) {
+            maxTTL = boost::get<size_t>(vars["maxTTL"]);
+          }
+          if (vars.count("minTTL")) {
+            minTTL = boost::get<size_t>(vars["minTTL"]);
+          }
+          if (vars.count("temporaryFailureTTL")) {
+            tempFailTTL = boost::get<size_t>(vars["temporaryFailureTTL"]);
+          }
+          if (vars.count("staleTTL")) {
+            staleTTL = boost::get<size_t>(vars["staleTTL"]);
+          }
+          if (vars.count("dontAge")) {
+            dontAge = boost::get<bool>(vars["dontAge"]);
+          }
+          if (vars.count("numberOfShards")) {
+            numberOfShards = boost::get<size_t>(vars["numberOfShards"]);
+          }
+          if (vars.count("deferrableInsertLock")) {
+            deferrableInsertLock = boost::get<bool>(vars["deferrableInsertLock"]);
+          }
+          if (vars.count("inlineEntrySize")) {
+            inlineEntrySize = boost::get<size_t>(vars["inlineEntrySize"]);
+            if (inlineEntrySize > DNSDistPacketCache::s_maxInlineEntrySize) {
+              throw std::runtime_error("The inlineEntrySize of a packet cache should not be larger than " + std::to_string(DNSDistPacketCache::s_maxInlineEntrySize));
+            }
+          }
+          if (vars.count("prefetch")) {
+            prefetchPercentage = boost::get<size_t>(vars["prefetch"]);
+            if (prefetchPercentage >= 100) {
+              throw std::runtime_error("The prefetch percentage of a packet cache should be lower than 100");
+            }
+          }
+          if (vars.count("l1Entries")) {
+            l1Entries = boost::get<size_t>(vars["l1Entries"]);
+          }
+          if (vars.count("l1EntrySize")) {
+            l1EntrySize = boost::get<size_t>(vars["l1EntrySize"]);
+            if (l1EntrySize > DNSDistPacketCache::s_maxInlineEntrySize) {
+              throw std::runtime_error("The l1EntrySize of a packet cache should not be larger than " + std::to_string(DNSDistPacketCache::s_maxInlineEntrySize));
+            }
+          }
+          if (vars.count("sharedMemoryFile")) {
+            sharedMemoryFile = boost::get<std::string>(vars["sharedMemoryFile"]);
+          }
+        }
+      }
+
+      return std::make_shared<DNSDistPacketCache>(maxEntries, maxTTL, minTTL ? *minTTL : 0, tempFailTTL ? *tempFailTTL : 60, staleTTL ? *staleTTL : 60, dontAge ? *dontAge : false, numberOfShards ? *numberOfShards : 1, deferrableInsertLock ? *deferrableInsertLock : true, static_cast<uint16_t>(inlineEntrySize), static_cast<uint8_t>(prefetchPercentage), l1Entries, static_cast<uint16_t>(l1EntrySize), sharedMemoryFile);
     });
   g_lua.registerFunction("toString", &DNSDistPacketCache::toString);
   g_lua.registerFunction("isFull", &DNSDistPacketCache::isFull);
@@ -217,7 +281,22 @@ void setupLuaBindings(bool client)
         g_outputBuffer+="Deferred lookups: " + std::to_string(cache->getDeferredLookups()) + "\n";
         g_outputBuffer+="Lookup Collisions: " + std::to_string(cache->getLookupCollisions()) + "\n";
         g_outputBuffer+="Insert Collisions: " + std::to_string(cache->getInsertCollisions()) + "\n";
+        g_outputBuffer+="Full inserts: " + std::to_string(cache->getFullInserts()) + "\n";
         g_outputBuffer+="TTL Too Shorts: " + std::to_string(cache->getTTLTooShorts()) + "\n";
+        if (cache->getInlineEntrySize() > 0) {
+          g_outputBuffer+="Too large for inline storage: " + std::to_string(cache->getInlineTooLarges()) + "\n";
+        }
+        if (cache->getPrefetchPercentage() > 0) {
+          g_outputBuffer+="Prefetches: " + std::to_string(cache->getPrefetches()) + "\n";
+          g_outputBuffer+="Prefetch hits: " + std::to_string(cache->getPrefetchHits()) + "\n";
+          g_outputBuffer+="Prefetch misses: " + std::to_string(cache->getPrefetchMisses()) + "\n";
+          g_outputBuffer+="Prefetches in-flight: " + std::to_string(cache->getPrefetchesInFlight()) + "\n";
+          g_outputBuffer+="Prefetches deduplicated: " + std::to_string(cache->getPrefetchDeduplicated()) + "\n";
+        }
+        if (cache->getL1Entries() > 0) {
+          g_outputBuffer+="L1 hits: " + std::to_string(cache->getL1Hits()) + "\n";
+          g_outputBuffer+="L1 misses: " + std::to_string(cache->getL1Misses()) + "\n";
+        }
       }
     });
 
@@ -285,6 +364,16 @@ void setupLuaBindings(bool client)
 #endif /* HAVE_FSTRM */
     });
 
+  g_lua.registerFunction<std::map<std::string, double>(std::shared_ptr<RemoteLoggerInterface>::*)()>("getStats", [](const std::shared_ptr<RemoteLoggerInterface> logger) {
+      std::map<std::string, double> result;
+      if (logger) {
+        result["queued-bytes"] = logger->getQueuedBytes();
+        result["dropped-bytes"] = logger->getDroppedBytes();
+        result["flushed-bytes"] = logger->getFlushedBytes();
+      }
+      return result;
+    });
+
 #ifdef HAVE_DNSCRYPT
   /* DnsCryptContext bindings */
   g_lua.registerFunction<std::string(DnsCryptContext::*)()>("getProviderName", [](const DnsCryptContext& ctx) { return ctx.getProviderName(); });
@@ -369,10 +458,73 @@ void setupLuaBindings(bool client)
         for (const auto& value : qstats) {
           res += std::get<0>(value).toString() + " " + std::to_string(std::get<1>(value)) + ": " + std::to_string(std::get<2>(value)) + "\n";
         }
+        std::vector<std::string> interfaces = bpf->getXDPInterfaces();
+        if (!interfaces.empty()) {
+          res += "XDP drops on";
+          for (const auto& interface : interfaces) {
+            res += " " + interface;
+          }
+          res += ": v4 " + std::to_string(bpf->getXDPDrops(BPFFilter::MapType::V4));
+          res += ", v6 " + std::to_string(bpf->getXDPDrops(BPFFilter::MapType::V6));
+          res += ", qnames " + std::to_string(bpf->getXDPDrops(BPFFilter::MapType::QNames)) + "\n";
+        }
       }
       return res;
     });
 
+  g_lua.registerFunction<bool(std::shared_ptr<BPFFilter>::*)(const std::string& interface, boost::optional<std::string> mode)>("attachXDP", [](std::shared_ptr<BPFFilter> bpf, const std::string& interface, boost::optional<std::string> mode) {
+      if (!bpf) {
+        return false;
+      }
+      BPFFilter::XDPMode xdpMode = BPFFilter::XDPMode::Auto;
+      if (mode) {
+        if (*mode == "native") {
+          xdpMode = BPFFilter::XDPMode::Native;
+        }
+        else if (*mode == "generic") {
+          xdpMode = BPFFilter::XDPMode::Generic;
+        }
+        else if (*mode != "auto") {
+          g_outputBuffer = "Invalid XDP mode '" + *mode + "', valid values are 'auto', 'native' and 'generic'\n";
+          errlog("Invalid XDP mode '%s', valid values are 'auto', 'native' and 'generic'", *mode);
+          return false;
+        }
+      }
+      try {
+        bpf->attachXDP(interface, xdpMode);
+        return true;
+      }
+      catch (const std::exception& e) {
+        /* the socket filter is still attached to our sockets, so blocked queries are dropped, just later */
+        g_outputBuffer = std::string(e.what()) + ", falling back to socket filtering\n";
+        warnlog("%s, falling back to socket filtering", e.what());
+      }
+      return false;
+    });
+
+  g_lua.registerFunction<void(std::shared_ptr<BPFFilter>::*)(const std::string& interface)>("detachXDP", [](std::shared_ptr<BPFFilter> bpf, const std::string& interface) {
+      if (bpf) {
+        bpf->detachXDP(interface);
+      }
+    });
+
+  g_lua.registerFunction<uint64_t(std::shared_ptr<BPFFilter>::*)(const std::string& map)>("getXDPDrops", [](const std::shared_ptr<BPFFilter> bpf, const std::string& map) {
+      setLuaNoSideEffect();
+      if (!bpf) {
+        return static_cast<uint64_t>(0);
+      }
+      if (map == "v4") {
+        return bpf->getXDPDrops(BPFFilter::MapType::V4);
+      }
+      else if (map == "v6") {
+        return bpf->getXDPDrops(BPFFilter::MapType::V6);
+      }
+      else if (map == "qnames") {
+        return bpf->getXDPDrops(BPFFilter::MapType::QNames);
+      }
+      throw std::runtime_error("Invalid map '" + map + "', valid values are 'v4', 'v6' and 'qnames'");
+    });
+
   g_lua.registerFunction<void(std::shared_ptr<BPFFilter>::*)()>("attachToAllBinds", [](std::shared_ptr<BPFFilter> bpf) {
       std::string res;
       if (bpf) {
@@ -29,28 +29,25 @@ static std::unordered_map<int, vector<boost::variant<string,double>>> getGenResp
   setLuaNoSideEffect();
   map<DNSName, int> counts;
   unsigned int total=0;
-  {
-    std::lock_guard<std::mutex> lock(g_rings.respMutex);
-    if(!labels) {
-      for(const auto& a : g_rings.respRing) {
+  if(!labels) {
+    g_rings.forEachResponse([&counts, &total, &pred](const Rings::Response& a) {
         if(!pred(a))
-          continue;
-        counts[a.name]++;
+          return;
+        counts[a.getName()]++;
         total++;
-      }
-    }
-    else {
-      unsigned int lab = *labels;
-      for(auto a : g_rings.respRing) {
+      });
+  }
+  else {
+    unsigned int lab = *labels;
+    g_rings.forEachResponse([&counts, &total, &pred, lab](const Rings::Response& a) {
         if(!pred(a))
-          continue;
+          return;
 
-        a.name.trimToLabels(lab);
-        counts[a.name]++;
+        DNSName name = a.getName();
+        name.trimToLabels(lab);
+        counts[name]++;
         total++;
-      }
-
-    }
+      });
   }
   //      cout<<"Looked at "<<total<<" responses, "<<counts.size()<<" different ones"<<endl;
   vector<pair<int, DNSName>> rcounts;
@@ -103,18 +100,16 @@ static void statNodeRespRing(statvisitor_t visitor, unsigned int seconds)
     cutoff.tv_sec -= seconds;
   }
 
-  std::lock_guard<std::mutex> lock(g_rings.respMutex);
-
   StatNode root;
-  for(const auto& c : g_rings.respRing) {
-    if (now < c.when)
-      continue;
+  g_rings.forEachResponse([&root, &now, &cutoff, seconds](const Rings::Response& c) {
+      if (now < c.when)
+        return;
 
-    if (seconds && c.when < cutoff)
-      continue;
+      if (seconds && c.when < cutoff)
+        return;
 
-    root.submit(c.name, c.dh.rcode, c.requestor);
-  }
+      root.submit(c.getName(), c.dh.rcode, c.requestor);
+    });
   StatNode::Stat node;
 
   root.visit([&visitor](const StatNode* node_, const StatNode::Stat& self, const StatNode::Stat& children) {
@@ -126,18 +121,17 @@ static vector<pair<unsigned int, std::unordered_map<string,string> > > getRespRi
 {
   typedef std::unordered_map<string,string>  entry_t;
   vector<pair<unsigned int, entry_t > > ret;
-  std::lock_guard<std::mutex> lock(g_rings.respMutex);
 
   entry_t e;
   unsigned int count=1;
-  for(const auto& c : g_rings.respRing) {
-    if(rcode && (rcode.get() != c.dh.rcode))
-      continue;
-    e["qname"]=c.name.toString();
-    e["rcode"]=std::to_string(c.dh.rcode);
-    ret.push_back(std::make_pair(count,e));
-    count++;
-  }
+  g_rings.forEachResponse([&ret, &e, &count, &rcode](const Rings::Response& c) {
+      if(rcode && (rcode.get() != c.dh.rcode))
+        return;
+      e["qname"]=c.getName().toString();
+      e["rcode"]=std::to_string(c.dh.rcode);
+      ret.push_back(std::make_pair(count,e));
+      count++;
+    });
   return ret;
 }
 
@@ -150,17 +144,16 @@ static map<ComboAddress,int> exceedRespGen(int rate, int seconds, std::function<
   cutoff = mintime = now;
   cutoff.tv_sec -= seconds;
 
-  std::lock_guard<std::mutex> lock(g_rings.respMutex);
-  for(const auto& c : g_rings.respRing) {
-    if(seconds && c.when < cutoff)
-      continue;
-    if(now < c.when)
-      continue;
+  g_rings.forEachResponse([&counts, &cutoff, &mintime, &now, seconds, &T](const Rings::Response& c) {
+      if(seconds && c.when < cutoff)
+        return;
+      if(now < c.when)
+        return;
 
-    T(counts, c);
-    if(c.when < mintime)
-      mintime = c.when;
-  }
+      T(counts, c);
+      if(c.when < mintime)
+        mintime = c.when;
+    });
   double delta = seconds ? seconds : DiffTime(now, mintime);
   return filterScore(counts, delta, rate);
 }
@@ -173,16 +166,15 @@ static map<ComboAddress,int> exceedQueryGen(int rate, int seconds, std::function
   cutoff = mintime = now;
   cutoff.tv_sec -= seconds;
 
-  ReadLock rl(&g_rings.queryLock);
-  for(const auto& c : g_rings.queryRing) {
-    if(seconds && c.when < cutoff)
-      continue;
-    if(now < c.when)
-      continue;
-    T(counts, c);
-    if(c.when < mintime)
-      mintime = c.when;
-  }
+  g_rings.forEachQuery([&counts, &cutoff, &mintime, &now, seconds, &T](const Rings::Query& c) {
+      if(seconds && c.when < cutoff)
+        return;
+      if(now < c.when)
+        return;
+      T(counts, c);
+      if(c.when < mintime)
+        mintime = c.when;
+    });
   double delta = seconds ? seconds : DiffTime(now, mintime);
   return filterScore(counts, delta, rate);
 }
@@ -212,13 +204,10 @@ void setupLuaInspection()
       auto top = top_.get_value_or(10);
       map<ComboAddress, int,ComboAddress::addressOnlyLessThan > counts;
       unsigned int total=0;
-      {
-        ReadLock rl(&g_rings.queryLock);
-        for(const auto& c : g_rings.queryRing) {
+      g_rings.forEachQuery([&counts, &total](const Rings::Query& c) {
           counts[c.requestor]++;
           total++;
-        }
-      }
+        });
       vector<pair<int, ComboAddress>> rcounts;
       rcounts.reserve(counts.size());
       for(const auto& c : counts)
@@ -244,20 +233,19 @@ void setupLuaInspection()
       map<DNSName, int> counts;
       unsigned int total=0;
       if(!labels) {
-	ReadLock rl(&g_rings.queryLock);
-	for(const auto& a : g_rings.queryRing) {
-	  counts[a.name]++;
-	  total++;
-	}
+	g_rings.forEachQuery([&counts, &total](const Rings::Query& a) {
+	    counts[a.getName()]++;
+	    total++;
+	  });
       }
       else {
 	unsigned int lab = *labels;
-	ReadLock rl(&g_rings.queryLock);
-	for(auto a : g_rings.queryRing) {
-	  a.name.trimToLabels(lab);
-	  counts[a.name]++;
-	  total++;
-	}
+	g_rings.forEachQuery([&counts, &total, lab](const Rings::Query& a) {
+	    DNSName name = a.getName();
+	    name.trimToLabels(lab);
+	    counts[name]++;
+	    total++;
+	  });
       }
       // cout<<"Looked at "<<total<<" queries, "<<counts.size()<<" different ones"<<endl;
       vector<pair<int, DNSName>> rcounts;
@@ -287,16 +275,12 @@ void setupLuaInspection()
 
   g_lua.writeFunction("getResponseRing", []() {
       setLuaNoSideEffect();
-      decltype(g_rings.respRing) ring;
-      {
-	std::lock_guard<std::mutex> lock(g_rings.respMutex);
-	ring = g_rings.respRing;
-      }
+      const auto ring = g_rings.getResponses();
       vector<std::unordered_map<string, boost::variant<string, unsigned int> > > ret;
       ret.reserve(ring.size());
       decltype(ret)::value_type item;
       for(const auto& r : ring) {
-	item["name"]=r.name.toString();
+	item["name"]=r.getName().toString();
 	item["qtype"]=r.qtype;
 	item["rcode"]=r.dh.rcode;
 	item["usec"]=r.usec;
@@ -375,19 +359,11 @@ void setupLuaInspection()
         }
       }
 
-      decltype(g_rings.queryRing) qr;
-      decltype(g_rings.respRing) rr;
-      {
-        ReadLock rl(&g_rings.queryLock);
-        qr=g_rings.queryRing;
-      }
+      auto qr = g_rings.getQueries();
       sort(qr.begin(), qr.end(), [](const decltype(qr)::value_type& a, const decltype(qr)::value_type& b) {
         return b.when < a.when;
       });
-      {
-	std::lock_guard<std::mutex> lock(g_rings.respMutex);
-        rr=g_rings.respRing;
-      }
+      auto rr = g_rings.getResponses();
 
       sort(rr.begin(), rr.end(), [](const decltype(rr)::value_type& a, const decltype(rr)::value_type& b) {
         return b.when < a.when;
@@ -405,13 +381,14 @@ void setupLuaInspection()
       if(msec==-1) {
         for(const auto& c : qr) {
           bool nmmatch=true, dnmatch=true;
+          const DNSName name = c.getName();
           if(nm)
             nmmatch = nm->match(c.requestor);
           if(dn)
-            dnmatch = c.name.isPartOf(*dn);
+            dnmatch = name.isPartOf(*dn);
           if(nmmatch && dnmatch) {
             QType qt(c.qtype);
-            out.insert(make_pair(c.when, (fmt % DiffTime(now, c.when) % c.requestor.toStringWithPort() % "" % htons(c.dh.id) % c.name.toString() % qt.getName()  % "" % (c.dh.tc ? "TC" : "") % (c.dh.rd? "RD" : "") % (c.dh.aa? "AA" : "") %  "Question").str() )) ;
+            out.insert(make_pair(c.when, (fmt % DiffTime(now, c.when) % c.requestor.toStringWithPort() % "" % htons(c.dh.id) % name.toString() % qt.getName()  % "" % (c.dh.tc ? "TC" : "") % (c.dh.rd? "RD" : "") % (c.dh.aa? "AA" : "") %  "Question").str() )) ;
 
             if(limit && *limit==++num)
               break;
@@ -424,10 +401,11 @@ void setupLuaInspection()
       string extra;
       for(const auto& c : rr) {
         bool nmmatch=true, dnmatch=true, msecmatch=true;
+        const DNSName name = c.getName();
         if(nm)
           nmmatch = nm->match(c.requestor);
         if(dn)
-          dnmatch = c.name.isPartOf(*dn);
+          dnmatch = name.isPartOf(*dn);
         if(msec != -1)
           msecmatch=(c.usec/1000 > (unsigned int)msec);
 
@@ -438,9 +416,9 @@ void setupLuaInspection()
 	  else
 	    extra.clear();
           if(c.usec != std::numeric_limits<decltype(c.usec)>::max())
-            out.insert(make_pair(c.when, (fmt % DiffTime(now, c.when) % c.requestor.toStringWithPort() % c.ds.toStringWithPort() % htons(c.dh.id) % c.name.toString()  % qt.getName()  % (c.usec/1000.0) % (c.dh.tc ? "TC" : "") % (c.dh.rd? "RD" : "") % (c.dh.aa? "AA" : "") % (RCode::to_s(c.dh.rcode) + extra)).str()  )) ;
+            out.insert(make_pair(c.when, (fmt % DiffTime(now, c.when) % c.requestor.toStringWithPort() % c.ds.toStringWithPort() % htons(c.dh.id) % name.toString()  % qt.getName()  % (c.usec/1000.0) % (c.dh.tc ? "TC" : "") % (c.dh.rd? "RD" : "") % (c.dh.aa? "AA" : "") % (RCode::to_s(c.dh.rcode) + extra)).str()  )) ;
           else
-            out.insert(make_pair(c.when, (fmt % DiffTime(now, c.when) % c.requestor.toStringWithPort() % c.ds.toStringWithPort() % htons(c.dh.id) % c.name.toString()  % qt.getName()  % "T.O" % (c.dh.tc ? "TC" : "") % (c.dh.rd? "RD" : "") % (c.dh.aa? "AA" : "") % (RCode::to_s(c.dh.rcode) + extra)).str()  )) ;
+            out.insert(make_pair(c.when, (fmt % DiffTime(now, c.when) % c.requestor.toStringWithPort() % c.ds.toStringWithPort() % htons(c.dh.id) % name.toString()  % qt.getName()  % "T.O" % (c.dh.tc ? "TC" : "") % (c.dh.rd? "RD" : "") % (c.dh.aa? "AA" : "") % (RCode::to_s(c.dh.rcode) + extra)).str()  )) ;
 
           if(limit && *limit==++num)
             break;
@@ -463,12 +441,10 @@ void setupLuaInspection()
 
       double totlat=0;
       unsigned int size=0;
-      {
-	std::lock_guard<std::mutex> lock(g_rings.respMutex);
-	for(const auto& r : g_rings.respRing) {
+      g_rings.forEachResponse([&histo, &totlat, &size](const Rings::Response& r) {
           /* skip actively discovered timeouts */
           if (r.usec == std::numeric_limits<unsigned int>::max())
-            continue;
+            return;
 
 	  ++size;
 	  auto iter = histo.lower_bound(r.usec);
@@ -477,8 +453,7 @@ void setupLuaInspection()
 	  else
 	    histo.rbegin()++;
 	  totlat+=r.usec;
-	}
-      }
+	});
 
       if (size == 0) {
         g_outputBuffer = "No traffic yet.\n";
@@ -514,6 +489,28 @@ void setupLuaInspection()
       g_outputBuffer += (fmt % "Clients" % "MaxClients" % "Queued" % "MaxQueued").str();
       g_outputBuffer += (fmt % g_tcpclientthreads->getThreadsCount() % g_maxTCPClientThreads % g_tcpclientthreads->getQueuedCount() % g_maxTCPQueuedConnections).str();
       g_outputBuffer += "Query distribution mode is: " + std::string(g_useTCPSinglePipe ? "single queue" : "per-thread queues") + "\n";
+      g_outputBuffer += "\n";
+
+      boost::format frontFmt("%-3d %-20.20s %-10d %-10d %-10d %-10d %-10d %-10d %-10d %-10.1f %-10.1f\n");
+      g_outputBuffer += (frontFmt % "#" % "Address" % "Connections" % "Queries" % "Died read" % "Died sent" % "Gave up" % "Client TO" % "Down TO" % "Avg queries" % "Avg dur").str();
+      size_t counter = 0;
+      for(const auto& f : g_frontends) {
+        if (f->tcpFD == -1) {
+          continue;
+        }
+        g_outputBuffer += (frontFmt % counter % f->local.toStringWithPort() % f->tcpCurrentConnections % f->queries % f->tcpDiedReadingQuery % f->tcpDiedSendingResponse % f->tcpGaveUp % f->tcpClientTimeouts % f->tcpDownstreamTimeouts % f->tcpAvgQueriesPerConnection % f->tcpAvgConnectionDuration).str();
+        ++counter;
+      }
+      g_outputBuffer += "\n";
+
+      boost::format backendFmt("%-3d %-20.20s %-20.20s %-10d %-10d %-10d %-10d %-10d %-10d %-10d %-10d %-10d\n");
+      g_outputBuffer += (backendFmt % "#" % "Name" % "Address" % "Connections" % "Died sent" % "Died read" % "Gave up" % "Read TO" % "Write TO" % "New" % "Reused" % "Too many").str();
+      auto states = g_dstates.getLocal();
+      counter = 0;
+      for(const auto& s : *states) {
+        g_outputBuffer += (backendFmt % counter % s->getName() % s->remote.toStringWithPort() % s->tcpCurrentConnections % s->tcpDiedSendingQuery % s->tcpDiedReadingResponse % s->tcpGaveUp % s->tcpReadTimeouts % s->tcpWriteTimeouts % s->tcpNewConnections % s->tcpReusedConnections % s->tcpTooManyConcurrentConnections).str();
+        ++counter;
+      }
     });
 
   g_lua.writeFunction("dumpStats", [] {
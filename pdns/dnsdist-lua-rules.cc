@@ -22,16 +22,17 @@
 #include "dnsdist.hh"
 #include "dnsdist-ecs.hh"
 #include "dnsdist-lua.hh"
+#include "dnsdist-qpstable.hh"
+#include "dnsdist-rules.hh"
 
 #include "dnsparser.hh"
 
 class MaxQPSIPRule : public DNSRule
 {
 public:
-  MaxQPSIPRule(unsigned int qps, unsigned int burst, unsigned int ipv4trunc=32, unsigned int ipv6trunc=64) :
-    d_qps(qps), d_burst(burst), d_ipv4trunc(ipv4trunc), d_ipv6trunc(ipv6trunc)
+  MaxQPSIPRule(unsigned int qps, unsigned int burst, unsigned int ipv4trunc=32, unsigned int ipv6trunc=64, unsigned int expiration=300, size_t maxEntries=1000000) :
+    d_limits(qps, burst, expiration, maxEntries), d_qps(qps), d_burst(burst), d_ipv4trunc(ipv4trunc), d_ipv6trunc(ipv6trunc)
   {
-    pthread_rwlock_init(&d_lock, 0);
   }
 
   bool matches(const DNSQuestion* dq) const override
@@ -39,21 +40,7 @@ public:
     ComboAddress zeroport(*dq->remote);
     zeroport.sin4.sin_port=0;
     zeroport.truncate(zeroport.sin4.sin_family == AF_INET ? d_ipv4trunc : d_ipv6trunc);
-    {
-      ReadLock r(&d_lock);
-      const auto iter = d_limits.find(zeroport);
-      if (iter != d_limits.end()) {
-        return !iter->second.check();
-      }
-    }
-    {
-      WriteLock w(&d_lock);
-      auto iter = d_limits.find(zeroport);
-      if(iter == d_limits.end()) {
-        iter=d_limits.insert({zeroport,QPSLimiter(d_qps, d_burst)}).first;
-      }
-      return !iter->second.check();
-    }
+    return !d_limits.check(zeroport, CoarseClock::getUsec());
   }
 
   string toString() const override
@@ -63,8 +50,7 @@ public:
 
 
 private:
-  mutable pthread_rwlock_t d_lock;
-  mutable std::map<ComboAddress, QPSLimiter> d_limits;
+  mutable QPSTable d_limits;
   unsigned int d_qps, d_burst, d_ipv4trunc, d_ipv6trunc;
 
 };
@@ -96,40 +82,6 @@ private:
   mutable QPSLimiter d_qps;
 };
 
-class NMGRule : public DNSRule
-{
-public:
-  NMGRule(const NetmaskGroup& nmg) : d_nmg(nmg) {}
-protected:
-  NetmaskGroup d_nmg;
-};
-
-class NetmaskGroupRule : public NMGRule
-{
-public:
-  NetmaskGroupRule(const NetmaskGroup& nmg, bool src) : NMGRule(nmg)
-  {
-      d_src = src;
-  }
-  bool matches(const DNSQuestion* dq) const override
-  {
-    if(!d_src) {
-        return d_nmg.match(*dq->local);
-    }
-    return d_nmg.match(*dq->remote);
-  }
-
-  string toString() const override
-  {
-    if(!d_src) {
-        return "Dst: "+d_nmg.toString();
-    }
-    return "Src: "+d_nmg.toString();
-  }
-private:
-  bool d_src;
-};
-
 class TimedIPSetRule : public DNSRule, boost::noncopyable
 {
 private:
@@ -426,28 +378,6 @@ private:
 #endif
 
 
-class SuffixMatchNodeRule : public DNSRule
-{
-public:
-  SuffixMatchNodeRule(const SuffixMatchNode& smn, bool quiet=false) : d_smn(smn), d_quiet(quiet)
-  {
-  }
-  bool matches(const DNSQuestion* dq) const override
-  {
-    return d_smn.check(*dq->qname);
-  }
-  string toString() const override
-  {
-    if(d_quiet)
-      return "qname==in-set";
-    else
-      return "qname in "+d_smn.toString();
-  }
-private:
-  SuffixMatchNode d_smn;
-  bool d_quiet;
-};
-
 class QNameRule : public DNSRule
 {
 public:
@@ -962,6 +892,7 @@ static void rmRule(GlobalStateHolder<vector<T> > *someRulActions, boost::variant
     rules.erase(rules.begin()+*pos);
   }
   someRulActions->setState(rules);
+  refreshRuleChain(someRulActions);
 }
 
 template<typename T>
@@ -974,6 +905,7 @@ static void topRule(GlobalStateHolder<vector<T> > *someRulActions) {
   rules.erase(std::prev(rules.end()));
   rules.insert(rules.begin(), subject);
   someRulActions->setState(rules);
+  refreshRuleChain(someRulActions);
 }
 
 template<typename T>
@@ -994,6 +926,7 @@ static void mvRule(GlobalStateHolder<vector<T> > *someRespRulActions, unsigned i
     rules.insert(rules.begin()+to, subject);
   }
   someRespRulActions->setState(rules);
+  refreshRuleChain(someRespRulActions);
 }
 
 void setupLuaRules()
@@ -1067,6 +1000,7 @@ void setupLuaRules()
       g_rulactions.modify([](decltype(g_rulactions)::value_type& rulactions) {
           rulactions.clear();
         });
+      refreshRuleChain(&g_rulactions);
     });
 
   g_lua.writeFunction("setRules", [](std::vector<DNSDistRuleAction>& newruleactions) {
@@ -1080,10 +1014,11 @@ void setupLuaRules()
             }
           }
         });
+      refreshRuleChain(&g_rulactions);
     });
 
-  g_lua.writeFunction("MaxQPSIPRule", [](unsigned int qps, boost::optional<int> ipv4trunc, boost::optional<int> ipv6trunc, boost::optional<int> burst) {
-      return std::shared_ptr<DNSRule>(new MaxQPSIPRule(qps, burst.get_value_or(qps), ipv4trunc.get_value_or(32), ipv6trunc.get_value_or(64)));
+  g_lua.writeFunction("MaxQPSIPRule", [](unsigned int qps, boost::optional<int> ipv4trunc, boost::optional<int> ipv6trunc, boost::optional<int> burst, boost::optional<unsigned int> expiration, boost::optional<unsigned int> maxEntries) {
+      return std::shared_ptr<DNSRule>(new MaxQPSIPRule(qps, burst.get_value_or(qps), ipv4trunc.get_value_or(32), ipv6trunc.get_value_or(64), expiration.get_value_or(300), maxEntries.get_value_or(1000000)));
     });
 
   g_lua.writeFunction("MaxQPSRule", [](unsigned int qps, boost::optional<int> burst) {
@@ -78,6 +78,27 @@ void resetLuaSideEffect()
 
 typedef std::unordered_map<std::string, boost::variant<bool, int, std::string, std::vector<std::pair<int,int> > > > localbind_t;
 
+static size_t parseUDPVectorSize(const boost::optional<localbind_t>& vars)
+{
+  size_t udpVectorSize = 0;
+
+  if (vars && vars->count("udpVectorSize")) {
+    int value = boost::get<int>(vars->at("udpVectorSize"));
+    if (value < 0) {
+      throw std::runtime_error("Invalid value for udpVectorSize: " + std::to_string(value));
+    }
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+    udpVectorSize = static_cast<size_t>(value);
+#else
+    if (value > 1) {
+      warnlog("recvmmsg() support is not available, ignoring the udpVectorSize value of %d", value);
+    }
+#endif
+  }
+
+  return udpVectorSize;
+}
+
 static void parseLocalBindVars(boost::optional<localbind_t> vars, bool& doTCP, bool& reusePort, int& tcpFastOpenQueueSize, std::string& interface, std::set<int>& cpus)
 {
   if (vars) {
@@ -158,11 +179,11 @@ void setupLuaConfig(bool client)
 			  if (ret->connected) {
 			    if(g_launchWork) {
 			      g_launchWork->push_back([ret]() {
-			        ret->tid = thread(responderThread, ret);
+			        startResponderThreads(ret, std::set<int>());
 			      });
 			    }
 			    else {
-			      ret->tid = thread(responderThread, ret);
+			      startResponderThreads(ret, std::set<int>());
 			    }
 			  }
 
@@ -216,6 +237,15 @@ void setupLuaConfig(bool client)
 			  }
 			}
 
+			size_t numberOfSockets = 1;
+			if(vars.count("sockets")) {
+			  numberOfSockets = std::stoul(boost::get<string>(vars["sockets"]));
+			  if (numberOfSockets == 0) {
+			    warnlog("Dismissing invalid number of sockets '%s', using 1 instead", boost::get<string>(vars["sockets"]));
+			    numberOfSockets = 1;
+			  }
+			}
+
 			std::shared_ptr<DownstreamState> ret;
 			try {
 			  ComboAddress address(boost::get<string>(vars["address"]), 53);
@@ -224,7 +254,7 @@ void setupLuaConfig(bool client)
 			    errlog("Error creating new server: %s is not a valid address for a downstream server", boost::get<string>(vars["address"]));
 			    return ret;
 			  }
-			  ret=std::make_shared<DownstreamState>(address, sourceAddr, sourceItf);
+			  ret=std::make_shared<DownstreamState>(address, sourceAddr, sourceItf, numberOfSockets);
 			}
 			catch(const PDNSException& e) {
 			  g_outputBuffer="Error creating new server: "+string(e.reason);
@@ -247,7 +277,7 @@ void setupLuaConfig(bool client)
 			}
 
 			if(vars.count("weight")) {
-			  ret->weight=std::stoi(boost::get<string>(vars["weight"]));
+			  ret->setWeight(std::stoi(boost::get<string>(vars["weight"])));
 			}
 
 			if(vars.count("retries")) {
@@ -266,6 +296,28 @@ void setupLuaConfig(bool client)
 			  ret->tcpRecvTimeout=std::stoi(boost::get<string>(vars["tcpRecvTimeout"]));
 			}
 
+			if(vars.count("tcpIdleTimeout")) {
+			  ret->tcpIdleTimeout=std::stoi(boost::get<string>(vars["tcpIdleTimeout"]));
+			}
+
+			if(vars.count("maxConcurrentTCPConnections")) {
+			  ret->tcpMaxConcurrentConnections=std::stoi(boost::get<string>(vars["maxConcurrentTCPConnections"]));
+			}
+
+			if(vars.count("maxIdleTCPConnections")) {
+			  ret->tcpMaxIdleConnections=std::stoi(boost::get<string>(vars["maxIdleTCPConnections"]));
+			}
+
+			if(vars.count("maxInFlight")) {
+			  int maxInFlight = std::stoi(boost::get<string>(vars["maxInFlight"]));
+			  if (maxInFlight < 1 || maxInFlight > 65535) {
+			    warnlog("Ignoring invalid maxInFlight value %d for downstream server %s, it should be between 1 and 65535", maxInFlight, boost::get<string>(vars["address"]));
+			  }
+			  else {
+			    ret->tcpMaxInFlight=maxInFlight;
+			  }
+			}
+
 			if(vars.count("tcpFastOpen")) {
 			  bool fastOpen = boost::get<bool>(vars["tcpFastOpen"]);
 			  if (fastOpen) {
@@ -348,17 +400,11 @@ void setupLuaConfig(bool client)
 			if (ret->connected) {
 			  if(g_launchWork) {
 			    g_launchWork->push_back([ret,cpus]() {
-			      ret->tid = thread(responderThread, ret);
-                              if (!cpus.empty()) {
-                                mapThreadToCPUList(ret->tid.native_handle(), cpus);
-                              }
+			      startResponderThreads(ret, cpus);
 			    });
 			  }
 			  else {
-			    ret->tid = thread(responderThread, ret);
-                            if (!cpus.empty()) {
-                              mapThreadToCPUList(ret->tid.native_handle(), cpus);
-                            }
+			    startResponderThreads(ret, cpus);
 			  }
 			}
 
@@ -436,8 +482,9 @@ void setupLuaConfig(bool client)
 
       try {
 	ComboAddress loc(addr, 53);
+	size_t udpVectorSize = parseUDPVectorSize(vars);
 	g_locals.clear();
-	g_locals.push_back(std::make_tuple(loc, doTCP, reusePort, tcpFastOpenQueueSize, interface, cpus)); /// only works pre-startup, so no sync necessary
+	g_locals.push_back(std::make_tuple(loc, doTCP, reusePort, tcpFastOpenQueueSize, interface, cpus, udpVectorSize)); /// only works pre-startup, so no sync necessary
       }
       catch(std::exception& e) {
 	g_outputBuffer="Error: "+string(e.what())+"\n";
@@ -462,7 +509,8 @@ void setupLuaConfig(bool client)
 
       try {
 	ComboAddress loc(addr, 53);
-	g_locals.push_back(std::make_tuple(loc, doTCP, reusePort, tcpFastOpenQueueSize, interface, cpus)); /// only works pre-startup, so no sync necessary
+	size_t udpVectorSize = parseUDPVectorSize(vars);
+	g_locals.push_back(std::make_tuple(loc, doTCP, reusePort, tcpFastOpenQueueSize, interface, cpus, udpVectorSize)); /// only works pre-startup, so no sync necessary
       }
       catch(std::exception& e) {
 	g_outputBuffer="Error: "+string(e.what())+"\n";
@@ -514,9 +562,9 @@ void setupLuaConfig(bool client)
       setLuaNoSideEffect();
       try {
       ostringstream ret;
-      boost::format fmt("%1$-3d %2$-20.20s %|25t|%3% %|55t|%4$5s %|51t|%5$7.1f %|66t|%6$7d %|69t|%7$3d %|78t|%8$2d %|80t|%9$10d %|86t|%10$7d %|91t|%11$5.1f %|109t|%12$5.1f %|115t|%13$11d %14%" );
-      //             1        2          3       4        5       6       7       8           9        10        11       12     13              14
-      ret << (fmt % "#" % "Name" % "Address" % "State" % "Qps" % "Qlim" % "Ord" % "Wt" % "Queries" % "Drops" % "Drate" % "Lat" % "Outstanding" % "Pools") << endl;
+      boost::format fmt("%1$-3d %2$-20.20s %|25t|%3% %|55t|%4$5s %|51t|%5$7.1f %|66t|%6$7d %|69t|%7$3d %|78t|%8$2d %|80t|%9$10d %|86t|%10$7d %|91t|%11$5.1f %|109t|%12$5.1f %|115t|%13$5.1f %|121t|%14$5.1f %|127t|%15$5.1f %|133t|%16$11d %17%" );
+      //             1        2          3       4        5       6       7       8           9        10        11       12     13     14     15       16              17
+      ret << (fmt % "#" % "Name" % "Address" % "State" % "Qps" % "Qlim" % "Ord" % "Wt" % "Queries" % "Drops" % "Drate" % "Lat" % "P50" % "P99" % "P99.9" % "Outstanding" % "Pools") << endl;
 
       uint64_t totQPS{0}, totQueries{0}, totDrops{0};
       int counter=0;
@@ -530,9 +578,10 @@ void setupLuaConfig(bool client)
 	  pools+=p;
 	}
 
+	const auto percentiles = s->latencyHistogram.getPercentiles();
 	ret << (fmt % counter % s->name % s->remote.toStringWithPort() %
 		status %
-		s->queryLoad % s->qps.getRate() % s->order % s->weight % s->queries.load() % s->reuseds.load() % (s->dropRate) % (s->latencyUsec/1000.0) % s->outstanding.load() % pools) << endl;
+		s->queryLoad % s->qps.getRate() % s->order % s->weight % s->queries.load() % s->reuseds.load() % (s->dropRate) % (s->latencyUsec/1000.0) % (percentiles.p50/1000.0) % (percentiles.p99/1000.0) % (percentiles.p999/1000.0) % s->outstanding.load() % pools) << endl;
 
 	totQPS += s->queryLoad;
 	totQueries += s->queries.load();
@@ -541,7 +590,7 @@ void setupLuaConfig(bool client)
       }
       ret<< (fmt % "All" % "" % "" % ""
 		%
-	     (double)totQPS % "" % "" % "" % totQueries % totDrops % "" % "" % "" % "" ) << endl;
+	     (double)totQPS % "" % "" % "" % totQueries % totDrops % "" % "" % "" % "" % "" % "" % "" ) << endl;
 
       g_outputBuffer=ret.str();
       }catch(std::exception& e) { g_outputBuffer=e.what(); throw; }
@@ -796,10 +845,10 @@ void setupLuaConfig(bool client)
       gettime(&now);
       boost::format fmt("%-24s %8d %8d %s\n");
       g_outputBuffer = (fmt % "What" % "Seconds" % "Blocks" % "Reason").str();
-      for(const auto& e: slow) {
-	if(now < e->second.until)
-	  g_outputBuffer+= (fmt % e->first.toString() % (e->second.until.tv_sec - now.tv_sec) % e->second.blocks % e->second.reason).str();
-      }
+      slow.visit([&now, &fmt](const PersistentNetmaskTree<DynBlock>::node_type& e) {
+	if(now < e.second.until)
+	  g_outputBuffer+= (fmt % e.first.toString() % (e.second.until.tv_sec - now.tv_sec) % e.second.blocks % e.second.reason).str();
+        });
       auto slow2 = g_dynblockSMT.getCopy();
       slow2.visit([&now, &fmt](const SuffixMatchTree<DynBlock>& node) {
           if(now <node.d_value.until) {
@@ -814,7 +863,7 @@ void setupLuaConfig(bool client)
 
   g_lua.writeFunction("clearDynBlocks", []() {
       setLuaSideEffect();
-      nmts_t nmg;
+      PersistentNetmaskTree<DynBlock> nmg;
       g_dynblockNMG.setState(nmg);
       SuffixMatchTree<DynBlock> smt;
       g_dynblockSMT.setState(smt);
@@ -823,31 +872,34 @@ void setupLuaConfig(bool client)
   g_lua.writeFunction("addDynBlocks",
                       [](const map<ComboAddress,int>& m, const std::string& msg, boost::optional<int> seconds, boost::optional<DNSAction::Action> action) {
                            setLuaSideEffect();
-			   auto slow = g_dynblockNMG.getCopy();
 			   struct timespec until, now;
 			   gettime(&now);
 			   until=now;
                            int actualSeconds = seconds ? *seconds : 10;
 			   until.tv_sec += actualSeconds;
-			   for(const auto& capair : m) {
-			     unsigned int count = 0;
-                             auto got = slow.lookup(Netmask(capair.first));
-                             bool expired=false;
-			     if(got) {
-			       if(until < got->second.until) // had a longer policy
-				 continue;
-			       if(now < got->second.until) // only inherit count on fresh query we are extending
-				 count=got->second.blocks;
-                               else
-                                 expired=true;
+			   /* only the entries we add are copied, not the whole table */
+			   g_dynblockNMG.modify([&](PersistentNetmaskTree<DynBlock>& slow) {
+			     for(const auto& capair : m) {
+			       unsigned int count = 0;
+			       const Netmask key(capair.first);
+			       auto got = slow.lookup(key);
+			       bool expired=false;
+			       if(got) {
+				 if(until < got->second.until) // had a longer policy
+				   continue;
+				 if(now < got->second.until) // only inherit count on fresh query we are extending
+				   count=got->second.blocks;
+				 else
+				   expired=true;
+			       }
+			       DynBlock db{msg,until,DNSName(),(action ? *action : DNSAction::Action::None)};
+			       db.blocks=count;
+			       if(!got || expired)
+				 warnlog("Inserting dynamic block for %s for %d seconds: %s", capair.first.toString(), actualSeconds, msg);
+			       slow.insert(key, db);
+			       g_dynblockExpiry.add(key, until.tv_sec);
 			     }
-			     DynBlock db{msg,until,DNSName(),(action ? *action : DNSAction::Action::None)};
-			     db.blocks=count;
-                             if(!got || expired)
-                               warnlog("Inserting dynamic block for %s for %d seconds: %s", capair.first.toString(), actualSeconds, msg);
-			     slow.insert(Netmask(capair.first)).second=db;
-			   }
-			   g_dynblockNMG.setState(slow);
+			   });
 			 });
 
   g_lua.writeFunction("addDynBlockSMT",
@@ -1092,13 +1144,17 @@ void setupLuaConfig(bool client)
       setLuaNoSideEffect();
       try {
         ostringstream ret;
-        boost::format fmt("%1$-3d %2$-20.20s %|25t|%3$-8.8s %|35t|%4%" );
-        //             1    2           3            4
-        ret << (fmt % "#" % "Address" % "Protocol" % "Queries" ) << endl;
+        boost::format fmt("%1$-3d %2$-20.20s %|25t|%3$-8.8s %|35t|%4$-10d %|46t|%5$-8.8s %|56t|%6%" );
+        //             1    2           3            4           5             6
+        ret << (fmt % "#" % "Address" % "Protocol" % "Queries" % "Recv avg" % "Send avg" ) << endl;
 
         size_t counter = 0;
         for (const auto& front : g_frontends) {
-          ret << (fmt % counter % front->local.toStringWithPort() % (front->udpFD != -1 ? "UDP" : "TCP") % front->queries) << endl;
+          const uint64_t recvBatches = front->udpRecvBatches;
+          const uint64_t sendBatches = front->udpSendBatches;
+          const string recvAvg = recvBatches > 0 ? (boost::format("%.2f") % (static_cast<double>(front->udpRecvBatchedQueries) / recvBatches)).str() : "-";
+          const string sendAvg = sendBatches > 0 ? (boost::format("%.2f") % (static_cast<double>(front->udpSendBatchedResponses) / sendBatches)).str() : "-";
+          ret << (fmt % counter % front->local.toStringWithPort() % (front->udpFD != -1 ? "UDP" : "TCP") % front->queries % recvAvg % sendAvg) << endl;
           counter++;
         }
         g_outputBuffer=ret.str();
@@ -1275,14 +1331,14 @@ void setupLuaConfig(bool client)
       g_servFailOnNoPolicy = servfail;
     });
 
-  g_lua.writeFunction("setRingBuffersSize", [](size_t capacity) {
+  g_lua.writeFunction("setRingBuffersSize", [](size_t capacity, boost::optional<size_t> numberOfShards) {
       setLuaSideEffect();
       if (g_configurationDone) {
         errlog("setRingBuffersSize() cannot be used at runtime!");
         g_outputBuffer="setRingBuffersSize() cannot be used at runtime!\n";
         return;
       }
-      g_rings.setCapacity(capacity);
+      g_rings.setCapacity(capacity, numberOfShards ? *numberOfShards : g_rings.getNumberOfShards());
     });
 
   g_lua.writeFunction("setWHashedPertubation", [](uint32_t pertub) {
@@ -1290,6 +1346,36 @@ void setupLuaConfig(bool client)
       g_hashperturb = pertub;
     });
 
+  g_lua.writeFunction("setConsistentHashingBalancingFactor", [](double factor) {
+      setLuaSideEffect();
+      if (factor != 0 && factor < 1.0) {
+        errlog("Invalid value passed to setConsistentHashingBalancingFactor(), it should be 0 or at least 1.0!");
+        g_outputBuffer="Invalid value passed to setConsistentHashingBalancingFactor(), it should be 0 or at least 1.0!\n";
+        return;
+      }
+      g_consistentHashBalancingFactor = factor;
+    });
+
+  g_lua.writeFunction("setLeastOutstandingLatency", [](const std::string& latency) {
+      setLuaSideEffect();
+      if (latency == "average") {
+        g_leastOutstandingLatency = LeastOutstandingLatency::Average;
+      }
+      else if (latency == "p50") {
+        g_leastOutstandingLatency = LeastOutstandingLatency::P50;
+      }
+      else if (latency == "p99") {
+        g_leastOutstandingLatency = LeastOutstandingLatency::P99;
+      }
+      else if (latency == "p99.9") {
+        g_leastOutstandingLatency = LeastOutstandingLatency::P999;
+      }
+      else {
+        errlog("Invalid value passed to setLeastOutstandingLatency(), it should be one of 'average', 'p50', 'p99' or 'p99.9'!");
+        g_outputBuffer="Invalid value passed to setLeastOutstandingLatency(), it should be one of 'average', 'p50', 'p99' or 'p99.9'!\n";
+      }
+    });
+
   g_lua.writeFunction("setTCPUseSinglePipe", [](bool flag) {
       if (g_configurationDone) {
         g_outputBuffer="setTCPUseSinglePipe() cannot be used at runtime!\n";
@@ -1366,6 +1452,21 @@ void setupLuaConfig(bool client)
       g_logConsoleConnections = enabled;
     });
 
+  g_lua.writeFunction("setUDPResponderMultipleMessagesVectorSize", [](size_t vSize) {
+      if (g_configurationDone) {
+        errlog("setUDPResponderMultipleMessagesVectorSize() cannot be used at runtime!");
+        g_outputBuffer="setUDPResponderMultipleMessagesVectorSize() cannot be used at runtime!\n";
+        return;
+      }
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+      setLuaSideEffect();
+      g_udpResponderVectorSize = vSize;
+#else
+      errlog("recvmmsg() support is not available!");
+      g_outputBuffer="recvmmsg support is not available!\n";
+#endif
+    });
+
   g_lua.writeFunction("setUDPMultipleMessagesVectorSize", [](size_t vSize) {
       if (g_configurationDone) {
         errlog("setUDPMultipleMessagesVectorSize() cannot be used at runtime!");
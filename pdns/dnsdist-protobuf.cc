@@ -24,6 +24,7 @@
 #include "dnsdist.hh"
 
 #include "dnsdist-protobuf.hh"
+#include "protobuf-encoder.hh"
 
 #ifdef HAVE_PROTOBUF
 #include "dnsmessage.pb.h"
@@ -40,4 +41,50 @@ DNSDistProtoBufMessage::DNSDistProtoBufMessage(const DNSResponse& dr, bool inclu
   addRRsFromPacket((const char*) dr.dh, dr.len, includeCNAME);
 };
 
+/* the fields have to be added in the field number order, see PBDNSMessageEncoder */
+static void encodeDNSDistProtoBufMessage(std::string& buffer, const DNSQuestion& dq, bool isResponse, bool includeCNAME)
+{
+  struct timespec ts;
+  gettime(&ts, true);
+
+  PBDNSMessageEncoder encoder(buffer);
+  encoder.setType(isResponse ? PBDNSMessageEncoder::MessageType::Response : PBDNSMessageEncoder::MessageType::Query);
+  encoder.setMessageId(dq.uniqueId ? *dq.uniqueId : t_uuidGenerator());
+  if (dq.remote) {
+    encoder.setSocketFamily(*dq.remote);
+  }
+  else if (dq.local) {
+    encoder.setSocketFamily(*dq.local);
+  }
+  encoder.setSocketProtocol(dq.tcp);
+  if (dq.remote) {
+    encoder.setRequestor(*dq.remote);
+  }
+  if (dq.local) {
+    encoder.setResponder(*dq.local);
+  }
+  encoder.setBytes(dq.len);
+  encoder.setTime(ts.tv_sec, ts.tv_nsec / 1000);
+  encoder.setId(ntohs(dq.dh->id));
+  encoder.setQuestion(*dq.qname, dq.qtype, dq.qclass);
+
+  encoder.startResponse();
+  if (isResponse) {
+    encoder.setResponseCode(dq.dh->rcode);
+    encoder.addRRsFromPacket(reinterpret_cast<const char*>(dq.dh), dq.len, includeCNAME);
+  }
+  encoder.setQueryTime(dq.queryTime->tv_sec, dq.queryTime->tv_nsec / 1000);
+  encoder.endResponse();
+}
+
+void encodeDNSDistProtoBufMessage(std::string& buffer, const DNSQuestion& dq)
+{
+  encodeDNSDistProtoBufMessage(buffer, dq, false, false);
+}
+
+void encodeDNSDistProtoBufMessage(std::string& buffer, const DNSResponse& dr, bool includeCNAME)
+{
+  encodeDNSDistProtoBufMessage(buffer, dr, true, includeCNAME);
+}
+
 #endif /* HAVE_PROTOBUF */
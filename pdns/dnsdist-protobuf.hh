@@ -29,3 +29,8 @@ public:
   DNSDistProtoBufMessage(const DNSQuestion& dq);
   DNSDistProtoBufMessage(const DNSResponse& dr, bool includeCNAME);
 };
+
+/* append the same content as DNSDistProtoBufMessage(dq) and DNSDistProtoBufMessage(dr, includeCNAME),
+   already serialized, to buffer, without building a PBDNSMessage object */
+void encodeDNSDistProtoBufMessage(std::string& buffer, const DNSQuestion& dq);
+void encodeDNSDistProtoBufMessage(std::string& buffer, const DNSResponse& dr, bool includeCNAME);
@@ -0,0 +1,256 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "dnsdist-qpstable.hh"
+
+static uint64_t hashKey(uint64_t hi, uint64_t lo)
+{
+  uint64_t result = lo ^ (hi * 0x9E3779B97F4A7C15ULL);
+  result ^= result >> 33;
+  result *= 0xff51afd7ed558ccdULL;
+  result ^= result >> 33;
+  return result;
+}
+
+static void makeKey(const ComboAddress& addr, uint64_t& hi, uint64_t& lo)
+{
+  if (addr.sin4.sin_family == AF_INET) {
+    /* no IPv6 client is coming from ffff:ffff:ffff:ffff::/64 */
+    hi = ~(static_cast<uint64_t>(0));
+    lo = ntohl(addr.sin4.sin_addr.s_addr);
+  }
+  else {
+    memcpy(&hi, &addr.sin6.sin6_addr.s6_addr[0], sizeof(hi));
+    memcpy(&lo, &addr.sin6.sin6_addr.s6_addr[8], sizeof(lo));
+  }
+}
+
+/* the largest power of two not over value, 1 for 0 */
+static size_t getPowerOfTwoBelow(size_t value)
+{
+  size_t result = 1;
+  while (result * 2 <= value) {
+    result *= 2;
+  }
+  return result;
+}
+
+std::mutex QPSTable::s_tablesLock;
+std::set<QPSTable*> QPSTable::s_tables;
+
+QPSTable::QPSTable(unsigned int rate, unsigned int burst, unsigned int expiration, size_t maxEntries): d_rate(rate), d_burst(burst)
+{
+  /* fewer shards for small tables, so that every shard can hold its initial size */
+  size_t shardsCount = s_maxShardsCount;
+  while (shardsCount > 1 && shardsCount * s_initialShardSize > maxEntries) {
+    shardsCount /= 2;
+  }
+  d_shards = std::vector<Shard>(shardsCount);
+  d_shardsMask = shardsCount - 1;
+
+  /* the largest power of two not over our share of maxEntries, but we need at
+     least one probe window */
+  d_maxShardSize = std::max(s_probeLength, getPowerOfTwoBelow(maxEntries / shardsCount));
+  const size_t initialShardSize = std::min(s_initialShardSize, d_maxShardSize);
+
+  d_expirationMsec = expiration < (std::numeric_limits<uint32_t>::max() / 2000) ? expiration * 1000 : std::numeric_limits<uint32_t>::max() / 2;
+
+  for (auto& shard : d_shards) {
+    shard.entries.resize(initialShardSize);
+    memset(shard.entries.data(), 0, shard.entries.size() * sizeof(Entry));
+  }
+
+  std::lock_guard<std::mutex> lock(s_tablesLock);
+  s_tables.insert(this);
+}
+
+QPSTable::~QPSTable()
+{
+  std::lock_guard<std::mutex> lock(s_tablesLock);
+  s_tables.erase(this);
+}
+
+uint32_t QPSTable::getTimestamp(uint64_t nowUsec) const
+{
+  /* wraps around every 49 days, which is fine as long as expired entries
+     are purged more often than that. 0 is reserved for empty slots. */
+  uint32_t result = static_cast<uint32_t>(nowUsec / 1000);
+  return result != 0 ? result : 1;
+}
+
+bool QPSTable::isExpired(const Entry& entry, uint32_t now) const
+{
+  return static_cast<uint32_t>(now - entry.lastSeen) > d_expirationMsec;
+}
+
+bool QPSTable::insert(std::vector<Entry>& entries, const Entry& entry, uint64_t hash)
+{
+  const size_t mask = entries.size() - 1;
+  for (size_t idx = 0; idx < s_probeLength; idx++) {
+    Entry& slot = entries[(hash + idx) & mask];
+    if (slot.lastSeen == 0) {
+      slot = entry;
+      return true;
+    }
+  }
+  return false;
+}
+
+void QPSTable::grow(Shard& shard)
+{
+  std::vector<Entry> entries(shard.entries.size() * 2);
+  memset(entries.data(), 0, entries.size() * sizeof(Entry));
+  size_t count = 0;
+
+  for (const auto& entry : shard.entries) {
+    /* an entry not fitting in its probe window is lost, its client
+       will start over with a full bucket */
+    if (entry.lastSeen != 0 && insert(entries, entry, hashKey(entry.hi, entry.lo))) {
+      count++;
+    }
+  }
+
+  shard.entries = std::move(entries);
+  shard.count = count;
+}
+
+void QPSTable::purgeExpired(Shard& shard, uint32_t now)
+{
+  for (auto& entry : shard.entries) {
+    if (entry.lastSeen != 0 && isExpired(entry, now)) {
+      entry.lastSeen = 0;
+      shard.count--;
+    }
+  }
+}
+
+void QPSTable::purgeExpired(uint64_t nowUsec)
+{
+  const uint32_t now = getTimestamp(nowUsec);
+  for (auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard.lock);
+    purgeExpired(shard, now);
+  }
+}
+
+void QPSTable::purgeAllExpired(uint64_t nowUsec)
+{
+  std::lock_guard<std::mutex> lock(s_tablesLock);
+  for (auto table : s_tables) {
+    table->purgeExpired(nowUsec);
+  }
+}
+
+size_t QPSTable::getCapacity()
+{
+  size_t result = 0;
+  for (auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard.lock);
+    result += shard.entries.size();
+  }
+  return result;
+}
+
+size_t QPSTable::getEntriesCount()
+{
+  size_t result = 0;
+  for (auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard.lock);
+    result += shard.count;
+  }
+  return result;
+}
+
+bool QPSTable::check(const ComboAddress& addr, uint64_t nowUsec)
+{
+  uint64_t hi, lo;
+  makeKey(addr, hi, lo);
+  const uint64_t hash = hashKey(hi, lo);
+  /* the low bits select the slot, use the high ones for the shard */
+  Shard& shard = d_shards[(hash >> 58) & d_shardsMask];
+  const uint32_t now = getTimestamp(nowUsec);
+
+  std::lock_guard<std::mutex> lock(shard.lock);
+  size_t mask = shard.entries.size() - 1;
+
+  for (size_t idx = 0; idx < s_probeLength; idx++) {
+    Entry& entry = shard.entries[(hash + idx) & mask];
+    if (entry.lastSeen == 0 || entry.hi != hi || entry.lo != lo) {
+      continue;
+    }
+
+    if (isExpired(entry, now)) {
+      entry.tokens = d_burst;
+    }
+    else {
+      const uint32_t elapsed = now - entry.lastSeen;
+      entry.tokens += static_cast<float>(1.0 * d_rate * elapsed / 1000.0);
+      if (entry.tokens > d_burst) {
+        entry.tokens = d_burst;
+      }
+    }
+    entry.lastSeen = now;
+
+    if (entry.tokens >= 1.0) {
+      entry.tokens--;
+      return true;
+    }
+    return false;
+  }
+
+  /* new client */
+  if (shard.count >= (shard.entries.size() / 4) * 3 && shard.entries.size() < d_maxShardSize) {
+    purgeExpired(shard, now);
+    if (shard.count >= (shard.entries.size() / 4) * 3) {
+      grow(shard);
+      mask = shard.entries.size() - 1;
+    }
+  }
+
+  Entry* target = nullptr;
+  for (size_t idx = 0; idx < s_probeLength; idx++) {
+    Entry& entry = shard.entries[(hash + idx) & mask];
+    if (entry.lastSeen == 0) {
+      shard.count++;
+      target = &entry;
+      break;
+    }
+    if (isExpired(entry, now)) {
+      target = &entry;
+      break;
+    }
+    if (target == nullptr || static_cast<uint32_t>(now - entry.lastSeen) > static_cast<uint32_t>(now - target->lastSeen)) {
+      /* the least recently seen one, in case we need to evict */
+      target = &entry;
+    }
+  }
+
+  target->hi = hi;
+  target->lo = lo;
+  target->tokens = d_burst;
+  target->lastSeen = now;
+
+  if (target->tokens >= 1.0) {
+    target->tokens--;
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,94 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "iputils.hh"
+
+/* Per-client token buckets, as used by MaxQPSIPRule.
+   The table is split into shards, each protected by its own lock and holding
+   a compact open-addressing array of entries: a client is stored in one of
+   the s_probeLength slots following its hash, so that the memory used is
+   bounded by maxEntries. Entries that have not been seen for 'expiration'
+   seconds are reused first, and when a shard is full and cannot grow
+   anymore, the least recently seen client of the probed slots is evicted,
+   which at worst resets its bucket to a full burst. Small tables use fewer
+   shards so that the total number of slots stays within maxEntries.
+   Every table registers itself so that the maintenance thread can purge
+   the expired entries of all of them via purgeAllExpired(). */
+class QPSTable
+{
+public:
+  QPSTable(unsigned int rate, unsigned int burst, unsigned int expiration, size_t maxEntries);
+  ~QPSTable();
+  QPSTable(const QPSTable&) = delete;
+  QPSTable& operator=(const QPSTable&) = delete;
+
+  /* returns true if this query, coming from the (already truncated) address
+     'addr' at the time 'nowUsec', is within the limit */
+  bool check(const ComboAddress& addr, uint64_t nowUsec);
+  size_t getEntriesCount();
+  /* number of slots allocated, in all shards */
+  size_t getCapacity();
+  void purgeExpired(uint64_t nowUsec);
+  static void purgeAllExpired(uint64_t nowUsec);
+
+private:
+  struct Entry
+  {
+    uint64_t hi;
+    uint64_t lo;
+    float tokens;
+    /* in milliseconds, 0 means that the slot is empty */
+    uint32_t lastSeen;
+  };
+
+  struct Shard
+  {
+    std::mutex lock;
+    std::vector<Entry> entries;
+    size_t count{0};
+  };
+
+  static const size_t s_maxShardsCount = 32;
+  static const size_t s_probeLength = 8;
+  static const size_t s_initialShardSize = 64;
+
+  static std::mutex s_tablesLock;
+  static std::set<QPSTable*> s_tables;
+
+  uint32_t getTimestamp(uint64_t nowUsec) const;
+  bool isExpired(const Entry& entry, uint32_t now) const;
+  void purgeExpired(Shard& shard, uint32_t now);
+  void grow(Shard& shard);
+  static bool insert(std::vector<Entry>& entries, const Entry& entry, uint64_t hash);
+
+  std::vector<Shard> d_shards;
+  size_t d_shardsMask;
+  size_t d_maxShardSize;
+  uint32_t d_expirationMsec;
+  unsigned int d_rate;
+  unsigned int d_burst;
+};
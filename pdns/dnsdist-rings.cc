@@ -22,12 +22,118 @@
 #include "dnsdist.hh"
 #include "lock.hh"
 
+void Rings::setCapacity(size_t newCapacity, size_t numberOfShards)
+{
+  if (numberOfShards == 0) {
+    throw std::runtime_error("The number of shards of the ring buffers should be larger than 0");
+  }
+
+  /* every shard can hold the full capacity, since a single busy thread might be the only one
+     inserting into the rings. The inspection functions only look at the last 'capacity' entries */
+  d_capacity = newCapacity;
+  d_shards.clear();
+  d_shards.reserve(numberOfShards);
+  for (size_t idx = 0; idx < numberOfShards; idx++) {
+    std::unique_ptr<Shard> shard(new Shard());
+    shard->queryRing.setCapacity(newCapacity);
+    shard->respRing.setCapacity(newCapacity);
+    d_shards.push_back(std::move(shard));
+  }
+}
+
+Rings::Shard& Rings::getShard()
+{
+  static std::atomic<size_t> s_nextShard{0};
+  /* assigned the first time a given thread inserts into the rings */
+  static thread_local size_t t_shardIndex = s_nextShard++;
+  return *d_shards[t_shardIndex % d_shards.size()];
+}
+
+static uint8_t copyName(const DNSName& name, char* dest)
+{
+  const auto& storage = name.getStorage();
+  /* a valid name is at most 255 bytes long in wire format */
+  const size_t len = std::min(storage.size(), static_cast<size_t>(255));
+  memcpy(dest, storage.data(), len);
+  return static_cast<uint8_t>(len);
+}
+
+void Rings::insertQuery(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, uint16_t size, const struct dnsheader& dh)
+{
+  Query query;
+  query.when = when;
+  query.requestor = requestor;
+  query.size = size;
+  query.qtype = qtype;
+  query.dh = dh;
+  query.nameLen = copyName(name, query.name);
+  getShard().queryRing.insert(query);
+}
+
+void Rings::insertResponse(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, unsigned int usec, unsigned int size, const struct dnsheader& dh, const ComboAddress& backend)
+{
+  Response response;
+  response.when = when;
+  response.requestor = requestor;
+  response.qtype = qtype;
+  response.usec = usec;
+  response.size = size;
+  response.dh = dh;
+  response.ds = backend;
+  response.nameLen = copyName(name, response.name);
+  getShard().respRing.insert(response);
+}
+
+/* merges the entries of all the shards in time order, keeping only the last 'capacity' ones */
+template <typename T>
+static void mergeShards(std::vector<T>& entries, size_t capacity)
+{
+  std::stable_sort(entries.begin(), entries.end(), [](const T& a, const T& b) { return a.when < b.when; });
+  if (entries.size() > capacity) {
+    entries.erase(entries.begin(), entries.begin() + (entries.size() - capacity));
+  }
+}
+
+std::vector<Rings::Query> Rings::getQueries() const
+{
+  std::vector<Query> ret;
+  size_t total = 0;
+  for (const auto& shard : d_shards) {
+    total += shard->queryRing.size();
+  }
+  ret.reserve(total);
+  for (const auto& shard : d_shards) {
+    shard->queryRing.visit([&ret](const Query& q) {
+        ret.push_back(q);
+      });
+  }
+  mergeShards(ret, d_capacity);
+  return ret;
+}
+
+std::vector<Rings::Response> Rings::getResponses() const
+{
+  std::vector<Response> ret;
+  size_t total = 0;
+  for (const auto& shard : d_shards) {
+    total += shard->respRing.size();
+  }
+  ret.reserve(total);
+  for (const auto& shard : d_shards) {
+    shard->respRing.visit([&ret](const Response& r) {
+        ret.push_back(r);
+      });
+  }
+  mergeShards(ret, d_capacity);
+  return ret;
+}
+
 size_t Rings::numDistinctRequestors()
 {
   std::set<ComboAddress, ComboAddress::addressOnlyLessThan> s;
-  ReadLock rl(&queryLock);
-  for(const auto& q : queryRing)
-    s.insert(q.requestor);
+  forEachQuery([&s](const Query& q) {
+      s.insert(q.requestor);
+    });
   return s.size();
 }
 
@@ -35,21 +141,15 @@ std::unordered_map<int, vector<boost::variant<string,double>>> Rings::getTopBand
 {
   map<ComboAddress, unsigned int, ComboAddress::addressOnlyLessThan> counts;
   uint64_t total=0;
-  {
-    ReadLock rl(&queryLock);
-    for(const auto& q : queryRing) {
+  forEachQuery([&counts, &total](const Query& q) {
       counts[q.requestor]+=q.size;
       total+=q.size;
-    }
-  }
+    });
 
-  {
-    std::lock_guard<std::mutex> lock(respMutex);
-    for(const auto& r : respRing) {
+  forEachResponse([&counts, &total](const Response& r) {
       counts[r.requestor]+=r.size;
       total+=r.size;
-    }
-  }
+    });
 
   typedef vector<pair<unsigned int, ComboAddress>> ret_t;
   ret_t rcounts;
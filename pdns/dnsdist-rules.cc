@@ -0,0 +1,166 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "dnsdist-rules.hh"
+
+GlobalStateHolder<DNSRuleChain> g_ruleChain;
+
+static void collectSuffixes(const SuffixMatchTree<bool>& node, const DNSName& name, std::vector<DNSName>& names)
+{
+  if (node.endNode) {
+    names.push_back(name);
+  }
+  for (const auto& child : node.children) {
+    DNSName childName(name);
+    childName.prependRawLabel(child.d_name);
+    collectSuffixes(child, childName, names);
+  }
+}
+
+/* returns the index of every rule whose most specific netmask containing 'nm' is a positive one */
+static std::vector<size_t> getMatchingRules(const NetmaskTree<std::vector<std::pair<size_t, bool>>>& tree, const Netmask& nm)
+{
+  std::set<size_t> decided;
+  std::vector<size_t> result;
+  int bits = nm.getBits();
+
+  while (bits >= 0) {
+    const auto* found = tree.lookup(nm.getNetwork(), bits);
+    if (found == nullptr) {
+      break;
+    }
+    for (const auto& entry : found->second) {
+      if (decided.insert(entry.first).second && entry.second) {
+        result.push_back(entry.first);
+      }
+    }
+    bits = found->first.getBits() - 1;
+  }
+
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+DNSRuleChain::DNSRuleChain(const std::vector<DNSDistRuleAction>& rules): d_rules(rules)
+{
+  size_t idx = 0;
+  while (idx < d_rules.size()) {
+    Group::Type type = Group::Type::Single;
+    const auto& rule = d_rules.at(idx).d_rule;
+    if (dynamic_cast<const SuffixMatchNodeRule*>(rule.get()) != nullptr) {
+      type = Group::Type::QNameSuffix;
+    }
+    else if (const auto nmgRule = dynamic_cast<const NetmaskGroupRule*>(rule.get())) {
+      type = nmgRule->isSource() ? Group::Type::SourceNetmask : Group::Type::DestinationNetmask;
+    }
+
+    /* find the end of the run of rules of the same type */
+    size_t end = idx + 1;
+    if (type != Group::Type::Single) {
+      for (; end < d_rules.size(); end++) {
+        const auto& next = d_rules.at(end).d_rule;
+        if (type == Group::Type::QNameSuffix) {
+          if (dynamic_cast<const SuffixMatchNodeRule*>(next.get()) == nullptr) {
+            break;
+          }
+        }
+        else {
+          const auto nmgRule = dynamic_cast<const NetmaskGroupRule*>(next.get());
+          if (nmgRule == nullptr || nmgRule->isSource() != (type == Group::Type::SourceNetmask)) {
+            break;
+          }
+        }
+      }
+    }
+
+    /* merging a single rule is not worth it */
+    if (end - idx < 2) {
+      type = Group::Type::Single;
+      end = idx + 1;
+    }
+
+    Group group;
+    group.type = type;
+    group.index = idx;
+
+    if (type == Group::Type::QNameSuffix) {
+      std::map<DNSName, std::vector<size_t>> names;
+      for (size_t pos = idx; pos < end; pos++) {
+        const auto smnRule = dynamic_cast<const SuffixMatchNodeRule*>(d_rules.at(pos).d_rule.get());
+        std::vector<DNSName> suffixes;
+        collectSuffixes(smnRule->getSuffixMatchNode().d_tree, g_rootdnsname, suffixes);
+        for (const auto& suffix : suffixes) {
+          names[suffix].push_back(pos);
+        }
+      }
+
+      /* the lookup only returns the value of the most specific suffix,
+         which has to contain the rules of every enclosing one as well */
+      for (const auto& entry : names) {
+        std::set<size_t> matching;
+        DNSName name(entry.first);
+        do {
+          const auto it = names.find(name);
+          if (it != names.end()) {
+            matching.insert(it->second.begin(), it->second.end());
+          }
+        }
+        while (name.chopOff());
+        group.suffixes.add(entry.first, std::vector<size_t>(matching.begin(), matching.end()));
+      }
+    }
+    else if (type == Group::Type::SourceNetmask || type == Group::Type::DestinationNetmask) {
+      NetmaskTree<std::vector<std::pair<size_t, bool>>> raw;
+      for (size_t pos = idx; pos < end; pos++) {
+        const auto nmgRule = dynamic_cast<const NetmaskGroupRule*>(d_rules.at(pos).d_rule.get());
+        std::vector<std::string> masks;
+        nmgRule->getNetmaskGroup().toStringVector(&masks);
+        for (const auto& mask : masks) {
+          bool positive = mask.empty() || mask.at(0) != '!';
+          auto& node = raw.insert(Netmask(positive ? mask : mask.substr(1)));
+          if (!node.second.empty() && node.second.back().first == pos) {
+            node.second.back().second = positive;
+          }
+          else {
+            node.second.push_back({pos, positive});
+          }
+        }
+      }
+
+      /* the lookup only returns the most specific netmask, so every netmask of the run
+         needs to know which rules match an address for which it is the best match */
+      for (const auto& node : raw) {
+        group.netmasks.insert(node->first).second = getMatchingRules(raw, node->first);
+      }
+    }
+
+    d_groups.push_back(std::move(group));
+    idx = end;
+  }
+}
+
+void refreshRuleChain(GlobalStateHolder<vector<DNSDistRuleAction> >* rules)
+{
+  /* several updates might be racing, make sure the last one to compile is the last one applied */
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
+  g_ruleChain.setState(DNSRuleChain(rules->getCopy()));
+}
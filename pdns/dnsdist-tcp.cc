@@ -26,6 +26,7 @@
 #include "dolog.hh"
 #include "lock.hh"
 #include "gettime.hh"
+#include "mplexer.hh"
 #include "tcpiohandler.hh"
 #include <thread>
 #include <atomic>
@@ -35,20 +36,26 @@ using std::atomic;
 
 /* TCP: the grand design.
    We forward 'messages' between clients and downstream servers. Messages are 65k bytes large, tops.
-   An answer might theoretically consist of multiple messages (for example, in the case of AXFR), initially
-   we will not go there.
+   An answer might theoretically consist of multiple messages (for example, in the case of AXFR).
 
    In a sense there is a strong symmetry between UDP and TCP, once a connection to a downstream has been setup.
    This symmetry is broken because of head-of-line blocking within TCP though, necessitating additional connections
    to guarantee performance.
 
-   So the idea is to have a 'pool' of available downstream connections, and forward messages to/from them and never queue.
-   So whenever an answer comes in, we know where it needs to go.
-
-   Let's start naively.
+   Each TCP worker thread runs an event loop (FDMultiplexer) and handles a lot of client connections at the same time,
+   every one of them being a state machine (IncomingTCPConnectionState) that never blocks: whenever a read or a write
+   on the client socket would block, the connection registers itself for that event and we go back to the loop.
+
+   Queries are sent to the backends over TCPDownstreamConnection objects, owned by a worker while they have queries
+   in flight. Up to 'tcpMaxInFlight' queries from different clients of that worker can be pipelined over the same
+   connection, the query ID being rewritten so that we know which client a response belongs to.
+   Once it has no query in flight, the connection goes back to a pool of idle connections attached to the backend
+   (DownstreamState) and shared by all workers, and will be reused for the next queries, unless it has been idle for
+   more than 'tcpIdleTimeout' seconds.
+   {A,I}XFR queries get a connection of their own, which is closed once the transfer is done.
 */
 
-static int setupTCPDownstream(shared_ptr<DownstreamState> ds, uint16_t& downstreamFailures)
+static int setupTCPDownstream(shared_ptr<DownstreamState>& ds, uint16_t& downstreamFailures, bool& connecting)
 {
   do {
     vinfolog("TCP connecting to downstream %s (%d)", ds->remote.toStringWithPort(), downstreamFailures);
@@ -64,17 +71,26 @@ static int setupTCPDownstream(shared_ptr<DownstreamState> ds, uint16_t& downstre
         SBind(sock, ds->sourceAddr);
       }
       setNonBlocking(sock);
+      connecting = false;
 #ifdef MSG_FASTOPEN
-      if (!ds->tcpFastOpen) {
-        SConnectWithTimeout(sock, ds->remote, ds->tcpConnectTimeout);
+      if (ds->tcpFastOpen) {
+        /* the connection will be established when we send the query */
+        ++ds->tcpCurrentConnections;
+        return sock;
       }
-#else
-      SConnectWithTimeout(sock, ds->remote, ds->tcpConnectTimeout);
 #endif /* MSG_FASTOPEN */
+      if (connect(sock, reinterpret_cast<const struct sockaddr*>(&ds->remote), ds->remote.getSocklen()) < 0) {
+        if (errno != EINPROGRESS) {
+          throw std::runtime_error("connecting to " + ds->remote.toStringWithPort() + ": " + strerror(errno));
+        }
+        /* we will know whether it succeeded once the socket becomes writable */
+        connecting = true;
+      }
+      ++ds->tcpCurrentConnections;
       return sock;
     }
     catch(const std::runtime_error& e) {
-      /* don't leak our file descriptor if SConnect() (for example) throws */
+      /* don't leak our file descriptor if SBind() (for example) throws */
       downstreamFailures++;
       close(sock);
       if (downstreamFailures > ds->retries) {
@@ -86,6 +102,62 @@ static int setupTCPDownstream(shared_ptr<DownstreamState> ds, uint16_t& downstre
   return -1;
 }
 
+static void closeDownstreamSocket(const std::shared_ptr<DownstreamState>& ds, int fd)
+{
+  close(fd);
+  --ds->tcpCurrentConnections;
+}
+
+static bool isIdleDownstreamConnectionExpired(const std::shared_ptr<DownstreamState>& ds, time_t idleSince, time_t now)
+{
+  return ds->tcpIdleTimeout > 0 && (now - idleSince) >= ds->tcpIdleTimeout;
+}
+
+/* get the most recently used idle connection to that backend from the pool shared by all TCP workers,
+   -1 if there is none */
+static int getIdleDownstreamConnection(const std::shared_ptr<DownstreamState>& ds, time_t now)
+{
+  std::lock_guard<std::mutex> lock(ds->tcpIdleConnectionsLock);
+  auto& idle = ds->tcpIdleConnections;
+  while (!idle.empty()) {
+    auto entry = idle.back();
+    idle.pop_back();
+    if (!isIdleDownstreamConnectionExpired(ds, entry.second, now) && isTCPSocketUsable(entry.first)) {
+      return entry.first;
+    }
+    closeDownstreamSocket(ds, entry.first);
+  }
+  return -1;
+}
+
+static void releaseIdleDownstreamConnection(const std::shared_ptr<DownstreamState>& ds, int fd, time_t now)
+{
+  {
+    std::lock_guard<std::mutex> lock(ds->tcpIdleConnectionsLock);
+    if (ds->tcpIdleConnections.size() < ds->tcpMaxIdleConnections) {
+      ds->tcpIdleConnections.push_back({fd, now});
+      return;
+    }
+  }
+  closeDownstreamSocket(ds, fd);
+}
+
+/* close the idle connections that have been closed by the backend or idle for too long */
+static void cleanupIdleDownstreamConnections(const std::shared_ptr<DownstreamState>& ds, time_t now)
+{
+  std::lock_guard<std::mutex> lock(ds->tcpIdleConnectionsLock);
+  auto& idle = ds->tcpIdleConnections;
+  for (auto it = idle.begin(); it != idle.end(); ) {
+    if (isIdleDownstreamConnectionExpired(ds, it->second, now) || !isTCPSocketUsable(it->first)) {
+      closeDownstreamSocket(ds, it->first);
+      it = idle.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
 struct ConnectionInfo
 {
   int fd;
@@ -171,34 +243,6 @@ void TCPClientCollection::addTCPClientThread()
   ++d_numthreads;
 }
 
-static bool getNonBlockingMsgLen(int fd, uint16_t* len, int timeout)
-try
-{
-  uint16_t raw;
-  size_t ret = readn2WithTimeout(fd, &raw, sizeof raw, timeout);
-  if(ret != sizeof raw)
-    return false;
-  *len = ntohs(raw);
-  return true;
-}
-catch(...) {
-  return false;
-}
-
-static bool getNonBlockingMsgLenFromClient(TCPIOHandler& handler, uint16_t* len)
-try
-{
-  uint16_t raw;
-  size_t ret = handler.read(&raw, sizeof raw, g_tcpRecvTimeout);
-  if(ret != sizeof raw)
-    return false;
-  *len = ntohs(raw);
-  return true;
-}
-catch(...) {
-  return false;
-}
-
 static bool maxConnectionDurationReached(unsigned int maxConnectionDuration, time_t start, unsigned int& remainingTime)
 {
   if (maxConnectionDuration) {
@@ -215,443 +259,1177 @@ static bool maxConnectionDurationReached(unsigned int maxConnectionDuration, tim
   return false;
 }
 
-void cleanupClosedTCPConnections(std::map<ComboAddress,int>& sockets)
+std::shared_ptr<TCPClientCollection> g_tcpclientthreads;
+
+uint64_t getTCPCurrentConnectionsCount(const std::string&)
 {
-  for(auto it = sockets.begin(); it != sockets.end(); ) {
-    if (isTCPSocketUsable(it->second)) {
-      ++it;
-    }
-    else {
-      close(it->second);
-      it = sockets.erase(it);
+  uint64_t result = 0;
+  for (const auto& cs : g_frontends) {
+    if (cs->tcpFD != -1) {
+      result += cs->tcpCurrentConnections;
     }
   }
+  return result;
 }
 
-std::shared_ptr<TCPClientCollection> g_tcpclientthreads;
+uint64_t getTCPQueuedConnectionsCount(const std::string&)
+{
+  if (!g_tcpclientthreads) {
+    return 0;
+  }
+  return g_tcpclientthreads->getQueuedCount();
+}
 
-void* tcpClientThread(int pipefd)
+class TCPDownstreamConnection;
+
+class TCPClientThreadData
 {
-  /* we get launched with a pipe on which we receive file descriptors from clients that we own
-     from that point on */
+public:
+  TCPClientThreadData(): localRespRulactions(g_resprulactions.getLocal()), mplexer(FDMultiplexer::getMultiplexerSilent())
+  {
+  }
 
-  bool outstanding = false;
-  time_t lastTCPCleanup = time(nullptr);
-  
   LocalHolders holders;
-  auto localRespRulactions = g_resprulactions.getLocal();
+  LocalStateHolder<vector<DNSDistResponseRuleAction> > localRespRulactions;
+  std::unique_ptr<FDMultiplexer> mplexer{nullptr};
+  /* connections to the backends owned by this worker that can be used to pipeline queries */
+  std::map<std::shared_ptr<DownstreamState>, std::vector<std::shared_ptr<TCPDownstreamConnection>>> activeDownstreamConnections;
+};
+
+class IncomingTCPConnectionState
+{
+public:
+  enum class State { doingHandshake, readingQuerySize, readingQuery, waitingForResponse, sendingResponse };
+
+  IncomingTCPConnectionState(const ConnectionInfo& ci, TCPClientThreadData& threadData, const struct timeval& now): d_buffer(4096), d_responseBuffer(4096), d_threadData(threadData), d_ci(ci), d_handler(d_ci.fd, g_tcpRecvTimeout, d_ci.cs->tlsFrontend ? d_ci.cs->tlsFrontend->getContext() : nullptr, now.tv_sec), d_connectionStartTime(now)
+  {
+    memset(&d_origDest, 0, sizeof(d_origDest));
+    d_origDest.sin4.sin_family = d_ci.remote.sin4.sin_family;
+    socklen_t socklen = d_origDest.getSocklen();
+    if (getsockname(d_ci.fd, reinterpret_cast<sockaddr*>(&d_origDest), &socklen)) {
+      d_origDest = d_ci.cs->local;
+    }
+    ++d_ci.cs->tcpCurrentConnections;
+  }
+
+  IncomingTCPConnectionState(const IncomingTCPConnectionState& rhs) = delete;
+  IncomingTCPConnectionState& operator=(const IncomingTCPConnectionState& rhs) = delete;
+
+  ~IncomingTCPConnectionState()
+  {
+    vinfolog("Closing TCP client connection with %s", d_ci.remote.toStringWithPort());
+
+    if (d_ds && d_outstanding) {
+      --d_ds->outstanding;
+    }
+
+    decrementTCPClientCount(d_ci.remote);
+    --d_ci.cs->tcpCurrentConnections;
+
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    double elapsed = (now.tv_sec - d_connectionStartTime.tv_sec) * 1000.0 + (now.tv_usec - d_connectionStartTime.tv_usec) / 1000.0;
+    d_ci.cs->tcpAvgQueriesPerConnection = (99.0 * d_ci.cs->tcpAvgQueriesPerConnection / 100.0) + (d_queriesCount / 100.0);
+    d_ci.cs->tcpAvgConnectionDuration = (99.0 * d_ci.cs->tcpAvgConnectionDuration / 100.0) + (elapsed / 100.0);
+    /* the client socket is closed by the TCPIOHandler */
+  }
+
+  /* how long we are willing to wait for the client socket to become readable (or writable) */
+  int getIOTimeout(bool forWrite) const
+  {
+    if (forWrite) {
+      return g_tcpSendTimeout;
+    }
+
+    int timeout = g_tcpRecvTimeout;
+    unsigned int remainingTime = 0;
+    if (maxConnectionDurationReached(g_maxTCPConnectionDuration, d_connectionStartTime.tv_sec, remainingTime)) {
+      return 0;
+    }
+    if (remainingTime > 0 && remainingTime < static_cast<unsigned int>(timeout)) {
+      timeout = remainingTime;
+    }
+    return timeout;
+  }
+
+  void unregisterFromMultiplexer()
+  {
+    if (d_registeredFD == -1) {
+      return;
+    }
+
+    int fd = d_registeredFD;
+    d_registeredFD = -1;
+    if (d_registeredForWrite) {
+      d_threadData.mplexer->removeWriteFD(fd);
+    }
+    else {
+      d_threadData.mplexer->removeReadFD(fd);
+    }
+  }
+
+  /* stop handling this connection, it will be destroyed once the last reference to it goes away */
+  void terminate();
+
+  /* copy the response into the response buffer, preceded by its size, and get ready to send it */
+  void prepareResponse(const char* response, uint16_t responseLen)
+  {
+    const char* existing = d_responseBuffer.size() >= sizeof(uint16_t) ? reinterpret_cast<const char*>(d_responseBuffer.data()) + sizeof(uint16_t) : nullptr;
+    if (response != existing) {
+      d_responseBuffer.resize(sizeof(uint16_t) + responseLen);
+      memcpy(&d_responseBuffer.at(sizeof(uint16_t)), response, responseLen);
+    }
+    else {
+      /* fixed up in place */
+      d_responseBuffer.resize(sizeof(uint16_t) + responseLen);
+    }
+    d_responseBuffer[0] = responseLen / 256;
+    d_responseBuffer[1] = responseLen % 256;
+    d_currentPos = 0;
+    d_state = State::sendingResponse;
+  }
+
+  std::vector<uint8_t> d_buffer;
+  std::vector<uint8_t> d_responseBuffer;
+  std::vector<uint8_t> d_rewrittenResponse;
+  TCPClientThreadData& d_threadData;
+  ConnectionInfo d_ci;
+  TCPIOHandler d_handler;
+  ComboAddress d_origDest;
+  DNSName d_qname;
+  struct timeval d_connectionStartTime;
+  /* we need this one to be accurate ("real") for the protobuf message */
+  struct timespec d_queryRealTime;
+  struct timespec d_queryTime;
+  std::shared_ptr<DownstreamState> d_ds{nullptr};
+  /* the dedicated connection used for an {A,I}XFR */
+  std::shared_ptr<TCPDownstreamConnection> d_xfrConnection{nullptr};
+  std::shared_ptr<DNSDistPacketCache> d_packetCache{nullptr};
+  std::shared_ptr<ServerPool> d_pool{nullptr};
+  std::shared_ptr<QTag> d_qTag{nullptr};
+#ifdef HAVE_PROTOBUF
+  boost::optional<boost::uuids::uuid> d_uniqueId;
+#endif
 #ifdef HAVE_DNSCRYPT
-  /* when the answer is encrypted in place, we need to get a copy
-     of the original header before encryption to fill the ring buffer */
-  dnsheader dhCopy;
+  std::shared_ptr<DnsCryptQuery> d_dnsCryptQuery{nullptr};
 #endif
+  boost::optional<uint32_t> d_tempFailureTTL{boost::none};
+  size_t d_currentPos{0};
+  size_t d_queriesCount{0};
+  uint32_t d_cacheKey{0};
+  int d_registeredFD{-1};
+  State d_state{State::doingHandshake};
+  uint16_t d_querySize{0};
+  uint16_t d_queryLen{0};
+  uint16_t d_responseSize{0};
+  uint16_t d_qtype{0};
+  uint16_t d_qclass{0};
+  uint16_t d_origFlags{0};
+  uint16_t d_downstreamFailures{0};
+  bool d_registeredForWrite{false};
+  bool d_ednsAdded{false};
+  bool d_ecsAdded{false};
+  bool d_skipCache{false};
+  bool d_isXFR{false};
+  bool d_xfrStarted{false};
+  bool d_firstResponsePacket{true};
+  bool d_moreResponsesExpected{false};
+  bool d_outstanding{false};
+  bool d_closeAfterResponse{false};
+};
 
-  map<ComboAddress,int> sockets;
-  for(;;) {
-    ConnectionInfo* citmp, ci;
+class TCPDownstreamConnection
+{
+public:
+  TCPDownstreamConnection(const std::shared_ptr<DownstreamState>& ds, TCPClientThreadData& threadData, int fd, bool connecting, bool fresh, bool exclusive): d_responseBuffer(4096), d_ds(ds), d_threadData(threadData), d_fd(fd), d_connecting(connecting), d_fresh(fresh), d_exclusive(exclusive)
+  {
+  }
 
-    try {
-      readn2(pipefd, &citmp, sizeof(citmp));
+  TCPDownstreamConnection(const TCPDownstreamConnection& rhs) = delete;
+  TCPDownstreamConnection& operator=(const TCPDownstreamConnection& rhs) = delete;
+
+  ~TCPDownstreamConnection()
+  {
+    if (d_fd != -1) {
+      closeDownstreamSocket(d_ds, d_fd);
     }
-    catch(const std::runtime_error& e) {
-      throw std::runtime_error("Error reading from TCP acceptor pipe (" + std::to_string(pipefd) + ") in " + std::string(isNonBlocking(pipefd) ? "non-blocking" : "blocking") + " mode: " + e.what());
+  }
+
+  bool canAcceptQuery() const
+  {
+    return d_fd != -1 && !d_exclusive && d_queries.size() < d_ds->tcpMaxInFlight;
+  }
+
+  /* whether a failure right now happened while sending a query or reading a response */
+  bool isSending() const
+  {
+    return d_connecting || !d_writeQueue.empty();
+  }
+
+  int getIOTimeout(bool forWrite) const
+  {
+    if (d_connecting) {
+      return d_ds->tcpConnectTimeout;
     }
+    return forWrite ? d_ds->tcpSendTimeout : d_ds->tcpRecvTimeout;
+  }
 
-    g_tcpclientthreads->decrementQueuedCount();
-    ci=*citmp;
-    delete citmp;
+  void unregisterFromMultiplexer()
+  {
+    if (!d_registered) {
+      return;
+    }
 
-    uint16_t qlen, rlen;
-    vector<uint8_t> rewrittenResponse;
-    shared_ptr<DownstreamState> ds;
-    ComboAddress dest;
-    memset(&dest, 0, sizeof(dest));
-    dest.sin4.sin_family = ci.remote.sin4.sin_family;
-    socklen_t len = dest.getSocklen();
-    size_t queriesCount = 0;
-    time_t connectionStartTime = time(NULL);
-    std::vector<char> queryBuffer;
+    d_registered = false;
+    if (d_registeredForWrite) {
+      d_threadData.mplexer->removeWriteFD(d_fd);
+    }
+    else {
+      d_threadData.mplexer->removeReadFD(d_fd);
+    }
+  }
 
-    if (getsockname(ci.fd, (sockaddr*)&dest, &len)) {
-      dest = ci.cs->local;
+  /* no longer usable for new queries from this worker */
+  void removeFromActiveConnections()
+  {
+    auto it = d_threadData.activeDownstreamConnections.find(d_ds);
+    if (it == d_threadData.activeDownstreamConnections.end()) {
+      return;
     }
+    auto& list = it->second;
+    for (auto connIt = list.begin(); connIt != list.end(); ++connIt) {
+      if (connIt->get() == this) {
+        list.erase(connIt);
+        break;
+      }
+    }
+  }
 
-    try {
-      TCPIOHandler handler(ci.fd, g_tcpRecvTimeout, ci.cs->tlsFrontend ? ci.cs->tlsFrontend->getContext() : nullptr, connectionStartTime);
+  void close()
+  {
+    unregisterFromMultiplexer();
+    removeFromActiveConnections();
+    if (d_fd != -1) {
+      closeDownstreamSocket(d_ds, d_fd);
+      d_fd = -1;
+    }
+  }
 
-      for(;;) {
-        unsigned int remainingTime = 0;
-        ds = nullptr;
-        outstanding = false;
+  /* rewrite the ID of the query so that it is unique on this connection, and queue it */
+  void queueQuery(const std::shared_ptr<IncomingTCPConnectionState>& client)
+  {
+    uint16_t id;
+    do {
+      id = d_nextID++;
+    }
+    while (d_queries.count(id) != 0);
+
+    std::vector<uint8_t> buffer(client->d_buffer.begin(), client->d_buffer.begin() + sizeof(uint16_t) + client->d_queryLen);
+    uint16_t origID;
+    memcpy(&origID, &buffer.at(sizeof(uint16_t)), sizeof(origID));
+    memcpy(&buffer.at(sizeof(uint16_t)), &id, sizeof(id));
+    d_queries[id] = { client, origID };
+    d_writeQueue.push_back(std::move(buffer));
+  }
 
-        if(!getNonBlockingMsgLenFromClient(handler, &qlen)) {
-          break;
+  IOState sendQueries()
+  {
+    while (!d_writeQueue.empty()) {
+      const auto& buffer = d_writeQueue.front();
+#ifdef MSG_FASTOPEN
+      if (d_fresh && d_ds->tcpFastOpen) {
+        d_fresh = false;
+        ssize_t res = sendto(d_fd, &buffer.at(0), buffer.size(), MSG_FASTOPEN, reinterpret_cast<const struct sockaddr*>(&d_ds->remote), d_ds->remote.getSocklen());
+        if (res < 0) {
+          if (errno == EINPROGRESS || errno == EAGAIN || errno == EWOULDBLOCK) {
+            d_connecting = (errno == EINPROGRESS);
+            return IOState::NeedWrite;
+          }
+          throw std::runtime_error("sending a TCP Fast Open query to " + d_ds->remote.toStringWithPort() + ": " + strerror(errno));
         }
+        d_writePos = res;
+      }
+#endif /* MSG_FASTOPEN */
+      IOState state = tryWriteToSocket(d_fd, buffer, d_writePos, buffer.size());
+      if (state != IOState::Done) {
+        return state;
+      }
+      d_writeQueue.pop_front();
+      d_writePos = 0;
+    }
+    d_fresh = false;
+    return IOState::Done;
+  }
 
-        queriesCount++;
+  IOState readResponse()
+  {
+    if (d_readingResponseSize) {
+      d_responseBuffer.resize(sizeof(uint16_t));
+      IOState state = tryReadFromSocket(d_fd, d_responseBuffer, d_readPos, sizeof(uint16_t));
+      if (state != IOState::Done) {
+        return state;
+      }
+      d_responseSize = d_responseBuffer.at(0) * 256 + d_responseBuffer.at(1);
+      if (d_responseSize < sizeof(dnsheader)) {
+        throw std::runtime_error("received a response too small to be valid (" + std::to_string(d_responseSize) + ")");
+      }
+      d_responseBuffer.resize(sizeof(uint16_t) + d_responseSize);
+      d_readingResponseSize = false;
+    }
 
-        if (qlen < sizeof(dnsheader)) {
-          g_stats.nonCompliantQueries++;
-          break;
-        }
+    IOState state = tryReadFromSocket(d_fd, d_responseBuffer, d_readPos, sizeof(uint16_t) + d_responseSize);
+    if (state == IOState::Done) {
+      d_readingResponseSize = true;
+      d_readPos = 0;
+    }
+    return state;
+  }
 
-        ci.cs->queries++;
-        g_stats.queries++;
+  struct PendingQuery
+  {
+    std::shared_ptr<IncomingTCPConnectionState> client;
+    uint16_t origID;
+  };
+
+  /* by rewritten ID */
+  std::unordered_map<uint16_t, PendingQuery> d_queries;
+  std::deque<std::vector<uint8_t>> d_writeQueue;
+  std::vector<uint8_t> d_responseBuffer;
+  std::shared_ptr<DownstreamState> d_ds;
+  TCPClientThreadData& d_threadData;
+  size_t d_writePos{0};
+  size_t d_readPos{0};
+  int d_fd{-1};
+  uint16_t d_responseSize{0};
+  uint16_t d_nextID{0};
+  bool d_connecting{false};
+  bool d_fresh{false};
+  /* used for a single {A,I}XFR, then closed */
+  bool d_exclusive{false};
+  /* an {A,I}XFR response is being sent to the client, don't read the next one yet */
+  bool d_paused{false};
+  bool d_readingResponseSize{true};
+  bool d_registered{false};
+  bool d_registeredForWrite{false};
+};
 
-        if (g_maxTCPQueriesPerConn && queriesCount > g_maxTCPQueriesPerConn) {
-          vinfolog("Terminating TCP connection from %s because it reached the maximum number of queries per conn (%d / %d)", ci.remote.toStringWithPort(), queriesCount, g_maxTCPQueriesPerConn);
-          break;
-        }
+void IncomingTCPConnectionState::terminate()
+{
+  unregisterFromMultiplexer();
+  if (d_xfrConnection) {
+    /* break the reference cycle between us and the connection */
+    auto conn = std::move(d_xfrConnection);
+    conn->d_queries.clear();
+    conn->close();
+  }
+}
 
-        if (maxConnectionDurationReached(g_maxTCPConnectionDuration, connectionStartTime, remainingTime)) {
-          vinfolog("Terminating TCP connection from %s because it reached the maximum TCP connection duration", ci.remote.toStringWithPort());
-          break;
+static void handleIOCallback(int fd, FDMultiplexer::funcparam_t& param);
+static void handleDownstreamIOCallback(int fd, FDMultiplexer::funcparam_t& param);
+static void handleIO(std::shared_ptr<IncomingTCPConnectionState>& state, const struct timeval& now);
+
+/* register the client connection for the event it is waiting for on its socket, if any, and set the corresponding timeout */
+static void updateIO(std::shared_ptr<IncomingTCPConnectionState>& state, int fd, IOState iostate, const struct timeval& now)
+{
+  const bool forWrite = iostate == IOState::NeedWrite;
+
+  if (state->d_registeredFD != -1 && (iostate == IOState::Done || state->d_registeredFD != fd || state->d_registeredForWrite != forWrite)) {
+    state->unregisterFromMultiplexer();
+  }
+
+  if (iostate == IOState::Done) {
+    return;
+  }
+
+  auto& mplexer = state->d_threadData.mplexer;
+  if (state->d_registeredFD == -1) {
+    if (forWrite) {
+      mplexer->addWriteFD(fd, handleIOCallback, state);
+    }
+    else {
+      mplexer->addReadFD(fd, handleIOCallback, state);
+    }
+    state->d_registeredFD = fd;
+    state->d_registeredForWrite = forWrite;
+  }
+
+  const int timeout = state->getIOTimeout(forWrite);
+  if (forWrite) {
+    mplexer->setWriteTTD(fd, now, timeout);
+  }
+  else {
+    mplexer->setReadTTD(fd, now, timeout);
+  }
+}
+
+/* register the backend connection for writing if it has queries to send, for reading if it has queries
+   in flight, or hand it back to the idle pool of the backend */
+static void updateDownstreamIO(std::shared_ptr<TCPDownstreamConnection>& conn, const struct timeval& now)
+{
+  if (conn->d_fd == -1) {
+    return;
+  }
+
+  if (conn->isSending() || (!conn->d_queries.empty() && !conn->d_paused)) {
+    const bool forWrite = conn->isSending();
+    auto& mplexer = conn->d_threadData.mplexer;
+    if (conn->d_registered && conn->d_registeredForWrite != forWrite) {
+      conn->unregisterFromMultiplexer();
+    }
+    if (!conn->d_registered) {
+      if (forWrite) {
+        mplexer->addWriteFD(conn->d_fd, handleDownstreamIOCallback, conn);
+      }
+      else {
+        mplexer->addReadFD(conn->d_fd, handleDownstreamIOCallback, conn);
+      }
+      conn->d_registered = true;
+      conn->d_registeredForWrite = forWrite;
+    }
+
+    const int timeout = conn->getIOTimeout(forWrite);
+    if (forWrite) {
+      mplexer->setWriteTTD(conn->d_fd, now, timeout);
+    }
+    else {
+      mplexer->setReadTTD(conn->d_fd, now, timeout);
+    }
+    return;
+  }
+
+  conn->unregisterFromMultiplexer();
+  if (conn->d_paused) {
+    /* waiting for the client to be done sending the current part of the {A,I}XFR */
+    return;
+  }
+
+  conn->removeFromActiveConnections();
+  if (conn->d_exclusive) {
+    /* Don't reuse the TCP connection after an {A,I}XFR */
+    conn->close();
+    return;
+  }
+
+  releaseIdleDownstreamConnection(conn->d_ds, conn->d_fd, now.tv_sec);
+  conn->d_fd = -1;
+}
+
+/* get a connection to the backend selected for the query of that client: an active one from this worker
+   if pipelining is allowed and it has room left, an idle one from the backend pool or a new one */
+static std::shared_ptr<TCPDownstreamConnection> getDownstreamConnection(std::shared_ptr<IncomingTCPConnectionState>& state, const struct timeval& now)
+{
+  auto& ds = state->d_ds;
+  const bool exclusive = state->d_isXFR;
+  const bool pipelining = !exclusive && ds->tcpMaxInFlight > 1;
+
+  if (pipelining) {
+    auto it = state->d_threadData.activeDownstreamConnections.find(ds);
+    if (it != state->d_threadData.activeDownstreamConnections.end()) {
+      for (auto& conn : it->second) {
+        if (conn->canAcceptQuery()) {
+          ++ds->tcpReusedConnections;
+          return conn;
         }
+      }
+    }
+  }
+
+  bool connecting = false;
+  bool fresh = false;
+  int fd = getIdleDownstreamConnection(ds, now.tv_sec);
+  if (fd != -1) {
+    ++ds->tcpReusedConnections;
+  }
+  else {
+    if (ds->tcpMaxConcurrentConnections > 0 && ds->tcpCurrentConnections >= ds->tcpMaxConcurrentConnections) {
+      ++ds->tcpTooManyConcurrentConnections;
+      return nullptr;
+    }
+    fd = setupTCPDownstream(ds, state->d_downstreamFailures, connecting);
+    fresh = true;
+    ++ds->tcpNewConnections;
+  }
+
+  auto conn = std::make_shared<TCPDownstreamConnection>(ds, state->d_threadData, fd, connecting, fresh, exclusive);
+  if (pipelining) {
+    state->d_threadData.activeDownstreamConnections[ds].push_back(conn);
+  }
+  return conn;
+}
 
-        bool ednsAdded = false;
-        bool ecsAdded = false;
-        /* allocate a bit more memory to be able to spoof the content,
-           or to add ECS without allocating a new buffer */
-        queryBuffer.reserve(qlen + 512);
+static void handleDownstreamIO(std::shared_ptr<TCPDownstreamConnection>& conn, const struct timeval& now, bool fromEvent);
+
+/* returns false if we gave up on that query, in which case the caller should terminate the client connection */
+static bool sendQueryToBackend(std::shared_ptr<IncomingTCPConnectionState>& state, const struct timeval& now)
+{
+  auto& ds = state->d_ds;
+  std::shared_ptr<TCPDownstreamConnection> conn;
+  try {
+    conn = getDownstreamConnection(state, now);
+  }
+  catch (const std::exception& e) {
+    vinfolog("Downstream connection to %s failed %d times in a row, giving up.", ds->getName(), state->d_downstreamFailures);
+  }
+
+  if (!conn) {
+    ++ds->tcpGaveUp;
+    ++state->d_ci.cs->tcpGaveUp;
+    return false;
+  }
+
+  state->d_state = IncomingTCPConnectionState::State::waitingForResponse;
+  state->d_firstResponsePacket = true;
+  if (state->d_isXFR) {
+    state->d_xfrConnection = conn;
+  }
+  conn->queueQuery(state);
+  /* don't read yet, we might be called while handling a response from that connection */
+  handleDownstreamIO(conn, now, false);
+  return true;
+}
+
+/* the connection to the backend failed or timed out: retry the queries in flight over another one */
+static void handleDownstreamConnectionFailure(std::shared_ptr<TCPDownstreamConnection>& conn, const struct timeval& now, const std::string& reason)
+{
+  auto ds = conn->d_ds;
+  vinfolog("Downstream connection to %s died on us (%s), getting a new one!", ds->getName(), reason);
+  ++(conn->isSending() ? ds->tcpDiedSendingQuery : ds->tcpDiedReadingResponse);
+
+  auto queries = std::move(conn->d_queries);
+  conn->d_queries.clear();
+  conn->d_writeQueue.clear();
+  conn->close();
+
+  for (auto& entry : queries) {
+    auto client = entry.second.client;
+    client->d_xfrConnection.reset();
+    if (client->d_xfrStarted) {
+      client->terminate();
+      continue;
+    }
+
+    client->d_downstreamFailures++;
+    if (client->d_downstreamFailures > ds->retries) {
+      vinfolog("Downstream connection to %s failed %d times in a row, giving up.", ds->getName(), client->d_downstreamFailures);
+      ++ds->tcpGaveUp;
+      ++client->d_ci.cs->tcpGaveUp;
+      client->terminate();
+      continue;
+    }
+
+    if (!sendQueryToBackend(client, now)) {
+      client->terminate();
+    }
+  }
+}
+
+/* returns false if the connection to the client should be closed,
+   otherwise sets the next state */
+static bool handleQuery(std::shared_ptr<IncomingTCPConnectionState>& state, const struct timeval& now)
+{
+  ClientState* cs = state->d_ci.cs;
+  auto& holders = state->d_threadData.holders;
+
+  CoarseClock::update();
+  state->d_queriesCount++;
+  cs->queries++;
+  g_stats.queries++;
+
+  if (g_maxTCPQueriesPerConn && state->d_queriesCount > g_maxTCPQueriesPerConn) {
+    vinfolog("Terminating TCP connection from %s because it reached the maximum number of queries per conn (%d / %d)", state->d_ci.remote.toStringWithPort(), state->d_queriesCount, g_maxTCPQueriesPerConn);
+    return false;
+  }
+
+  unsigned int remainingTime = 0;
+  if (maxConnectionDurationReached(g_maxTCPConnectionDuration, state->d_connectionStartTime.tv_sec, remainingTime)) {
+    vinfolog("Terminating TCP connection from %s because it reached the maximum TCP connection duration", state->d_ci.remote.toStringWithPort());
+    return false;
+  }
+
+  state->d_ds = nullptr;
+  state->d_ednsAdded = false;
+  state->d_ecsAdded = false;
+  state->d_rewrittenResponse.clear();
+
+  char* query = reinterpret_cast<char*>(&state->d_buffer.at(sizeof(uint16_t)));
+  uint16_t queryLen = state->d_querySize;
+  /* the buffer holds the size of the query, then the query */
+  const size_t querySize = state->d_buffer.size() - sizeof(uint16_t);
 
-        char* query = &queryBuffer[0];
-        handler.read(query, qlen, g_tcpRecvTimeout, remainingTime);
 #ifdef HAVE_DNSCRYPT
-        std::shared_ptr<DnsCryptQuery> dnsCryptQuery = nullptr;
-
-        if (ci.cs->dnscryptCtx) {
-          dnsCryptQuery = std::make_shared<DnsCryptQuery>();
-          uint16_t decryptedQueryLen = 0;
-          vector<uint8_t> response;
-          bool decrypted = handleDnsCryptQuery(ci.cs->dnscryptCtx, query, qlen, dnsCryptQuery, &decryptedQueryLen, true, response);
-
-          if (!decrypted) {
-            if (response.size() > 0) {
-              handler.writeSizeAndMsg(response.data(), response.size(), g_tcpSendTimeout);
-            }
-            break;
-          }
-          qlen = decryptedQueryLen;
-        }
+  state->d_dnsCryptQuery = nullptr;
+
+  if (cs->dnscryptCtx) {
+    state->d_dnsCryptQuery = std::make_shared<DnsCryptQuery>();
+    uint16_t decryptedQueryLen = 0;
+    vector<uint8_t> response;
+    bool decrypted = handleDnsCryptQuery(cs->dnscryptCtx, query, queryLen, state->d_dnsCryptQuery, &decryptedQueryLen, true, response);
+
+    if (!decrypted) {
+      if (response.size() > 0) {
+        state->prepareResponse(reinterpret_cast<const char*>(response.data()), response.size());
+        state->d_closeAfterResponse = true;
+        return true;
+      }
+      return false;
+    }
+    queryLen = decryptedQueryLen;
+  }
 #endif
-        struct dnsheader* dh = reinterpret_cast<struct dnsheader*>(query);
+  struct dnsheader* dh = reinterpret_cast<struct dnsheader*>(query);
 
-        if (!checkQueryHeaders(dh)) {
-          goto drop;
-        }
+  if (!checkQueryHeaders(dh)) {
+    return false;
+  }
+
+  string poolname;
+  int delayMsec=0;
+  gettime(&state->d_queryTime);
+  gettime(&state->d_queryRealTime, true);
+
+  const uint16_t* flags = getFlagsFromDNSHeader(dh);
+  state->d_origFlags = *flags;
+  unsigned int consumed = 0;
+  state->d_qname = DNSName(query, queryLen, sizeof(dnsheader), false, &state->d_qtype, &state->d_qclass, &consumed);
+  DNSQuestion dq(&state->d_qname, state->d_qtype, state->d_qclass, &state->d_origDest, &state->d_ci.remote, dh, querySize, queryLen, true, &state->d_queryRealTime);
+
+  if (!processQuery(holders, dq, poolname, &delayMsec, state->d_queryTime)) {
+    return false;
+  }
 
-	string poolname;
-	int delayMsec=0;
-	/* we need this one to be accurate ("real") for the protobuf message */
-	struct timespec queryRealTime;
-	struct timespec now;
-	gettime(&now);
-	gettime(&queryRealTime, true);
-
-	const uint16_t* flags = getFlagsFromDNSHeader(dh);
-	uint16_t origFlags = *flags;
-	uint16_t qtype, qclass;
-	unsigned int consumed = 0;
-	DNSName qname(query, qlen, sizeof(dnsheader), false, &qtype, &qclass, &consumed);
-	DNSQuestion dq(&qname, qtype, qclass, &dest, &ci.remote, dh, queryBuffer.capacity(), qlen, true, &queryRealTime);
-
-	if (!processQuery(holders, dq, poolname, &delayMsec, now)) {
-	  goto drop;
-	}
-
-	if(dq.dh->qr) { // something turned it into a response
-          restoreFlags(dh, origFlags);
-
-          DNSResponse dr(dq.qname, dq.qtype, dq.qclass, dq.local, dq.remote, reinterpret_cast<dnsheader*>(query), dq.size, dq.len, true, &queryRealTime);
+  if(dq.dh->qr) { // something turned it into a response
+    restoreFlags(dh, state->d_origFlags);
+
+    DNSResponse dr(dq.qname, dq.qtype, dq.qclass, dq.local, dq.remote, reinterpret_cast<dnsheader*>(query), dq.size, dq.len, true, &state->d_queryRealTime);
 #ifdef HAVE_PROTOBUF
-          dr.uniqueId = dq.uniqueId;
+    dr.uniqueId = dq.uniqueId;
 #endif
-          dr.qTag = dq.qTag;
+    dr.qTag = dq.qTag;
 
-          if (!processResponse(holders.selfAnsweredRespRulactions, dr, &delayMsec)) {
-            goto drop;
-          }
+    if (!processResponse(holders.selfAnsweredRespRulactions, dr, &delayMsec)) {
+      return false;
+    }
 
 #ifdef HAVE_DNSCRYPT
-          if (!encryptResponse(query, &dq.len, dq.size, true, dnsCryptQuery, nullptr, nullptr)) {
-            goto drop;
-          }
+    if (!encryptResponse(query, &dq.len, dq.size, true, state->d_dnsCryptQuery, nullptr, nullptr)) {
+      return false;
+    }
 #endif
-          handler.writeSizeAndMsg(query, dq.len, g_tcpSendTimeout);
-          g_stats.selfAnswered++;
-          continue;
-        }
+    state->prepareResponse(query, dq.len);
+    g_stats.selfAnswered++;
+    return true;
+  }
 
-        std::shared_ptr<ServerPool> serverPool = getPool(*holders.pools, poolname);
-        std::shared_ptr<DNSDistPacketCache> packetCache = nullptr;
-        auto policy = holders.policy->policy;
-        if (serverPool->policy != nullptr) {
-          policy = serverPool->policy->policy;
-        }
-        {
-          std::lock_guard<std::mutex> lock(g_luamutex);
-          ds = policy(serverPool->servers, &dq);
-          packetCache = serverPool->packetCache;
-        }
+  std::shared_ptr<ServerPool> serverPool = getPool(*holders.pools, poolname);
+  std::shared_ptr<DownstreamState> ds;
+  auto policy = holders.policy->policy;
+  if (serverPool->policy != nullptr) {
+    policy = serverPool->policy->policy;
+  }
+  {
+    std::lock_guard<std::mutex> lock(g_luamutex);
+    ds = policy(serverPool->servers, &dq);
+    state->d_packetCache = serverPool->packetCache;
+    state->d_pool = serverPool;
+  }
 
-        if (dq.useECS && ds && ds->useECS) {
-          uint16_t newLen = dq.len;
-          if (!handleEDNSClientSubnet(query, dq.size, consumed, &newLen, &ednsAdded, &ecsAdded, ci.remote, dq.ecsOverride, dq.ecsPrefixLength)) {
-            vinfolog("Dropping query from %s because we couldn't insert the ECS value", ci.remote.toStringWithPort());
-            goto drop;
-          }
-          dq.len = newLen;
-        }
+  if (dq.useECS && ds && ds->useECS) {
+    uint16_t newLen = dq.len;
+    if (!handleEDNSClientSubnet(query, dq.size, consumed, &newLen, &state->d_ednsAdded, &state->d_ecsAdded, state->d_ci.remote, dq.ecsOverride, dq.ecsPrefixLength)) {
+      vinfolog("Dropping query from %s because we couldn't insert the ECS value", state->d_ci.remote.toStringWithPort());
+      return false;
+    }
+    dq.len = newLen;
+  }
 
-        uint32_t cacheKey = 0;
-        if (packetCache && !dq.skipCache) {
-          char cachedResponse[4096];
-          uint16_t cachedResponseSize = sizeof cachedResponse;
-          uint32_t allowExpired = ds ? 0 : g_staleCacheEntriesTTL;
-          if (packetCache->get(dq, (uint16_t) consumed, dq.dh->id, cachedResponse, &cachedResponseSize, &cacheKey, allowExpired)) {
-            DNSResponse dr(dq.qname, dq.qtype, dq.qclass, dq.local, dq.remote, (dnsheader*) cachedResponse, sizeof cachedResponse, cachedResponseSize, true, &queryRealTime);
+  state->d_cacheKey = 0;
+  auto& packetCache = state->d_packetCache;
+  if (packetCache && !dq.skipCache) {
+    char cachedResponse[4096];
+    uint16_t cachedResponseSize = sizeof cachedResponse;
+    uint32_t allowExpired = ds ? 0 : g_staleCacheEntriesTTL;
+    if (packetCache->get(dq, (uint16_t) consumed, dq.dh->id, cachedResponse, &cachedResponseSize, &state->d_cacheKey, allowExpired)) {
+      DNSResponse dr(dq.qname, dq.qtype, dq.qclass, dq.local, dq.remote, (dnsheader*) cachedResponse, sizeof cachedResponse, cachedResponseSize, true, &state->d_queryRealTime);
 #ifdef HAVE_PROTOBUF
-            dr.uniqueId = dq.uniqueId;
+      dr.uniqueId = dq.uniqueId;
 #endif
-            dr.qTag = dq.qTag;
+      dr.qTag = dq.qTag;
 
-            if (!processResponse(holders.cacheHitRespRulactions, dr, &delayMsec)) {
-              goto drop;
-            }
+      if (!processResponse(holders.cacheHitRespRulactions, dr, &delayMsec)) {
+        return false;
+      }
 
 #ifdef HAVE_DNSCRYPT
-            if (!encryptResponse(cachedResponse, &cachedResponseSize, sizeof cachedResponse, true, dnsCryptQuery, nullptr, nullptr)) {
-              goto drop;
-            }
+      if (!encryptResponse(cachedResponse, &cachedResponseSize, sizeof cachedResponse, true, state->d_dnsCryptQuery, nullptr, nullptr)) {
+        return false;
+      }
 #endif
-            handler.writeSizeAndMsg(cachedResponse, cachedResponseSize, g_tcpSendTimeout);
-            g_stats.cacheHits++;
-            continue;
-          }
-          g_stats.cacheMisses++;
-        }
+      state->prepareResponse(cachedResponse, cachedResponseSize);
+      g_stats.cacheHits++;
+      return true;
+    }
+    g_stats.cacheMisses++;
+  }
 
-        if(!ds) {
-          g_stats.noPolicy++;
+  if(!ds) {
+    g_stats.noPolicy++;
 
-          if (g_servFailOnNoPolicy) {
-            restoreFlags(dh, origFlags);
-            dq.dh->rcode = RCode::ServFail;
-            dq.dh->qr = true;
+    if (g_servFailOnNoPolicy) {
+      restoreFlags(dh, state->d_origFlags);
+      dq.dh->rcode = RCode::ServFail;
+      dq.dh->qr = true;
 
-            DNSResponse dr(dq.qname, dq.qtype, dq.qclass, dq.local, dq.remote, reinterpret_cast<dnsheader*>(query), dq.size, dq.len, false, &queryRealTime);
+      DNSResponse dr(dq.qname, dq.qtype, dq.qclass, dq.local, dq.remote, reinterpret_cast<dnsheader*>(query), dq.size, dq.len, false, &state->d_queryRealTime);
 #ifdef HAVE_PROTOBUF
-            dr.uniqueId = dq.uniqueId;
+      dr.uniqueId = dq.uniqueId;
 #endif
-            dr.qTag = dq.qTag;
+      dr.qTag = dq.qTag;
 
-            if (!processResponse(holders.selfAnsweredRespRulactions, dr, &delayMsec)) {
-              goto drop;
-            }
+      if (!processResponse(holders.selfAnsweredRespRulactions, dr, &delayMsec)) {
+        return false;
+      }
 
 #ifdef HAVE_DNSCRYPT
-            if (!encryptResponse(query, &dq.len, dq.size, true, dnsCryptQuery, nullptr, nullptr)) {
-              goto drop;
-            }
+      if (!encryptResponse(query, &dq.len, dq.size, true, state->d_dnsCryptQuery, nullptr, nullptr)) {
+        return false;
+      }
 #endif
-            handler.writeSizeAndMsg(query, dq.len, g_tcpSendTimeout);
+      state->prepareResponse(query, dq.len);
 
-            // no response-only statistics counter to update.
-            continue;
-          }
+      // no response-only statistics counter to update.
+      return true;
+    }
 
-          break;
-        }
+    return false;
+  }
 
-        if (dq.addXPF && ds->xpfRRCode != 0) {
-          addXPF(dq, ds->xpfRRCode);
-        }
+  if (dq.addXPF && ds->xpfRRCode != 0) {
+    addXPF(dq, ds->xpfRRCode);
+  }
 
-	int dsock = -1;
-	uint16_t downstreamFailures=0;
-#ifdef MSG_FASTOPEN
-	bool freshConn = true;
-#endif /* MSG_FASTOPEN */
-	if(sockets.count(ds->remote) == 0) {
-	  dsock=setupTCPDownstream(ds, downstreamFailures);
-	  sockets[ds->remote]=dsock;
-	}
-	else {
-	  dsock=sockets[ds->remote];
-#ifdef MSG_FASTOPEN
-	  freshConn = false;
-#endif /* MSG_FASTOPEN */
-        }
+  state->d_ds = ds;
+#ifdef HAVE_PROTOBUF
+  state->d_uniqueId = dq.uniqueId;
+#endif
+  state->d_qTag = dq.qTag;
+  state->d_tempFailureTTL = dq.tempFailureTTL;
+  state->d_isXFR = (dq.qtype == QType::AXFR || dq.qtype == QType::IXFR);
+  state->d_skipCache = dq.skipCache || state->d_isXFR;
+  state->d_xfrStarted = false;
+  state->d_queryLen = dq.len;
+  /* update the size preceding the query, ECS or XPF might have changed it */
+  state->d_buffer[0] = dq.len / 256;
+  state->d_buffer[1] = dq.len % 256;
+
+  ds->queries++;
+  ds->outstanding++;
+  state->d_outstanding = true;
+  state->d_downstreamFailures = 0;
+
+  return sendQueryToBackend(state, now);
+}
 
-        ds->queries++;
-        ds->outstanding++;
-        outstanding = true;
+/* returns false if the connection to the client should be closed,
+   otherwise sets the next state */
+static bool handleResponse(std::shared_ptr<IncomingTCPConnectionState>& state)
+{
+  auto& ds = state->d_ds;
+  if (state->d_outstanding) {
+    /* might be false for {A,I}XFR */
+    --ds->outstanding;
+    state->d_outstanding = false;
+  }
 
-      retry:; 
-        if (dsock < 0) {
-          sockets.erase(ds->remote);
-          break;
-        }
+  uint16_t addRoom = 0;
+#ifdef HAVE_DNSCRYPT
+  if (state->d_dnsCryptQuery && (UINT16_MAX - state->d_responseSize) > (uint16_t) DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE) {
+    addRoom = DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE;
+  }
+#endif
+  state->d_responseBuffer.resize(sizeof(uint16_t) + state->d_responseSize + addRoom);
 
-        if (ds->retries > 0 && downstreamFailures > ds->retries) {
-          vinfolog("Downstream connection to %s failed %d times in a row, giving up.", ds->getName(), downstreamFailures);
-          close(dsock);
-          dsock=-1;
-          sockets.erase(ds->remote);
-          break;
-        }
+  char* response = reinterpret_cast<char*>(&state->d_responseBuffer.at(sizeof(uint16_t)));
+  uint16_t responseLen = state->d_responseSize;
+  size_t responseSize = state->d_responseBuffer.size() - sizeof(uint16_t);
 
-        try {
-          int socketFlags = 0;
-#ifdef MSG_FASTOPEN
-          if (ds->tcpFastOpen && freshConn) {
-            socketFlags |= MSG_FASTOPEN;
-          }
-#endif /* MSG_FASTOPEN */
-          sendSizeAndMsgWithTimeout(dsock, dq.len, query, ds->tcpSendTimeout, &ds->remote, &ds->sourceAddr, ds->sourceItf, 0, socketFlags);
-        }
-        catch(const runtime_error& e) {
-          vinfolog("Downstream connection to %s died on us (%s), getting a new one!", ds->getName(), e.what());
-          close(dsock);
-          dsock=-1;
-          sockets.erase(ds->remote);
-          downstreamFailures++;
-          dsock=setupTCPDownstream(ds, downstreamFailures);
-          sockets[ds->remote]=dsock;
-#ifdef MSG_FASTOPEN
-          freshConn=true;
-#endif /* MSG_FASTOPEN */
-          goto retry;
-        }
+  if (state->d_firstResponsePacket && !responseContentMatches(response, responseLen, state->d_qname, state->d_qtype, state->d_qclass, ds->remote)) {
+    return false;
+  }
+  state->d_firstResponsePacket = false;
 
-        bool xfrStarted = false;
-        bool isXFR = (dq.qtype == QType::AXFR || dq.qtype == QType::IXFR);
-        if (isXFR) {
-          dq.skipCache = true;
-        }
-        bool firstPacket=true;
-      getpacket:;
-
-        if(!getNonBlockingMsgLen(dsock, &rlen, ds->tcpRecvTimeout)) {
-	  vinfolog("Downstream connection to %s died on us phase 2, getting a new one!", ds->getName());
-          close(dsock);
-          dsock=-1;
-          sockets.erase(ds->remote);
-          downstreamFailures++;
-          dsock=setupTCPDownstream(ds, downstreamFailures);
-          sockets[ds->remote]=dsock;
-#ifdef MSG_FASTOPEN
-          freshConn=true;
-#endif /* MSG_FASTOPEN */
-          if(xfrStarted) {
-            goto drop;
-          }
-          goto retry;
-        }
+  if (!fixUpResponse(&response, &responseLen, &responseSize, state->d_qname, state->d_origFlags, state->d_ednsAdded, state->d_ecsAdded, state->d_rewrittenResponse, addRoom)) {
+    return false;
+  }
 
-        size_t responseSize = rlen;
-        uint16_t addRoom = 0;
-#ifdef HAVE_DNSCRYPT
-        if (dnsCryptQuery && (UINT16_MAX - rlen) > (uint16_t) DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE) {
-          addRoom = DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE;
-        }
+  struct dnsheader* dh = reinterpret_cast<struct dnsheader*>(response);
+  DNSResponse dr(&state->d_qname, state->d_qtype, state->d_qclass, &state->d_origDest, &state->d_ci.remote, dh, responseSize, responseLen, true, &state->d_queryRealTime);
+#ifdef HAVE_PROTOBUF
+  dr.uniqueId = state->d_uniqueId;
 #endif
-        responseSize += addRoom;
-        char answerbuffer[responseSize];
-        readn2WithTimeout(dsock, answerbuffer, rlen, ds->tcpRecvTimeout);
-        char* response = answerbuffer;
-        uint16_t responseLen = rlen;
-        if (outstanding) {
-          /* might be false for {A,I}XFR */
-          --ds->outstanding;
-          outstanding = false;
-        }
+  dr.qTag = state->d_qTag;
 
-        if (rlen < sizeof(dnsheader)) {
-          break;
-        }
+  int delayMsec = 0;
+  if (!processResponse(state->d_threadData.localRespRulactions, dr, &delayMsec)) {
+    return false;
+  }
 
-        if (firstPacket && !responseContentMatches(response, responseLen, qname, qtype, qclass, ds->remote)) {
-          break;
-        }
-        firstPacket=false;
-        if (!fixUpResponse(&response, &responseLen, &responseSize, qname, origFlags, ednsAdded, ecsAdded, rewrittenResponse, addRoom)) {
-          break;
+  if (state->d_packetCache && !state->d_skipCache) {
+    state->d_packetCache->insert(state->d_cacheKey, state->d_qname, state->d_qtype, state->d_qclass, response, responseLen, true, dh->rcode, state->d_tempFailureTTL);
+  }
+
+  state->d_moreResponsesExpected = false;
+  if (state->d_isXFR) {
+    if (dh->rcode == 0 && dh->ancount != 0) {
+      if (state->d_xfrStarted == false) {
+        state->d_xfrStarted = true;
+        if (getRecordsOfTypeCount(response, responseLen, 1, QType::SOA) == 1) {
+          state->d_moreResponsesExpected = true;
         }
+      }
+      else if (getRecordsOfTypeCount(response, responseLen, 1, QType::SOA) == 0) {
+        state->d_moreResponsesExpected = true;
+      }
+    }
+  }
 
-        dh = (struct dnsheader*) response;
-        DNSResponse dr(&qname, qtype, qclass, &dest, &ci.remote, dh, responseSize, responseLen, true, &queryRealTime);
-#ifdef HAVE_PROTOBUF
-        dr.uniqueId = dq.uniqueId;
+  /* when the answer is encrypted in place, we need to get a copy
+     of the original header before encryption to fill the ring buffer */
+  struct dnsheader cleartextDH;
+  memcpy(&cleartextDH, dh, sizeof(cleartextDH));
+#ifdef HAVE_DNSCRYPT
+  if (!encryptResponse(response, &responseLen, responseSize, true, state->d_dnsCryptQuery, nullptr, nullptr)) {
+    return false;
+  }
 #endif
-        dr.qTag = dq.qTag;
 
-        if (!processResponse(localRespRulactions, dr, &delayMsec)) {
-          break;
-        }
+  if (!state->d_moreResponsesExpected) {
+    g_stats.responses++;
+    struct timespec answertime;
+    gettime(&answertime);
+    unsigned int udiff = 1000000.0*DiffTime(state->d_queryTime, answertime);
+    g_rings.insertResponse(answertime, state->d_ci.remote, state->d_qname, state->d_qtype, udiff, static_cast<unsigned int>(responseLen), cleartextDH, ds->remote);
+    ds->latencyHistogram.record(udiff);
+    state->d_ci.cs->latencyHistogram.record(udiff);
+    if (state->d_pool) {
+      state->d_pool->latencyHistogram.record(udiff);
+    }
+  }
+
+  state->prepareResponse(response, responseLen);
+  return true;
+}
 
-	if (packetCache && !dq.skipCache) {
-	  packetCache->insert(cacheKey, qname, qtype, qclass, response, responseLen, true, dh->rcode, dq.tempFailureTTL);
-	}
+/* hand the response we just read over to the client it belongs to */
+static void dispatchResponse(std::shared_ptr<TCPDownstreamConnection>& conn, const struct timeval& now)
+{
+  uint16_t id;
+  memcpy(&id, &conn->d_responseBuffer.at(sizeof(uint16_t)), sizeof(id));
+  auto it = conn->d_queries.find(id);
+  if (it == conn->d_queries.end()) {
+    throw std::runtime_error("received a response with an unexpected ID " + std::to_string(ntohs(id)));
+  }
 
-#ifdef HAVE_DNSCRYPT
-        if (!encryptResponse(response, &responseLen, responseSize, true, dnsCryptQuery, &dh, &dhCopy)) {
-          goto drop;
+  auto client = it->second.client;
+  memcpy(&conn->d_responseBuffer.at(sizeof(uint16_t)), &it->second.origID, sizeof(it->second.origID));
+  client->d_responseSize = conn->d_responseSize;
+  std::swap(client->d_responseBuffer, conn->d_responseBuffer);
+
+  bool keep = false;
+  try {
+    keep = handleResponse(client);
+  }
+  catch (const std::exception& e) {
+    vinfolog("Got an exception while handling a TCP response from %s for %s: %s", conn->d_ds->getName(), client->d_ci.remote.toStringWithPort(), e.what());
+  }
+
+  if (keep && client->d_moreResponsesExpected) {
+    /* the rest of the {A,I}XFR will be read once this part has been sent */
+    conn->d_paused = true;
+  }
+  else {
+    conn->d_queries.erase(id);
+    client->d_xfrConnection.reset();
+  }
+
+  if (!keep) {
+    client->terminate();
+    return;
+  }
+
+  handleIO(client, now);
+}
+
+static void handleDownstreamIO(std::shared_ptr<TCPDownstreamConnection>& conn, const struct timeval& now, bool fromEvent)
+{
+  try {
+    if (conn->d_connecting) {
+      if (!fromEvent) {
+        /* not writable yet */
+        updateDownstreamIO(conn, now);
+        return;
+      }
+
+      int err = 0;
+      socklen_t errlen = sizeof(err);
+      if (getsockopt(conn->d_fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0) {
+        err = errno;
+      }
+      if (err != 0) {
+        throw std::runtime_error("connecting to " + conn->d_ds->remote.toStringWithPort() + ": " + strerror(err));
+      }
+      conn->d_connecting = false;
+    }
+
+    conn->sendQueries();
+
+    /* even if we are waiting to be able to write, read what we can so the backend is never
+       stuck waiting for us to read its responses while we are waiting for it to read our queries */
+    while (fromEvent && !conn->d_queries.empty() && !conn->d_paused) {
+      if (conn->readResponse() != IOState::Done) {
+        break;
+      }
+
+      dispatchResponse(conn, now);
+      if (conn->d_fd == -1) {
+        /* closed while handling that response */
+        return;
+      }
+    }
+  }
+  catch (const std::exception& e) {
+    handleDownstreamConnectionFailure(conn, now, e.what());
+    return;
+  }
+
+  updateDownstreamIO(conn, now);
+}
+
+static void handleDownstreamIOCallback(int fd, FDMultiplexer::funcparam_t& param)
+{
+  /* get a copy of the shared pointer, the parameter stored by the multiplexer
+     is destroyed if we unregister the descriptor */
+  auto conn = boost::any_cast<std::shared_ptr<TCPDownstreamConnection>>(param);
+  if (fd != conn->d_fd) {
+    errlog("Unexpected socket descriptor %d received in the TCP worker, expected %d", fd, conn->d_fd);
+    return;
+  }
+
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  handleDownstreamIO(conn, now, true);
+}
+
+static void handleIO(std::shared_ptr<IncomingTCPConnectionState>& state, const struct timeval& now)
+{
+  typedef IncomingTCPConnectionState::State State;
+  IOState iostate = IOState::Done;
+  const int fd = state->d_ci.fd;
+
+  try {
+    while (iostate == IOState::Done) {
+      switch (state->d_state) {
+      case State::doingHandshake:
+        iostate = state->d_handler.tryHandshake();
+        if (iostate == IOState::Done) {
+          state->d_state = State::readingQuerySize;
+          state->d_currentPos = 0;
         }
-#endif
-        if (!handler.writeSizeAndMsg(response, responseLen, g_tcpSendTimeout)) {
-          break;
+        break;
+
+      case State::readingQuerySize:
+        iostate = state->d_handler.tryRead(state->d_buffer, state->d_currentPos, sizeof(uint16_t));
+        if (iostate == IOState::Done) {
+          state->d_querySize = state->d_buffer.at(0) * 256 + state->d_buffer.at(1);
+          if (state->d_querySize < sizeof(dnsheader)) {
+            ++g_stats.nonCompliantQueries;
+            state->terminate();
+            return;
+          }
+          /* allocate a bit more memory to be able to spoof the content,
+             or to add ECS without allocating a new buffer */
+          state->d_buffer.resize(sizeof(uint16_t) + state->d_querySize + 512);
+          state->d_state = State::readingQuery;
         }
-
-        if (isXFR) {
-          if (dh->rcode == 0 && dh->ancount != 0) {
-            if (xfrStarted == false) {
-              xfrStarted = true;
-              if (getRecordsOfTypeCount(response, responseLen, 1, QType::SOA) == 1) {
-                goto getpacket;
-              }
-            }
-            else if (getRecordsOfTypeCount(response, responseLen, 1, QType::SOA) == 0) {
-              goto getpacket;
-            }
+        break;
+
+      case State::readingQuery:
+        iostate = state->d_handler.tryRead(state->d_buffer, state->d_currentPos, sizeof(uint16_t) + state->d_querySize);
+        if (iostate == IOState::Done) {
+          bool keep = false;
+          try {
+            keep = handleQuery(state, now);
+          }
+          catch (const std::exception& e) {
+            vinfolog("Got an exception while handling a TCP query from %s: %s", state->d_ci.remote.toStringWithPort(), e.what());
+          }
+          if (!keep) {
+            state->terminate();
+            return;
           }
-          /* Don't reuse the TCP connection after an {A,I}XFR */
-          close(dsock);
-          dsock=-1;
-          sockets.erase(ds->remote);
         }
-
-        g_stats.responses++;
-        struct timespec answertime;
-        gettime(&answertime);
-        unsigned int udiff = 1000000.0*DiffTime(now,answertime);
-        {
-          std::lock_guard<std::mutex> lock(g_rings.respMutex);
-          g_rings.respRing.push_back({answertime, ci.remote, qname, dq.qtype, (unsigned int)udiff, (unsigned int)responseLen, *dh, ds->remote});
+        break;
+
+      case State::waitingForResponse:
+        /* nothing to do on the client side until the backend answers */
+        state->unregisterFromMultiplexer();
+        return;
+
+      case State::sendingResponse:
+        iostate = state->d_handler.tryWrite(state->d_responseBuffer, state->d_currentPos, state->d_responseBuffer.size());
+        if (iostate == IOState::Done) {
+          if (state->d_closeAfterResponse) {
+            state->terminate();
+            return;
+          }
+          if (state->d_moreResponsesExpected && state->d_xfrConnection) {
+            /* the rest of the {A,I}XFR */
+            auto conn = state->d_xfrConnection;
+            state->d_state = State::waitingForResponse;
+            conn->d_paused = false;
+            updateDownstreamIO(conn, now);
+          }
+          else {
+            state->d_state = State::readingQuerySize;
+            state->d_currentPos = 0;
+          }
         }
-
-        rewrittenResponse.clear();
+        break;
       }
     }
-    catch(...) {}
+  }
+  catch (const std::exception& e) {
+    if (state->d_state == State::sendingResponse) {
+      ++state->d_ci.cs->tcpDiedSendingResponse;
+    }
+    else if (state->d_state != State::readingQuerySize || state->d_currentPos > 0) {
+      /* an EOF between two queries is the client closing the connection, the rest is not */
+      ++state->d_ci.cs->tcpDiedReadingQuery;
+    }
+    state->terminate();
+    return;
+  }
 
-  drop:;
+  updateIO(state, fd, iostate, now);
+}
 
-    vinfolog("Closing TCP client connection with %s", ci.remote.toStringWithPort());
-    if (ci.fd >= 0) {
-      close(ci.fd);
-    }
-    ci.fd = -1;
+static void handleIOCallback(int fd, FDMultiplexer::funcparam_t& param)
+{
+  /* get a copy of the shared pointer, the parameter stored by the multiplexer
+     is destroyed if we unregister the descriptor */
+  auto state = boost::any_cast<std::shared_ptr<IncomingTCPConnectionState>>(param);
+  if (fd != state->d_registeredFD) {
+    errlog("Unexpected socket descriptor %d received in the TCP worker, expected %d", fd, state->d_registeredFD);
+    return;
+  }
+
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  handleIO(state, now);
+}
 
-    if (ds && outstanding) {
-      outstanding = false;
-      --ds->outstanding;
+static void handleNewConnection(int pipefd, FDMultiplexer::funcparam_t& param)
+{
+  auto threadData = boost::any_cast<TCPClientThreadData*>(param);
+  ConnectionInfo* citmp = nullptr;
+
+  ssize_t got = read(pipefd, &citmp, sizeof(citmp));
+  if (got == 0) {
+    throw std::runtime_error("EOF while reading from the TCP acceptor pipe (" + std::to_string(pipefd) + ") in " + std::string(isNonBlocking(pipefd) ? "non-blocking" : "blocking") + " mode");
+  }
+  else if (got == -1) {
+    if (errno == EAGAIN || errno == EINTR) {
+      /* another worker got it first (single pipe mode) */
+      return;
     }
+    throw std::runtime_error("Error while reading from the TCP acceptor pipe (" + std::to_string(pipefd) + ") in " + std::string(isNonBlocking(pipefd) ? "non-blocking" : "blocking") + " mode: " + strerror(errno));
+  }
+  else if (got != sizeof(citmp)) {
+    throw std::runtime_error("Partial read while reading from the TCP acceptor pipe (" + std::to_string(pipefd) + ") in " + std::string(isNonBlocking(pipefd) ? "non-blocking" : "blocking") + " mode");
+  }
+
+  g_tcpclientthreads->decrementQueuedCount();
+  ConnectionInfo ci = *citmp;
+  delete citmp;
+
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  std::shared_ptr<IncomingTCPConnectionState> state;
+  try {
+    state = std::make_shared<IncomingTCPConnectionState>(ci, *threadData, now);
+  }
+  catch (const std::exception& e) {
+    vinfolog("Error setting up the TCP connection from %s: %s", ci.remote.toStringWithPort(), e.what());
+    close(ci.fd);
     decrementTCPClientCount(ci.remote);
+    return;
+  }
 
-    if (g_downstreamTCPCleanupInterval > 0 && (connectionStartTime > (lastTCPCleanup + g_downstreamTCPCleanupInterval))) {
-      cleanupClosedTCPConnections(sockets);
-      lastTCPCleanup = time(nullptr);
+  handleIO(state, now);
+}
+
+static void handleTimeouts(TCPClientThreadData& data, const struct timeval& now, bool writes)
+{
+  auto expired = data.mplexer->getTimeouts(now, writes);
+  for (const auto& cbData : expired) {
+    if (cbData.second.type() == typeid(std::shared_ptr<TCPDownstreamConnection>)) {
+      auto conn = boost::any_cast<std::shared_ptr<TCPDownstreamConnection>>(cbData.second);
+      if (!conn->d_registered || cbData.first != conn->d_fd) {
+        continue;
+      }
+
+      vinfolog("Timeout (%s) from remote TCP backend %s", writes ? "write" : "read", conn->d_ds->getName());
+      ++(writes ? conn->d_ds->tcpWriteTimeouts : conn->d_ds->tcpReadTimeouts);
+      for (const auto& entry : conn->d_queries) {
+        ++entry.second.client->d_ci.cs->tcpDownstreamTimeouts;
+      }
+      handleDownstreamConnectionFailure(conn, now, "timeout");
+    }
+    else if (cbData.second.type() == typeid(std::shared_ptr<IncomingTCPConnectionState>)) {
+      auto state = boost::any_cast<std::shared_ptr<IncomingTCPConnectionState>>(cbData.second);
+      if (cbData.first != state->d_registeredFD) {
+        continue;
+      }
+
+      vinfolog("Timeout (%s) from remote TCP client %s", writes ? "write" : "read", state->d_ci.remote.toStringWithPort());
+      ++state->d_ci.cs->tcpClientTimeouts;
+      state->terminate();
+    }
+  }
+}
+
+void* tcpClientThread(int pipefd)
+{
+  /* we get launched with a pipe on which we receive file descriptors from clients that we own
+     from that point on */
+  if (!setNonBlocking(pipefd)) {
+    throw std::runtime_error("Error setting the TCP acceptor pipe (" + std::to_string(pipefd) + ") non-blocking: " + strerror(errno));
+  }
+
+  TCPClientThreadData data;
+  if (!data.mplexer) {
+    throw std::runtime_error("Unable to get a multiplexer for the TCP worker thread");
+  }
+
+  data.mplexer->addReadFD(pipefd, handleNewConnection, &data);
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  time_t lastTCPCleanup = now.tv_sec;
+  time_t lastTimeoutScan = now.tv_sec;
+
+  for (;;) {
+    data.mplexer->run(&now);
+
+    if (now.tv_sec > lastTimeoutScan) {
+      lastTimeoutScan = now.tv_sec;
+      handleTimeouts(data, now, false);
+      handleTimeouts(data, now, true);
+    }
+
+    if (g_downstreamTCPCleanupInterval > 0 && (now.tv_sec > (lastTCPCleanup + g_downstreamTCPCleanupInterval))) {
+      for (const auto& ds : *data.holders.servers) {
+        cleanupIdleDownstreamConnections(ds, now.tv_sec);
+      }
+      lastTCPCleanup = now.tv_sec;
     }
   }
   return 0;
@@ -325,16 +325,16 @@ static void connectionThread(int sock, ComboAddress remote, string password, str
         auto slow = g_dynblockNMG.getCopy();
         struct timespec now;
         gettime(&now);
-        for(const auto& e: slow) {
-          if(now < e->second.until ) {
+        slow.visit([&now,&obj](const PersistentNetmaskTree<DynBlock>::node_type& e) {
+          if(now < e.second.until ) {
             Json::object thing{
-              {"reason", e->second.reason},
-              {"seconds", (double)(e->second.until.tv_sec - now.tv_sec)},
-              {"blocks", (double)e->second.blocks}
+              {"reason", e.second.reason},
+              {"seconds", (double)(e.second.until.tv_sec - now.tv_sec)},
+              {"blocks", (double)e.second.blocks}
             };
-            obj.insert({e->first.toString(), thing});
+            obj.insert({e.first.toString(), thing});
           }
-        }
+        });
 
         auto slow2 = g_dynblockSMT.getCopy();
         slow2.visit([&now,&obj](const SuffixMatchTree<DynBlock>& node) {
@@ -400,6 +400,8 @@ static void connectionThread(int sock, ComboAddress remote, string password, str
 	for(const auto& p: a->pools)
 	  pools.push_back(p);
 
+        const auto percentiles = a->latencyHistogram.getPercentiles();
+
 	Json::object server{ 
 	  {"id", num++},
 	  {"name", a->name},
@@ -413,13 +415,32 @@ static void connectionThread(int sock, ComboAddress remote, string password, str
           {"order", (int)a->order},
           {"pools", pools},
           {"latency", (int)(a->latencyUsec/1000.0)},
+          {"latencyP50", percentiles.p50/1000.0},
+          {"latencyP99", percentiles.p99/1000.0},
+          {"latencyP999", percentiles.p999/1000.0},
           {"queries", (double)a->queries},
-          {"sendErrors", (int)a->sendErrors}
+          {"sendErrors", (int)a->sendErrors},
+          {"udpRecvBatches", (double)a->udpRecvBatches},
+          {"udpRecvBatchedResponses", (double)a->udpRecvBatchedResponses},
+          {"udpSendBatches", (double)a->udpSendBatches},
+          {"udpSendBatchedResponses", (double)a->udpSendBatchedResponses},
+          {"tcpCurrentConnections", (double)a->tcpCurrentConnections},
+          {"tcpDiedSendingQuery", (double)a->tcpDiedSendingQuery},
+          {"tcpDiedReadingResponse", (double)a->tcpDiedReadingResponse},
+          {"tcpGaveUp", (double)a->tcpGaveUp},
+          {"tcpReadTimeouts", (double)a->tcpReadTimeouts},
+          {"tcpWriteTimeouts", (double)a->tcpWriteTimeouts},
+          {"tcpNewConnections", (double)a->tcpNewConnections},
+          {"tcpReusedConnections", (double)a->tcpReusedConnections},
+          {"tcpTooManyConcurrentConnections", (double)a->tcpTooManyConcurrentConnections}
         };
 
         /* sending a latency for a DOWN server doesn't make sense */
         if (a->availability == DownstreamState::Availability::Down) {
           server["latency"] = nullptr;
+          server["latencyP50"] = nullptr;
+          server["latencyP99"] = nullptr;
+          server["latencyP999"] = nullptr;
         }
 
 	servers.push_back(server);
@@ -430,12 +451,28 @@ static void connectionThread(int sock, ComboAddress remote, string password, str
       for(const auto& front : g_frontends) {
         if (front->udpFD == -1 && front->tcpFD == -1)
           continue;
+        const auto percentiles = front->latencyHistogram.getPercentiles();
         Json::object frontend{
           { "id", num++ },
           { "address", front->local.toStringWithPort() },
           { "udp", front->udpFD >= 0 },
           { "tcp", front->tcpFD >= 0 },
-          { "queries", (double) front->queries.load() }
+          { "queries", (double) front->queries.load() },
+          { "udpRecvBatches", (double) front->udpRecvBatches.load() },
+          { "udpRecvBatchedQueries", (double) front->udpRecvBatchedQueries.load() },
+          { "udpSendBatches", (double) front->udpSendBatches.load() },
+          { "udpSendBatchedResponses", (double) front->udpSendBatchedResponses.load() },
+          { "tcpCurrentConnections", (double) front->tcpCurrentConnections.load() },
+          { "tcpDiedReadingQuery", (double) front->tcpDiedReadingQuery.load() },
+          { "tcpDiedSendingResponse", (double) front->tcpDiedSendingResponse.load() },
+          { "tcpGaveUp", (double) front->tcpGaveUp.load() },
+          { "tcpClientTimeouts", (double) front->tcpClientTimeouts.load() },
+          { "tcpDownstreamTimeouts", (double) front->tcpDownstreamTimeouts.load() },
+          { "tcpAvgQueriesPerConnection", front->tcpAvgQueriesPerConnection },
+          { "tcpAvgConnectionDuration", front->tcpAvgConnectionDuration },
+          { "latencyP50", percentiles.p50/1000.0 },
+          { "latencyP99", percentiles.p99/1000.0 },
+          { "latencyP999", percentiles.p999/1000.0 }
         };
         frontends.push_back(frontend);
       }
@@ -445,6 +482,7 @@ static void connectionThread(int sock, ComboAddress remote, string password, str
       num=0;
       for(const auto& pool :localPools) {
         const auto& cache = pool.second->packetCache;
+        const auto percentiles = pool.second->latencyHistogram.getPercentiles();
         Json::object entry {
           { "id", num++ },
           { "name", pool.first },
@@ -457,7 +495,16 @@ static void connectionThread(int sock, ComboAddress remote, string password, str
           { "cacheDeferredLookups", (double) (cache ? cache->getDeferredLookups() : 0) },
           { "cacheLookupCollisions", (double) (cache ? cache->getLookupCollisions() : 0) },
           { "cacheInsertCollisions", (double) (cache ? cache->getInsertCollisions() : 0) },
-          { "cacheTTLTooShorts", (double) (cache ? cache->getTTLTooShorts() : 0) }
+          { "cacheFullInserts", (double) (cache ? cache->getFullInserts() : 0) },
+          { "cacheTTLTooShorts", (double) (cache ? cache->getTTLTooShorts() : 0) },
+          { "cachePrefetches", (double) (cache ? cache->getPrefetches() : 0) },
+          { "cachePrefetchHits", (double) (cache ? cache->getPrefetchHits() : 0) },
+          { "cachePrefetchMisses", (double) (cache ? cache->getPrefetchMisses() : 0) },
+          { "cachePrefetchesInFlight", (double) (cache ? cache->getPrefetchesInFlight() : 0) },
+          { "cachePrefetchesDeduplicated", (double) (cache ? cache->getPrefetchDeduplicated() : 0) },
+          { "latencyP50", percentiles.p50/1000.0 },
+          { "latencyP99", percentiles.p99/1000.0 },
+          { "latencyP999", percentiles.p999/1000.0 }
         };
         pools.push_back(entry);
       }
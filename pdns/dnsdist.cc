@@ -45,6 +45,7 @@
 #include "dnsdist-cache.hh"
 #include "dnsdist-ecs.hh"
 #include "dnsdist-lua.hh"
+#include "dnsdist-qpstable.hh"
 
 #include "base64.hh"
 #include "delaypipe.hh"
@@ -87,7 +88,7 @@ bool g_syslog{true};
 GlobalStateHolder<NetmaskGroup> g_ACL;
 string g_outputBuffer;
 
-vector<std::tuple<ComboAddress, bool, bool, int, string, std::set<int>>> g_locals;
+vector<std::tuple<ComboAddress, bool, bool, int, string, std::set<int>, size_t>> g_locals;
 std::vector<std::shared_ptr<TLSFrontend>> g_tlslocals;
 #ifdef HAVE_DNSCRYPT
 std::vector<std::tuple<ComboAddress,DnsCryptContext,bool, int, string, std::set<int>>> g_dnsCryptLocals;
@@ -99,6 +100,7 @@ std::vector<std::shared_ptr<DynBPFFilter> > g_dynBPFFilters;
 vector<ClientState *> g_frontends;
 GlobalStateHolder<pools_t> g_pools;
 size_t g_udpVectorSize{1};
+size_t g_udpResponderVectorSize{1};
 
 bool g_snmpEnabled{false};
 bool g_snmpTrapsEnabled{false};
@@ -128,7 +130,8 @@ Rings g_rings;
 QueryCount g_qcount;
 
 GlobalStateHolder<servers_t> g_dstates;
-GlobalStateHolder<NetmaskTree<DynBlock>> g_dynblockNMG;
+GlobalStateHolder<PersistentNetmaskTree<DynBlock>> g_dynblockNMG;
+DynBlockExpiryWheel g_dynblockExpiry;
 GlobalStateHolder<SuffixMatchTree<DynBlock>> g_dynblockSMT;
 DNSAction::Action g_dynBlockAction = DNSAction::Action::Drop;
 int g_tcpRecvTimeout{2};
@@ -383,141 +386,314 @@ static bool sendUDPResponse(int origFD, char* response, uint16_t responseLen, in
   return true;
 }
 
-// listens on a dedicated socket, lobs answers from downstream servers to original requestors
-void* responderThread(std::shared_ptr<DownstreamState> dss)
-try {
-  auto localRespRulactions = g_resprulactions.getLocal();
+/* a response received from a backend, ready to be sent to the client */
+struct PendingUDPResponse
+{
+  ComboAddress origRemote;
+  /* family is 0 if the destination address of the query was not harvested */
+  ComboAddress origDest;
+  char* response{nullptr};
+  uint16_t responseLen{0};
+  int origFD{-1};
+  int delayMsec{0};
+};
+
+/* Process a response received from the backend, releasing the corresponding
+   IDState. Returns true if the response should be sent to the client,
+   in which case 'pending' is filled. 'packet' and 'rewrittenResponse'
+   must not be modified until the response has been sent. */
+static bool processResponderPacket(const std::shared_ptr<DownstreamState>& dss, size_t socketIdx, LocalStateHolder<vector<DNSDistResponseRuleAction> >& localRespRulactions, char* packet, size_t packetSize, uint16_t got, vector<uint8_t>& rewrittenResponse, PendingUDPResponse& pending)
+{
+  dnsheader* dh = reinterpret_cast<struct dnsheader*>(packet);
 #ifdef HAVE_DNSCRYPT
-  char packet[4096 + DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE];
   /* when the answer is encrypted in place, we need to get a copy
      of the original header before encryption to fill the ring buffer */
   dnsheader dhCopy;
-#else
-  char packet[4096];
 #endif
-  static_assert(sizeof(packet) <= UINT16_MAX, "Packet size should fit in a uint16_t");
-  vector<uint8_t> rewrittenResponse;
-
+  bool outstandingDecreased = false;
   uint16_t queryId = 0;
-  for(;;) {
-    dnsheader* dh = reinterpret_cast<struct dnsheader*>(packet);
-    bool outstandingDecreased = false;
-    try {
-      ssize_t got = recv(dss->fd, packet, sizeof(packet), 0);
-      char * response = packet;
-      size_t responseSize = sizeof(packet);
+  rewrittenResponse.clear();
 
-      if (got < (ssize_t) sizeof(dnsheader))
-        continue;
+  try {
+    char * response = packet;
+    size_t responseSize = packetSize;
 
-      uint16_t responseLen = (uint16_t) got;
-      queryId = dh->id;
+    if (got < sizeof(dnsheader))
+      return false;
 
-      if(queryId >= dss->idStates.size())
-        continue;
+    uint16_t responseLen = got;
+    queryId = dh->id;
 
-      IDState* ids = &dss->idStates[queryId];
-      int origFD = ids->origFD;
+    const size_t idStatesPerSocket = dss->getIDStatesPerSocket();
+    if(queryId >= idStatesPerSocket)
+      return false;
 
-      if(origFD < 0) // duplicate
-        continue;
+    IDState* ids = &dss->idStates[socketIdx * idStatesPerSocket + queryId];
+    int origFD = ids->origFD;
 
-      /* setting age to 0 to prevent the maintainer thread from
-         cleaning this IDS while we process the response.
-         We have already a copy of the origFD, so it would
-         mostly mess up the outstanding counter.
-      */
-      ids->age = 0;
+    if(origFD < 0) // duplicate
+      return false;
 
-      if (!responseContentMatches(response, responseLen, ids->qname, ids->qtype, ids->qclass, dss->remote)) {
-        continue;
-      }
+    /* setting age to 0 to prevent the maintainer thread from
+       cleaning this IDS while we process the response.
+       We have already a copy of the origFD, so it would
+       mostly mess up the outstanding counter.
+    */
+    ids->age = 0;
+
+    if (!responseContentMatches(response, responseLen, ids->qname, ids->qtype, ids->qclass, dss->remote)) {
+      return false;
+    }
+
+    --dss->outstanding;  // you'd think an attacker could game this, but we're using connected socket
+    outstandingDecreased = true;
+
+    if(dh->tc && g_truncateTC) {
+      truncateTC(response, &responseLen);
+    }
 
-      --dss->outstanding;  // you'd think an attacker could game this, but we're using connected socket
-      outstandingDecreased = true;
+    dh->id = ids->origID;
 
-      if(dh->tc && g_truncateTC) {
-        truncateTC(response, &responseLen);
+    if (ids->isPrefetch) {
+      /* nobody is waiting for this response: it does not go through the response rules,
+         the ring buffers or the latency stats, it is only used to refresh the cache */
+      if (fixUpResponse(&response, &responseLen, &responseSize, ids->qname, ids->origFlags, ids->ednsAdded, ids->ecsAdded, rewrittenResponse, 0) && ids->packetCache) {
+        ids->packetCache->insert(ids->cacheKey, ids->qname, ids->qtype, ids->qclass, response, responseLen, false, dh->rcode, ids->tempFailureTTL);
       }
+      vinfolog("Refreshed the cache entry for %s|%s from %s", ids->qname.toString(), QType(ids->qtype).getName(), dss->getName());
 
-      dh->id = ids->origID;
+      if (ids->origFD == origFD) {
+        ids->origFD = -1;
+        outstandingDecreased = false;
+      }
+      return false;
+    }
 
-      uint16_t addRoom = 0;
-      DNSResponse dr(&ids->qname, ids->qtype, ids->qclass, &ids->origDest, &ids->origRemote, dh, sizeof(packet), responseLen, false, &ids->sentTime.d_start);
+    uint16_t addRoom = 0;
+    DNSResponse dr(&ids->qname, ids->qtype, ids->qclass, &ids->origDest, &ids->origRemote, dh, packetSize, responseLen, false, &ids->sentTime.d_start);
 #ifdef HAVE_PROTOBUF
-      dr.uniqueId = ids->uniqueId;
+    dr.uniqueId = ids->uniqueId;
 #endif
-      dr.qTag = ids->qTag;
+    dr.qTag = ids->qTag;
 
-      if (!processResponse(localRespRulactions, dr, &ids->delayMsec)) {
-        continue;
-      }
+    if (!processResponse(localRespRulactions, dr, &ids->delayMsec)) {
+      return false;
+    }
 
 #ifdef HAVE_DNSCRYPT
-      if (ids->dnsCryptQuery) {
-        addRoom = DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE;
-      }
+    if (ids->dnsCryptQuery) {
+      addRoom = DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE;
+    }
 #endif
-      if (!fixUpResponse(&response, &responseLen, &responseSize, ids->qname, ids->origFlags, ids->ednsAdded, ids->ecsAdded, rewrittenResponse, addRoom)) {
-        continue;
+    if (!fixUpResponse(&response, &responseLen, &responseSize, ids->qname, ids->origFlags, ids->ednsAdded, ids->ecsAdded, rewrittenResponse, addRoom)) {
+      return false;
+    }
+
+    if (ids->packetCache && !ids->skipCache) {
+      ids->packetCache->insert(ids->cacheKey, ids->qname, ids->qtype, ids->qclass, response, responseLen, false, dh->rcode, ids->tempFailureTTL);
+    }
+
+    bool send = false;
+    if (ids->cs && !ids->cs->muted) {
+#ifdef HAVE_DNSCRYPT
+      if (!encryptResponse(response, &responseLen, responseSize, false, ids->dnsCryptQuery, &dh, &dhCopy)) {
+        return false;
       }
+#endif
 
-      if (ids->packetCache && !ids->skipCache) {
-        ids->packetCache->insert(ids->cacheKey, ids->qname, ids->qtype, ids->qclass, response, responseLen, false, dh->rcode, ids->tempFailureTTL);
+      /* we need a copy of these because the IDState might be reused
+         as soon as we release it below */
+      pending.origRemote = ids->origRemote;
+      /* if ids->destHarvested is false, origDest holds the listening address.
+         We don't want to use that as a source since it could be 0.0.0.0 for example. */
+      if (ids->destHarvested) {
+        pending.origDest = ids->origDest;
       }
+      else {
+        pending.origDest.sin4.sin_family = 0;
+      }
+      pending.response = response;
+      pending.responseLen = responseLen;
+      pending.origFD = origFD;
+      pending.delayMsec = ids->delayMsec;
+      send = true;
+    }
+
+    g_stats.responses++;
+
+    double udiff = ids->sentTime.udiff();
+    vinfolog("Got answer from %s, relayed to %s, took %f usec", dss->remote.toStringWithPort(), ids->origRemote.toStringWithPort(), udiff);
+
+    {
+      struct timespec ts;
+      gettime(&ts);
+      g_rings.insertResponse(ts, ids->origRemote, ids->qname, ids->qtype, (unsigned int)udiff, (unsigned int)got, *dh, dss->remote);
+    }
+
+    if(dh->rcode == RCode::ServFail)
+      g_stats.servfailResponses++;
+    dss->latencyUsec = (127.0 * dss->latencyUsec / 128.0) + udiff/128.0;
 
-      if (ids->cs && !ids->cs->muted) {
+    doLatencyStats(udiff);
+    dss->latencyHistogram.record(udiff);
+    if (ids->cs) {
+      ids->cs->latencyHistogram.record(udiff);
+    }
+    if (ids->pool) {
+      ids->pool->latencyHistogram.record(udiff);
+    }
+
+    if (ids->origFD == origFD) {
 #ifdef HAVE_DNSCRYPT
-        if (!encryptResponse(response, &responseLen, responseSize, false, ids->dnsCryptQuery, &dh, &dhCopy)) {
-          continue;
-        }
+      ids->dnsCryptQuery = nullptr;
+#endif
+      ids->origFD = -1;
+      outstandingDecreased = false;
+    }
+
+    return send;
+  }
+  catch(const std::exception& e){
+    vinfolog("Got an error in UDP responder thread while parsing a response from %s, id %d: %s", dss->remote.toStringWithPort(), queryId, e.what());
+    if (outstandingDecreased) {
+      /* so an exception was raised after we decreased the outstanding queries counter,
+         but before we could set ids->origFD to -1 (because we also set outstandingDecreased
+         to false then), meaning the IDS is still considered active and we will decrease the
+         counter again on a duplicate, or simply while reaping downstream timeouts, so let's
+         increase it back. */
+      dss->outstanding++;
+    }
+  }
+
+  return false;
+}
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+static void MultipleMessagesResponderThread(const std::shared_ptr<DownstreamState>& dss, size_t socketIdx, LocalStateHolder<vector<DNSDistResponseRuleAction> >& localRespRulactions, size_t vectSize)
+{
+  struct MMResponse
+  {
+#ifdef HAVE_DNSCRYPT
+    char packet[4096 + DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE];
+#else
+    char packet[4096];
 #endif
+    vector<uint8_t> rewrittenResponse;
+    PendingUDPResponse pending;
+    /* used to set the source address of the response */
+    char cbuf[256];
+    struct iovec iov;
+  };
+  static_assert(sizeof(MMResponse::packet) <= UINT16_MAX, "Packet size should fit in a uint16_t");
 
-        ComboAddress empty;
-        empty.sin4.sin_family = 0;
-        /* if ids->destHarvested is false, origDest holds the listening address.
-           We don't want to use that as a source since it could be 0.0.0.0 for example. */
-        sendUDPResponse(origFD, response, responseLen, ids->delayMsec, ids->destHarvested ? ids->origDest : empty, ids->origRemote);
+  auto respData = std::unique_ptr<MMResponse[]>(new MMResponse[vectSize]);
+  auto msgVec = std::unique_ptr<struct mmsghdr[]>(new struct mmsghdr[vectSize]);
+  auto outMsgVec = std::unique_ptr<struct mmsghdr[]>(new struct mmsghdr[vectSize]);
+  /* the socket is connected, we don't care about the source address */
+  ComboAddress from(dss->remote);
+  vector<size_t> toSend;
+  toSend.reserve(vectSize);
+
+  for(;;) {
+    for (size_t idx = 0; idx < vectSize; idx++) {
+      fillMSGHdr(&msgVec[idx].msg_hdr, &respData[idx].iov, nullptr, 0, respData[idx].packet, sizeof(respData[idx].packet), &from);
+      msgVec[idx].msg_len = 0;
+    }
+
+    /* block until we have at least one response ready, but return
+       as many as possible to save the syscall costs */
+    int msgsGot = recvmmsg(dss->sockets.at(socketIdx), msgVec.get(), vectSize, MSG_WAITFORONE, nullptr);
+    if (msgsGot <= 0) {
+      continue;
+    }
+
+    dss->udpRecvBatches++;
+    dss->udpRecvBatchedResponses += msgsGot;
+
+    toSend.clear();
+    for (int msgIdx = 0; msgIdx < msgsGot; msgIdx++) {
+      MMResponse& resp = respData[msgIdx];
+
+      if (!processResponderPacket(dss, socketIdx, localRespRulactions, resp.packet, sizeof(resp.packet), static_cast<uint16_t>(msgVec[msgIdx].msg_len), resp.rewrittenResponse, resp.pending)) {
+        continue;
       }
 
-      g_stats.responses++;
+      if (resp.pending.delayMsec && g_delay) {
+        sendUDPResponse(resp.pending.origFD, resp.pending.response, resp.pending.responseLen, resp.pending.delayMsec, resp.pending.origDest, resp.pending.origRemote);
+        continue;
+      }
+
+      toSend.push_back(msgIdx);
+    }
+
+    if (toSend.empty()) {
+      continue;
+    }
 
-      double udiff = ids->sentTime.udiff();
-      vinfolog("Got answer from %s, relayed to %s, took %f usec", dss->remote.toStringWithPort(), ids->origRemote.toStringWithPort(), udiff);
+    /* responses are grouped by the socket they have to be sent from,
+       then sent with one sendmmsg() call per socket */
+    std::stable_sort(toSend.begin(), toSend.end(), [&respData](size_t a, size_t b) {
+        return respData[a].pending.origFD < respData[b].pending.origFD;
+      });
+
+    size_t pos = 0;
+    while (pos < toSend.size()) {
+      const int origFD = respData[toSend.at(pos)].pending.origFD;
+      unsigned int count = 0;
+
+      for (; pos < toSend.size() && respData[toSend.at(pos)].pending.origFD == origFD; pos++) {
+        MMResponse& resp = respData[toSend.at(pos)];
+        struct mmsghdr& outMsg = outMsgVec[count];
+        outMsg.msg_len = 0;
+        fillMSGHdr(&outMsg.msg_hdr, &resp.iov, nullptr, 0, resp.pending.response, resp.pending.responseLen, &resp.pending.origRemote);
+        if (resp.pending.origDest.sin4.sin_family != 0) {
+          addCMsgSrcAddr(&outMsg.msg_hdr, resp.cbuf, &resp.pending.origDest, 0);
+        }
+        count++;
+      }
 
-      {
-        struct timespec ts;
-        gettime(&ts);
-        std::lock_guard<std::mutex> lock(g_rings.respMutex);
-        g_rings.respRing.push_back({ts, ids->origRemote, ids->qname, ids->qtype, (unsigned int)udiff, (unsigned int)got, *dh, dss->remote});
+      int sent = sendmmsg(origFD, outMsgVec.get(), count, 0);
+      if (sent < 0 || static_cast<unsigned int>(sent) != count) {
+        vinfolog("Error sending responses with sendmmsg() (%d on %u): %s", sent, count, strerror(errno));
       }
+      if (sent > 0) {
+        dss->udpSendBatches++;
+        dss->udpSendBatchedResponses += sent;
+      }
+    }
+  }
+}
+#endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
 
-      if(dh->rcode == RCode::ServFail)
-        g_stats.servfailResponses++;
-      dss->latencyUsec = (127.0 * dss->latencyUsec / 128.0) + udiff/128.0;
+// listens on a dedicated socket, lobs answers from downstream servers to original requestors
+void* responderThread(std::shared_ptr<DownstreamState> dss, size_t socketIdx)
+try {
+  auto localRespRulactions = g_resprulactions.getLocal();
 
-      doLatencyStats(udiff);
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+  if (g_udpResponderVectorSize > 1) {
+    MultipleMessagesResponderThread(dss, socketIdx, localRespRulactions, g_udpResponderVectorSize);
+    return 0;
+  }
+#endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
 
-      if (ids->origFD == origFD) {
 #ifdef HAVE_DNSCRYPT
-        ids->dnsCryptQuery = nullptr;
+  char packet[4096 + DNSCRYPT_MAX_RESPONSE_PADDING_AND_MAC_SIZE];
+#else
+  char packet[4096];
 #endif
-        ids->origFD = -1;
-        outstandingDecreased = false;
-      }
+  static_assert(sizeof(packet) <= UINT16_MAX, "Packet size should fit in a uint16_t");
+  vector<uint8_t> rewrittenResponse;
+  PendingUDPResponse pending;
 
-      rewrittenResponse.clear();
-    }
-    catch(const std::exception& e){
-      vinfolog("Got an error in UDP responder thread while parsing a response from %s, id %d: %s", dss->remote.toStringWithPort(), queryId, e.what());
-      if (outstandingDecreased) {
-        /* so an exception was raised after we decreased the outstanding queries counter,
-           but before we could set ids->origFD to -1 (because we also set outstandingDecreased
-           to false then), meaning the IDS is still considered active and we will decrease the
-           counter again on a duplicate, or simply while reaping downstream timeouts, so let's
-           increase it back. */
-        dss->outstanding++;
-      }
+  for(;;) {
+    ssize_t got = recv(dss->sockets.at(socketIdx), packet, sizeof(packet), 0);
+
+    if (got < (ssize_t) sizeof(dnsheader))
+      continue;
+
+    if (processResponderPacket(dss, socketIdx, localRespRulactions, packet, sizeof(packet), static_cast<uint16_t>(got), rewrittenResponse, pending)) {
+      sendUDPResponse(pending.origFD, pending.response, pending.responseLen, pending.delayMsec, pending.origDest, pending.origRemote);
     }
   }
   return 0;
@@ -541,38 +717,105 @@ catch(...)
 void DownstreamState::reconnect()
 {
   connected = false;
-  if (fd != -1) {
-    /* shutdown() is needed to wake up recv() in the responderThread */
-    shutdown(fd, SHUT_RDWR);
-    close(fd);
-    fd = -1;
+  for (auto& fd : sockets) {
+    if (fd != -1) {
+      /* shutdown() is needed to wake up recv() in the responderThread */
+      shutdown(fd, SHUT_RDWR);
+      close(fd);
+      fd = -1;
+    }
   }
   if (!IsAnyAddress(remote)) {
-    fd = SSocket(remote.sin4.sin_family, SOCK_DGRAM, 0);
-    if (!IsAnyAddress(sourceAddr)) {
-      SSetsockopt(fd, SOL_SOCKET, SO_REUSEADDR, 1);
-      SBind(fd, sourceAddr);
+    for (auto& fd : sockets) {
+      fd = SSocket(remote.sin4.sin_family, SOCK_DGRAM, 0);
+      if (!IsAnyAddress(sourceAddr)) {
+        SSetsockopt(fd, SOL_SOCKET, SO_REUSEADDR, 1);
+        SBind(fd, sourceAddr);
+      }
     }
-    try {
+    connectSockets();
+  }
+}
+
+bool DownstreamState::connectSockets()
+{
+  try {
+    for (const auto& fd : sockets) {
       SConnect(fd, remote);
-      connected = true;
-    }
-    catch(const std::runtime_error& error) {
-      infolog("Error connecting to new server with address %s: %s", remote.toStringWithPort(), error.what());
     }
+    connected = true;
+  }
+  catch(const std::runtime_error& error) {
+    infolog("Error connecting to new server with address %s: %s", remote.toStringWithPort(), error.what());
+    connected = false;
   }
+
+  return connected;
 }
 
-DownstreamState::DownstreamState(const ComboAddress& remote_, const ComboAddress& sourceAddr_, unsigned int sourceItf_): remote(remote_), sourceAddr(sourceAddr_), sourceItf(sourceItf_)
+DownstreamState::DownstreamState(const ComboAddress& remote_, const ComboAddress& sourceAddr_, unsigned int sourceItf_, size_t numberOfSockets): remote(remote_), sourceAddr(sourceAddr_), sourceItf(sourceItf_)
 {
+  if (numberOfSockets == 0) {
+    throw std::runtime_error("The number of sockets of a downstream server should be larger than 0");
+  }
+
+  sockets.resize(numberOfSockets, -1);
+
   if (!IsAnyAddress(remote)) {
     reconnect();
-    idStates.resize(g_maxOutstanding);
+    /* each socket gets its own set of query IDs */
+    idStates.resize(g_maxOutstanding * numberOfSockets);
     sw.start();
     infolog("Added downstream server %s", remote.toStringWithPort());
   }
 }
 
+/* a server with a weight of 1 gets that many points on the consistent hashing ring,
+   enough for the names to be evenly distributed without having to use large weights */
+static const size_t s_consistentHashPointsPerWeight = 100;
+
+void DownstreamState::hash()
+{
+  const std::string base = remote.toStringWithPort() + "-";
+  const size_t points = weight > 0 ? weight * s_consistentHashPointsPerWeight : 0;
+  hashes.clear();
+  hashes.reserve(points);
+  for (size_t point = 0; point < points; point++) {
+    const std::string key = base + std::to_string(point);
+    /* the points do not depend on g_hashperturb, which can be changed at runtime
+       without the points being recomputed. Only the hash of the qname does */
+    hashes.push_back(burtle(reinterpret_cast<const unsigned char*>(key.c_str()), key.size(), 0));
+  }
+  std::sort(hashes.begin(), hashes.end());
+}
+
+void DownstreamState::setWeight(int newWeight)
+{
+  if (newWeight < 1) {
+    errlog("Error setting server's weight: downstream weight value must be greater than 0.");
+    return;
+  }
+  weight = newWeight;
+  if (!hashes.empty()) {
+    hash();
+  }
+}
+
+void startResponderThreads(const std::shared_ptr<DownstreamState>& dss, const std::set<int>& cpus)
+{
+  if (dss->threadsStarted.exchange(true)) {
+    return;
+  }
+
+  for (size_t idx = 0; idx < dss->sockets.size(); idx++) {
+    thread tid(responderThread, dss, idx);
+    if (!cpus.empty()) {
+      mapThreadToCPUList(tid.native_handle(), cpus);
+    }
+    tid.detach();
+  }
+}
+
 std::mutex g_luamutex;
 LuaContext g_lua;
 
@@ -587,6 +830,23 @@ shared_ptr<DownstreamState> firstAvailable(const NumberedServerVector& servers,
   return leastOutstanding(servers, dq);
 }
 
+LeastOutstandingLatency g_leastOutstandingLatency{LeastOutstandingLatency::Average};
+
+static double getLeastOutstandingLatency(const DownstreamState& ds)
+{
+  switch (g_leastOutstandingLatency) {
+  case LeastOutstandingLatency::P50:
+    return ds.latencyHistogram.getPercentiles().p50;
+  case LeastOutstandingLatency::P99:
+    return ds.latencyHistogram.getPercentiles().p99;
+  case LeastOutstandingLatency::P999:
+    return ds.latencyHistogram.getPercentiles().p999;
+  case LeastOutstandingLatency::Average:
+  default:
+    return ds.latencyUsec;
+  }
+}
+
 // get server with least outstanding queries, and within those, with the lowest order, and within those: the fastest
 shared_ptr<DownstreamState> leastOutstanding(const NumberedServerVector& servers, const DNSQuestion* dq)
 {
@@ -594,19 +854,23 @@ shared_ptr<DownstreamState> leastOutstanding(const NumberedServerVector& servers
     return servers[0].second;
   }
 
-  vector<pair<tuple<int,int,double>, shared_ptr<DownstreamState>>> poss;
-  /* so you might wonder, why do we go through this trouble? The data on which we sort could change during the sort,
-     which would suck royally and could even lead to crashes. So first we snapshot on what we sort, and then we sort */
-  poss.reserve(servers.size());
+  /* the values we compare could change while we look at them, so we snapshot them once per server
+     and only compare snapshots. We only need the smallest one, which a single pass gives us without
+     having to allocate anything for every query */
+  const shared_ptr<DownstreamState>* best = nullptr;
+  tuple<int,int,double> bestValue;
   for(auto& d : servers) {
     if(d.second->isUp()) {
-      poss.push_back({make_tuple(d.second->outstanding.load(), d.second->order, d.second->latencyUsec), d.second});
+      auto value = make_tuple(d.second->outstanding.load(), d.second->order, getLeastOutstandingLatency(*d.second));
+      if (best == nullptr || value < bestValue) {
+        best = &d.second;
+        bestValue = value;
+      }
     }
   }
-  if(poss.empty())
+  if(best == nullptr)
     return shared_ptr<DownstreamState>();
-  nth_element(poss.begin(), poss.begin(), poss.end(), [](const decltype(poss)::value_type& a, const decltype(poss)::value_type& b) { return a.first < b.first; });
-  return poss.begin()->second;
+  return *best;
 }
 
 shared_ptr<DownstreamState> valrandom(unsigned int val, const NumberedServerVector& servers, const DNSQuestion* dq)
@@ -642,6 +906,70 @@ shared_ptr<DownstreamState> whashed(const NumberedServerVector& servers, const D
   return valrandom(dq->qname->hash(g_hashperturb), servers, dq);
 }
 
+double g_consistentHashBalancingFactor{0};
+/* Consistent hashing: every server owns 100 points per unit of weight on a ring of 32-bit hashes, and a query
+   goes to the server owning the first point at or after the hash of its qname, wrapping around.
+   Adding or removing a server only moves the names falling between its points and the preceding ones.
+   If a balancing factor is set, servers having more than that factor times the average number of
+   outstanding queries are skipped, so their names overflow to the next point of the ring. */
+shared_ptr<DownstreamState> chashed(const NumberedServerVector& servers, const DNSQuestion* dq)
+{
+  const unsigned int qhash = dq->qname->hash(g_hashperturb);
+  double targetLoad = std::numeric_limits<double>::max();
+
+  if (g_consistentHashBalancingFactor > 0) {
+    /* we start with one, representing the query we are currently handling */
+    double currentLoad = 1;
+    size_t upServers = 0;
+    for (const auto& d : servers) {
+      if (d.second->isUp()) {
+        currentLoad += d.second->outstanding;
+        upServers++;
+      }
+    }
+    if (upServers > 0) {
+      targetLoad = (currentLoad / upServers) * g_consistentHashBalancingFactor;
+    }
+  }
+
+  /* each server's points are sorted, so we only need to look at its first point
+     at or after the hash, and at its lowest point in case we have to wrap around */
+  unsigned int selected = std::numeric_limits<unsigned int>::max();
+  unsigned int lowest = std::numeric_limits<unsigned int>::max();
+  shared_ptr<DownstreamState> ret = nullptr;
+  shared_ptr<DownstreamState> first = nullptr;
+
+  for (const auto& d : servers) {
+    const auto& server = d.second;
+    if (!server->isUp() || server->outstanding > targetLoad) {
+      continue;
+    }
+
+    if (server->hashes.empty()) {
+      server->hash();
+    }
+    const auto& hashes = server->hashes;
+    if (hashes.empty()) {
+      continue;
+    }
+
+    if (first == nullptr || hashes.front() < lowest) {
+      lowest = hashes.front();
+      first = server;
+    }
+
+    auto it = std::lower_bound(hashes.cbegin(), hashes.cend(), qhash);
+    if (it != hashes.cend() && (ret == nullptr || *it < selected)) {
+      selected = *it;
+      ret = server;
+    }
+  }
+
+  if (ret != nullptr) {
+    return ret;
+  }
+  return first;
+}
 
 shared_ptr<DownstreamState> roundrobin(const NumberedServerVector& servers, const DNSQuestion* dq)
 {
@@ -863,10 +1191,7 @@ static void spoofResponseFromString(DNSQuestion& dq, const string& spoofContent)
 
 bool processQuery(LocalHolders& holders, DNSQuestion& dq, string& poolname, int* delayMsec, const struct timespec& now)
 {
-  {
-    WriteLock wl(&g_rings.queryLock);
-    g_rings.queryRing.push_back({now,*dq.remote,*dq.qname,dq.len,dq.qtype,*dq.dh});
-  }
+  g_rings.insertQuery(now, *dq.remote, *dq.qname, dq.qtype, dq.len, *dq.dh);
 
   if(g_qcount.enabled) {
     string qname = (*dq.qname).toString(".");
@@ -965,66 +1290,67 @@ bool processQuery(LocalHolders& holders, DNSQuestion& dq, string& poolname, int*
     }
   }
 
-  DNSAction::Action action=DNSAction::Action::None;
+  bool result = true;
   string ruleresult;
-  for(const auto& lr : *holders.rulactions) {
-    if(lr.d_rule->matches(&dq)) {
-      lr.d_rule->d_matches++;
-      action=(*lr.d_action)(&dq, &ruleresult);
+  auto visitor = [&dq, &poolname, delayMsec, &result, &ruleresult](const DNSDistRuleAction& lr) {
+    DNSAction::Action action=(*lr.d_action)(&dq, &ruleresult);
 
-      switch(action) {
-      case DNSAction::Action::Allow:
-        return true;
-        break;
-      case DNSAction::Action::Drop:
-        g_stats.ruleDrop++;
-        return false;
-        break;
-      case DNSAction::Action::Nxdomain:
-        dq.dh->rcode = RCode::NXDomain;
-        dq.dh->qr=true;
-        g_stats.ruleNXDomain++;
-        return true;
-        break;
-      case DNSAction::Action::Refused:
-        dq.dh->rcode = RCode::Refused;
-        dq.dh->qr=true;
-        g_stats.ruleRefused++;
-        return true;
-        break;
-      case DNSAction::Action::ServFail:
-        dq.dh->rcode = RCode::ServFail;
-        dq.dh->qr=true;
-        g_stats.ruleServFail++;
-        return true;
-        break;
-      case DNSAction::Action::Spoof:
-        spoofResponseFromString(dq, ruleresult);
-        return true;
-        break;
-      case DNSAction::Action::Truncate:
-        dq.dh->tc = true;
-        dq.dh->qr = true;
-        return true;
-        break;
-      case DNSAction::Action::HeaderModify:
-        return true;
-        break;
-      case DNSAction::Action::Pool:
-        poolname=ruleresult;
-        return true;
-        break;
-        /* non-terminal actions follow */
-      case DNSAction::Action::Delay:
-        *delayMsec = static_cast<int>(pdns_stou(ruleresult)); // sorry
-        break;
-      case DNSAction::Action::None:
-        break;
-      }
+    switch(action) {
+    case DNSAction::Action::Allow:
+      return false;
+      break;
+    case DNSAction::Action::Drop:
+      g_stats.ruleDrop++;
+      result = false;
+      return false;
+      break;
+    case DNSAction::Action::Nxdomain:
+      dq.dh->rcode = RCode::NXDomain;
+      dq.dh->qr=true;
+      g_stats.ruleNXDomain++;
+      return false;
+      break;
+    case DNSAction::Action::Refused:
+      dq.dh->rcode = RCode::Refused;
+      dq.dh->qr=true;
+      g_stats.ruleRefused++;
+      return false;
+      break;
+    case DNSAction::Action::ServFail:
+      dq.dh->rcode = RCode::ServFail;
+      dq.dh->qr=true;
+      g_stats.ruleServFail++;
+      return false;
+      break;
+    case DNSAction::Action::Spoof:
+      spoofResponseFromString(dq, ruleresult);
+      return false;
+      break;
+    case DNSAction::Action::Truncate:
+      dq.dh->tc = true;
+      dq.dh->qr = true;
+      return false;
+      break;
+    case DNSAction::Action::HeaderModify:
+      return false;
+      break;
+    case DNSAction::Action::Pool:
+      poolname=ruleresult;
+      return false;
+      break;
+      /* non-terminal actions follow */
+    case DNSAction::Action::Delay:
+      *delayMsec = static_cast<int>(pdns_stou(ruleresult)); // sorry
+      break;
+    case DNSAction::Action::None:
+      break;
     }
-  }
+    return true;
+  };
 
-  return true;
+  holders.ruleChain->forEachMatch(&dq, visitor);
+
+  return result;
 }
 
 bool processResponse(LocalStateHolder<vector<DNSDistResponseRuleAction> >& localRespRulactions, DNSResponse& dr, int* delayMsec)
@@ -1211,6 +1537,76 @@ static void queueResponse(const ClientState& cs, const char* response, uint16_t
 }
 #endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
 
+/* Sends a copy of a query that has just been answered from the cache to the backend,
+   so that the cached entry gets refreshed before it expires. The IDState has no ClientState
+   attached, so the response will be inserted into the cache but not sent to any client. */
+static void sendCachePrefetchQuery(DownstreamState* ss, const ClientState& cs, const std::shared_ptr<DNSDistPacketCache>& packetCache, uint32_t cacheKey, const DNSQuestion& dq, char* query, uint16_t queryLen, uint16_t origFlags, bool ednsAdded, bool ecsAdded)
+{
+  struct dnsheader* dh = reinterpret_cast<struct dnsheader*>(query);
+
+  if (dq.addXPF && ss->xpfRRCode != 0) {
+    /* the XPF record would carry the address of the client triggering the refresh */
+    return;
+  }
+
+  ss->queries++;
+
+  const uint64_t counter = ss->idOffset++;
+  const size_t socketIdx = counter % ss->sockets.size();
+  const size_t idStatesPerSocket = ss->getIDStatesPerSocket();
+  unsigned int idOffset = (counter / ss->sockets.size()) % idStatesPerSocket;
+  IDState* ids = &ss->idStates[socketIdx * idStatesPerSocket + idOffset];
+  ids->age = 0;
+
+  if(ids->origFD < 0) // if we are reusing, no change in outstanding
+    ss->outstanding++;
+  else {
+    ss->reuseds++;
+    g_stats.downstreamTimeouts++;
+  }
+
+  ids->cs = nullptr;
+  /* only used to mark the state as in use */
+  ids->origFD = cs.udpFD;
+  ids->origID = dh->id;
+  ids->origRemote = *dq.remote;
+  ids->sentTime.start();
+  ids->qname = *dq.qname;
+  ids->qtype = dq.qtype;
+  ids->qclass = dq.qclass;
+  ids->delayMsec = 0;
+  ids->tempFailureTTL = dq.tempFailureTTL;
+  ids->origFlags = origFlags;
+  ids->cacheKey = cacheKey;
+  ids->skipCache = false;
+  ids->isPrefetch = true;
+  ids->packetCache = packetCache;
+  ids->pool = nullptr;
+  ids->ednsAdded = ednsAdded;
+  ids->ecsAdded = ecsAdded;
+  ids->qTag = dq.qTag;
+  ids->origDest = cs.local;
+  ids->destHarvested = false;
+#ifdef HAVE_DNSCRYPT
+  ids->dnsCryptQuery = nullptr;
+#endif
+#ifdef HAVE_PROTOBUF
+  /* the response is not logged, it belongs to the client query */
+  ids->uniqueId = boost::none;
+#endif
+
+  dh->id = idOffset;
+
+  ssize_t ret = udpClientSendRequestToBackend(ss, ss->sockets[socketIdx], query, queryLen);
+
+  if(ret < 0) {
+    ss->sendErrors++;
+    g_stats.downstreamSendErrors++;
+  }
+
+  vinfolog("Refreshing the cache entry for %s|%s, sent to %s", ids->qname.toString(), QType(ids->qtype).getName(), ss->getName());
+}
+
 static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct msghdr* msgh, const ComboAddress& remote, ComboAddress& dest, char* query, uint16_t len, size_t queryBufferSize, struct mmsghdr* responsesVect, unsigned int* queuedResponses, struct iovec* respIOV, char* respCBuf)
 {
   assert(responsesVect == nullptr || (queuedResponses != nullptr && respIOV != nullptr && respCBuf != nullptr));
@@ -1293,6 +1689,7 @@ static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct
 
         g_stats.selfAnswered++;
         doLatencyStats(0);  // we're not going to measure this
+        cs.latencyHistogram.record(0);
       }
 
       return;
@@ -1324,7 +1721,20 @@ static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct
     if (packetCache && !dq.skipCache) {
       uint16_t cachedResponseSize = dq.size;
       uint32_t allowExpired = ss ? 0 : g_staleCacheEntriesTTL;
-      if (packetCache->get(dq, consumed, dh->id, query, &cachedResponseSize, &cacheKey, allowExpired)) {
+      /* the response will overwrite the query, so keep a copy in case we need to refresh the entry */
+      char prefetchQuery[4096];
+      const uint16_t prefetchQueryLen = dq.len;
+      bool prefetch = false;
+      const bool canPrefetch = ss != nullptr && packetCache->getPrefetchPercentage() > 0 && prefetchQueryLen <= sizeof(prefetchQuery);
+      if (canPrefetch) {
+        memcpy(prefetchQuery, query, prefetchQueryLen);
+      }
+
+      if (packetCache->get(dq, consumed, dh->id, query, &cachedResponseSize, &cacheKey, allowExpired, false, canPrefetch ? &prefetch : nullptr)) {
+        if (prefetch) {
+          sendCachePrefetchQuery(ss, cs, packetCache, cacheKey, dq, prefetchQuery, prefetchQueryLen, origFlags, ednsAdded, ecsAdded);
+        }
+
         DNSResponse dr(dq.qname, dq.qtype, dq.qclass, dq.local, dq.remote, reinterpret_cast<dnsheader*>(query), dq.size, cachedResponseSize, false, &queryRealTime);
 #ifdef HAVE_PROTOBUF
         dr.uniqueId = dq.uniqueId;
@@ -1355,6 +1765,7 @@ static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct
 
         g_stats.cacheHits++;
         doLatencyStats(0);  // we're not going to measure this
+        cs.latencyHistogram.record(0);
         return;
       }
       g_stats.cacheMisses++;
@@ -1399,6 +1810,7 @@ static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct
 
         // no response-only statistics counter to update.
         doLatencyStats(0);  // we're not going to measure this
+        cs.latencyHistogram.record(0);
       }
       vinfolog("%s query for %s|%s from %s, no policy applied", g_servFailOnNoPolicy ? "ServFailed" : "Dropped", dq.qname->toString(), QType(dq.qtype).getName(), remote.toStringWithPort());
       return;
@@ -1410,8 +1822,13 @@ static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct
 
     ss->queries++;
 
-    unsigned int idOffset = (ss->idOffset++) % ss->idStates.size();
-    IDState* ids = &ss->idStates[idOffset];
+    /* queries are spread over the sockets of the backend, each socket
+       having its own range of query IDs */
+    const uint64_t counter = ss->idOffset++;
+    const size_t socketIdx = counter % ss->sockets.size();
+    const size_t idStatesPerSocket = ss->getIDStatesPerSocket();
+    unsigned int idOffset = (counter / ss->sockets.size()) % idStatesPerSocket;
+    IDState* ids = &ss->idStates[socketIdx * idStatesPerSocket + idOffset];
     ids->age = 0;
 
     if(ids->origFD < 0) // if we are reusing, no change in outstanding
@@ -1434,7 +1851,9 @@ static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct
     ids->origFlags = origFlags;
     ids->cacheKey = cacheKey;
     ids->skipCache = dq.skipCache;
+    ids->isPrefetch = false;
     ids->packetCache = packetCache;
+    ids->pool = serverPool;
     ids->ednsAdded = ednsAdded;
     ids->ecsAdded = ecsAdded;
     ids->qTag = dq.qTag;
@@ -1462,7 +1881,7 @@ static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct
 
     dh->id = idOffset;
 
-    ssize_t ret = udpClientSendRequestToBackend(ss, ss->fd, query, dq.len);
+    ssize_t ret = udpClientSendRequestToBackend(ss, ss->sockets[socketIdx], query, dq.len);
 
     if(ret < 0) {
       ss->sendErrors++;
@@ -1488,7 +1907,7 @@ static void MultipleMessagesUDPClientThread(ClientState* cs, LocalHolders& holde
     ComboAddress dest;
     struct iovec iov;
   };
-  const size_t vectSize = g_udpVectorSize;
+  const size_t vectSize = cs->getUDPVectorSize();
   /* the actual buffer is larger because:
      - we may have to add EDNS and/or ECS
      - we use it for self-generated responses (from rule or cache)
@@ -1525,6 +1944,10 @@ static void MultipleMessagesUDPClientThread(ClientState* cs, LocalHolders& holde
       continue;
     }
 
+    CoarseClock::update();
+    cs->udpRecvBatches++;
+    cs->udpRecvBatchedQueries += msgsGot;
+
     unsigned int msgsToSend = 0;
 
     /* process the received messages */
@@ -1551,6 +1974,11 @@ static void MultipleMessagesUDPClientThread(ClientState* cs, LocalHolders& holde
       if (sent < 0 || static_cast<unsigned int>(sent) != msgsToSend) {
         vinfolog("Error sending responses with sendmmsg() (%d on %u): %s", sent, msgsToSend, strerror(errno));
       }
+
+      if (sent > 0) {
+        cs->udpSendBatches++;
+        cs->udpSendBatchedResponses += sent;
+      }
     }
 
   }
@@ -1564,7 +1992,7 @@ try
   LocalHolders holders;
 
 #if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
-  if (g_udpVectorSize > 1) {
+  if (cs->getUDPVectorSize() > 1) {
     MultipleMessagesUDPClientThread(cs, holders);
 
   }
@@ -1590,6 +2018,7 @@ try
 
     for(;;) {
       ssize_t got = recvmsg(cs->udpFD, &msgh, 0);
+      CoarseClock::update();
 
       if (got < 0 || static_cast<size_t>(got) < sizeof(struct dnsheader)) {
         g_stats.nonCompliantQueries++;
@@ -1713,10 +2142,34 @@ uint64_t g_maxTCPClientThreads{10};
 std::atomic<uint16_t> g_cacheCleaningDelay{60};
 std::atomic<uint16_t> g_cacheCleaningPercentage{100};
 
+/* only the entries whose expiration time has been reached are looked at, so this is cheap
+   even with a very large number of dynamic blocks */
+static void pruneExpiredDynBlocks()
+{
+  struct timespec now;
+  gettime(&now);
+  std::vector<std::pair<Netmask, time_t>> expired;
+  g_dynblockExpiry.getExpired(now.tv_sec, expired);
+  if (expired.empty()) {
+    return;
+  }
+
+  g_dynblockNMG.modify([&expired,&now](PersistentNetmaskTree<DynBlock>& blocks) {
+      for (const auto& entry : expired) {
+        const auto got = blocks.lookup(entry.first);
+        /* the block might have been extended, or replaced by a new one, since */
+        if (got && got->first == entry.first && got->second.until.tv_sec == entry.second && !(now < got->second.until)) {
+          blocks.erase(entry.first);
+        }
+      }
+    });
+}
+
 void* maintThread()
 {
   int interval = 1;
   size_t counter = 0;
+  size_t qpsTablesCounter = 0;
   int32_t secondsToWaitLog = 0;
 
   for(;;) {
@@ -1757,7 +2210,15 @@ void* maintThread()
       counter = 0;
     }
 
-    // ponder pruning g_dynblocks of expired entries here
+    /* the MaxQPSIPRule tables reuse expired entries on their own, purging them
+       regularly keeps the tables from growing needlessly */
+    qpsTablesCounter++;
+    if (qpsTablesCounter >= 60) {
+      QPSTable::purgeAllExpired(CoarseClock::getUsec());
+      qpsTablesCounter = 0;
+    }
+
+    pruneExpiredDynBlocks();
   }
   return 0;
 }
@@ -1791,15 +2252,11 @@ void* healthChecksThread()
           warnlog("Marking downstream %s as '%s'", dss->getNameWithAddr(), newState ? "up" : "down");
 
           if (newState && !dss->connected) {
-            try {
-              SConnect(dss->fd, dss->remote);
-              dss->connected = true;
-              dss->tid = thread(responderThread, dss);
+            if (dss->connectSockets()) {
+              startResponderThreads(dss, std::set<int>());
             }
-            catch(const std::runtime_error& error) {
-              infolog("Error connecting to new server with address %s: %s", dss->remote.toStringWithPort(), error.what());
+            else {
               newState = false;
-              dss->connected = false;
             }
           }
 
@@ -1816,6 +2273,7 @@ void* healthChecksThread()
       dss->dropRate = 1.0*(dss->reuseds.load() - dss->prev.reuseds.load())/delta;
       dss->prev.queries.store(dss->queries.load());
       dss->prev.reuseds.store(dss->reuseds.load());
+      dss->latencyHistogram.updatePercentiles();
       
       for(IDState& ids  : dss->idStates) { // timeouts
         if(ids.origFD >=0 && ids.age++ > g_udpTimeout) {
@@ -1836,6 +2294,11 @@ void* healthChecksThread()
                    dss->remote.toStringWithPort(), dss->name,
                    ids.qname.toString(), QType(ids.qtype).getName(), ids.origRemote.toStringWithPort());
 
+          if (ids.isPrefetch) {
+            /* no client query to report in the ring buffers */
+            continue;
+          }
+
           struct timespec ts;
           gettime(&ts);
 
@@ -1843,11 +2306,17 @@ void* healthChecksThread()
           memset(&fake, 0, sizeof(fake));
           fake.id = ids.origID;
 
-          std::lock_guard<std::mutex> lock(g_rings.respMutex);
-          g_rings.respRing.push_back({ts, ids.origRemote, ids.qname, ids.qtype, std::numeric_limits<unsigned int>::max(), 0, fake, dss->remote});
+          g_rings.insertResponse(ts, ids.origRemote, ids.qname, ids.qtype, std::numeric_limits<unsigned int>::max(), 0, fake, dss->remote);
         }          
       }
     }
+
+    for (const auto& front : g_frontends) {
+      front->latencyHistogram.updatePercentiles();
+    }
+    for (const auto& entry : g_pools.getCopy()) {
+      entry.second->latencyHistogram.updatePercentiles();
+    }
   }
   return 0;
 }
@@ -1934,8 +2403,9 @@ static void checkFileDescriptorsLimits(size_t udpBindsCount, size_t tcpBindsCoun
   /* listening sockets */
   requiredFDsCount += udpBindsCount;
   requiredFDsCount += tcpBindsCount;
-  /* max TCP connections currently served */
-  requiredFDsCount += g_maxTCPClientThreads;
+  /* TCP connections currently served: at least one per client thread, each also having its multiplexer descriptor.
+     Every thread handles a lot of connections at the same time so that's only a lower bound */
+  requiredFDsCount += (g_maxTCPClientThreads * 2);
   /* max pipes for communicating between TCP acceptors and client threads */
   requiredFDsCount += (g_maxTCPClientThreads * 2);
   /* UDP sockets to backends */
@@ -2231,11 +2701,11 @@ try
   if(g_cmdLine.locals.size()) {
     g_locals.clear();
     for(auto loc : g_cmdLine.locals)
-      g_locals.push_back(std::make_tuple(ComboAddress(loc, 53), true, false, 0, "", std::set<int>()));
+      g_locals.push_back(std::make_tuple(ComboAddress(loc, 53), true, false, 0, "", std::set<int>(), 0));
   }
   
   if(g_locals.empty())
-    g_locals.push_back(std::make_tuple(ComboAddress("127.0.0.1", 53), true, false, 0, "", std::set<int>()));
+    g_locals.push_back(std::make_tuple(ComboAddress("127.0.0.1", 53), true, false, 0, "", std::set<int>(), 0));
 
   g_configurationDone = true;
 
@@ -2290,6 +2760,7 @@ try
 #endif /* HAVE_EBPF */
 
     cs->cpus = std::get<5>(local);
+    cs->udpVectorSize = std::get<6>(local);
 
     SBind(cs->udpFD, cs->local);
     toLaunch.push_back(cs);
@@ -2569,7 +3040,7 @@ try
       auto ret=std::make_shared<DownstreamState>(ComboAddress(address, 53));
       addServerToPool(localPools, "", ret);
       if (ret->connected) {
-        ret->tid = thread(responderThread, ret);
+        startResponderThreads(ret, std::set<int>());
       }
       g_dstates.modify([ret](servers_t& servers) { servers.push_back(ret); });
     }
@@ -26,16 +26,20 @@
 #include "misc.hh"
 #include "iputils.hh"
 #include "dnsname.hh"
+#include "latency-histogram.hh"
 #include <atomic>
+#include <deque>
 #include <boost/circular_buffer.hpp>
 #include <boost/variant.hpp>
 #include <mutex>
 #include <thread>
 #include <unistd.h>
+#include "sharded-counter.hh"
 #include "sholder.hh"
 #include "dnscrypt.hh"
 #include "dnsdist-cache.hh"
 #include "gettime.hh"
+#include "dnsdist-dynblocks.hh"
 #include "dnsdist-dynbpf.hh"
 #include "bpf-filter.hh"
 #include <string>
@@ -144,13 +148,17 @@ struct DynBlock
   mutable std::atomic<unsigned int> blocks;
 };
 
-extern GlobalStateHolder<NetmaskTree<DynBlock>> g_dynblockNMG;
+extern GlobalStateHolder<PersistentNetmaskTree<DynBlock>> g_dynblockNMG;
+extern DynBlockExpiryWheel g_dynblockExpiry;
 
 extern vector<pair<struct timeval, std::string> > g_confDelta;
 
+uint64_t getTCPCurrentConnectionsCount(const std::string&);
+uint64_t getTCPQueuedConnectionsCount(const std::string&);
+
 struct DNSDistStats
 {
-  using stat_t=std::atomic<uint64_t>; // aww yiss ;-)
+  using stat_t=ShardedCounter;
   stat_t responses{0};
   stat_t servfailResponses{0};
   stat_t queries{0};
@@ -212,6 +220,8 @@ struct DNSDistStats
     {"cpu-sys-msec", getCPUTimeSystem},
     {"fd-usage", getOpenFileDescriptors},
     {"dyn-blocked", &dynBlocked}, 
+    {"tcp-current-connections", getTCPCurrentConnectionsCount},
+    {"tcp-queued-connections", getTCPQueuedConnectionsCount},
     {"dyn-block-nmg-size", [](const std::string&) { return g_dynblockNMG.getLocal()->size(); }}
   };
 };
@@ -259,6 +269,61 @@ struct StopWatch
 
 };
 
+/* A clock updated once per event-loop iteration by the threads processing
+   queries, so that hot paths like the QPS limiters do not need to read the
+   time for every query. Threads that never update it, like the console one,
+   get the current time instead. */
+class CoarseClock
+{
+public:
+  static void update()
+  {
+    State& state = getState();
+    if (gettime(&state.now) < 0) {
+      unixDie("Getting timestamp");
+    }
+    state.valid = true;
+  }
+
+  /* sets the cached time of the current thread to a given value, for tests */
+  static void set(const struct timespec& now)
+  {
+    State& state = getState();
+    state.now = now;
+    state.valid = true;
+  }
+
+  static uint64_t getUsec()
+  {
+    const State& state = getState();
+    struct timespec now;
+    const struct timespec* ts = &state.now;
+    if (!state.valid) {
+      if (gettime(&now) < 0) {
+        unixDie("Getting timestamp");
+      }
+      ts = &now;
+    }
+    return static_cast<uint64_t>(ts->tv_sec) * 1000000 + ts->tv_nsec / 1000;
+  }
+
+private:
+  struct State
+  {
+    struct timespec now{0,0};
+    bool valid{false};
+  };
+
+  static State& getState()
+  {
+    static thread_local State state;
+    return state;
+  }
+};
+
+/* A token bucket shared by all threads. To keep threads from contending on
+   the bucket for every query, a thread takes several tokens at once (up to
+   1% of the rate) and consumes them locally before coming back. */
 class QPSLimiter
 {
 public:
@@ -266,10 +331,37 @@ public:
   {
   }
 
-  QPSLimiter(unsigned int rate, unsigned int burst) : d_rate(rate), d_burst(burst), d_tokens(burst)
+  QPSLimiter(unsigned int rate, unsigned int burst) : d_rate(rate), d_burst(burst), d_batch(std::max(1U, std::min(rate, burst) / 100)), d_tokens(burst), d_lastUpdate(CoarseClock::getUsec())
   {
     d_passthrough=false;
-    d_prev.start();
+    allocateSlots();
+  }
+
+  /* only the configuration is copied, the copy starts with a full bucket */
+  QPSLimiter(const QPSLimiter& rhs)
+  {
+    *this = rhs;
+  }
+
+  QPSLimiter& operator=(const QPSLimiter& rhs)
+  {
+    if (this != &rhs) {
+      std::lock_guard<std::mutex> lock(d_lock);
+      d_passthrough = rhs.d_passthrough;
+      d_rate = rhs.d_rate;
+      d_burst = rhs.d_burst;
+      d_batch = rhs.d_batch;
+      d_tokens = rhs.d_burst;
+      d_lastUpdate = CoarseClock::getUsec();
+      if (d_passthrough) {
+        d_storage.reset();
+        d_slots = nullptr;
+      }
+      else {
+        allocateSlots();
+      }
+    }
+    return *this;
   }
 
   unsigned int getRate() const
@@ -279,46 +371,113 @@ public:
 
   int getPassed() const
   {
-    return d_passed;
+    uint64_t passed = 0;
+    for (size_t idx = 0; !d_passthrough && idx < s_slotsCount; idx++) {
+      passed += d_slots[idx].passed.load();
+    }
+    return passed;
   }
   int getBlocked() const
   {
-    return d_blocked;
+    uint64_t blocked = 0;
+    for (size_t idx = 0; !d_passthrough && idx < s_slotsCount; idx++) {
+      blocked += d_slots[idx].blocked.load();
+    }
+    return blocked;
   }
 
   bool check() const // this is not quite fair
   {
     if(d_passthrough)
       return true;
-    auto delta = d_prev.udiffAndSet();
-  
-    d_tokens += 1.0*d_rate * (delta/1000000.0);
 
-    if(d_tokens > d_burst)
-      d_tokens = d_burst;
+    Slot& slot = d_slots[getThreadSlot()];
+    int64_t credits = slot.credits.load(std::memory_order_relaxed);
+    while (credits > 0) {
+      if (slot.credits.compare_exchange_weak(credits, credits - 1, std::memory_order_relaxed)) {
+        slot.passed++;
+        return true;
+      }
+    }
 
-    bool ret=false;
-    if(d_tokens >= 1.0) { // we need this because burst=1 is weird otherwise
-      ret=true;
-      --d_tokens;
-      d_passed++;
+    if (refill(slot)) {
+      slot.passed++;
+      return true;
     }
-    else
-      d_blocked++;
 
-    return ret; 
+    slot.blocked++;
+    return false;
   }
 private:
+  static const size_t s_slotsCount = 16;
+  static const size_t s_cacheLineSize = 64;
+
+  /* padded and aligned so that two threads never share a cache line */
+  struct Slot
+  {
+    std::atomic<int64_t> credits{0};
+    std::atomic<uint64_t> passed{0};
+    std::atomic<uint64_t> blocked{0};
+    char padding[s_cacheLineSize - 3 * sizeof(uint64_t)];
+  };
+  static_assert(sizeof(Slot) == s_cacheLineSize, "a slot should fill exactly one cache line");
+
+  void allocateSlots()
+  {
+    /* new[] only guarantees the alignment of max_align_t, make sure that the slots
+       start on a cache line boundary */
+    d_storage.reset(new char[(s_slotsCount + 1) * s_cacheLineSize]);
+    const auto address = reinterpret_cast<uintptr_t>(d_storage.get());
+    d_slots = reinterpret_cast<Slot*>((address + s_cacheLineSize - 1) & ~(static_cast<uintptr_t>(s_cacheLineSize) - 1));
+    for (size_t idx = 0; idx < s_slotsCount; idx++) {
+      new (&d_slots[idx]) Slot();
+    }
+  }
+
+  static size_t getThreadSlot()
+  {
+    static std::atomic<size_t> s_nextSlot{0};
+    static thread_local size_t t_slot = s_nextSlot++ % s_slotsCount;
+    return t_slot;
+  }
+
+  /* takes one token for the current query and, if possible,
+     a batch for the next ones from the shared bucket */
+  bool refill(Slot& slot) const
+  {
+    std::lock_guard<std::mutex> lock(d_lock);
+    uint64_t now = CoarseClock::getUsec();
+    if (now > d_lastUpdate) {
+      d_tokens += 1.0 * d_rate * ((now - d_lastUpdate) / 1000000.0);
+      d_lastUpdate = now;
+      if (d_tokens > d_burst) {
+        d_tokens = d_burst;
+      }
+    }
+
+    if (d_tokens < 1.0) { // we need this because burst=1 is weird otherwise
+      return false;
+    }
+
+    unsigned int batch = std::min(d_batch, static_cast<unsigned int>(d_tokens));
+    d_tokens -= batch;
+    slot.credits += batch - 1;
+    return true;
+  }
+
+  std::unique_ptr<char[]> d_storage{nullptr};
+  Slot* d_slots{nullptr};
   bool d_passthrough{true};
-  unsigned int d_rate;
-  unsigned int d_burst;
-  mutable double d_tokens;
-  mutable StopWatch d_prev;
-  mutable unsigned int d_passed{0};
-  mutable unsigned int d_blocked{0};
+  unsigned int d_rate{0};
+  unsigned int d_burst{0};
+  unsigned int d_batch{1};
+  mutable std::mutex d_lock;
+  mutable double d_tokens{0};
+  mutable uint64_t d_lastUpdate{0};
 };
 
 struct ClientState;
+struct ServerPool;
 
 struct IDState
 {
@@ -347,6 +506,7 @@ struct IDState
   boost::optional<boost::uuids::uuid> uniqueId;
 #endif
   std::shared_ptr<DNSDistPacketCache> packetCache{nullptr};
+  std::shared_ptr<ServerPool> pool{nullptr};
   std::shared_ptr<QTag> qTag{nullptr};
   const ClientState* cs{nullptr};
   uint32_t cacheKey;                                          // 8
@@ -361,53 +521,189 @@ struct IDState
   bool ecsAdded{false};
   bool skipCache{false};
   bool destHarvested{false}; // if true, origDest holds the original dest addr, otherwise the listening addr
+  bool isPrefetch{false}; // if true, this is a cache refresh query and nobody is waiting for the response
 };
 
+/* A fixed-size ring of trivially copyable entries, which can be written to by several threads
+   and read concurrently without taking any lock. Writers reserve a slot by incrementing the
+   position, then update it while its sequence counter is odd. Readers copy the entry and
+   check that the sequence counter did not change in the meantime, skipping the entry otherwise. */
+template <typename T>
+class RingShard
+{
+public:
+  void setCapacity(size_t capacity)
+  {
+    d_slots = std::unique_ptr<Slot[]>(new Slot[capacity]);
+    d_capacity = capacity;
+    d_pos.store(0);
+  }
+
+  size_t getCapacity() const
+  {
+    return d_capacity;
+  }
+
+  size_t size() const
+  {
+    return std::min(static_cast<size_t>(d_pos.load(std::memory_order_relaxed)), d_capacity);
+  }
+
+  void insert(const T& entry)
+  {
+    if (d_capacity == 0) {
+      return;
+    }
+
+    const uint64_t pos = d_pos.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = d_slots[pos % d_capacity];
+    uint32_t seq = slot.d_seq.load(std::memory_order_relaxed);
+    /* if another writer is still busy with this slot we wrapped around the whole ring
+       in the meantime, and this entry would be overwritten right away anyway */
+    if ((seq & 1) || !slot.d_seq.compare_exchange_strong(seq, seq + 1, std::memory_order_relaxed)) {
+      return;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.d_entry = entry;
+    slot.d_seq.store(seq + 2, std::memory_order_release);
+  }
+
+  template <typename F>
+  void visit(const F& fn) const
+  {
+    const size_t count = size();
+    T entry;
+    for (size_t idx = 0; idx < count; idx++) {
+      if (read(d_slots[idx], entry)) {
+        fn(entry);
+      }
+    }
+  }
+
+private:
+  struct Slot
+  {
+    std::atomic<uint32_t> d_seq{0};
+    T d_entry;
+  };
+
+  static bool read(const Slot& slot, T& entry)
+  {
+    static const size_t maxAttempts = 4;
+
+    for (size_t attempt = 0; attempt < maxAttempts; attempt++) {
+      const uint32_t before = slot.d_seq.load(std::memory_order_acquire);
+      if (before == 0) {
+        /* never written to */
+        return false;
+      }
+      if (before & 1) {
+        continue;
+      }
+      entry = slot.d_entry;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.d_seq.load(std::memory_order_relaxed) == before) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::unique_ptr<Slot[]> d_slots{nullptr};
+  size_t d_capacity{0};
+  std::atomic<uint64_t> d_pos{0};
+};
+
+/* The rings are split into shards, and each thread inserting into the rings
+   is assigned a shard the first time it does, so that threads do not contend
+   with each other as long as there are at least as many shards as threads.
+   Every shard can hold the full capacity, and the inspection functions merge
+   the shards in time order and only look at the last 'capacity' entries, so the
+   result does not depend on how the entries were spread over the threads.
+   Entries have a fixed size and hold the name in wire format, so that inserting
+   does not allocate. */
 struct Rings {
-  Rings(size_t capacity=10000)
+  Rings(size_t capacity=10000, size_t numberOfShards=10)
   {
-    queryRing.set_capacity(capacity);
-    respRing.set_capacity(capacity);
-    pthread_rwlock_init(&queryLock, 0);
+    setCapacity(capacity, numberOfShards);
   }
   struct Query
   {
+    DNSName getName() const
+    {
+      if (nameLen == 0) {
+        return DNSName();
+      }
+      return DNSName(name, nameLen, 0, false);
+    }
     struct timespec when;
     ComboAddress requestor;
-    DNSName name;
     uint16_t size;
     uint16_t qtype;
     struct dnsheader dh;
+    uint8_t nameLen;
+    char name[255];
   };
-  boost::circular_buffer<Query> queryRing;
   struct Response
   {
+    DNSName getName() const
+    {
+      if (nameLen == 0) {
+        return DNSName();
+      }
+      return DNSName(name, nameLen, 0, false);
+    }
     struct timespec when;
     ComboAddress requestor;
-    DNSName name;
     uint16_t qtype;
     unsigned int usec;
     unsigned int size;
     struct dnsheader dh;
     ComboAddress ds; // who handled it
+    uint8_t nameLen;
+    char name[255];
   };
-  boost::circular_buffer<Response> respRing;
-  std::mutex respMutex;
-  pthread_rwlock_t queryLock;
 
-  std::unordered_map<int, vector<boost::variant<string,double> > > getTopBandwidth(unsigned int numentries);
-  size_t numDistinctRequestors();
-  void setCapacity(size_t newCapacity) 
+  void insertQuery(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, uint16_t size, const struct dnsheader& dh);
+  void insertResponse(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, unsigned int usec, unsigned int size, const struct dnsheader& dh, const ComboAddress& backend);
+
+  template <typename F>
+  void forEachQuery(F fn) const
   {
-    {
-      WriteLock wl(&queryLock);
-      queryRing.set_capacity(newCapacity);
+    for (const auto& query : getQueries()) {
+      fn(query);
     }
-    {
-      std::lock_guard<std::mutex> lock(respMutex);
-      respRing.set_capacity(newCapacity);
+  }
+  template <typename F>
+  void forEachResponse(F fn) const
+  {
+    for (const auto& response : getResponses()) {
+      fn(response);
     }
   }
+  std::vector<Query> getQueries() const;
+  std::vector<Response> getResponses() const;
+
+  std::unordered_map<int, vector<boost::variant<string,double> > > getTopBandwidth(unsigned int numentries);
+  size_t numDistinctRequestors();
+  size_t getNumberOfShards() const
+  {
+    return d_shards.size();
+  }
+  /* not thread-safe, should only be called before the threads inserting into the rings are started */
+  void setCapacity(size_t newCapacity, size_t numberOfShards);
+
+private:
+  struct Shard
+  {
+    RingShard<Query> queryRing;
+    RingShard<Response> respRing;
+  };
+
+  Shard& getShard();
+
+  std::vector<std::unique_ptr<Shard> > d_shards;
+  size_t d_capacity{0};
 };
 
 extern Rings g_rings;
@@ -426,6 +722,8 @@ struct QueryCount {
 };
 
 extern QueryCount g_qcount;
+extern size_t g_udpVectorSize;
+extern size_t g_udpResponderVectorSize;
 
 struct ClientState
 {
@@ -435,11 +733,37 @@ struct ClientState
   DnsCryptContext* dnscryptCtx{0};
 #endif
   shared_ptr<TLSFrontend> tlsFrontend;
-  std::atomic<uint64_t> queries{0};
+  ShardedCounter queries{0};
+  /* number of recvmmsg() calls and of messages received by them */
+  std::atomic<uint64_t> udpRecvBatches{0};
+  std::atomic<uint64_t> udpRecvBatchedQueries{0};
+  /* number of sendmmsg() calls and of responses sent by them */
+  std::atomic<uint64_t> udpSendBatches{0};
+  std::atomic<uint64_t> udpSendBatchedResponses{0};
+  /* TCP connections currently handled, and how the ones we handled ended */
+  std::atomic<uint64_t> tcpCurrentConnections{0};
+  std::atomic<uint64_t> tcpDiedReadingQuery{0};
+  std::atomic<uint64_t> tcpDiedSendingResponse{0};
+  std::atomic<uint64_t> tcpGaveUp{0};
+  std::atomic<uint64_t> tcpClientTimeouts{0};
+  std::atomic<uint64_t> tcpDownstreamTimeouts{0};
+  /* averaged over the last 100 connections, the duration is in ms */
+  double tcpAvgQueriesPerConnection{0.0};
+  double tcpAvgConnectionDuration{0.0};
+  /* updated from the threads handling the responses, which only get a const pointer */
+  mutable LatencyHistogram latencyHistogram;
+  /* maximum number of UDP messages to handle per recvmmsg() call,
+     0 means that the global setting (setUDPMultipleMessagesVectorSize()) is used */
+  size_t udpVectorSize{0};
   int udpFD{-1};
   int tcpFD{-1};
   bool muted{false};
 
+  size_t getUDPVectorSize() const
+  {
+    return udpVectorSize > 0 ? udpVectorSize : g_udpVectorSize;
+  }
+
   int getSocket() const
   {
     return udpFD != -1 ? udpFD : tcpFD;
@@ -523,16 +847,23 @@ extern std::shared_ptr<TCPClientCollection> g_tcpclientthreads;
 
 struct DownstreamState
 {
-  DownstreamState(const ComboAddress& remote_, const ComboAddress& sourceAddr_, unsigned int sourceItf);
-  DownstreamState(const ComboAddress& remote_): DownstreamState(remote_, ComboAddress(), 0) {}
+  DownstreamState(const ComboAddress& remote_, const ComboAddress& sourceAddr_, unsigned int sourceItf, size_t numberOfSockets);
+  DownstreamState(const ComboAddress& remote_): DownstreamState(remote_, ComboAddress(), 0, 1) {}
   ~DownstreamState()
   {
-    if (fd >= 0)
-      close(fd);
+    for (auto& fd : sockets) {
+      if (fd >= 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    for (const auto& idle : tcpIdleConnections) {
+      close(idle.first);
+    }
   }
 
-  int fd{-1};
-  std::thread tid;
+  /* one UDP socket per responder thread, each socket having its own slice of idStates */
+  std::vector<int> sockets;
   ComboAddress remote;
   QPSLimiter qps;
   vector<IDState> idStates;
@@ -544,21 +875,54 @@ struct DownstreamState
   std::atomic<uint64_t> sendErrors{0};
   std::atomic<uint64_t> outstanding{0};
   std::atomic<uint64_t> reuseds{0};
-  std::atomic<uint64_t> queries{0};
+  ShardedCounter queries{0};
+  /* number of recvmmsg() calls and of responses received by them */
+  std::atomic<uint64_t> udpRecvBatches{0};
+  std::atomic<uint64_t> udpRecvBatchedResponses{0};
+  /* number of sendmmsg() calls and of responses sent to clients by them */
+  std::atomic<uint64_t> udpSendBatches{0};
+  std::atomic<uint64_t> udpSendBatchedResponses{0};
+  /* TCP connections currently opened to this backend, and the reasons the ones we gave up on failed */
+  std::atomic<uint64_t> tcpCurrentConnections{0};
+  std::atomic<uint64_t> tcpDiedSendingQuery{0};
+  std::atomic<uint64_t> tcpDiedReadingResponse{0};
+  std::atomic<uint64_t> tcpGaveUp{0};
+  std::atomic<uint64_t> tcpReadTimeouts{0};
+  std::atomic<uint64_t> tcpWriteTimeouts{0};
+  /* TCP connections opened to this backend, queries sent over an already opened connection,
+     and queries we could not send because tcpMaxConcurrentConnections was reached */
+  std::atomic<uint64_t> tcpNewConnections{0};
+  std::atomic<uint64_t> tcpReusedConnections{0};
+  std::atomic<uint64_t> tcpTooManyConcurrentConnections{0};
   struct {
     std::atomic<uint64_t> sendErrors{0};
     std::atomic<uint64_t> reuseds{0};
     std::atomic<uint64_t> queries{0};
   } prev;
+  /* the points of this server on the consistent hashing ring used by the chashed policy,
+     100 per unit of weight, sorted. Computed lazily and only accessed with g_luamutex held,
+     like the policies themselves */
+  std::vector<unsigned int> hashes;
   string name;
   double queryLoad{0.0};
   double dropRate{0.0};
   double latencyUsec{0.0};
+  LatencyHistogram latencyHistogram;
   int order{1};
   int weight{1};
   int tcpConnectTimeout{5};
   int tcpRecvTimeout{30};
   int tcpSendTimeout{30};
+  /* idle TCP connections to this backend, shared by all the TCP workers, with the time they became idle */
+  std::mutex tcpIdleConnectionsLock;
+  std::deque<std::pair<int, time_t>> tcpIdleConnections;
+  /* 0 means no limit */
+  size_t tcpMaxConcurrentConnections{0};
+  size_t tcpMaxIdleConnections{20};
+  /* number of queries that can be pipelined over a single TCP connection */
+  size_t tcpMaxInFlight{1};
+  /* idle connections are closed after that many seconds, 0 means never */
+  int tcpIdleTimeout{60};
   unsigned int sourceItf{0};
   uint16_t retries{5};
   uint16_t xpfRRCode{0};
@@ -572,6 +936,7 @@ struct DownstreamState
   bool useECS{false};
   bool setCD{false};
   std::atomic<bool> connected{false};
+  std::atomic<bool> threadsStarted{false};
   bool tcpFastOpen{false};
   bool ipBindAddrNoPort{true};
   bool isUp() const
@@ -609,12 +974,20 @@ struct DownstreamState
     return status;
   }
   void reconnect();
+  bool connectSockets();
+  void hash();
+  void setWeight(int newWeight);
+  size_t getIDStatesPerSocket() const
+  {
+    return idStates.size() / sockets.size();
+  }
 };
 using servers_t =vector<std::shared_ptr<DownstreamState>>;
 
 template <class T> using NumberedVector = std::vector<std::pair<unsigned int, T> >;
 
-void* responderThread(std::shared_ptr<DownstreamState> state);
+void* responderThread(std::shared_ptr<DownstreamState> state, size_t socketIdx);
+void startResponderThreads(const std::shared_ptr<DownstreamState>& dss, const std::set<int>& cpus);
 extern std::mutex g_luamutex;
 extern LuaContext g_lua;
 extern std::string g_outputBuffer; // locking for this is ok, as locked by g_luamutex
@@ -627,7 +1000,7 @@ public:
   }
   virtual bool matches(const DNSQuestion* dq) const =0;
   virtual string toString() const = 0;
-  mutable std::atomic<uint64_t> d_matches{0};
+  mutable ShardedCounter d_matches{0};
 };
 
 using NumberedServerVector = NumberedVector<shared_ptr<DownstreamState>>;
@@ -646,6 +1019,7 @@ struct ServerPool
   NumberedVector<shared_ptr<DownstreamState>> servers;
   std::shared_ptr<DNSDistPacketCache> packetCache{nullptr};
   std::shared_ptr<ServerPolicy> policy{nullptr};
+  LatencyHistogram latencyHistogram;
 };
 using pools_t=map<std::string,std::shared_ptr<ServerPool>>;
 void setPoolPolicy(pools_t& pools, const string& poolName, std::shared_ptr<ServerPolicy> policy);
@@ -678,6 +1052,78 @@ struct DNSDistResponseRuleAction
   boost::uuids::uuid d_id;
 };
 
+/* The query rules compiled for dispatch: runs of consecutive rules matching only on the qname suffix,
+   or only on the source (or destination) address, are merged into a single suffix or netmask tree lookup
+   returning the indexes of all the rules of the run that match. Every other rule is evaluated on its own,
+   in order, so rules with side effects in matches() are only evaluated when they would have been anyway. */
+class DNSRuleChain
+{
+public:
+  DNSRuleChain()
+  {
+  }
+  DNSRuleChain(const std::vector<DNSDistRuleAction>& rules);
+
+  /* calls visitor for every matching rule, in order, until it returns false */
+  template<typename V>
+  void forEachMatch(const DNSQuestion* dq, V& visitor) const
+  {
+    for (const auto& group : d_groups) {
+      if (group.type == Group::Type::Single) {
+        const auto& ra = d_rules.at(group.index);
+        if (ra.d_rule->matches(dq)) {
+          ra.d_rule->d_matches++;
+          if (!visitor(ra)) {
+            return;
+          }
+        }
+        continue;
+      }
+
+      const std::vector<size_t>* matching = nullptr;
+      if (group.type == Group::Type::QNameSuffix) {
+        matching = group.suffixes.lookup(*dq->qname);
+      }
+      else {
+        const auto* found = group.netmasks.lookup(group.type == Group::Type::SourceNetmask ? *dq->remote : *dq->local);
+        if (found != nullptr) {
+          matching = &found->second;
+        }
+      }
+
+      if (matching == nullptr) {
+        continue;
+      }
+
+      for (const auto idx : *matching) {
+        const auto& ra = d_rules.at(idx);
+        ra.d_rule->d_matches++;
+        if (!visitor(ra)) {
+          return;
+        }
+      }
+    }
+  }
+
+  size_t getGroupsCount() const
+  {
+    return d_groups.size();
+  }
+
+private:
+  struct Group
+  {
+    enum class Type : uint8_t { Single, QNameSuffix, SourceNetmask, DestinationNetmask };
+    Type type{Type::Single};
+    size_t index{0};
+    SuffixMatchTree<std::vector<size_t>> suffixes;
+    NetmaskTree<std::vector<size_t>> netmasks;
+  };
+
+  std::vector<DNSDistRuleAction> d_rules;
+  std::vector<Group> d_groups;
+};
+
 extern GlobalStateHolder<SuffixMatchTree<DynBlock>> g_dynblockSMT;
 extern DNSAction::Action g_dynBlockAction;
 
@@ -686,6 +1132,7 @@ extern GlobalStateHolder<ServerPolicy> g_policy;
 extern GlobalStateHolder<servers_t> g_dstates;
 extern GlobalStateHolder<pools_t> g_pools;
 extern GlobalStateHolder<vector<DNSDistRuleAction> > g_rulactions;
+extern GlobalStateHolder<DNSRuleChain> g_ruleChain;
 extern GlobalStateHolder<vector<DNSDistResponseRuleAction> > g_resprulactions;
 extern GlobalStateHolder<vector<DNSDistResponseRuleAction> > g_cachehitresprulactions;
 extern GlobalStateHolder<vector<DNSDistResponseRuleAction> > g_selfansweredresprulactions;
@@ -693,7 +1140,7 @@ extern GlobalStateHolder<NetmaskGroup> g_ACL;
 
 extern ComboAddress g_serverControl; // not changed during runtime
 
-extern std::vector<std::tuple<ComboAddress, bool, bool, int, std::string, std::set<int>>> g_locals; // not changed at runtime (we hope XXX)
+extern std::vector<std::tuple<ComboAddress, bool, bool, int, std::string, std::set<int>, size_t>> g_locals; // not changed at runtime (we hope XXX)
 extern std::vector<shared_ptr<TLSFrontend>> g_tlslocals;
 extern vector<ClientState*> g_frontends;
 extern std::string g_key; // in theory needs locking
@@ -717,9 +1164,13 @@ extern bool g_apiReadWrite;
 extern std::string g_apiConfigDirectory;
 extern bool g_servFailOnNoPolicy;
 extern uint32_t g_hashperturb;
+extern double g_consistentHashBalancingFactor;
+/* the latency used by the leastOutstanding policy to pick between servers with the
+   same number of outstanding queries and the same order */
+enum class LeastOutstandingLatency : uint8_t { Average, P50, P99, P999 };
+extern LeastOutstandingLatency g_leastOutstandingLatency;
 extern bool g_useTCPSinglePipe;
 extern std::atomic<uint16_t> g_downstreamTCPCleanupInterval;
-extern size_t g_udpVectorSize;
 
 struct ConsoleKeyword {
   std::string name;
@@ -747,17 +1198,17 @@ extern std::vector<std::shared_ptr<DynBPFFilter> > g_dynBPFFilters;
 
 struct LocalHolders
 {
-  LocalHolders(): acl(g_ACL.getLocal()), policy(g_policy.getLocal()), rulactions(g_rulactions.getLocal()), cacheHitRespRulactions(g_cachehitresprulactions.getLocal()), selfAnsweredRespRulactions(g_selfansweredresprulactions.getLocal()), servers(g_dstates.getLocal()), dynNMGBlock(g_dynblockNMG.getLocal()), dynSMTBlock(g_dynblockSMT.getLocal()), pools(g_pools.getLocal())
+  LocalHolders(): acl(g_ACL.getLocal()), policy(g_policy.getLocal()), ruleChain(g_ruleChain.getLocal()), cacheHitRespRulactions(g_cachehitresprulactions.getLocal()), selfAnsweredRespRulactions(g_selfansweredresprulactions.getLocal()), servers(g_dstates.getLocal()), dynNMGBlock(g_dynblockNMG.getLocal()), dynSMTBlock(g_dynblockSMT.getLocal()), pools(g_pools.getLocal())
   {
   }
 
   LocalStateHolder<NetmaskGroup> acl;
   LocalStateHolder<ServerPolicy> policy;
-  LocalStateHolder<vector<DNSDistRuleAction> > rulactions;
+  LocalStateHolder<DNSRuleChain> ruleChain;
   LocalStateHolder<vector<DNSDistResponseRuleAction> > cacheHitRespRulactions;
   LocalStateHolder<vector<DNSDistResponseRuleAction> > selfAnsweredRespRulactions;
   LocalStateHolder<servers_t> servers;
-  LocalStateHolder<NetmaskTree<DynBlock> > dynNMGBlock;
+  LocalStateHolder<PersistentNetmaskTree<DynBlock> > dynNMGBlock;
   LocalStateHolder<SuffixMatchTree<DynBlock> > dynSMTBlock;
   LocalStateHolder<pools_t> pools;
 };
@@ -768,6 +1219,10 @@ void controlThread(int fd, ComboAddress local);
 vector<std::function<void(void)>> setupLua(bool client, const std::string& config);
 std::shared_ptr<ServerPool> getPool(const pools_t& pools, const std::string& poolName);
 std::shared_ptr<ServerPool> createPoolIfNotExists(pools_t& pools, const string& poolName);
+void refreshRuleChain(GlobalStateHolder<vector<DNSDistRuleAction> >* rules);
+inline void refreshRuleChain(GlobalStateHolder<vector<DNSDistResponseRuleAction> >* rules)
+{
+}
 const NumberedServerVector& getDownstreamCandidates(const pools_t& pools, const std::string& poolName);
 
 std::shared_ptr<DownstreamState> firstAvailable(const NumberedServerVector& servers, const DNSQuestion* dq);
@@ -775,6 +1230,7 @@ std::shared_ptr<DownstreamState> firstAvailable(const NumberedServerVector& serv
 std::shared_ptr<DownstreamState> leastOutstanding(const NumberedServerVector& servers, const DNSQuestion* dq);
 std::shared_ptr<DownstreamState> wrandom(const NumberedServerVector& servers, const DNSQuestion* dq);
 std::shared_ptr<DownstreamState> whashed(const NumberedServerVector& servers, const DNSQuestion* dq);
+std::shared_ptr<DownstreamState> chashed(const NumberedServerVector& servers, const DNSQuestion* dq);
 std::shared_ptr<DownstreamState> roundrobin(const NumberedServerVector& servers, const DNSQuestion* dq);
 int getEDNSZ(const char* packet, unsigned int len);
 uint16_t getEDNSOptionCode(const char * packet, size_t len);
@@ -0,0 +1 @@
+../dnsdist-dynblocks.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../dnsdist-dynblocks.hh
\ No newline at end of file
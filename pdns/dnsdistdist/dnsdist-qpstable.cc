@@ -0,0 +1 @@
+../dnsdist-qpstable.cc
\ No newline at end of file
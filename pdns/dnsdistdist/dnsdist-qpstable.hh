@@ -0,0 +1 @@
+../dnsdist-qpstable.hh
\ No newline at end of file
@@ -0,0 +1 @@
+../dnsdist-rules.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../dnsdist-rules.hh
\ No newline at end of file
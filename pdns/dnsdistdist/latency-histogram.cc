@@ -0,0 +1 @@
+../latency-histogram.cc
\ No newline at end of file
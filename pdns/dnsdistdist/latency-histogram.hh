@@ -0,0 +1 @@
+../latency-histogram.hh
\ No newline at end of file
@@ -0,0 +1 @@
+../protobuf-encoder.cc
\ No newline at end of file
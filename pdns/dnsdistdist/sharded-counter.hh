@@ -0,0 +1 @@
+../sharded-counter.hh
\ No newline at end of file
@@ -249,18 +249,9 @@ public:
       throw std::runtime_error("Error assigning socket");
     }
 
-    int res = 0;
-    do {
-      res = SSL_accept(d_conn);
-      if (res < 0) {
-        handleIORequest(res, timeout);
-      }
-    }
-    while (res < 0);
-
-    if (res != 1) {
-      throw std::runtime_error("Error accepting TLS connection");
-    }
+    /* the buffer might be reallocated between two attempts to write the same data */
+    SSL_set_mode(d_conn, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_set_accept_state(d_conn);
   }
 
   virtual ~OpenSSLTLSConnection() override
@@ -270,81 +261,63 @@ public:
     }
   }
 
-  void handleIORequest(int res, unsigned int timeout)
+  IOState convertIORequestToIOState(int res) const
   {
     int error = SSL_get_error(d_conn, res);
     if (error == SSL_ERROR_WANT_READ) {
-      res = waitForData(d_socket, timeout);
-      if (res <= 0) {
-        throw std::runtime_error("Error reading from TLS connection");
-      }
+      return IOState::NeedRead;
     }
     else if (error == SSL_ERROR_WANT_WRITE) {
-      res = waitForRWData(d_socket, false, timeout, 0);
-      if (res <= 0) {
-        throw std::runtime_error("Error waiting to write to TLS connection");
-      }
+      return IOState::NeedWrite;
+    }
+    else if (error == SSL_ERROR_SYSCALL) {
+      throw std::runtime_error("Error while processing TLS connection: " + std::string(strerror(errno)));
     }
-    else {
-      throw std::runtime_error("Error writing to TLS connection");
+    else if (error == SSL_ERROR_ZERO_RETURN) {
+      throw std::runtime_error("TLS connection closed by remote end");
     }
+    throw std::runtime_error("Error while processing TLS connection");
   }
 
-  size_t read(void* buffer, size_t bufferSize, unsigned int readTimeout, unsigned int totalTimeout) override
+  IOState tryHandshake() override
   {
-    size_t got = 0;
-    time_t start = 0;
-    unsigned int remainingTime = totalTimeout;
-    if (totalTimeout) {
-      start = time(nullptr);
+    int res = SSL_accept(d_conn);
+    if (res == 1) {
+      return IOState::Done;
+    }
+    else if (res < 0) {
+      return convertIORequestToIOState(res);
     }
 
-    do {
-      int res = SSL_read(d_conn, (reinterpret_cast<char *>(buffer) + got), static_cast<int>(bufferSize - got));
-      if (res == 0) {
-        throw std::runtime_error("Error reading from TLS connection");
-      }
-      else if (res < 0) {
-        handleIORequest(res, readTimeout);
-      }
-      else {
-        got += (size_t) res;
-      }
+    throw std::runtime_error("Error accepting TLS connection");
+  }
 
-      if (totalTimeout) {
-        time_t now = time(nullptr);
-        unsigned int elapsed = now - start;
-        if (now < start || elapsed >= remainingTime) {
-          throw runtime_error("Timeout while reading data");
-        }
-        start = now;
-        remainingTime -= elapsed;
+  IOState tryRead(std::vector<uint8_t>& buffer, size_t& pos, size_t toRead) override
+  {
+    while (pos < toRead) {
+      int res = SSL_read(d_conn, reinterpret_cast<char *>(&buffer.at(pos)), static_cast<int>(toRead - pos));
+      if (res <= 0) {
+        return convertIORequestToIOState(res);
       }
+      pos += static_cast<size_t>(res);
     }
-    while (got < bufferSize);
 
-    return got;
+    return IOState::Done;
   }
 
-  size_t write(const void* buffer, size_t bufferSize, unsigned int writeTimeout) override
+  IOState tryWrite(const std::vector<uint8_t>& buffer, size_t& pos, size_t toWrite) override
   {
-    size_t got = 0;
-    do {
-      int res = SSL_write(d_conn, (reinterpret_cast<const char *>(buffer) + got), static_cast<int>(bufferSize - got));
-      if (res == 0) {
-        throw std::runtime_error("Error writing to TLS connection");
-      }
-      else if (res < 0) {
-        handleIORequest(res, writeTimeout);
-      }
-      else {
-        got += (size_t) res;
+    while (pos < toWrite) {
+      int res = SSL_write(d_conn, reinterpret_cast<const char *>(&buffer.at(pos)), static_cast<int>(toWrite - pos));
+      if (res <= 0) {
+        return convertIORequestToIOState(res);
       }
+      pos += static_cast<size_t>(res);
     }
-    while (got < bufferSize);
 
-    return got;
+    return IOState::Done;
   }
+
   void close() override
   {
     if (d_conn) {
@@ -647,13 +620,6 @@ public:
 
     /* timeouts are in milliseconds */
     gnutls_handshake_set_timeout(d_conn, timeout * 1000);
-    gnutls_record_set_timeout(d_conn, timeout * 1000);
-
-    int ret = 0;
-    do {
-      ret = gnutls_handshake(d_conn);
-    }
-    while (ret < 0 && gnutls_error_is_fatal(ret) == 0);
   }
 
   virtual ~GnuTLSConnection() override
@@ -663,67 +629,75 @@ public:
     }
   }
 
-  size_t read(void* buffer, size_t bufferSize, unsigned int readTimeout, unsigned int totalTimeout) override
+  /* GNUTLS_E_AGAIN does not tell whether we need to wait for the socket to become readable or writable */
+  IOState getPendingIOState() const
   {
-    size_t got = 0;
-    time_t start = 0;
-    unsigned int remainingTime = totalTimeout;
-    if (totalTimeout) {
-      start = time(nullptr);
-    }
+    return gnutls_record_get_direction(d_conn) == 0 ? IOState::NeedRead : IOState::NeedWrite;
+  }
 
+  IOState tryHandshake() override
+  {
+    int ret = 0;
     do {
-      ssize_t res = gnutls_record_recv(d_conn, (reinterpret_cast<char *>(buffer) + got), bufferSize - got);
+      ret = gnutls_handshake(d_conn);
+      if (ret == GNUTLS_E_SUCCESS) {
+        return IOState::Done;
+      }
+      else if (ret == GNUTLS_E_AGAIN) {
+        return getPendingIOState();
+      }
+    }
+    while (gnutls_error_is_fatal(ret) == 0);
+
+    throw std::runtime_error("Error accepting a new connection: " + std::string(gnutls_strerror(ret)));
+  }
+
+  IOState tryRead(std::vector<uint8_t>& buffer, size_t& pos, size_t toRead) override
+  {
+    while (pos < toRead) {
+      ssize_t res = gnutls_record_recv(d_conn, reinterpret_cast<char *>(&buffer.at(pos)), toRead - pos);
       if (res == 0) {
         throw std::runtime_error("Error reading from TLS connection");
       }
       else if (res > 0) {
-        got += (size_t) res;
+        pos += static_cast<size_t>(res);
       }
-      else if (res < 0) {
-        if (gnutls_error_is_fatal(res)) {
-          throw std::runtime_error("Error reading from TLS connection");
-        }
-        warnlog("Warning, non-fatal error while reading from TLS connection: %s", gnutls_strerror(res));
+      else if (res == GNUTLS_E_AGAIN) {
+        return getPendingIOState();
       }
-
-      if (totalTimeout) {
-        time_t now = time(nullptr);
-        unsigned int elapsed = now - start;
-        if (now < start || elapsed >= remainingTime) {
-          throw runtime_error("Timeout while reading data");
-        }
-        start = now;
-        remainingTime -= elapsed;
+      else if (gnutls_error_is_fatal(res)) {
+        throw std::runtime_error("Error reading from TLS connection: " + std::string(gnutls_strerror(res)));
+      }
+      else {
+        vinfolog("Non-fatal error while reading from TLS connection: %s", gnutls_strerror(res));
       }
     }
-    while (got < bufferSize);
 
-    return got;
+    return IOState::Done;
   }
 
-  size_t write(const void* buffer, size_t bufferSize, unsigned int writeTimeout) override
+  IOState tryWrite(const std::vector<uint8_t>& buffer, size_t& pos, size_t toWrite) override
   {
-    size_t got = 0;
-
-    do {
-      ssize_t res = gnutls_record_send(d_conn, (reinterpret_cast<const char *>(buffer) + got), bufferSize - got);
+    while (pos < toWrite) {
+      ssize_t res = gnutls_record_send(d_conn, reinterpret_cast<const char *>(&buffer.at(pos)), toWrite - pos);
       if (res == 0) {
         throw std::runtime_error("Error writing to TLS connection");
       }
       else if (res > 0) {
-        got += (size_t) res;
+        pos += static_cast<size_t>(res);
       }
-      else if (res < 0) {
-        if (gnutls_error_is_fatal(res)) {
-          throw std::runtime_error("Error writing to TLS connection");
-        }
-        warnlog("Warning, non-fatal error while writing to TLS connection: %s", gnutls_strerror(res));
+      else if (res == GNUTLS_E_AGAIN) {
+        return getPendingIOState();
+      }
+      else if (gnutls_error_is_fatal(res)) {
+        throw std::runtime_error("Error writing to TLS connection: " + std::string(gnutls_strerror(res)));
+      }
+      else {
+        vinfolog("Non-fatal error while writing to TLS connection: %s", gnutls_strerror(res));
       }
     }
-    while (got < bufferSize);
 
-    return got;
+    return IOState::Done;
   }
 
   void close() override
@@ -834,6 +808,50 @@ private:
 
 #endif /* HAVE_DNS_OVER_TLS */
 
+IOState tryReadFromSocket(int fd, std::vector<uint8_t>& buffer, size_t& pos, size_t toRead)
+{
+  while (pos < toRead) {
+    ssize_t res = ::read(fd, reinterpret_cast<char*>(&buffer.at(pos)), toRead - pos);
+    if (res == 0) {
+      throw std::runtime_error("EOF while reading message");
+    }
+    else if (res < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return IOState::NeedRead;
+      }
+      else if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Error while reading message: " + std::string(strerror(errno)));
+    }
+    pos += static_cast<size_t>(res);
+  }
+
+  return IOState::Done;
+}
+
+IOState tryWriteToSocket(int fd, const std::vector<uint8_t>& buffer, size_t& pos, size_t toWrite)
+{
+  while (pos < toWrite) {
+    ssize_t res = ::write(fd, reinterpret_cast<const char*>(&buffer.at(pos)), toWrite - pos);
+    if (res == 0) {
+      throw std::runtime_error("EOF while sending message");
+    }
+    else if (res < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return IOState::NeedWrite;
+      }
+      else if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Error while writing message: " + std::string(strerror(errno)));
+    }
+    pos += static_cast<size_t>(res);
+  }
+
+  return IOState::Done;
+}
+
 bool TLSFrontend::setupTLS()
 {
 #ifdef HAVE_DNS_OVER_TLS
@@ -1,15 +1,25 @@
 
 #pragma once
 #include <memory>
+#include <vector>
 
 #include "misc.hh"
 
+enum class IOState { Done, NeedRead, NeedWrite };
+
+/* non-blocking I/O on a plain socket: read (or write) until 'pos' reaches 'toRead' (or 'toWrite'),
+   return NeedRead (or NeedWrite) if the operation would block, throw on error or if the
+   other end closed the connection */
+IOState tryReadFromSocket(int fd, std::vector<uint8_t>& buffer, size_t& pos, size_t toRead);
+IOState tryWriteToSocket(int fd, const std::vector<uint8_t>& buffer, size_t& pos, size_t toWrite);
+
 class TLSConnection
 {
 public:
   virtual ~TLSConnection() { }
-  virtual size_t read(void* buffer, size_t bufferSize, unsigned int readTimeout, unsigned int totalTimeout=0) = 0;
-  virtual size_t write(const void* buffer, size_t bufferSize, unsigned int writeTimeout) = 0;
+  virtual IOState tryHandshake() = 0;
+  virtual IOState tryRead(std::vector<uint8_t>& buffer, size_t& pos, size_t toRead) = 0;
+  virtual IOState tryWrite(const std::vector<uint8_t>& buffer, size_t& pos, size_t toWrite) = 0;
   virtual void close() = 0;
 
 protected:
@@ -162,37 +172,32 @@ public:
     else if (d_socket != -1) {
       shutdown(d_socket, SHUT_RDWR);
     }
+    /* we own the socket */
+    if (d_socket != -1) {
+      ::close(d_socket);
+    }
   }
-  size_t read(void* buffer, size_t bufferSize, unsigned int readTimeout, unsigned int totalTimeout=0)
+  /* the handshake is a no-op for plain TCP connections */
+  IOState tryHandshake()
   {
     if (d_conn) {
-      return d_conn->read(buffer, bufferSize, readTimeout, totalTimeout);
-    } else {
-      return readn2WithTimeout(d_socket, buffer, bufferSize, readTimeout, totalTimeout);
+      return d_conn->tryHandshake();
     }
+    return IOState::Done;
   }
-  size_t write(const void* buffer, size_t bufferSize, unsigned int writeTimeout)
+  IOState tryRead(std::vector<uint8_t>& buffer, size_t& pos, size_t toRead)
   {
     if (d_conn) {
-      return d_conn->write(buffer, bufferSize, writeTimeout);
-    }
-    else {
-      return writen2WithTimeout(d_socket, buffer, bufferSize, writeTimeout);
+      return d_conn->tryRead(buffer, pos, toRead);
     }
+    return tryReadFromSocket(d_socket, buffer, pos, toRead);
   }
-
-  bool writeSizeAndMsg(const void* buffer, size_t bufferSize, unsigned int writeTimeout)
+  IOState tryWrite(const std::vector<uint8_t>& buffer, size_t& pos, size_t toWrite)
   {
     if (d_conn) {
-      uint16_t size = htons(bufferSize);
-      if (d_conn->write(&size, sizeof(size), writeTimeout) != sizeof(size)) {
-        return false;
-      }
-      return (d_conn->write(buffer, bufferSize, writeTimeout) == bufferSize);
-    }
-    else {
-      return sendSizeAndMsgWithTimeout(d_socket, bufferSize, static_cast<const char*>(buffer), writeTimeout, nullptr, nullptr, 0, 0, 0);
+      return d_conn->tryWrite(buffer, pos, toWrite);
     }
+    return tryWriteToSocket(d_socket, buffer, pos, toWrite);
   }
 
 private:
@@ -0,0 +1 @@
+../test-dnsdist-allocations.cc
\ No newline at end of file
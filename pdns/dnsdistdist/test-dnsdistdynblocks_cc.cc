@@ -0,0 +1 @@
+../test-dnsdistdynblocks_cc.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../test-dnsdistqpstable_cc.cc
\ No newline at end of file
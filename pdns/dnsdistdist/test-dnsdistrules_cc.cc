@@ -0,0 +1 @@
+../test-dnsdistrules_cc.cc
\ No newline at end of file
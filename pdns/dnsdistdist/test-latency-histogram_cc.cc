@@ -0,0 +1 @@
+../test-latency-histogram_cc.cc
\ No newline at end of file
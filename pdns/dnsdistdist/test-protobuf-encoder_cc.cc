@@ -0,0 +1 @@
+../test-protobuf-encoder_cc.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../test-sharded-counter_hh.cc
\ No newline at end of file
@@ -317,7 +317,12 @@ struct SuffixMatchTree
       return 0;
     }
     labels.pop_back();
-    return child->lookup(labels);
+    auto result = child->lookup(labels);
+    if (result) {
+      return result;
+    }
+    /* the descent ended on an intermediary node, we might be an end node ourselves */
+    return endNode ? &d_value : 0;
   }
 
 };
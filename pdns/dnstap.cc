@@ -58,6 +58,22 @@ void DnstapMessage::serialize(std::string& data) const
 #endif /* HAVE_PROTOBUF */
 }
 
+size_t DnstapMessage::serializedSize() const
+{
+#ifdef HAVE_PROTOBUF
+  return proto_message.ByteSize();
+#else
+  return 0;
+#endif /* HAVE_PROTOBUF */
+}
+
+void DnstapMessage::serialize(char* out, size_t size) const
+{
+#ifdef HAVE_PROTOBUF
+  proto_message.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(out));
+#endif /* HAVE_PROTOBUF */
+}
+
 std::string DnstapMessage::toDebugString() const
 {
   return
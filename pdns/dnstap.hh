@@ -40,6 +40,9 @@ class DnstapMessage
 public:
   DnstapMessage(const std::string& identity, const ComboAddress* requestor, const ComboAddress* responder, bool isTCP, const char* packet, const size_t len, const struct timespec* queryTime, const struct timespec* responseTime);
   void serialize(std::string& data) const;
+  /* serializedSize() has to be called first, serialize() then writes exactly that many bytes to out */
+  size_t serializedSize() const;
+  void serialize(char* out, size_t size) const;
   std::string toDebugString() const;
 
   void setExtra(const std::string& extra);
@@ -68,26 +68,9 @@ FrameStreamLogger::FrameStreamLogger(const int family, const std::string& addres
       throw std::runtime_error("FrameStreamLogger: family " + std::to_string(family) + " not supported");
     }
 
-    d_iothropt = fstrm_iothr_options_init();
-    if (!d_iothropt) {
-      throw std::runtime_error("FrameStreamLogger: fstrm_iothr_options_init() failed.");
-    }
-
-    res = fstrm_iothr_options_set_queue_model(d_iothropt, FSTRM_IOTHR_QUEUE_MODEL_MPSC);
-    if (res != fstrm_res_success) {
-      throw std::runtime_error("FrameStreamLogger: fstrm_iothr_options_set_queue_model failed: " + std::to_string(res));
-    }
-
     if (connect) {
-      d_iothr = fstrm_iothr_init(d_iothropt, &d_writer);
-      if (!d_iothr) {
-        throw std::runtime_error("FrameStreamLogger: fstrm_iothr_init() failed.");
-      }
-
-      d_ioqueue = fstrm_iothr_get_input_queue(d_iothr);
-      if (!d_ioqueue) {
-        throw std::runtime_error("FrameStreamLogger: fstrm_iothr_get_input_queue() failed.");
-      }
+      d_ring = std::unique_ptr<RemoteLoggerRing>(new RemoteLoggerRing(s_ringSize));
+      d_thread = std::thread(&FrameStreamLogger::worker, this);
     }
   } catch (std::runtime_error &e) {
     this->cleanup();
@@ -97,13 +80,10 @@ FrameStreamLogger::FrameStreamLogger(const int family, const std::string& addres
 
 void FrameStreamLogger::cleanup()
 {
-  if (d_iothr != nullptr) {
-    fstrm_iothr_destroy(&d_iothr);
-    d_iothr = nullptr;
-  }
-  if (d_iothropt != nullptr) {
-    fstrm_iothr_options_destroy(&d_iothropt);
-    d_iothropt = nullptr;
+  if (d_thread.joinable()) {
+    d_exiting = true;
+    d_ring->wakeUp();
+    d_thread.join();
   }
   if (d_writer != nullptr) {
     fstrm_writer_destroy(&d_writer);
@@ -130,31 +110,70 @@ FrameStreamLogger::~FrameStreamLogger()
   this->cleanup();
 }
 
-void FrameStreamLogger::queueData(const std::string& data)
+void FrameStreamLogger::worker()
 {
-  if (!d_ioqueue || !d_iothr) {
-    return;
+  std::vector<struct iovec> iovs;
+  iovs.reserve(s_maxBatchSize);
+  time_t failedAt = 0;
+
+  while (true) {
+    d_ring->waitForData(1000);
+    if (d_exiting) {
+      break;
+    }
+
+    iovs.clear();
+    const size_t count = d_ring->peek(iovs, s_maxBatchSize);
+    if (count == 0) {
+      continue;
+    }
+
+    size_t bytes = 0;
+    for (const auto& iov : iovs) {
+      bytes += iov.iov_len;
+    }
+
+    /* don't try to reopen the writer for every batch while the remote end is down */
+    if (failedAt != 0 && time(nullptr) < static_cast<time_t>(failedAt + s_reopenInterval)) {
+      d_droppedBytes += bytes;
+      d_ring->release();
+      continue;
+    }
+
+    /* the writer is opened on the first write, and re-opened after a failure */
+    fstrm_res res = fstrm_writer_writev(d_writer, iovs.data(), static_cast<int>(iovs.size()));
+    if (res == fstrm_res_success) {
+      d_flushedBytes += bytes;
+      failedAt = 0;
+    }
+    else {
+      if (failedAt == 0) {
+        warnlog("FrameStreamLogger: writing to %s failed: %d", d_address, static_cast<int>(res));
+      }
+      fstrm_writer_close(d_writer);
+      d_droppedBytes += bytes;
+      failedAt = time(nullptr);
+    }
+
+    d_ring->release();
   }
-  uint8_t *frame = (uint8_t*)malloc(data.length());
-  if (!frame) {
-    warnlog("FrameStreamLogger: cannot allocate memory for stream.");
-    return;
+
+  fstrm_writer_close(d_writer);
+}
+
+bool FrameStreamLogger::queueData(size_t size, const std::function<void(char*)>& writer)
+{
+  if (!d_ring) {
+    return false;
   }
-  memcpy(frame, data.c_str(), data.length());
 
-  fstrm_res res;
-  res = fstrm_iothr_submit(d_iothr, d_ioqueue, frame, data.length(), fstrm_free_wrapper, nullptr);
-
-  if (res == fstrm_res_success) {
-    // Frame successfully queued.
-  } else if (res == fstrm_res_again) {
-    free(frame);
-    warnlog("FrameStreamLogger: queue full, dropping.");
-  } else {
-    // Permanent failure.
-    free(frame);
-    warnlog("FrameStreamLogger: submitting to queue failed.");
+  if (!d_ring->write(size, writer)) {
+    d_droppedBytes += size;
+    return false;
   }
+
+  d_queuedBytes += size;
+  return true;
 }
 
 #endif /* HAVE_FSTRM */
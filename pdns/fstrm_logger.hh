@@ -26,7 +26,6 @@
 #ifdef HAVE_FSTRM
 
 #include <fstrm.h>
-#include <fstrm/iothr.h>
 #include <fstrm/unix_writer.h>
 #ifdef HAVE_FSTRM_TCP_WRITER_INIT
 #include <fstrm/tcp_writer.h>
@@ -37,7 +36,8 @@ class FrameStreamLogger : public RemoteLoggerInterface, boost::noncopyable
 public:
   FrameStreamLogger(int family, const std::string& address, bool connect);
   virtual ~FrameStreamLogger();
-  virtual void queueData(const std::string& data) override;
+  using RemoteLoggerInterface::queueData;
+  virtual bool queueData(size_t size, const std::function<void(char*)>& writer) override;
   virtual std::string toString() override
   {
     return "FrameStreamLogger to " + d_address;
@@ -45,16 +45,24 @@ public:
 private:
   const int d_family;
   const std::string d_address;
-  struct fstrm_iothr_queue *d_ioqueue{nullptr};
   struct fstrm_writer_options *d_fwopt{nullptr};
   struct fstrm_unix_writer_options *d_uwopt{nullptr};
 #ifdef HAVE_FSTRM_TCP_WRITER_INIT
   struct fstrm_tcp_writer_options *d_twopt{nullptr};
 #endif
   struct fstrm_writer *d_writer{nullptr};
-  struct fstrm_iothr_options *d_iothropt{nullptr};
-  struct fstrm_iothr *d_iothr{nullptr};
+  /* we don't use fstrm's I/O thread, which needs a malloc'ed copy of every frame,
+     but our own ring and worker writing frames in batches */
+  std::unique_ptr<RemoteLoggerRing> d_ring{nullptr};
+  std::thread d_thread;
+  std::atomic<bool> d_exiting{false};
 
+  /* same as fstrm's I/O thread defaults */
+  static const size_t s_ringSize = 512 * 1024;
+  static const unsigned int s_reopenInterval = 5;
+  static const size_t s_maxBatchSize = 256;
+
+  void worker();
   void cleanup();
 };
 
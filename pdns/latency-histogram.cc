@@ -0,0 +1,95 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "latency-histogram.hh"
+
+/* the weight kept by the previous samples at each update */
+static const double s_decayFactor = 0.9;
+/* below that, we don't have enough samples to say anything meaningful */
+static const double s_minimumWeight = 1.0;
+
+uint64_t LatencyHistogram::getBucketLowerBound(size_t idx)
+{
+  const size_t subBuckets = 1 << s_subBucketsBits;
+  if (idx < subBuckets) {
+    return idx;
+  }
+  const unsigned int shift = (idx >> s_subBucketsBits) - 1;
+  return static_cast<uint64_t>(subBuckets + (idx & (subBuckets - 1))) << shift;
+}
+
+uint64_t LatencyHistogram::getBucketWidth(size_t idx)
+{
+  const size_t subBuckets = 1 << s_subBucketsBits;
+  if (idx < subBuckets) {
+    return 1;
+  }
+  return static_cast<uint64_t>(1) << ((idx >> s_subBucketsBits) - 1);
+}
+
+uint64_t LatencyHistogram::getCount() const
+{
+  uint64_t result = 0;
+  for (const auto& bucket : d_buckets) {
+    result += bucket.load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+void LatencyHistogram::updatePercentiles()
+{
+  std::lock_guard<std::mutex> lock(d_updateLock);
+
+  double total = 0.0;
+  for (size_t idx = 0; idx < s_numberOfBuckets; idx++) {
+    const uint64_t current = d_buckets[idx].load(std::memory_order_relaxed);
+    d_decayed[idx] = d_decayed[idx] * s_decayFactor + (current - d_previous[idx]);
+    d_previous[idx] = current;
+    total += d_decayed[idx];
+  }
+
+  if (total < s_minimumWeight) {
+    /* keep the last known values */
+    return;
+  }
+
+  const double targets[] = { total * 0.5, total * 0.99, total * 0.999 };
+  double results[] = { 0.0, 0.0, 0.0 };
+  size_t target = 0;
+  double cumulated = 0.0;
+  for (size_t idx = 0; idx < s_numberOfBuckets && target < 3; idx++) {
+    cumulated += d_decayed[idx];
+    while (target < 3 && cumulated >= targets[target]) {
+      /* the middle of the bucket */
+      results[target] = getBucketLowerBound(idx) + (getBucketWidth(idx) - 1) / 2.0;
+      target++;
+    }
+  }
+  /* rounding errors might prevent us from reaching the last targets */
+  while (target < 3) {
+    results[target] = getBucketLowerBound(s_numberOfBuckets - 1);
+    target++;
+  }
+
+  d_p50.store(results[0], std::memory_order_relaxed);
+  d_p99.store(results[1], std::memory_order_relaxed);
+  d_p999.store(results[2], std::memory_order_relaxed);
+}
@@ -0,0 +1,112 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+/* A log-linear (HDR-style) histogram of latencies, in microseconds.
+
+   Values below 16 us get a bucket of their own, then every power of two is
+   split in 16 buckets of the same width, so that the relative error of a
+   percentile is at most 1/16th of the value. Values above 2^27 us (~134s)
+   all end up in the last bucket. Recording a value is a single relaxed
+   atomic increment.
+
+   The percentiles are computed by updatePercentiles(), which is meant to be
+   called regularly (every second or so) from a single thread. They reflect
+   the recent latencies, each update decaying the weight of the previous
+   samples so that the last ten updates or so count the most. */
+class LatencyHistogram
+{
+public:
+  struct Percentiles
+  {
+    /* in microseconds */
+    double p50{0.0};
+    double p99{0.0};
+    double p999{0.0};
+  };
+
+  static const unsigned int s_subBucketsBits = 4;
+  static const unsigned int s_maxBits = 27;
+  static const size_t s_numberOfBuckets = (s_maxBits - s_subBucketsBits + 1) << s_subBucketsBits;
+
+  LatencyHistogram()
+  {
+    for (auto& bucket : d_buckets) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+    d_previous.fill(0);
+    d_decayed.fill(0.0);
+  }
+
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+  void record(uint64_t usec)
+  {
+    d_buckets[getBucketIndex(usec)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /* number of values recorded since the histogram was created */
+  uint64_t getCount() const;
+  void updatePercentiles();
+  Percentiles getPercentiles() const
+  {
+    Percentiles result;
+    result.p50 = d_p50.load(std::memory_order_relaxed);
+    result.p99 = d_p99.load(std::memory_order_relaxed);
+    result.p999 = d_p999.load(std::memory_order_relaxed);
+    return result;
+  }
+
+  static size_t getBucketIndex(uint64_t usec)
+  {
+    static const uint64_t subBuckets = 1 << s_subBucketsBits;
+    if (usec < subBuckets) {
+      return usec;
+    }
+    if (usec >= (static_cast<uint64_t>(1) << s_maxBits)) {
+      return s_numberOfBuckets - 1;
+    }
+    /* position of the most significant bit, at least s_subBucketsBits */
+    const unsigned int msb = 63 - __builtin_clzll(usec);
+    const size_t subBucket = (usec >> (msb - s_subBucketsBits)) & (subBuckets - 1);
+    return ((msb - s_subBucketsBits + 1) << s_subBucketsBits) + subBucket;
+  }
+
+  static uint64_t getBucketLowerBound(size_t idx);
+  static uint64_t getBucketWidth(size_t idx);
+
+private:
+  std::array<std::atomic<uint64_t>, s_numberOfBuckets> d_buckets;
+  /* only accessed by updatePercentiles() */
+  std::mutex d_updateLock;
+  std::array<uint64_t, s_numberOfBuckets> d_previous;
+  std::array<double, s_numberOfBuckets> d_decayed;
+  std::atomic<double> d_p50{0.0};
+  std::atomic<double> d_p99{0.0};
+  std::atomic<double> d_p999{0.0};
+};
@@ -61,9 +61,7 @@ static void logOutgoingQuery(std::shared_ptr<RemoteLogger> outgoingLogger, boost
   }
 
 //  cerr <<message.toDebugString()<<endl;
-  std::string str;
-  message.serialize(str);
-  outgoingLogger->queueData(str);
+  outgoingLogger->queueMessage(message);
 }
 
 static void logIncomingResponse(std::shared_ptr<RemoteLogger> outgoingLogger, boost::optional<const boost::uuids::uuid&> initialRequestId, const boost::uuids::uuid& uuid, const ComboAddress& ip, const DNSName& domain, int type, uint16_t qid, bool doTCP, size_t bytes, int rcode, const std::vector<DNSRecord>& records, const struct timeval& queryTime)
@@ -80,9 +78,7 @@ static void logIncomingResponse(std::shared_ptr<RemoteLogger> outgoingLogger, bo
   message.addRRs(records);
 
 //  cerr <<message.toDebugString()<<endl;
-  std::string str;
-  message.serialize(str);
-  outgoingLogger->queueData(str);
+  outgoingLogger->queueMessage(message);
 }
 #endif /* HAVE_PROTOBUF */
 
@@ -166,42 +162,60 @@ int asyncresolve(const ComboAddress& ip, const DNSName& domain, int type, bool d
   }
   else {
     try {
-      Socket s(ip.sin4.sin_family, SOCK_STREAM);
-
-      s.setNonBlocking();
-      ComboAddress local = getQueryLocalAddress(ip.sin4.sin_family, 0);
-
-      s.bind(local);
-        
-      s.connect(ip);
-      
       uint16_t tlen=htons(vpacket.size());
       char *lenP=(char*)&tlen;
       const char *msgP=(const char*)&*vpacket.begin();
-      string packet=string(lenP, lenP+2)+string(msgP, msgP+vpacket.size());
-      
-      ret=asendtcp(packet, &s);
-      if(!(ret>0))           
-        return ret;
-      
-      packet.clear();
-      ret=arecvtcp(packet, 2, &s, false);
-      if(!(ret > 0))
-        return ret;
-      
-      memcpy(&tlen, packet.c_str(), sizeof(tlen));
-      len=ntohs(tlen); // switch to the 'len' shared with the rest of the function
-      
-      ret=arecvtcp(packet, len, &s, false);
-      if(!(ret > 0))
-        return ret;
-      
-      if(len > bufsize) {
-        bufsize=len;
-        scoped_array<unsigned char> narray(new unsigned char[bufsize]);
-        buf.swap(narray);
+      const string query=string(lenP, lenP+2)+string(msgP, msgP+vpacket.size());
+
+      for(;;) {
+        auto connection = t_tcpOutConnections.get(ip, now->tv_sec);
+        const bool reused = connection.d_socket != nullptr;
+        if(reused) {
+          g_stats.tcpOutConnectionsReused++;
+        }
+        else {
+          connection.d_socket = std::make_shared<Socket>(ip.sin4.sin_family, SOCK_STREAM);
+          connection.d_socket->setNonBlocking();
+          ComboAddress local = getQueryLocalAddress(ip.sin4.sin_family, 0);
+
+          connection.d_socket->bind(local);
+
+          connection.d_socket->connect(ip);
+          g_stats.tcpOutConnectionsOpened++;
+        }
+
+        ret=asendtcp(query, connection.d_socket.get());
+        if(ret > 0) {
+          string packet;
+          ret=arecvtcp(packet, 2, connection.d_socket.get(), false);
+          if(ret > 0) {
+            memcpy(&tlen, packet.c_str(), sizeof(tlen));
+            len=ntohs(tlen); // switch to the 'len' shared with the rest of the function
+
+            ret=arecvtcp(packet, len, connection.d_socket.get(), false);
+          }
+
+          if(ret > 0) {
+            if(len > bufsize) {
+              bufsize=len;
+              scoped_array<unsigned char> narray(new unsigned char[bufsize]);
+              buf.swap(narray);
+            }
+            memcpy(buf.get(), packet.c_str(), len);
+          }
+        }
+
+        if(ret == -1 && reused) {
+          // the remote end might have closed the connection while we were sending, try again over a new one
+          continue;
+        }
+        if(!(ret > 0))
+          return ret;
+
+        connection.d_queries++;
+        t_tcpOutConnections.store(ip, std::move(connection), now->tv_sec);
+        break;
       }
-      memcpy(buf.get(), packet.c_str(), len);
 
       ret=1;
     }
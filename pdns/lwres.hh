@@ -42,6 +42,7 @@
 #include "namespaces.hh"
 #include "remote_logger.hh"
 #include "resolve-context.hh"
+#include "rec-tcpout.hh"
 
 int asendto(const char *data, size_t len, int flags, const ComboAddress& ip, uint16_t id,
             const DNSName& domain, uint16_t qtype,  int* fd);
@@ -68,4 +69,5 @@ public:
 };
 
 int asyncresolve(const ComboAddress& ip, const DNSName& domain, int type, bool doTCP, bool sendRDQuery, int EDNS0Level, struct timeval* now, boost::optional<Netmask>& srcmask, boost::optional<const ResolveContext&> context, std::shared_ptr<RemoteLogger> outgoingLogger, LWResult* res);
+
 #endif // PDNS_LWRES_HH
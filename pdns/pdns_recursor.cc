@@ -85,13 +85,19 @@
 #include "ednsoptions.hh"
 #include "gettime.hh"
 
+#include "protobuf-encoder.hh"
 #include "rec-protobuf.hh"
 #include "rec-snmp.hh"
+#include "spsc-ring.hh"
 
 #ifdef HAVE_SYSTEMD
 #include <systemd/sd-daemon.h>
 #endif
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 #include "namespaces.hh"
 
 #include "xpf.hh"
@@ -104,7 +110,7 @@ static thread_local std::shared_ptr<Regex> t_traceRegex;
 static thread_local std::unique_ptr<tcpClientCounts_t> t_tcpClientCounts;
 
 thread_local std::unique_ptr<MT_t> MT; // the big MTasker
-thread_local std::unique_ptr<MemRecursorCache> t_RC;
+std::unique_ptr<MemRecursorCache> g_recCache;
 thread_local std::unique_ptr<RecursorPacketCache> t_packetCache;
 thread_local FDMultiplexer* t_fdm{nullptr};
 thread_local std::unique_ptr<addrringbuf_t> t_remotes, t_servfailremotes, t_largeanswerremotes;
@@ -124,12 +130,33 @@ struct ThreadPipeSet
   int readFromThread;
 };
 
+// a UDP query handed over by the distributor thread, see distributeUDPQuestion()
+struct DistributedUDPQuery
+{
+  ComboAddress source;
+  ComboAddress destination;
+  struct timeval tv;
+  int fd;
+  uint16_t len;
+  char data[1500];
+};
+
+// queries waiting to be processed by a worker thread, with the file descriptors used to wake it up
+struct ThreadQueryQueue
+{
+  std::vector<std::unique_ptr<SPSCRing<DistributedUDPQuery> > > rings; // one per distributor thread
+  int readNotify{-1};
+  int writeNotify{-1};
+};
+
 typedef vector<int> tcpListenSockets_t;
 typedef map<int, ComboAddress> listenSocketsAddresses_t; // is shared across all threads right now
 typedef vector<pair<int, function< void(int, any&) > > > deferredAdd_t;
 
 static const ComboAddress g_local4("0.0.0.0"), g_local6("::");
 static vector<ThreadPipeSet> g_pipes; // effectively readonly after startup
+static vector<ThreadQueryQueue> g_queryQueues; // one per thread, only set for the workers if we distribute queries
+static thread_local std::unique_ptr<vector<bool> > t_queryQueuesToNotify; // distributor side, workers that received queries since we last woke them up
 static tcpListenSockets_t g_tcpListenSockets;   // shared across threads, but this is fine, never written to from a thread. All threads listen on all sockets
 static listenSocketsAddresses_t g_listenSocketsAddresses; // is shared across all threads right now
 static std::unordered_map<unsigned int, deferredAdd_t> deferredAdds;
@@ -146,6 +173,7 @@ static unsigned int g_maxTCPPerClient;
 static unsigned int g_networkTimeoutMsec;
 static unsigned int g_maxMThreads;
 static unsigned int g_numWorkerThreads;
+static unsigned int g_numDistributorThreads; // 0 unless we distribute queries, in which case threads 0 to g_numDistributorThreads-1 are distributors
 static int g_tcpTimeout;
 static uint16_t g_udpTruncationThreshold;
 static uint16_t g_xpfRRCode{0};
@@ -153,7 +181,7 @@ static std::atomic<bool> statsWanted;
 static std::atomic<bool> g_quiet;
 static bool g_logCommonErrors;
 static bool g_anyToTcp;
-static bool g_weDistributeQueries; // if true, only 1 thread listens on the incoming query sockets
+static bool g_weDistributeQueries; // if true, only the distributor threads listen on the incoming query sockets
 static bool g_reusePort{false};
 static bool g_useOneSocketPerThread;
 static bool g_gettagNeedsEDNSOptions{false};
@@ -268,6 +296,11 @@ unsigned int getRecursorThreadId()
   return t_id;
 }
 
+static bool isDistributorThread()
+{
+  return t_id < g_numDistributorThreads;
+}
+
 int getMTaskerTID()
 {
   return MT->getTid();
@@ -691,27 +724,39 @@ static void protobufLogQuery(const std::shared_ptr<RemoteLogger>& logger, uint8_
 {
   Netmask requestorNM(remote, remote.sin4.sin_family == AF_INET ? maskV4 : maskV6);
   const ComboAddress& requestor = requestorNM.getMaskedNetwork();
-  RecProtoBufMessage message(DNSProtoBufMessage::Query, uniqueId, &requestor, &local, qname, qtype, qclass, id, tcp, len);
-  message.setEDNSSubnet(ednssubnet, ednssubnet.isIpv4() ? maskV4 : maskV6);
-  message.setRequestorId(requestorId);
-  message.setDeviceId(deviceId);
-
+  struct timespec ts;
+  gettime(&ts, true);
+
+  /* same content as a RecProtoBufMessage, but encoded directly, in field number order */
+  static thread_local std::string t_buffer;
+  t_buffer.clear();
+  PBDNSMessageEncoder encoder(t_buffer);
+  encoder.setType(PBDNSMessageEncoder::MessageType::Query);
+  encoder.setMessageId(uniqueId);
+  encoder.setSocketFamily(requestor);
+  encoder.setSocketProtocol(tcp);
+  encoder.setRequestor(requestor);
+  encoder.setResponder(local);
+  encoder.setBytes(len);
+  encoder.setTime(ts.tv_sec, ts.tv_nsec / 1000);
+  encoder.setId(ntohs(id));
+  encoder.setQuestion(qname, qtype, qclass);
   if (!policyTags.empty()) {
-    message.setPolicyTags(policyTags);
+    encoder.startResponse();
+    encoder.addTags(policyTags);
+    encoder.endResponse();
   }
+  encoder.setEDNSSubnet(ednssubnet, ednssubnet.isIpv4() ? maskV4 : maskV6);
+  encoder.setRequestorId(requestorId);
+  encoder.setDeviceId(deviceId);
 
-//  cerr <<message.toDebugString()<<endl;
-  std::string str;
-  message.serialize(str);
-  logger->queueData(str);
+  logger->queueData(t_buffer);
 }
 
 static void protobufLogResponse(const std::shared_ptr<RemoteLogger>& logger, const RecProtoBufMessage& message)
 {
 //  cerr <<message.toDebugString()<<endl;
-  std::string str;
-  message.serialize(str);
-  logger->queueData(str);
+  logger->queueMessage(message);
 }
 #endif
 
@@ -761,6 +806,92 @@ static bool addRecordToPacket(DNSPacketWriter& pw, const DNSRecord& rec, uint32_
   return true;
 }
 
+/* Client queries being resolved on this thread, keyed on (qname, qtype, outgoing ECS network).
+   An identical query arriving in the meantime waits for the first resolution to be done, then
+   finds its answer in the cache instead of walking the delegation chain in parallel. */
+struct InFlightKey
+{
+  DNSName qname;
+  Netmask ecs;
+  uint16_t qtype;
+
+  bool operator<(const InFlightKey& rhs) const
+  {
+    return tie(qtype, qname, ecs) < tie(rhs.qtype, rhs.qname, rhs.ecs);
+  }
+};
+
+typedef std::map<InFlightKey, std::vector<PacketID> > inflight_t;
+static thread_local std::unique_ptr<inflight_t> t_inFlight;
+// waiters of the resolutions that are done, to be woken up from the main loop since MTasker::sendEvent() can't be called from a MThread
+static thread_local std::unique_ptr<std::vector<PacketID> > t_inFlightToWake;
+
+class InFlightResolution
+{
+public:
+  InFlightResolution(const DNSName& qname, uint16_t qtype, const boost::optional<Netmask>& ecs)
+  {
+    if(!t_inFlight) {
+      t_inFlight = std::unique_ptr<inflight_t>(new inflight_t());
+      t_inFlightToWake = std::unique_ptr<std::vector<PacketID> >(new std::vector<PacketID>());
+    }
+
+    InFlightKey key{qname, ecs ? *ecs : Netmask(), qtype};
+    auto it = t_inFlight->find(key);
+    if(it == t_inFlight->end()) {
+      d_entry = t_inFlight->insert(make_pair(std::move(key), std::vector<PacketID>())).first;
+      d_leader = true;
+      return;
+    }
+
+    static thread_local uint16_t s_waiterId;
+    PacketID pident;
+    pident.domain = qname;
+    pident.type = qtype;
+    pident.fd = -2; // never a real socket, nor a chained query
+    pident.id = s_waiterId++;
+    it->second.push_back(pident);
+    g_stats.coalescedQueries++;
+
+    // if the first resolution takes too long, we go on with our own
+    if(MT->waitEvent(pident, nullptr, g_networkTimeoutMsec) == 0) {
+      g_stats.coalescedTimeouts++;
+    }
+  }
+
+  ~InFlightResolution()
+  {
+    if(!d_leader)
+      return;
+
+    auto& waiters = d_entry->second;
+    t_inFlightToWake->insert(t_inFlightToWake->end(), waiters.begin(), waiters.end());
+    t_inFlight->erase(d_entry);
+  }
+
+  InFlightResolution(const InFlightResolution&) = delete;
+  InFlightResolution& operator=(const InFlightResolution&) = delete;
+
+private:
+  inflight_t::iterator d_entry;
+  bool d_leader{false};
+};
+
+// returns true if at least one waiter has been woken up
+static bool wakeInFlightWaiters()
+{
+  if(!t_inFlightToWake || t_inFlightToWake->empty())
+    return false;
+
+  std::vector<PacketID> toWake;
+  toWake.swap(*t_inFlightToWake);
+  string empty;
+  for(const auto& pident : toWake) {
+    MT->sendEvent(pident, &empty);
+  }
+  return true;
+}
+
 static void startDoResolve(void *p)
 {
   DNSComboWriter* dc=(DNSComboWriter *)p;
@@ -947,7 +1078,13 @@ static void startDoResolve(void *p)
 
       // Query got not handled for QNAME Policy reasons, now actually go out to find an answer
       try {
-        res = sr.beginResolve(dc->d_mdp.d_qname, QType(dc->d_mdp.d_qtype), dc->d_mdp.d_qclass, ret);
+        if(dc->d_mdp.d_header.rd) {
+          InFlightResolution inFlight(dc->d_mdp.d_qname, dc->d_mdp.d_qtype, sr.getOutgoingECSNetwork());
+          res = sr.beginResolve(dc->d_mdp.d_qname, QType(dc->d_mdp.d_qtype), dc->d_mdp.d_qclass, ret);
+        }
+        else {
+          res = sr.beginResolve(dc->d_mdp.d_qname, QType(dc->d_mdp.d_qtype), dc->d_mdp.d_qclass, ret);
+        }
         shouldNotValidate = sr.wasOutOfBand();
       }
       catch(ImmediateServFailException &e) {
@@ -1289,10 +1426,10 @@ static void startDoResolve(void *p)
     }
 
     if (sr.d_outqueries || sr.d_authzonequeries) {
-      t_RC->cacheMisses++;
+      g_recCache->cacheMisses++;
     }
     else {
-      t_RC->cacheHits++;
+      g_recCache->cacheHits++;
     }
 
     if(spent < 0.001)
@@ -1868,6 +2005,107 @@ static string* doProcessUDPQuestion(const std::string& question, const ComboAddr
 }
 
 
+static void notifyQueryQueue(unsigned int target)
+{
+#ifdef __linux__
+  uint64_t value = 1;
+#else
+  char value = 0;
+#endif
+  // EAGAIN on the fallback pipe means the worker has not seen the previous notification yet, which is fine
+  if(write(g_queryQueues[target].writeNotify, &value, sizeof(value)) != sizeof(value) && errno != EAGAIN)
+    unixDie("write to thread notification fd returned wrong size or error");
+}
+
+// wakes up the workers we handed queries to, once per batch of queries read from a socket instead of once per query
+static void notifyQueryQueues()
+{
+  if(!t_queryQueuesToNotify)
+    return;
+
+  auto& toNotify = *t_queryQueuesToNotify;
+  for(unsigned int target = 0; target < toNotify.size(); ++target) {
+    if(toNotify[target]) {
+      notifyQueryQueue(target);
+      toNotify[target] = false;
+    }
+  }
+}
+
+static void distributeUDPQuestion(const char* data, size_t len, const ComboAddress& source, const ComboAddress& destination, const struct timeval& tv, int fd)
+{
+  // every distributor sends a given question to the same worker, so that it stays in that worker's caches
+  unsigned int hash = hashQuestion(data, len, g_disthashseed);
+  unsigned int target = g_numDistributorThreads + (hash % g_numWorkerThreads);
+
+  auto& ring = *g_queryQueues[target].rings[t_id];
+  DistributedUDPQuery* query = ring.getWriteSlot();
+  if(query == nullptr) {
+    // the worker is lagging behind, make sure it is awake but don't wait for it
+    notifyQueryQueue(target);
+    g_stats.distributionQueueDrops++;
+    return;
+  }
+
+  query->source = source;
+  query->destination = destination;
+  query->tv = tv;
+  query->fd = fd;
+  query->len = len;
+  memcpy(query->data, data, len);
+  ring.commit();
+
+  if(!t_queryQueuesToNotify)
+    t_queryQueuesToNotify = std::unique_ptr<vector<bool> >(new vector<bool>(g_queryQueues.size(), false));
+  (*t_queryQueuesToNotify)[target] = true;
+}
+
+static void handleDistributedQueries(int fd, FDMultiplexer::funcparam_t& var)
+{
+#ifdef __linux__
+  uint64_t value;
+  if(read(fd, &value, sizeof(value)) != sizeof(value) && errno != EAGAIN)
+    unixDie("read from thread notification fd returned wrong size or error");
+#else
+  char value[64];
+  ssize_t got;
+  while((got = read(fd, value, sizeof(value))) == sizeof(value))
+    ;
+  if(got < 0 && errno != EAGAIN)
+    unixDie("read from thread notification fd returned error");
+#endif
+
+  // don't starve our other file descriptors if the distributors keep filling the rings
+  bool remaining = false;
+  for(auto& ringPtr : g_queryQueues[t_id].rings) {
+    auto& ring = *ringPtr;
+    size_t processed = 0;
+    DistributedUDPQuery* query;
+    while(processed < ring.capacity() && (query = ring.getReadSlot()) != nullptr) {
+      processed++;
+      try {
+        string question(query->data, query->len);
+        doProcessUDPQuestion(question, query->source, query->destination, query->tv, query->fd);
+      }
+      catch(std::exception& e) {
+        if(g_logCommonErrors)
+          L<<Logger::Error<<"Processing a distributed query created exception: "<<e.what()<<endl;
+      }
+      catch(PDNSException& e) {
+        if(g_logCommonErrors)
+          L<<Logger::Error<<"Processing a distributed query created PDNS exception: "<<e.reason<<endl;
+      }
+      ring.release();
+    }
+
+    if(processed == ring.capacity() && ring.getReadSlot() != nullptr)
+      remaining = true;
+  }
+
+  if(remaining)
+    notifyQueryQueue(t_id);
+}
+
 static void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
 {
   ssize_t len;
@@ -1894,7 +2132,7 @@ static void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
         L<<Logger::Error<<"["<<MT->getTid()<<"] dropping UDP query from "<<fromaddr.toString()<<", address not matched by allow-from"<<endl;
 
       g_stats.unauthorizedUDP++;
-      return;
+      break;
     }
     BOOST_STATIC_ASSERT(offsetof(sockaddr_in, sin_port) == offsetof(sockaddr_in6, sin6_port));
     if(!fromaddr.sin4.sin_port) { // also works for IPv6
@@ -1902,7 +2140,7 @@ static void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
         L<<Logger::Error<<"["<<MT->getTid()<<"] dropping UDP query from "<<fromaddr.toStringWithPort()<<", can't deal with port 0"<<endl;
 
       g_stats.clientParseError++; // not quite the best place to put it, but needs to go somewhere
-      return;
+      break;
     }
     try {
       dnsheader* dh=(dnsheader*)data;
@@ -1918,7 +2156,6 @@ static void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
           L<<Logger::Error<<"Ignoring non-query opcode "<<dh->opcode<<" from "<<fromaddr.toString()<<" on server socket!"<<endl;
       }
       else {
-        string question(data, (size_t)len);
 	struct timeval tv={0,0};
 	HarvestTimestamp(&msgh, &tv);
 	ComboAddress dest;
@@ -1939,10 +2176,13 @@ static void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
             getsockname(fd, (sockaddr*)&dest, &slen); // if this fails, we're ok with it
           }
         }
-        if(g_weDistributeQueries)
-          distributeAsyncFunction(question, boost::bind(doProcessUDPQuestion, question, fromaddr, dest, tv, fd));
-        else
+        if(g_weDistributeQueries) {
+          distributeUDPQuestion(data, (size_t)len, fromaddr, dest, tv, fd);
+        }
+        else {
+          string question(data, (size_t)len);
           doProcessUDPQuestion(question, fromaddr, dest, tv, fd);
+        }
       }
     }
     catch(MOADNSException& mde) {
@@ -1963,6 +2203,9 @@ static void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
 
     break;
   }
+
+  if(g_weDistributeQueries)
+    notifyQueryQueues();
 }
 
 static void makeTCPServerSockets(unsigned int threadId)
@@ -2160,12 +2403,12 @@ static void doStats(void)
   static time_t lastOutputTime;
   static uint64_t lastQueryCount;
 
-  uint64_t cacheHits = broadcastAccFunction<uint64_t>(pleaseGetCacheHits);
-  uint64_t cacheMisses = broadcastAccFunction<uint64_t>(pleaseGetCacheMisses);
+  uint64_t cacheHits = g_recCache->cacheHits;
+  uint64_t cacheMisses = g_recCache->cacheMisses;
 
   if(g_stats.qcounter && (cacheHits + cacheMisses) && SyncRes::s_queries && SyncRes::s_outqueries) {
     L<<Logger::Notice<<"stats: "<<g_stats.qcounter<<" questions, "<<
-      broadcastAccFunction<uint64_t>(pleaseGetCacheSize)<< " cache entries, "<<
+      g_recCache->size()<< " cache entries, "<<
       broadcastAccFunction<uint64_t>(pleaseGetNegCacheSize)<<" negative entries, "<<
       (int)((cacheHits*100.0)/(cacheHits+cacheMisses))<<"% cache hits"<<endl;
 
@@ -2199,7 +2442,8 @@ static void doStats(void)
 
 static void houseKeeping(void *)
 {
-  static thread_local time_t last_stat, last_rootupdate, last_prune, last_secpoll;
+  static thread_local time_t last_stat, last_prune, last_secpoll;
+  static time_t last_RC_prune, last_rootupdate;
   static thread_local int cleanCounter=0;
   static thread_local bool s_running;  // houseKeeping can get suspended in secpoll, and be restarted, which makes us do duplicate work
   try {
@@ -2213,11 +2457,12 @@ static void houseKeeping(void *)
     if(now.tv_sec - last_prune > (time_t)(5 + t_id)) {
       DTime dt;
       dt.setTimeval(now);
-      t_RC->doPrune(g_maxCacheEntries / g_numThreads); // this function is local to a thread, so fine anyhow
       t_packetCache->doPruneTo(g_maxPacketCacheEntries / g_numWorkerThreads);
 
       SyncRes::pruneNegCache(g_maxCacheEntries / (g_numWorkerThreads * 10));
 
+      t_tcpOutConnections.cleanup(now.tv_sec);
+
       if(!((cleanCounter++)%40)) {  // this is a full scan!
 	time_t limit=now.tv_sec-300;
         SyncRes::pruneNSSpeeds(limit);
@@ -2225,13 +2470,20 @@ static void houseKeeping(void *)
       last_prune=time(0);
     }
 
-    if(now.tv_sec - last_rootupdate > 7200) {
-      int res = SyncRes::getRootNS(g_now, nullptr);
-      if (!res)
-        last_rootupdate=now.tv_sec;
-    }
-
     if(!t_id) {
+      // the record cache is shared by all threads, only one of them needs to prune it
+      if(now.tv_sec - last_RC_prune > 5) {
+        g_recCache->doPrune(g_maxCacheEntries);
+        last_RC_prune = now.tv_sec;
+      }
+
+      // same for the root NS, which are stored in that cache
+      if(now.tv_sec - last_rootupdate > 7200) {
+        int res = SyncRes::getRootNS(g_now, nullptr);
+        if (!res)
+          last_rootupdate=now.tv_sec;
+      }
+
       if(g_statisticsInterval > 0 && now.tv_sec - last_stat >= g_statisticsInterval) {
 	doStats();
 	last_stat=time(0);
@@ -2290,6 +2542,37 @@ static void makeThreadPipes()
   }
 }
 
+static void makeThreadQueryQueues()
+{
+  g_queryQueues.resize(g_numThreads);
+  if(!g_weDistributeQueries)
+    return;
+
+  const size_t queueSize = ::arg().asNum("distribution-queue-size");
+  // the distributors don't get queries handed over, each worker gets one ring per distributor
+  for(unsigned int n=g_numDistributorThreads; n < g_numThreads; ++n) {
+    auto& queue = g_queryQueues[n];
+    for(unsigned int distributor = 0; distributor < g_numDistributorThreads; ++distributor) {
+      queue.rings.push_back(std::unique_ptr<SPSCRing<DistributedUDPQuery> >(new SPSCRing<DistributedUDPQuery>(queueSize)));
+    }
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(fd < 0)
+      unixDie("Creating eventfd for inter-thread communications");
+    queue.readNotify = fd;
+    queue.writeNotify = fd;
+#else
+    int fd[2];
+    if(pipe(fd) < 0)
+      unixDie("Creating pipe for inter-thread communications");
+    setNonBlocking(fd[0]);
+    setNonBlocking(fd[1]);
+    queue.readNotify = fd[0];
+    queue.writeNotify = fd[1];
+#endif
+  }
+}
+
 struct ThreadMSG
 {
   pipefunc_t func;
@@ -2326,26 +2609,6 @@ void broadcastFunction(const pipefunc_t& func, bool skipSelf)
   }
 }
 
-void distributeAsyncFunction(const string& packet, const pipefunc_t& func)
-{
-  unsigned int hash = hashQuestion(packet.c_str(), packet.length(), g_disthashseed);
-  unsigned int target = 1 + (hash % (g_pipes.size()-1));
-
-  if(target == t_id) {
-    func();
-    return;
-  }
-  ThreadPipeSet& tps = g_pipes[target];
-  ThreadMSG* tmsg = new ThreadMSG();
-  tmsg->func = func;
-  tmsg->wantAnswer = false;
-
-  if(write(tps.writeToThread, &tmsg, sizeof(tmsg)) != sizeof(tmsg)) {
-    delete tmsg;
-    unixDie("write to thread pipe returned wrong size or error");
-  }
-}
-
 static void handlePipeRequest(int fd, FDMultiplexer::funcparam_t& var)
 {
   ThreadMSG* tmsg = nullptr;
@@ -3005,7 +3268,12 @@ static int serviceMain(int argc, char*argv[])
 
   g_weDistributeQueries = ::arg().mustDo("pdns-distributes-queries");
   if(g_weDistributeQueries) {
-      L<<Logger::Warning<<"PowerDNS Recursor itself will distribute queries over threads"<<endl;
+      g_numDistributorThreads = ::arg().asNum("distributor-threads");
+      if (g_numDistributorThreads < 1) {
+        L<<Logger::Warning<<"Asked to run with 0 distributor threads, raising to 1 instead"<<endl;
+        g_numDistributorThreads = 1;
+      }
+      L<<Logger::Warning<<"PowerDNS Recursor itself will distribute queries over threads, using "<<g_numDistributorThreads<<" distributor thread(s)"<<endl;
   }
 
   setupDelegationOnly();
@@ -3083,6 +3351,11 @@ static int serviceMain(int argc, char*argv[])
 
   g_networkTimeoutMsec = ::arg().asNum("network-timeout");
 
+  TCPOutConnectionManager::s_maxIdleTime = ::arg().asNum("tcp-out-max-idle-time");
+  TCPOutConnectionManager::s_maxIdlePerAuth = ::arg().asNum("tcp-out-max-idle-per-auth");
+  TCPOutConnectionManager::s_maxIdlePerThread = ::arg().asNum("tcp-out-max-idle-per-thread");
+  TCPOutConnectionManager::s_maxQueries = ::arg().asNum("tcp-out-max-queries");
+
   g_initialDomainMap = parseAuthAndForwards();
 
   g_latencyStatSize=::arg().asNum("latency-statistic-size");
@@ -3101,7 +3374,8 @@ static int serviceMain(int argc, char*argv[])
     g_numWorkerThreads = 1;
   }
 
-  g_numThreads = g_numWorkerThreads + g_weDistributeQueries;
+  g_numThreads = g_numWorkerThreads + g_numDistributorThreads;
+  g_recCache = std::unique_ptr<MemRecursorCache>(new MemRecursorCache(::arg().asNum("record-cache-shards")));
   g_maxMThreads = ::arg().asNum("max-mthreads");
 
   g_gettagNeedsEDNSOptions = ::arg().mustDo("gettag-needs-edns-options");
@@ -3112,10 +3386,12 @@ static int serviceMain(int argc, char*argv[])
   g_reusePort = ::arg().mustDo("reuseport");
 #endif
 
-  g_useOneSocketPerThread = (!g_weDistributeQueries && g_reusePort);
+  // with SO_REUSEPORT, every thread reading from the incoming query sockets gets its own, and the kernel balances the queries between them
+  g_useOneSocketPerThread = g_reusePort;
 
   if (g_useOneSocketPerThread) {
-    for (unsigned int threadId = 0; threadId < g_numWorkerThreads; threadId++) {
+    const unsigned int listeningThreads = g_weDistributeQueries ? g_numDistributorThreads : g_numWorkerThreads;
+    for (unsigned int threadId = 0; threadId < listeningThreads; threadId++) {
       makeUDPServerSockets(threadId);
       makeTCPServerSockets(threadId);
     }
@@ -3189,6 +3465,7 @@ static int serviceMain(int argc, char*argv[])
   Utility::dropUserPrivs(newuid);
 
   makeThreadPipes();
+  makeThreadQueryQueues();
 
   g_tcpTimeout=::arg().asNum("client-tcp-timeout");
   g_maxTCPPerClient=::arg().asNum("max-tcp-per-client");
@@ -3199,6 +3476,10 @@ static int serviceMain(int argc, char*argv[])
     g_snmpAgent->run();
   }
 
+  // the record cache is shared by all threads, so we only need to prime it once
+  primeHints();
+  L<<Logger::Warning<<"Done priming cache with root hints"<<endl;
+
   const auto cpusMap = parseCPUMap();
   if(g_numThreads == 1) {
     L<<Logger::Warning<<"Operating unthreaded"<<endl;
@@ -3229,19 +3510,17 @@ static void* recursorThread(void* ptr)
 try
 {
   t_id=(int) (long) ptr;
-  SyncRes tmp(g_now); // make sure it allocates tsstorage before we do anything, like primeHints or so..
+  SyncRes tmp(g_now); // make sure it allocates tsstorage before we do anything
   SyncRes::setDomainMap(g_initialDomainMap);
   t_allowFrom = g_initialAllowFrom;
   t_udpclientsocks = std::unique_ptr<UDPClientSocks>(new UDPClientSocks());
   t_tcpClientCounts = std::unique_ptr<tcpClientCounts_t>(new tcpClientCounts_t());
-  primeHints();
 
   t_packetCache = std::unique_ptr<RecursorPacketCache>(new RecursorPacketCache());
 
 #ifdef HAVE_PROTOBUF
   t_uuidGenerator = std::unique_ptr<boost::uuids::random_generator>(new boost::uuids::random_generator());
 #endif
-  L<<Logger::Warning<<"Done priming cache with root hints"<<endl;
 
   try {
     if(!::arg()["lua-dns-script"].empty()) {
@@ -3258,8 +3537,8 @@ try
   unsigned int ringsize=::arg().asNum("stats-ringbuffer-entries") / g_numWorkerThreads;
   if(ringsize) {
     t_remotes = std::unique_ptr<addrringbuf_t>(new addrringbuf_t());
-    if(g_weDistributeQueries)  // if so, only 1 thread does recvfrom
-      t_remotes->set_capacity(::arg().asNum("stats-ringbuffer-entries"));
+    if(g_weDistributeQueries)  // if so, only the distributor threads do recvfrom
+      t_remotes->set_capacity(::arg().asNum("stats-ringbuffer-entries") / g_numDistributorThreads);
     else
       t_remotes->set_capacity(ringsize);
     t_servfailremotes = std::unique_ptr<addrringbuf_t>(new addrringbuf_t());
@@ -3293,14 +3572,19 @@ try
   }
 
   t_fdm->addReadFD(g_pipes[t_id].readToThread, handlePipeRequest);
+  if(g_weDistributeQueries && !isDistributorThread()) {
+    t_fdm->addReadFD(g_queryQueues[t_id].readNotify, handleDistributedQueries);
+  }
 
   if(g_useOneSocketPerThread) {
-    for(deferredAdd_t::const_iterator i = deferredAdds[t_id].cbegin(); i != deferredAdds[t_id].cend(); ++i) {
-      t_fdm->addReadFD(i->first, i->second);
+    if(!g_weDistributeQueries || isDistributorThread()) { // if we distribute queries, only the distributors listen
+      for(deferredAdd_t::const_iterator i = deferredAdds[t_id].cbegin(); i != deferredAdds[t_id].cend(); ++i) {
+        t_fdm->addReadFD(i->first, i->second);
+      }
     }
   }
   else {
-    if(!g_weDistributeQueries || !t_id) { // if we distribute queries, only t_id = 0 listens
+    if(!g_weDistributeQueries || isDistributorThread()) { // if we distribute queries, only the distributors listen
       for(deferredAdd_t::const_iterator i = deferredAdds[0].cbegin(); i != deferredAdds[0].cend(); ++i) {
         t_fdm->addReadFD(i->first, i->second);
       }
@@ -3320,7 +3604,10 @@ try
   time_t carbonInterval=::arg().asNum("carbon-interval");
   counter.store(0); // used to periodically execute certain tasks
   for(;;) {
-    while(MT->schedule(&g_now)); // MTasker letting the mthreads do their thing
+    do {
+      while(MT->schedule(&g_now)); // MTasker letting the mthreads do their thing
+    }
+    while(wakeInFlightWaiters());
 
     if(!(counter%500)) {
       MT->makeThread(houseKeeping, 0);
@@ -3354,7 +3641,7 @@ try
     t_fdm->run(&g_now);
     // 'run' updates g_now for us
 
-    if(!g_weDistributeQueries || !t_id) { // if pdns distributes queries, only tid 0 should do this
+    if(!g_weDistributeQueries || isDistributorThread()) { // if pdns distributes queries, only the distributors should do this
       if(listenOnTCP) {
 	if(TCPConnection::getCurrentConnections() > maxTcpClients) {  // shutdown, too many connections
 	  for(tcpListenSockets_t::iterator i=g_tcpListenSockets.begin(); i != g_tcpListenSockets.end(); ++i)
@@ -3417,6 +3704,10 @@ int main(int argc, char **argv)
     ::arg().set("setgid","If set, change group id to this gid for more security")="";
     ::arg().set("setuid","If set, change user id to this uid for more security")="";
     ::arg().set("network-timeout", "Wait this number of milliseconds for network i/o")="1500";
+    ::arg().set("tcp-out-max-idle-time", "Close outgoing TCP connections that have been idle for this number of seconds")="10";
+    ::arg().set("tcp-out-max-idle-per-auth", "Maximum number of idle outgoing TCP connections kept per remote server and per thread, 0 to disable reuse")="10";
+    ::arg().set("tcp-out-max-idle-per-thread", "Maximum number of idle outgoing TCP connections kept per thread")="100";
+    ::arg().set("tcp-out-max-queries", "Maximum number of queries sent over an outgoing TCP connection, 0 for unlimited")="0";
     ::arg().set("threads", "Launch this number of threads")="2";
     ::arg().set("processes", "Launch this number of processes (EXPERIMENTAL, DO NOT CHANGE)")="1"; // if we un-experimental this, need to fix openssl rand seeding for multiple PIDs!
     ::arg().set("config-name","Name of this virtual configuration - will rename the binary image")="";
@@ -3451,6 +3742,7 @@ int main(int argc, char **argv)
     ::arg().set("server-down-throttle-time","Number of seconds to throttle all queries to a server after being marked as down")="60";
     ::arg().set("hint-file", "If set, load root hints from this file")="";
     ::arg().set("max-cache-entries", "If set, maximum number of entries in the main cache")="1000000";
+    ::arg().set("record-cache-shards", "Number of shards in the record cache, each with its own lock")="1024";
     ::arg().set("max-negative-ttl", "maximum number of seconds to keep a negative cached entry in memory")="3600";
     ::arg().set("max-cache-ttl", "maximum number of seconds to keep a cached entry in memory")="86400";
     ::arg().set("packetcache-ttl", "maximum number of seconds to keep a cached entry in packetcache")="3600";
@@ -3487,6 +3779,8 @@ int main(int argc, char **argv)
     ::arg().set("ecs-scope-zero-address", "Address to send to whitelisted authoritative servers for incoming queries with ECS prefix-length source of 0")="";
     ::arg().setSwitch( "use-incoming-edns-subnet", "Pass along received EDNS Client Subnet information")="no";
     ::arg().setSwitch( "pdns-distributes-queries", "If PowerDNS itself should distribute queries over threads")="yes";
+    ::arg().set("distributor-threads", "Launch this number of distributor threads, distributing queries to other threads")="1";
+    ::arg().set("distribution-queue-size", "Maximum number of queries waiting to be processed in each queue from a distributor thread to a worker thread")="1024";
     ::arg().setSwitch( "root-nx-trust", "If set, believe that an NXDOMAIN from the root means the TLD does not exist")="yes";
     ::arg().setSwitch( "any-to-tcp","Answer ANY queries with tc=1, shunting to TCP" )="no";
     ::arg().setSwitch( "lowercase-outgoing","Force outgoing questions to lowercase")="no";
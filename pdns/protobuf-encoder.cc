@@ -0,0 +1,317 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include "protobuf-encoder.hh"
+#include "dns.hh"
+#include "qtype.hh"
+
+/* field numbers from dnsmessage.proto */
+enum PBDNSMessageField : uint8_t { PBType = 1, PBMessageId = 2, PBSocketFamily = 4, PBSocketProtocol = 5, PBFrom = 6, PBTo = 7, PBInBytes = 8, PBTimeSec = 9, PBTimeUsec = 10, PBId = 11, PBQuestion = 12, PBResponse = 13, PBOriginalRequestorSubnet = 14, PBRequestorId = 15, PBInitialRequestId = 16, PBDeviceId = 17 };
+enum PBDNSQuestionField : uint8_t { PBQName = 1, PBQType = 2, PBQClass = 3 };
+enum PBDNSResponseField : uint8_t { PBRcode = 1, PBRRs = 2, PBTags = 4, PBQueryTimeSec = 5, PBQueryTimeUsec = 6 };
+enum PBDNSRRField : uint8_t { PBRRName = 1, PBRRType = 2, PBRRClass = 3, PBRRTTL = 4, PBRRData = 5 };
+/* same values as PBDNSMessage::SocketFamily and PBDNSMessage::SocketProtocol */
+enum PBSocketValue : uint8_t { PBInet = 1, PBInet6 = 2, PBUDP = 1, PBTCP = 2 };
+
+static size_t encodeVarint(uint64_t value, char* out)
+{
+  size_t pos = 0;
+  while (value >= 0x80) {
+    out[pos++] = static_cast<char>((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out[pos++] = static_cast<char>(value);
+  return pos;
+}
+
+void PBDNSMessageEncoder::addVarint(uint64_t value)
+{
+  char buffer[10];
+  d_buffer.append(buffer, encodeVarint(value, buffer));
+}
+
+void PBDNSMessageEncoder::addTag(uint8_t field, WireType type)
+{
+  addVarint((static_cast<uint32_t>(field) << 3) | static_cast<uint8_t>(type));
+}
+
+void PBDNSMessageEncoder::addVarintField(uint8_t field, uint64_t value)
+{
+  addTag(field, WireType::Varint);
+  addVarint(value);
+}
+
+void PBDNSMessageEncoder::addBytesField(uint8_t field, const char* data, size_t len)
+{
+  addTag(field, WireType::LengthDelimited);
+  addVarint(len);
+  d_buffer.append(data, len);
+}
+
+void PBDNSMessageEncoder::addAddressField(uint8_t field, const ComboAddress& address)
+{
+  if (address.sin4.sin_family == AF_INET) {
+    addBytesField(field, reinterpret_cast<const char*>(&address.sin4.sin_addr.s_addr), sizeof(address.sin4.sin_addr.s_addr));
+  }
+  else if (address.sin4.sin_family == AF_INET6) {
+    addBytesField(field, reinterpret_cast<const char*>(&address.sin6.sin6_addr.s6_addr), sizeof(address.sin6.sin6_addr.s6_addr));
+  }
+}
+
+size_t PBDNSMessageEncoder::startMessage(uint8_t field)
+{
+  addTag(field, WireType::LengthDelimited);
+  /* we don't know the size yet, reserve one byte which is enough for most sub-messages */
+  const size_t pos = d_buffer.size();
+  d_buffer.push_back(0);
+  return pos;
+}
+
+void PBDNSMessageEncoder::endMessage(size_t pos)
+{
+  const size_t len = d_buffer.size() - pos - 1;
+  if (len < 0x80) {
+    d_buffer.at(pos) = static_cast<char>(len);
+    return;
+  }
+
+  /* the size needs more than one byte, move the content to make room for it
+     since libprotobuf always uses the shortest encoding */
+  char size[10];
+  const size_t sizeLen = encodeVarint(len, size);
+  d_buffer.insert(pos + 1, sizeLen - 1, '\0');
+  d_buffer.replace(pos, sizeLen, size, sizeLen);
+}
+
+void PBDNSMessageEncoder::setType(MessageType type)
+{
+  addVarintField(PBType, static_cast<uint8_t>(type));
+}
+
+void PBDNSMessageEncoder::setMessageId(const boost::uuids::uuid& uuid)
+{
+  addBytesField(PBMessageId, reinterpret_cast<const char*>(uuid.begin()), uuid.size());
+}
+
+void PBDNSMessageEncoder::setSocketFamily(const ComboAddress& address)
+{
+  addVarintField(PBSocketFamily, address.sin4.sin_family == AF_INET ? PBInet : PBInet6);
+}
+
+void PBDNSMessageEncoder::setSocketProtocol(bool isTCP)
+{
+  addVarintField(PBSocketProtocol, isTCP ? PBTCP : PBUDP);
+}
+
+void PBDNSMessageEncoder::setRequestor(const ComboAddress& requestor)
+{
+  addAddressField(PBFrom, requestor);
+}
+
+void PBDNSMessageEncoder::setResponder(const ComboAddress& responder)
+{
+  addAddressField(PBTo, responder);
+}
+
+void PBDNSMessageEncoder::setBytes(uint64_t bytes)
+{
+  addVarintField(PBInBytes, bytes);
+}
+
+void PBDNSMessageEncoder::setTime(uint32_t sec, uint32_t usec)
+{
+  addVarintField(PBTimeSec, sec);
+  addVarintField(PBTimeUsec, usec);
+}
+
+void PBDNSMessageEncoder::setId(uint16_t id)
+{
+  addVarintField(PBId, id);
+}
+
+void PBDNSMessageEncoder::setQuestion(const DNSName& qname, uint16_t qtype, uint16_t qclass)
+{
+  const size_t pos = startMessage(PBQuestion);
+  if (!qname.empty()) {
+    const std::string name = qname.toString();
+    addBytesField(PBQName, name.c_str(), name.size());
+  }
+  addVarintField(PBQType, qtype);
+  addVarintField(PBQClass, qclass);
+  endMessage(pos);
+}
+
+void PBDNSMessageEncoder::startResponse()
+{
+  d_responsePos = startMessage(PBResponse);
+}
+
+void PBDNSMessageEncoder::setResponseCode(uint8_t rcode)
+{
+  addVarintField(PBRcode, rcode);
+}
+
+void PBDNSMessageEncoder::addRR(const std::string& name, uint16_t qtype, uint16_t qclass, uint32_t ttl, const char* rdata, size_t rdataLen)
+{
+  const size_t pos = startMessage(PBRRs);
+  addBytesField(PBRRName, name.c_str(), name.size());
+  addVarintField(PBRRType, qtype);
+  addVarintField(PBRRClass, qclass);
+  addVarintField(PBRRTTL, ttl);
+  addBytesField(PBRRData, rdata, rdataLen);
+  endMessage(pos);
+}
+
+void PBDNSMessageEncoder::addRR(const DNSName& name, uint16_t qtype, uint16_t qclass, uint32_t ttl, const char* rdata, size_t rdataLen)
+{
+  addRR(name.toString(), qtype, qclass, ttl, rdata, rdataLen);
+}
+
+/* returns the position right after the name, or 0 if it goes past the end of the packet */
+static size_t skipName(const char* packet, size_t len, size_t pos)
+{
+  while (pos < len) {
+    const uint8_t labelLen = static_cast<uint8_t>(packet[pos]);
+    if (labelLen == 0) {
+      return pos + 1;
+    }
+    if ((labelLen & 0xc0) == 0xc0) {
+      return pos + 2 <= len ? pos + 2 : 0;
+    }
+    pos += labelLen + 1;
+  }
+  return 0;
+}
+
+void PBDNSMessageEncoder::addRRsFromPacket(const char* packet, size_t len, bool includeCNAME)
+{
+  if (len < sizeof(struct dnsheader)) {
+    return;
+  }
+
+  const struct dnsheader* dh = reinterpret_cast<const struct dnsheader*>(packet);
+  const uint16_t qdcount = ntohs(dh->qdcount);
+  const uint16_t ancount = ntohs(dh->ancount);
+  if (ancount == 0 || qdcount == 0) {
+    return;
+  }
+
+  try {
+    size_t pos = sizeof(struct dnsheader);
+    for (size_t idx = 0; idx < qdcount; idx++) {
+      pos = skipName(packet, len, pos);
+      /* qtype and qclass */
+      if (pos == 0 || pos + 4 > len) {
+        return;
+      }
+      pos += 4;
+    }
+
+    /* the owner names of the answers are usually compression pointers to the same
+       few names, only convert each of them to text once */
+    uint16_t lastPointer = 0;
+    std::string rrname;
+    for (size_t idx = 0; idx < ancount; idx++) {
+      if (pos + 2 <= len && (static_cast<uint8_t>(packet[pos]) & 0xc0) == 0xc0) {
+        const uint16_t pointer = ((static_cast<uint8_t>(packet[pos]) & 0x3f) << 8) | static_cast<uint8_t>(packet[pos + 1]);
+        if (pointer != lastPointer) {
+          rrname = DNSName(packet, len, pos, true).toString();
+          lastPointer = pointer;
+        }
+        pos += 2;
+      }
+      else {
+        unsigned int consumed = 0;
+        rrname = DNSName(packet, len, pos, true, nullptr, nullptr, &consumed).toString();
+        lastPointer = 0;
+        pos += consumed;
+      }
+
+      /* type, class, TTL, rdlength */
+      if (pos + 10 > len) {
+        return;
+      }
+      const unsigned char* header = reinterpret_cast<const unsigned char*>(packet + pos);
+      const uint16_t rrtype = (header[0] << 8) | header[1];
+      const uint16_t rrclass = (header[2] << 8) | header[3];
+      const uint32_t ttl = (static_cast<uint32_t>(header[4]) << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
+      const uint16_t rdlength = (header[8] << 8) | header[9];
+      pos += 10;
+      if (pos + rdlength > len) {
+        return;
+      }
+
+      if (rrtype == QType::A || rrtype == QType::AAAA) {
+        addRR(rrname, rrtype, rrclass, ttl, packet + pos, rdlength);
+      }
+      else if (rrtype == QType::CNAME && includeCNAME) {
+        const std::string target = DNSName(packet, len, pos, true).toString();
+        addRR(rrname, rrtype, rrclass, ttl, target.c_str(), target.size());
+      }
+      pos += rdlength;
+    }
+  }
+  catch (const std::exception& e) {
+    /* malformed name, keep what we have so far */
+  }
+}
+
+void PBDNSMessageEncoder::addTags(const std::vector<std::string>& tags)
+{
+  for (const auto& tag : tags) {
+    addBytesField(PBTags, tag.c_str(), tag.size());
+  }
+}
+
+void PBDNSMessageEncoder::setQueryTime(uint32_t sec, uint32_t usec)
+{
+  addVarintField(PBQueryTimeSec, sec);
+  addVarintField(PBQueryTimeUsec, usec);
+}
+
+void PBDNSMessageEncoder::endResponse()
+{
+  endMessage(d_responsePos);
+}
+
+void PBDNSMessageEncoder::setEDNSSubnet(const Netmask& subnet, uint8_t mask)
+{
+  if (!subnet.empty()) {
+    ComboAddress ca(subnet.getNetwork());
+    ca.truncate(mask);
+    addAddressField(PBOriginalRequestorSubnet, ca);
+  }
+}
+
+void PBDNSMessageEncoder::setRequestorId(const std::string& requestorId)
+{
+  addBytesField(PBRequestorId, requestorId.c_str(), requestorId.size());
+}
+
+void PBDNSMessageEncoder::setInitialRequestId(const boost::uuids::uuid& uuid)
+{
+  addBytesField(PBInitialRequestId, reinterpret_cast<const char*>(uuid.begin()), uuid.size());
+}
+
+void PBDNSMessageEncoder::setDeviceId(const std::string& deviceId)
+{
+  addBytesField(PBDeviceId, deviceId.c_str(), deviceId.size());
+}
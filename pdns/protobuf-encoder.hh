@@ -0,0 +1,89 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include <boost/uuid/uuid.hpp>
+
+#include "dnsname.hh"
+#include "iputils.hh"
+
+/* Writes a PBDNSMessage (dnsmessage.proto) in the protobuf wire format straight
+   to the end of a caller-supplied buffer, without building a libprotobuf object.
+
+   Fields have to be added in increasing field number order, which is the order
+   the methods are declared in, so that the output is byte for byte identical to
+   what libprotobuf produces for the same message. The response-related methods
+   can only be called between startResponse() and endResponse(). */
+class PBDNSMessageEncoder
+{
+public:
+  /* same values as PBDNSMessage::Type */
+  enum class MessageType : uint8_t { Query = 1, Response = 2, OutgoingQuery = 3, IncomingResponse = 4 };
+
+  PBDNSMessageEncoder(std::string& buffer): d_buffer(buffer)
+  {
+  }
+
+  void setType(MessageType type);
+  void setMessageId(const boost::uuids::uuid& uuid);
+  void setSocketFamily(const ComboAddress& address);
+  void setSocketProtocol(bool isTCP);
+  void setRequestor(const ComboAddress& requestor);
+  void setResponder(const ComboAddress& responder);
+  void setBytes(uint64_t bytes);
+  void setTime(uint32_t sec, uint32_t usec);
+  /* in host byte order */
+  void setId(uint16_t id);
+  void setQuestion(const DNSName& qname, uint16_t qtype, uint16_t qclass);
+
+  void startResponse();
+  void setResponseCode(uint8_t rcode);
+  void addRR(const DNSName& name, uint16_t qtype, uint16_t qclass, uint32_t ttl, const char* rdata, size_t rdataLen);
+  /* adds the A and AAAA (and CNAME, if asked to) records of the answer section,
+     parsing the packet in place. Stops at the first malformed record. */
+  void addRRsFromPacket(const char* packet, size_t len, bool includeCNAME);
+  void addTags(const std::vector<std::string>& tags);
+  void setQueryTime(uint32_t sec, uint32_t usec);
+  void endResponse();
+
+  void setEDNSSubnet(const Netmask& subnet, uint8_t mask);
+  void setRequestorId(const std::string& requestorId);
+  void setInitialRequestId(const boost::uuids::uuid& uuid);
+  void setDeviceId(const std::string& deviceId);
+
+private:
+  enum class WireType : uint8_t { Varint = 0, LengthDelimited = 2 };
+
+  void addTag(uint8_t field, WireType type);
+  void addVarint(uint64_t value);
+  void addVarintField(uint8_t field, uint64_t value);
+  void addBytesField(uint8_t field, const char* data, size_t len);
+  void addAddressField(uint8_t field, const ComboAddress& address);
+  void addRR(const std::string& name, uint16_t qtype, uint16_t qclass, uint32_t ttl, const char* rdata, size_t rdataLen);
+  size_t startMessage(uint8_t field);
+  void endMessage(size_t pos);
+
+  std::string& d_buffer;
+  size_t d_responsePos{0};
+};
@@ -269,6 +269,23 @@ void DNSProtoBufMessage::serialize(std::string& data) const
 #endif /* HAVE_PROTOBUF */
 }
 
+size_t DNSProtoBufMessage::serializedSize() const
+{
+#ifdef HAVE_PROTOBUF
+  /* this computes and caches the size of every sub-message */
+  return d_message.ByteSize();
+#else
+  return 0;
+#endif /* HAVE_PROTOBUF */
+}
+
+void DNSProtoBufMessage::serialize(char* out, size_t size) const
+{
+#ifdef HAVE_PROTOBUF
+  d_message.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(out));
+#endif /* HAVE_PROTOBUF */
+}
+
 std::string DNSProtoBufMessage::toDebugString() const
 {
 #ifdef HAVE_PROTOBUF
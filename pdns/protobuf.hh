@@ -64,6 +64,9 @@ public:
   void setResponseCode(uint8_t rcode);
   void addRRsFromPacket(const char* packet, const size_t len, bool includeCNAME=false);
   void serialize(std::string& data) const;
+  /* serializedSize() has to be called first, serialize() then writes exactly that many bytes to out */
+  size_t serializedSize() const;
+  void serialize(char* out, size_t size) const;
   void setRequestor(const std::string& requestor);
   void setRequestor(const ComboAddress& requestor);
   void setResponder(const std::string& responder);
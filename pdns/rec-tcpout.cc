@@ -0,0 +1,100 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "rec-tcpout.hh"
+
+thread_local TCPOutConnectionManager t_tcpOutConnections;
+time_t TCPOutConnectionManager::s_maxIdleTime{10};
+size_t TCPOutConnectionManager::s_maxIdlePerAuth{10};
+size_t TCPOutConnectionManager::s_maxIdlePerThread{100};
+size_t TCPOutConnectionManager::s_maxQueries{0};
+
+TCPOutConnectionManager::Connection TCPOutConnectionManager::get(const ComboAddress& remote, time_t now)
+{
+  Connection result;
+  auto it = d_idle.find(remote);
+  if(it == d_idle.end()) {
+    return result;
+  }
+
+  auto& idle = it->second;
+  while(!idle.empty()) {
+    Connection entry = std::move(idle.back());
+    idle.pop_back();
+    d_count--;
+    if(!isExpired(entry, now) && isTCPSocketUsable(entry.d_socket->getHandle())) {
+      result = std::move(entry);
+      break;
+    }
+  }
+
+  if(idle.empty()) {
+    d_idle.erase(it);
+  }
+  return result;
+}
+
+void TCPOutConnectionManager::store(const ComboAddress& remote, Connection&& connection, time_t now)
+{
+  if(s_maxIdlePerAuth == 0 || d_count >= s_maxIdlePerThread || (s_maxQueries > 0 && connection.d_queries >= s_maxQueries)) {
+    return;
+  }
+
+  auto& idle = d_idle[remote];
+  if(idle.size() >= s_maxIdlePerAuth) {
+    return;
+  }
+
+  connection.d_idleSince = now;
+  idle.push_back(std::move(connection));
+  d_count++;
+}
+
+size_t TCPOutConnectionManager::cleanup(time_t now)
+{
+  size_t removed = 0;
+  for(auto it = d_idle.begin(); it != d_idle.end(); ) {
+    auto& idle = it->second;
+    for(auto entry = idle.begin(); entry != idle.end(); ) {
+      if(isExpired(*entry, now) || !isTCPSocketUsable(entry->d_socket->getHandle())) {
+        entry = idle.erase(entry);
+        removed++;
+      }
+      else {
+        ++entry;
+      }
+    }
+
+    if(idle.empty()) {
+      it = d_idle.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+
+  d_count -= removed;
+  return removed;
+}
@@ -0,0 +1,75 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "iputils.hh"
+#include "sstuff.hh"
+
+/* Per-thread pool of idle outgoing TCP connections, keyed by the address of the remote
+   server, so that TCP queries to an authoritative server we recently talked to do not
+   need a new handshake. A connection is only used by one query at a time, and is handed
+   back to the pool once a complete answer has been read from it. */
+class TCPOutConnectionManager
+{
+public:
+  struct Connection
+  {
+    std::shared_ptr<Socket> d_socket{nullptr};
+    time_t d_idleSince{0};
+    size_t d_queries{0};
+  };
+
+  /* returns the most recently used idle connection to that remote that is still usable,
+     or one without a socket if there is none */
+  Connection get(const ComboAddress& remote, time_t now);
+  /* hands back a connection after a successful exchange, it is closed instead if we
+     already have enough idle connections or if it has been used for too many queries */
+  void store(const ComboAddress& remote, Connection&& connection, time_t now);
+  /* closes the idle connections that have been closed by the remote end or idle for too long,
+     returns the number of connections closed */
+  size_t cleanup(time_t now);
+
+  size_t size() const
+  {
+    return d_count;
+  }
+
+  static time_t s_maxIdleTime;
+  static size_t s_maxIdlePerAuth;
+  static size_t s_maxIdlePerThread;
+  static size_t s_maxQueries;
+
+private:
+  bool isExpired(const Connection& connection, time_t now) const
+  {
+    return (now - connection.d_idleSince) >= s_maxIdleTime;
+  }
+
+  std::map<ComboAddress, std::vector<Connection> > d_idle;
+  size_t d_count{0};
+};
+
+extern thread_local TCPOutConnectionManager t_tcpOutConnections;
@@ -186,7 +186,7 @@ static uint64_t dumpNegCache(NegCache& negcache, int fd)
 
 static uint64_t* pleaseDump(int fd)
 {
-  return new uint64_t(t_RC->doDump(fd) + dumpNegCache(SyncRes::t_sstorage.negcache, fd) + t_packetCache->doDump(fd));
+  return new uint64_t(dumpNegCache(SyncRes::t_sstorage.negcache, fd) + t_packetCache->doDump(fd));
 }
 
 static uint64_t* pleaseDumpNSSpeeds(int fd)
@@ -239,7 +239,7 @@ string doDumpCache(T begin, T end)
     return "Error opening dump file for writing: "+string(strerror(errno))+"\n";
   uint64_t total = 0;
   try {
-    total = broadcastAccFunction<uint64_t>(boost::bind(pleaseDump, fd));
+    total = g_recCache->doDump(fd) + broadcastAccFunction<uint64_t>(boost::bind(pleaseDump, fd));
   }
   catch(...){}
   
@@ -305,11 +305,6 @@ string doDumpRPZ(T begin, T end)
   return "done\n";
 }
 
-uint64_t* pleaseWipeCache(const DNSName& canon, bool subtree)
-{
-  return new uint64_t(t_RC->doWipeCache(canon, subtree));
-}
-
 uint64_t* pleaseWipePacketCache(const DNSName& canon, bool subtree)
 {
   return new uint64_t(t_packetCache->doWipePacketCache(canon,0xffff, subtree));
@@ -346,7 +341,7 @@ string doWipeCache(T begin, T end)
 
   int count=0, pcount=0, countNeg=0;
   for (auto wipe : toWipe) {
-    count+= broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeCache, wipe.first, wipe.second));
+    count+= g_recCache->doWipeCache(wipe.first, wipe.second);
     pcount+= broadcastAccFunction<uint64_t>(boost::bind(pleaseWipePacketCache, wipe.first, wipe.second));
     countNeg+=broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeAndCountNegCache, wipe.first, wipe.second));
   }
@@ -669,7 +664,7 @@ static string* pleaseGetCurrentQueries()
     ostr << (fmt 
              % pident.domain.toLogString() /* ?? */ % DNSRecordContent::NumberToType(pident.type) 
              % pident.remote.toString() % (pident.sock ? 'Y' : 'n')
-             % (pident.fd == -1 ? 'Y' : 'n')
+             % (pident.fd < 0 ? 'Y' : 'n')
              );
     ++n;
     if (n >= 100)
@@ -735,20 +730,9 @@ static uint64_t getConcurrentQueries()
   return broadcastAccFunction<uint64_t>(pleaseGetConcurrentQueries);
 }
 
-uint64_t* pleaseGetCacheSize()
-{
-  return new uint64_t(t_RC ? t_RC->size() : 0);
-}
-
-uint64_t* pleaseGetCacheBytes()
-{
-  return new uint64_t(t_RC ? t_RC->bytes() : 0);
-}
-
-
 uint64_t doGetCacheSize()
 {
-  return broadcastAccFunction<uint64_t>(pleaseGetCacheSize);
+  return g_recCache->size();
 }
 
 uint64_t doGetAvgLatencyUsec()
@@ -759,27 +743,17 @@ uint64_t doGetAvgLatencyUsec()
 
 uint64_t doGetCacheBytes()
 {
-  return broadcastAccFunction<uint64_t>(pleaseGetCacheBytes);
-}
-
-uint64_t* pleaseGetCacheHits()
-{
-  return new uint64_t(t_RC ? t_RC->cacheHits : 0);
+  return g_recCache->bytes();
 }
 
 uint64_t doGetCacheHits()
 {
-  return broadcastAccFunction<uint64_t>(pleaseGetCacheHits);
-}
-
-uint64_t* pleaseGetCacheMisses()
-{
-  return new uint64_t(t_RC ? t_RC->cacheMisses : 0);
+  return g_recCache->cacheHits;
 }
 
 uint64_t doGetCacheMisses()
 {
-  return broadcastAccFunction<uint64_t>(pleaseGetCacheMisses);
+  return g_recCache->cacheMisses;
 }
 
 
@@ -804,6 +778,16 @@ uint64_t doGetPacketCacheBytes()
   return broadcastAccFunction<uint64_t>(pleaseGetPacketCacheBytes);
 }
 
+static uint64_t* pleaseGetTCPOutIdleConnections()
+{
+  return new uint64_t(t_tcpOutConnections.size());
+}
+
+static uint64_t doGetTCPOutIdleConnections()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetTCPOutIdleConnections);
+}
+
 
 uint64_t* pleaseGetPacketCacheHits()
 {
@@ -835,6 +819,19 @@ uint64_t doGetMallocated()
 
 extern ResponseStats g_rs;
 
+static uint64_t getProtobufServersStat(uint64_t (RemoteLoggerInterface::*getter)() const)
+{
+  uint64_t result = 0;
+  auto luaconf = g_luaconfs.getLocal();
+  if (luaconf->protobufServer) {
+    result += ((*luaconf->protobufServer).*getter)();
+  }
+  if (luaconf->outgoingProtobufServer) {
+    result += ((*luaconf->outgoingProtobufServer).*getter)();
+  }
+  return result;
+}
+
 void registerAllStats()
 {
   static std::atomic_flag s_init = ATOMIC_FLAG_INIT;
@@ -851,6 +848,8 @@ void registerAllStats()
   addGetStat("max-cache-entries", []() { return g_maxCacheEntries.load(); });
   addGetStat("max-packetcache-entries", []() { return g_maxPacketCacheEntries.load();}); 
   addGetStat("cache-bytes", doGetCacheBytes); 
+  addGetStat("record-cache-acquired", []() { return g_recCache->getAcquired(); });
+  addGetStat("record-cache-contended", []() { return g_recCache->getContended(); });
   
   addGetStat("packetcache-hits", doGetPacketCacheHits);
   addGetStat("packetcache-misses", doGetPacketCacheMisses); 
@@ -910,6 +909,7 @@ void registerAllStats()
   addGetStat("over-capacity-drops", &g_stats.overCapacityDrops);
   addGetStat("policy-drops", &g_stats.policyDrops);
   addGetStat("no-packet-error", &g_stats.noPacketError);
+  addGetStat("distribution-queue-drops", &g_stats.distributionQueueDrops);
   addGetStat("dlg-only-drops", &SyncRes::s_nodelegated);
   addGetStat("ignored-packets", &g_stats.ignoredCount);
   addGetStat("max-mthread-stack", &g_stats.maxMThreadStackUsage);
@@ -927,6 +927,9 @@ void registerAllStats()
   addGetStat("outgoing6-timeouts", &SyncRes::s_outgoing6timeouts);
   addGetStat("auth-zone-queries", &SyncRes::s_authzonequeries);
   addGetStat("tcp-outqueries", &SyncRes::s_tcpoutqueries);
+  addGetStat("tcp-out-connections-opened", &g_stats.tcpOutConnectionsOpened);
+  addGetStat("tcp-out-connections-reused", &g_stats.tcpOutConnectionsReused);
+  addGetStat("tcp-out-connections-idle", doGetTCPOutIdleConnections);
   addGetStat("all-outqueries", &SyncRes::s_outqueries);
   addGetStat("ipv6-outqueries", &g_stats.ipv6queries);
   addGetStat("throttled-outqueries", &SyncRes::s_throttledqueries);
@@ -936,6 +939,8 @@ void registerAllStats()
   addGetStat("ecs-queries", &SyncRes::s_ecsqueries);
   addGetStat("ecs-responses", &SyncRes::s_ecsresponses);
   addGetStat("chain-resends", &g_stats.chainResends);
+  addGetStat("coalesced-queries", &g_stats.coalescedQueries);
+  addGetStat("coalesced-timeouts", &g_stats.coalescedTimeouts);
   addGetStat("tcp-clients", boost::bind(TCPConnection::getCurrentConnections));
 
 #ifdef __linux__
@@ -979,6 +984,10 @@ void registerAllStats()
   addGetStat("policy-result-nodata", &g_stats.policyResults[DNSFilterEngine::PolicyKind::NODATA]);
   addGetStat("policy-result-truncate", &g_stats.policyResults[DNSFilterEngine::PolicyKind::Truncate]);
   addGetStat("policy-result-custom", &g_stats.policyResults[DNSFilterEngine::PolicyKind::Custom]);
+
+  addGetStat("protobuf-queued-bytes", boost::bind(getProtobufServersStat, &RemoteLoggerInterface::getQueuedBytes));
+  addGetStat("protobuf-dropped-bytes", boost::bind(getProtobufServersStat, &RemoteLoggerInterface::getDroppedBytes));
+  addGetStat("protobuf-flushed-bytes", boost::bind(getProtobufServersStat, &RemoteLoggerInterface::getFlushedBytes));
 }
 
 static void doExitGeneric(bool nicely)
@@ -14,31 +14,65 @@
 #include "cachecleaner.hh"
 #include "namespaces.hh"
 
-unsigned int MemRecursorCache::size() const
+MemRecursorCache::MemRecursorCache(size_t mapsCount): d_maps(mapsCount > 0 ? mapsCount : 1)
 {
-  return (unsigned int)d_cache.size();
 }
 
-size_t MemRecursorCache::ecsIndexSize() const
+size_t MemRecursorCache::size() const
 {
-  return d_ecsIndex.size();
+  size_t count = 0;
+  for (const auto& map : d_maps) {
+    count += map.d_entriesCount;
+  }
+  return count;
 }
 
-// this function is too slow to poll!
-unsigned int MemRecursorCache::bytes() const
+size_t MemRecursorCache::ecsIndexSize()
 {
-  unsigned int ret=0;
+  size_t count = 0;
+  for (auto& map : d_maps) {
+    ShardLock lock(map);
+    count += map.d_ecsIndex.size();
+  }
+  return count;
+}
 
-  for(cache_t::const_iterator i=d_cache.begin(); i!=d_cache.end(); ++i) {
-    ret+=sizeof(struct CacheEntry);
-    ret+=(unsigned int)i->d_qname.toString().length();
-    for(auto j=i->d_records.begin(); j!= i->d_records.end(); ++j)
-      ret+= sizeof(*j); // XXX WRONG we don't know the stored size! j->size();
+uint64_t MemRecursorCache::getAcquired() const
+{
+  uint64_t count = 0;
+  for (const auto& map : d_maps) {
+    count += map.d_acquired;
+  }
+  return count;
+}
+
+uint64_t MemRecursorCache::getContended() const
+{
+  uint64_t count = 0;
+  for (const auto& map : d_maps) {
+    count += map.d_contended;
+  }
+  return count;
+}
+
+// this function is too slow to poll!
+size_t MemRecursorCache::bytes()
+{
+  size_t ret=0;
+
+  for (auto& map : d_maps) {
+    ShardLock lock(map);
+    for(cache_t::const_iterator i=map.d_map.begin(); i!=map.d_map.end(); ++i) {
+      ret+=sizeof(struct CacheEntry);
+      ret+=i->d_qname.toString().length();
+      for(auto j=i->d_records.begin(); j!= i->d_records.end(); ++j)
+        ret+= sizeof(*j); // XXX WRONG we don't know the stored size! j->size();
+    }
   }
   return ret;
 }
 
-int32_t MemRecursorCache::handleHit(cache_t::iterator entry, const DNSName& qname, const ComboAddress& who, vector<DNSRecord>* res, vector<std::shared_ptr<RRSIGRecordContent>>* signatures, std::vector<std::shared_ptr<DNSRecord>>* authorityRecs, bool* variable, vState* state, bool* wasAuth)
+int32_t MemRecursorCache::handleHit(MapCombo& map, cache_t::iterator entry, const DNSName& qname, const ComboAddress& who, vector<DNSRecord>* res, vector<std::shared_ptr<RRSIGRecordContent>>* signatures, std::vector<std::shared_ptr<DNSRecord>>* authorityRecs, bool* variable, vState* state, bool* wasAuth)
 {
   int32_t ttd = entry->d_ttd;
 
@@ -76,16 +110,16 @@ int32_t MemRecursorCache::handleHit(cache_t::iterator entry, const DNSName& qnam
     *wasAuth = entry->d_auth;
   }
 
-  moveCacheItemToBack(d_cache, entry);
+  moveCacheItemToBack(map.d_map, entry);
 
   return ttd;
 }
 
-MemRecursorCache::cache_t::const_iterator MemRecursorCache::getEntryUsingECSIndex(time_t now, const DNSName &qname, uint16_t qtype, bool requireAuth, const ComboAddress& who)
+MemRecursorCache::cache_t::const_iterator MemRecursorCache::getEntryUsingECSIndex(MapCombo& map, time_t now, const DNSName &qname, uint16_t qtype, bool requireAuth, const ComboAddress& who)
 {
   auto ecsIndexKey = tie(qname, qtype);
-  auto ecsIndex = d_ecsIndex.find(ecsIndexKey);
-  if (ecsIndex != d_ecsIndex.end() && !ecsIndex->isEmpty()) {
+  auto ecsIndex = map.d_ecsIndex.find(ecsIndexKey);
+  if (ecsIndex != map.d_ecsIndex.end() && !ecsIndex->isEmpty()) {
     /* we have netmask-specific entries, let's see if we match one */
     while (true) {
       const Netmask best = ecsIndex->lookupBestMatch(who);
@@ -94,12 +128,12 @@ MemRecursorCache::cache_t::const_iterator MemRecursorCache::getEntryUsingECSInde
         break;
       }
       auto key = boost::make_tuple(qname, qtype, best);
-      auto entry = d_cache.find(key);
-      if (entry == d_cache.end()) {
+      auto entry = map.d_map.find(key);
+      if (entry == map.d_map.end()) {
         /* ecsIndex is not up-to-date */
         ecsIndex->removeNetmask(best);
         if (ecsIndex->isEmpty()) {
-          d_ecsIndex.erase(ecsIndex);
+          map.d_ecsIndex.erase(ecsIndex);
           break;
         }
         continue;
@@ -110,14 +144,14 @@ MemRecursorCache::cache_t::const_iterator MemRecursorCache::getEntryUsingECSInde
           return entry;
         }
         /* we need auth data and the best match is not authoritative */
-        return d_cache.end();
+        return map.d_map.end();
       }
       else {
         /* this netmask-specific entry has expired */
-        moveCacheItemToFront(d_cache, entry);
+        moveCacheItemToFront(map.d_map, entry);
         ecsIndex->removeNetmask(best);
         if (ecsIndex->isEmpty()) {
-          d_ecsIndex.erase(ecsIndex);
+          map.d_ecsIndex.erase(ecsIndex);
           break;
         }
       }
@@ -126,35 +160,35 @@ MemRecursorCache::cache_t::const_iterator MemRecursorCache::getEntryUsingECSInde
 
   /* we have nothing specific, let's see if we have a generic one */
   auto key = boost::make_tuple(qname, qtype, Netmask());
-  auto entry = d_cache.find(key);
-  if (entry != d_cache.end()) {
+  auto entry = map.d_map.find(key);
+  if (entry != map.d_map.end()) {
     if (entry->d_ttd > now) {
       if (!requireAuth || entry->d_auth) {
         return entry;
       }
     }
     else {
-      moveCacheItemToFront(d_cache, entry);
+      moveCacheItemToFront(map.d_map, entry);
     }
   }
 
   /* nothing for you, sorry */
-  return d_cache.end();
+  return map.d_map.end();
 }
 
 // returns -1 for no hits
-std::pair<MemRecursorCache::cache_t::const_iterator, MemRecursorCache::cache_t::const_iterator> MemRecursorCache::getEntries(const DNSName &qname, const QType& qt)
+std::pair<MemRecursorCache::cache_t::const_iterator, MemRecursorCache::cache_t::const_iterator> MemRecursorCache::getEntries(MapCombo& map, const DNSName &qname, const QType& qt)
 {
   //  cerr<<"looking up "<< qname<<"|"+qt.getName()<<"\n";
-  if(!d_cachecachevalid || d_cachedqname!= qname) {
+  if(!map.d_cachecachevalid || map.d_cachedqname!= qname) {
     //    cerr<<"had cache cache miss"<<endl;
-    d_cachedqname=qname;
-    d_cachecache=d_cache.equal_range(tie(qname));
-    d_cachecachevalid=true;
+    map.d_cachedqname=qname;
+    map.d_cachecache=map.d_map.equal_range(tie(qname));
+    map.d_cachecachevalid=true;
   }
   //  else cerr<<"had cache cache hit!"<<endl;
 
-  return d_cachecache;
+  return map.d_cachecache;
 }
 
 bool MemRecursorCache::entryMatches(cache_t::const_iterator& entry, uint16_t qt, bool requireAuth, const ComboAddress& who)
@@ -177,19 +211,22 @@ int32_t MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt,
   }
 
   const uint16_t qtype = qt.getCode();
+  auto& map = getMap(qname);
+  ShardLock lock(map);
+
   /* If we don't have any netmask-specific entries at all, let's just skip this
      to be able to use the nice d_cachecache hack. */
-  if (qtype != QType::ANY && !d_ecsIndex.empty()) {
+  if (qtype != QType::ANY && !map.d_ecsIndex.empty()) {
     if (qtype == QType::ADDR) {
       int32_t ret = -1;
 
-      auto entryA = getEntryUsingECSIndex(now, qname, QType::A, requireAuth, who);
-      if (entryA != d_cache.end()) {
-        ret = handleHit(entryA, qname, who, res, signatures, authorityRecs, variable, state, wasAuth);
+      auto entryA = getEntryUsingECSIndex(map, now, qname, QType::A, requireAuth, who);
+      if (entryA != map.d_map.end()) {
+        ret = handleHit(map, entryA, qname, who, res, signatures, authorityRecs, variable, state, wasAuth);
       }
-      auto entryAAAA = getEntryUsingECSIndex(now, qname, QType::AAAA, requireAuth, who);
-      if (entryAAAA != d_cache.end()) {
-        int32_t ttdAAAA = handleHit(entryAAAA, qname, who, res, signatures, authorityRecs, variable, state, wasAuth);
+      auto entryAAAA = getEntryUsingECSIndex(map, now, qname, QType::AAAA, requireAuth, who);
+      if (entryAAAA != map.d_map.end()) {
+        int32_t ttdAAAA = handleHit(map, entryAAAA, qname, who, res, signatures, authorityRecs, variable, state, wasAuth);
         if (ret > 0) {
           ret = std::min(ret, ttdAAAA);
         } else {
@@ -199,28 +236,28 @@ int32_t MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt,
       return ret > 0 ? static_cast<int32_t>(ret-now) : ret;
     }
     else {
-      auto entry = getEntryUsingECSIndex(now, qname, qtype, requireAuth, who);
-      if (entry != d_cache.end()) {
-        return static_cast<int32_t>(handleHit(entry, qname, who, res, signatures, authorityRecs, variable, state, wasAuth) - now);
+      auto entry = getEntryUsingECSIndex(map, now, qname, qtype, requireAuth, who);
+      if (entry != map.d_map.end()) {
+        return static_cast<int32_t>(handleHit(map, entry, qname, who, res, signatures, authorityRecs, variable, state, wasAuth) - now);
       }
       return -1;
     }
   }
 
-  auto entries = getEntries(qname, qt);
+  auto entries = getEntries(map, qname, qt);
 
   if(entries.first!=entries.second) {
     for(cache_t::const_iterator i=entries.first; i != entries.second; ++i) {
 
       if (i->d_ttd <= now) {
-        moveCacheItemToFront(d_cache, i);
+        moveCacheItemToFront(map.d_map, i);
         continue;
       }
 
       if (!entryMatches(i, qtype, requireAuth, who))
         continue;
 
-      ttd = handleHit(i, qname, who, res, signatures, authorityRecs, variable, state, wasAuth);
+      ttd = handleHit(map, i, qname, who, res, signatures, authorityRecs, variable, state, wasAuth);
 
       if(qt.getCode()!=QType::ANY && qt.getCode()!=QType::ADDR) // normally if we have a hit, we are done
         break;
@@ -262,13 +299,17 @@ bool MemRecursorCache::attemptToRefreshNSTTL(const QType& qt, const vector<DNSRe
 
 void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt, const vector<DNSRecord>& content, const vector<shared_ptr<RRSIGRecordContent>>& signatures, const std::vector<std::shared_ptr<DNSRecord>>& authorityRecs, bool auth, boost::optional<Netmask> ednsmask, vState state)
 {
-  d_cachecachevalid = false;
+  auto& map = getMap(qname);
+  ShardLock lock(map);
+
+  map.d_cachecachevalid = false;
   //  cerr<<"Replacing "<<qname<<" for "<< (ednsmask ? ednsmask->toString() : "everyone") << endl;
   auto key = boost::make_tuple(qname, qt.getCode(), ednsmask ? *ednsmask : Netmask());
   bool isNew = false;
-  cache_t::iterator stored = d_cache.find(key);
-  if (stored == d_cache.end()) {
-    stored = d_cache.insert(CacheEntry(key, CacheEntry::records_t(), auth)).first;
+  cache_t::iterator stored = map.d_map.find(key);
+  if (stored == map.d_map.end()) {
+    stored = map.d_map.insert(CacheEntry(key, CacheEntry::records_t(), auth)).first;
+    map.d_entriesCount = map.d_map.size();
     isNew = true;
   }
 
@@ -281,9 +322,9 @@ void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt
     /* don't bother building an ecsIndex if we don't have any netmask-specific entries */
     if (ednsmask && !ednsmask->empty()) {
       auto ecsIndexKey = boost::make_tuple(qname, qt.getCode());
-      auto ecsIndex = d_ecsIndex.find(ecsIndexKey);
-      if (ecsIndex == d_ecsIndex.end()) {
-        ecsIndex = d_ecsIndex.insert(ECSIndexEntry(qname, qt.getCode())).first;
+      auto ecsIndex = map.d_ecsIndex.find(ecsIndexKey);
+      if (ecsIndex == map.d_ecsIndex.end()) {
+        ecsIndex = map.d_ecsIndex.insert(ECSIndexEntry(qname, qt.getCode())).first;
       }
       ecsIndex->addMask(*ednsmask);
     }
@@ -336,64 +377,84 @@ void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt
   }
 
   if (!isNew) {
-    moveCacheItemToBack(d_cache, stored);
+    moveCacheItemToBack(map.d_map, stored);
   }
-  d_cache.replace(stored, ce);
+  map.d_map.replace(stored, ce);
 }
 
-int MemRecursorCache::doWipeCache(const DNSName& name, bool sub, uint16_t qtype)
+int MemRecursorCache::wipeFromMap(MapCombo& map, const DNSName& name, bool sub, uint16_t qtype)
 {
   int count=0;
-  d_cachecachevalid=false;
+  map.d_cachecachevalid=false;
   pair<cache_t::iterator, cache_t::iterator> range;
 
   if(!sub) {
     pair<ecsIndex_t::iterator, ecsIndex_t::iterator> ecsIndexRange;
     if(qtype==0xffff) {
-      range = d_cache.equal_range(tie(name));
-      ecsIndexRange = d_ecsIndex.equal_range(tie(name));
+      range = map.d_map.equal_range(tie(name));
+      ecsIndexRange = map.d_ecsIndex.equal_range(tie(name));
     }
     else {
-      range=d_cache.equal_range(tie(name, qtype));
-      ecsIndexRange = d_ecsIndex.equal_range(tie(name, qtype));
+      range=map.d_map.equal_range(tie(name, qtype));
+      ecsIndexRange = map.d_ecsIndex.equal_range(tie(name, qtype));
     }
     for(cache_t::const_iterator i=range.first; i != range.second; ) {
       count++;
-      d_cache.erase(i++);
+      map.d_map.erase(i++);
     }
     for(auto i = ecsIndexRange.first; i != ecsIndexRange.second; ) {
-      d_ecsIndex.erase(i++);
+      map.d_ecsIndex.erase(i++);
     }
   }
   else {
-    for(auto iter = d_cache.lower_bound(tie(name)); iter != d_cache.end(); ) {
+    for(auto iter = map.d_map.lower_bound(tie(name)); iter != map.d_map.end(); ) {
       if(!iter->d_qname.isPartOf(name))
 	break;
       if(iter->d_qtype == qtype || qtype == 0xffff) {
 	count++;
-	d_cache.erase(iter++);
+	map.d_map.erase(iter++);
       }
       else 
 	iter++;
     }
-    for(auto iter = d_ecsIndex.lower_bound(tie(name)); iter != d_ecsIndex.end(); ) {
+    for(auto iter = map.d_ecsIndex.lower_bound(tie(name)); iter != map.d_ecsIndex.end(); ) {
       if(!iter->d_qname.isPartOf(name))
 	break;
       if(iter->d_qtype == qtype || qtype == 0xffff) {
-	d_ecsIndex.erase(iter++);
+	map.d_ecsIndex.erase(iter++);
       }
       else {
 	iter++;
       }
     }
   }
+  map.d_entriesCount = map.d_map.size();
+  return count;
+}
+
+int MemRecursorCache::doWipeCache(const DNSName& name, bool sub, uint16_t qtype)
+{
+  if (!sub) {
+    auto& map = getMap(name);
+    ShardLock lock(map);
+    return wipeFromMap(map, name, sub, qtype);
+  }
+
+  /* the names below that one can be in any shard */
+  int count = 0;
+  for (auto& map : d_maps) {
+    ShardLock lock(map);
+    count += wipeFromMap(map, name, sub, qtype);
+  }
   return count;
 }
 
 bool MemRecursorCache::doAgeCache(time_t now, const DNSName& name, uint16_t qtype, uint32_t newTTL)
 {
-  cache_t::iterator iter = d_cache.find(tie(name, qtype));
-  if(iter == d_cache.end()) {
+  auto& map = getMap(name);
+  ShardLock lock(map);
+  cache_t::iterator iter = map.d_map.find(tie(name, qtype));
+  if(iter == map.d_map.end()) {
     return false;
   }
 
@@ -403,7 +464,7 @@ bool MemRecursorCache::doAgeCache(time_t now, const DNSName& name, uint16_t qtyp
 
   uint32_t maxTTL = static_cast<uint32_t>(ce.d_ttd - now);
   if(maxTTL > newTTL) {
-    d_cachecachevalid=false;
+    map.d_cachecachevalid=false;
 
     time_t newTTD = now + newTTL;
 
@@ -412,7 +473,7 @@ bool MemRecursorCache::doAgeCache(time_t now, const DNSName& name, uint16_t qtyp
       ce.d_ttd = newTTD;
   
 
-    d_cache.replace(iter, ce);
+    map.d_map.replace(iter, ce);
     return true;
   }
   return false;
@@ -422,9 +483,12 @@ bool MemRecursorCache::updateValidationStatus(time_t now, const DNSName &qname,
 {
   bool updated = false;
   uint16_t qtype = qt.getCode();
-  if (qtype != QType::ANY && qtype != QType::ADDR && !d_ecsIndex.empty()) {
-    auto entry = getEntryUsingECSIndex(now, qname, qtype, requireAuth, who);
-    if (entry == d_cache.end()) {
+  auto& map = getMap(qname);
+  ShardLock lock(map);
+
+  if (qtype != QType::ANY && qtype != QType::ADDR && !map.d_ecsIndex.empty()) {
+    auto entry = getEntryUsingECSIndex(map, now, qname, qtype, requireAuth, who);
+    if (entry == map.d_map.end()) {
       return false;
     }
 
@@ -432,7 +496,7 @@ bool MemRecursorCache::updateValidationStatus(time_t now, const DNSName &qname,
     return true;
   }
 
-  auto entries = getEntries(qname, qt);
+  auto entries = getEntries(map, qname, qt);
 
   for(auto i = entries.first; i != entries.second; ++i) {
     if (!entryMatches(i, qtype, requireAuth, who))
@@ -454,28 +518,32 @@ uint64_t MemRecursorCache::doDump(int fd)
   if(!fp) { // dup probably failed
     return 0;
   }
-  fprintf(fp, "; main record cache dump from thread follows\n;\n");
-  const auto& sidx=d_cache.get<1>();
+  fprintf(fp, "; main record cache dump follows\n;\n");
 
   uint64_t count=0;
   time_t now=time(0);
-  for(const auto i : sidx) {
-    for(const auto j : i.d_records) {
-      count++;
-      try {
-        fprintf(fp, "%s %" PRId64 " IN %s %s ; (%s) auth=%i %s\n", i.d_qname.toString().c_str(), static_cast<int64_t>(i.d_ttd - now), DNSRecordContent::NumberToType(i.d_qtype).c_str(), j->getZoneRepresentation().c_str(), vStates[i.d_state], i.d_auth, i.d_netmask.empty() ? "" : i.d_netmask.toString().c_str());
-      }
-      catch(...) {
-        fprintf(fp, "; error printing '%s'\n", i.d_qname.empty() ? "EMPTY" : i.d_qname.toString().c_str());
-      }
-    }
-    for(const auto &sig : i.d_signatures) {
-      count++;
-      try {
-        fprintf(fp, "%s %" PRId64 " IN RRSIG %s ; %s\n", i.d_qname.toString().c_str(), static_cast<int64_t>(i.d_ttd - now), sig->getZoneRepresentation().c_str(), i.d_netmask.empty() ? "" : i.d_netmask.toString().c_str());
+  for (auto& map : d_maps) {
+    ShardLock lock(map);
+    const auto& sidx=map.d_map.get<1>();
+
+    for(const auto i : sidx) {
+      for(const auto j : i.d_records) {
+        count++;
+        try {
+          fprintf(fp, "%s %" PRId64 " IN %s %s ; (%s) auth=%i %s\n", i.d_qname.toString().c_str(), static_cast<int64_t>(i.d_ttd - now), DNSRecordContent::NumberToType(i.d_qtype).c_str(), j->getZoneRepresentation().c_str(), vStates[i.d_state], i.d_auth, i.d_netmask.empty() ? "" : i.d_netmask.toString().c_str());
+        }
+        catch(...) {
+          fprintf(fp, "; error printing '%s'\n", i.d_qname.empty() ? "EMPTY" : i.d_qname.toString().c_str());
+        }
       }
-      catch(...) {
-        fprintf(fp, "; error printing '%s'\n", i.d_qname.empty() ? "EMPTY" : i.d_qname.toString().c_str());
+      for(const auto &sig : i.d_signatures) {
+        count++;
+        try {
+          fprintf(fp, "%s %" PRId64 " IN RRSIG %s ; %s\n", i.d_qname.toString().c_str(), static_cast<int64_t>(i.d_ttd - now), sig->getZoneRepresentation().c_str(), i.d_netmask.empty() ? "" : i.d_netmask.toString().c_str());
+        }
+        catch(...) {
+          fprintf(fp, "; error printing '%s'\n", i.d_qname.empty() ? "EMPTY" : i.d_qname.toString().c_str());
+        }
       }
     }
   }
@@ -483,10 +551,17 @@ uint64_t MemRecursorCache::doDump(int fd)
   return count;
 }
 
-void MemRecursorCache::doPrune(unsigned int keep)
+void MemRecursorCache::doPrune(size_t keep)
 {
-  d_cachecachevalid=false;
+  /* every shard keeps its share of the entries, in proportion to its current size */
+  const size_t total = size();
 
-  pruneCollection(*this, d_cache, keep);
+  for (auto& map : d_maps) {
+    ShardLock lock(map);
+    map.d_cachecachevalid=false;
+    const size_t shardSize = map.d_map.size();
+    const size_t shardKeep = total > keep ? (shardSize * keep) / total : shardSize;
+    pruneCollection(map, map.d_map, shardKeep);
+    map.d_entriesCount = map.d_map.size();
+  }
 }
-
@@ -21,6 +21,8 @@
  */
 #ifndef RECURSOR_CACHE_HH
 #define RECURSOR_CACHE_HH
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <set>
 #include "dns.hh"
@@ -46,32 +48,36 @@
 #include "namespaces.hh"
 using namespace ::boost::multi_index;
 
+/* The record cache is shared by all the worker threads. It is split into
+   shards, each with its own lock, selected by the hash of the qname, so that
+   everything related to a given name (every type, ECS-specific entries and the
+   corresponding ECS index) lives in the same shard. */
 class MemRecursorCache : public boost::noncopyable //  : public RecursorCache
 {
 public:
-  MemRecursorCache() : d_cachecachevalid(false)
-  {
-    cacheHits = cacheMisses = 0;
-  }
-  unsigned int size() const;
-  unsigned int bytes() const;
-  size_t ecsIndexSize() const;
+  MemRecursorCache(size_t mapsCount=1024);
+
+  size_t size() const;
+  size_t bytes();
+  size_t ecsIndexSize();
+  /* number of times a shard lock has been acquired, and how many of these had to wait because it was held by another thread */
+  uint64_t getAcquired() const;
+  uint64_t getContended() const;
 
   int32_t get(time_t, const DNSName &qname, const QType& qt, bool requireAuth, vector<DNSRecord>* res, const ComboAddress& who, vector<std::shared_ptr<RRSIGRecordContent>>* signatures=nullptr, std::vector<std::shared_ptr<DNSRecord>>* authorityRecs=nullptr, bool* variable=nullptr, vState* state=nullptr, bool* wasAuth=nullptr);
 
   void replace(time_t, const DNSName &qname, const QType& qt,  const vector<DNSRecord>& content, const vector<shared_ptr<RRSIGRecordContent>>& signatures, const std::vector<std::shared_ptr<DNSRecord>>& authorityRecs, bool auth, boost::optional<Netmask> ednsmask=boost::none, vState state=Indeterminate);
 
-  void doPrune(unsigned int keep);
+  void doPrune(size_t keep);
   uint64_t doDump(int fd);
 
   int doWipeCache(const DNSName& name, bool sub, uint16_t qtype=0xffff);
   bool doAgeCache(time_t now, const DNSName& name, uint16_t qtype, uint32_t newTTL);
   bool updateValidationStatus(time_t now, const DNSName &qname, const QType& qt, const ComboAddress& who, bool requireAuth, vState newState);
 
-  uint64_t cacheHits, cacheMisses;
+  std::atomic<uint64_t> cacheHits{0}, cacheMisses{0};
 
 private:
-
   struct CacheEntry
   {
     CacheEntry(const boost::tuple<DNSName, uint16_t, Netmask>& key, const vector<shared_ptr<DNSRecordContent>>& records, bool auth) : 
@@ -172,33 +178,72 @@ private:
     >
   > ecsIndex_t;
 
-  cache_t d_cache;
-  ecsIndex_t d_ecsIndex;
-  pair<cache_t::iterator, cache_t::iterator> d_cachecache;
-  DNSName d_cachedqname;
-  bool d_cachecachevalid;
+  struct MapCombo
+  {
+    MapCombo()
+    {
+    }
+    MapCombo(const MapCombo&) = delete;
+    MapCombo& operator=(const MapCombo&) = delete;
 
-  bool attemptToRefreshNSTTL(const QType& qt, const vector<DNSRecord>& content, const CacheEntry& stored);
-  bool entryMatches(cache_t::const_iterator& entry, uint16_t qt, bool requireAuth, const ComboAddress& who);
-  std::pair<cache_t::const_iterator, cache_t::const_iterator> getEntries(const DNSName &qname, const QType& qt);
-  cache_t::const_iterator getEntryUsingECSIndex(time_t now, const DNSName &qname, uint16_t qtype, bool requireAuth, const ComboAddress& who);
-  int32_t handleHit(cache_t::iterator entry, const DNSName& qname, const ComboAddress& who, vector<DNSRecord>* res, vector<std::shared_ptr<RRSIGRecordContent>>* signatures, std::vector<std::shared_ptr<DNSRecord>>* authorityRecs, bool* variable, vState* state, bool* wasAuth);
+    /* called by pruneCollection() */
+    void preRemoval(const CacheEntry& entry)
+    {
+      if (entry.d_netmask.empty()) {
+        return;
+      }
 
-public:
-  void preRemoval(const CacheEntry& entry)
-  {
-    if (entry.d_netmask.empty()) {
-      return;
+      auto key = tie(entry.d_qname, entry.d_qtype);
+      auto ecsIndexEntry = d_ecsIndex.find(key);
+      if (ecsIndexEntry != d_ecsIndex.end()) {
+        ecsIndexEntry->removeNetmask(entry.d_netmask);
+        if (ecsIndexEntry->isEmpty()) {
+          d_ecsIndex.erase(ecsIndexEntry);
+        }
+      }
     }
 
-    auto key = tie(entry.d_qname, entry.d_qtype);
-    auto ecsIndexEntry = d_ecsIndex.find(key);
-    if (ecsIndexEntry != d_ecsIndex.end()) {
-      ecsIndexEntry->removeNetmask(entry.d_netmask);
-      if (ecsIndexEntry->isEmpty()) {
-        d_ecsIndex.erase(ecsIndexEntry);
+    cache_t d_map;
+    ecsIndex_t d_ecsIndex;
+    pair<cache_t::iterator, cache_t::iterator> d_cachecache;
+    DNSName d_cachedqname;
+    std::mutex d_mutex;
+    /* updated with the lock held, but can be read without it */
+    std::atomic<uint64_t> d_entriesCount{0};
+    std::atomic<uint64_t> d_acquired{0};
+    std::atomic<uint64_t> d_contended{0};
+    bool d_cachecachevalid{false};
+  };
+
+  /* locks a shard, keeping track of whether we had to wait for it */
+  class ShardLock
+  {
+  public:
+    ShardLock(MapCombo& map): d_lock(map.d_mutex, std::try_to_lock)
+    {
+      if (!d_lock.owns_lock()) {
+        map.d_contended++;
+        d_lock.lock();
       }
+      map.d_acquired++;
     }
+
+  private:
+    std::unique_lock<std::mutex> d_lock;
+  };
+
+  vector<MapCombo> d_maps;
+
+  MapCombo& getMap(const DNSName& qname)
+  {
+    return d_maps[qname.hash() % d_maps.size()];
   }
+
+  bool attemptToRefreshNSTTL(const QType& qt, const vector<DNSRecord>& content, const CacheEntry& stored);
+  bool entryMatches(cache_t::const_iterator& entry, uint16_t qt, bool requireAuth, const ComboAddress& who);
+  std::pair<cache_t::const_iterator, cache_t::const_iterator> getEntries(MapCombo& map, const DNSName &qname, const QType& qt);
+  cache_t::const_iterator getEntryUsingECSIndex(MapCombo& map, time_t now, const DNSName &qname, uint16_t qtype, bool requireAuth, const ComboAddress& who);
+  int32_t handleHit(MapCombo& map, cache_t::iterator entry, const DNSName& qname, const ComboAddress& who, vector<DNSRecord>* res, vector<std::shared_ptr<RRSIGRecordContent>>* signatures, std::vector<std::shared_ptr<DNSRecord>>* authorityRecs, bool* variable, vState* state, bool* wasAuth);
+  int wipeFromMap(MapCombo& map, const DNSName& name, bool sub, uint16_t qtype);
 };
 #endif
@@ -0,0 +1 @@
+../protobuf-encoder.hh
\ No newline at end of file
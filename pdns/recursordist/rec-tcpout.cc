@@ -0,0 +1 @@
+../rec-tcpout.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../rec-tcpout.hh
\ No newline at end of file
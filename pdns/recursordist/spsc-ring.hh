@@ -0,0 +1 @@
+../spsc-ring.hh
\ No newline at end of file
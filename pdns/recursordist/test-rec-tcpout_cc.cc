@@ -0,0 +1,267 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+
+#include "iputils.hh"
+#include "rec-tcpout.hh"
+
+/* Accepts TCP connections on a local port, so that we can create connections the
+   manager considers usable, then close them from the remote end. */
+class TCPOutTestServer
+{
+public:
+  TCPOutTestServer(): d_listener(AF_INET, SOCK_STREAM), d_address("127.0.0.1:0")
+  {
+    d_listener.bind(d_address);
+    d_listener.listen(100);
+    socklen_t addrLen = d_address.getSocklen();
+    BOOST_REQUIRE_EQUAL(getsockname(d_listener.getHandle(), reinterpret_cast<struct sockaddr*>(&d_address), &addrLen), 0);
+  }
+
+  /* returns a connection to the server, the server side of it being kept until closeAll() is called */
+  TCPOutConnectionManager::Connection connect()
+  {
+    TCPOutConnectionManager::Connection connection;
+    connection.d_socket = std::make_shared<Socket>(AF_INET, SOCK_STREAM);
+    connection.d_socket->connect(d_address);
+    connection.d_socket->setNonBlocking();
+    d_accepted.push_back(std::unique_ptr<Socket>(d_listener.accept()));
+    return connection;
+  }
+
+  void closeAll()
+  {
+    d_accepted.clear();
+  }
+
+private:
+  Socket d_listener;
+  ComboAddress d_address;
+  std::vector<std::unique_ptr<Socket>> d_accepted;
+};
+
+/* restores the default settings when a test is done */
+class TCPOutSettings
+{
+public:
+  TCPOutSettings()
+  {
+    TCPOutConnectionManager::s_maxIdleTime = 10;
+    TCPOutConnectionManager::s_maxIdlePerAuth = 10;
+    TCPOutConnectionManager::s_maxIdlePerThread = 100;
+    TCPOutConnectionManager::s_maxQueries = 0;
+  }
+
+  ~TCPOutSettings()
+  {
+    TCPOutConnectionManager::s_maxIdleTime = 10;
+    TCPOutConnectionManager::s_maxIdlePerAuth = 10;
+    TCPOutConnectionManager::s_maxIdlePerThread = 100;
+    TCPOutConnectionManager::s_maxQueries = 0;
+  }
+};
+
+BOOST_AUTO_TEST_SUITE(rec_tcpout_cc)
+
+BOOST_AUTO_TEST_CASE(test_TCPOutGetStore) {
+  TCPOutSettings settings;
+  TCPOutTestServer server;
+  TCPOutConnectionManager manager;
+  const ComboAddress auth1("192.0.2.1:53");
+  const ComboAddress auth2("192.0.2.2:53");
+  const time_t now = time(nullptr);
+
+  /* nothing to reuse yet */
+  BOOST_CHECK(manager.get(auth1, now).d_socket == nullptr);
+  BOOST_CHECK_EQUAL(manager.size(), 0);
+
+  auto first = server.connect();
+  auto second = server.connect();
+  const int firstHandle = first.d_socket->getHandle();
+  const int secondHandle = second.d_socket->getHandle();
+  first.d_queries = 1;
+  manager.store(auth1, std::move(first), now);
+  manager.store(auth1, std::move(second), now);
+  BOOST_CHECK_EQUAL(manager.size(), 2);
+
+  /* connections are only handed out for the remote they were stored for */
+  BOOST_CHECK(manager.get(auth2, now).d_socket == nullptr);
+  BOOST_CHECK_EQUAL(manager.size(), 2);
+
+  /* the most recently used one first */
+  auto connection = manager.get(auth1, now);
+  BOOST_REQUIRE(connection.d_socket != nullptr);
+  BOOST_CHECK_EQUAL(connection.d_socket->getHandle(), secondHandle);
+  BOOST_CHECK_EQUAL(manager.size(), 1);
+
+  connection = manager.get(auth1, now);
+  BOOST_REQUIRE(connection.d_socket != nullptr);
+  BOOST_CHECK_EQUAL(connection.d_socket->getHandle(), firstHandle);
+  BOOST_CHECK_EQUAL(connection.d_queries, 1);
+  BOOST_CHECK_EQUAL(manager.size(), 0);
+
+  BOOST_CHECK(manager.get(auth1, now).d_socket == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(test_TCPOutMaxIdlePerAuth) {
+  TCPOutSettings settings;
+  TCPOutTestServer server;
+  TCPOutConnectionManager manager;
+  const ComboAddress auth1("192.0.2.1:53");
+  const ComboAddress auth2("192.0.2.2:53");
+  const time_t now = time(nullptr);
+
+  TCPOutConnectionManager::s_maxIdlePerAuth = 2;
+  for (size_t idx = 0; idx < 3; idx++) {
+    manager.store(auth1, server.connect(), now);
+    manager.store(auth2, server.connect(), now);
+  }
+  BOOST_CHECK_EQUAL(manager.size(), 4);
+
+  size_t reused = 0;
+  while (manager.get(auth1, now).d_socket != nullptr) {
+    reused++;
+  }
+  BOOST_CHECK_EQUAL(reused, 2);
+  BOOST_CHECK_EQUAL(manager.size(), 2);
+
+  /* 0 disables the reuse of connections */
+  TCPOutConnectionManager::s_maxIdlePerAuth = 0;
+  manager.store(auth1, server.connect(), now);
+  BOOST_CHECK(manager.get(auth1, now).d_socket == nullptr);
+  BOOST_CHECK_EQUAL(manager.size(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_TCPOutMaxIdlePerThread) {
+  TCPOutSettings settings;
+  TCPOutTestServer server;
+  TCPOutConnectionManager manager;
+  const time_t now = time(nullptr);
+
+  TCPOutConnectionManager::s_maxIdlePerThread = 5;
+  for (uint16_t idx = 0; idx < 10; idx++) {
+    manager.store(ComboAddress("192.0.2.1", 53 + idx), server.connect(), now);
+  }
+  BOOST_CHECK_EQUAL(manager.size(), 5);
+
+  size_t reused = 0;
+  for (uint16_t idx = 0; idx < 10; idx++) {
+    if (manager.get(ComboAddress("192.0.2.1", 53 + idx), now).d_socket != nullptr) {
+      BOOST_CHECK_LT(idx, 5);
+      reused++;
+    }
+  }
+  BOOST_CHECK_EQUAL(reused, 5);
+  BOOST_CHECK_EQUAL(manager.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_TCPOutMaxQueries) {
+  TCPOutSettings settings;
+  TCPOutTestServer server;
+  TCPOutConnectionManager manager;
+  const ComboAddress auth("192.0.2.1:53");
+  const time_t now = time(nullptr);
+
+  TCPOutConnectionManager::s_maxQueries = 2;
+  auto connection = server.connect();
+  connection.d_queries = 1;
+  manager.store(auth, std::move(connection), now);
+  BOOST_CHECK_EQUAL(manager.size(), 1);
+
+  connection = manager.get(auth, now);
+  BOOST_REQUIRE(connection.d_socket != nullptr);
+  connection.d_queries++;
+  /* it has been used for the maximum number of queries, closed instead of being stored */
+  manager.store(auth, std::move(connection), now);
+  BOOST_CHECK_EQUAL(manager.size(), 0);
+  BOOST_CHECK(manager.get(auth, now).d_socket == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(test_TCPOutIdleExpiry) {
+  TCPOutSettings settings;
+  TCPOutTestServer server;
+  TCPOutConnectionManager manager;
+  const ComboAddress auth("192.0.2.1:53");
+  const time_t now = time(nullptr);
+
+  TCPOutConnectionManager::s_maxIdleTime = 5;
+  manager.store(auth, server.connect(), now);
+  manager.store(auth, server.connect(), now + 3);
+  BOOST_CHECK_EQUAL(manager.size(), 2);
+
+  /* the most recent one is still fresh */
+  auto connection = manager.get(auth, now + 5);
+  BOOST_CHECK(connection.d_socket != nullptr);
+  BOOST_CHECK_EQUAL(manager.size(), 1);
+
+  /* the other one has been idle for too long, it is closed instead of being handed out */
+  BOOST_CHECK(manager.get(auth, now + 5).d_socket == nullptr);
+  BOOST_CHECK_EQUAL(manager.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_TCPOutCleanup) {
+  TCPOutSettings settings;
+  TCPOutTestServer server;
+  TCPOutTestServer otherServer;
+  TCPOutConnectionManager manager;
+  const ComboAddress auth1("192.0.2.1:53");
+  const ComboAddress auth2("192.0.2.2:53");
+  const time_t now = time(nullptr);
+
+  TCPOutConnectionManager::s_maxIdleTime = 5;
+  manager.store(auth1, server.connect(), now);
+  manager.store(auth1, otherServer.connect(), now + 3);
+  manager.store(auth2, otherServer.connect(), now + 3);
+  BOOST_CHECK_EQUAL(manager.size(), 3);
+
+  /* nothing to do */
+  BOOST_CHECK_EQUAL(manager.cleanup(now + 4), 0);
+  BOOST_CHECK_EQUAL(manager.size(), 3);
+
+  /* the first one has expired */
+  BOOST_CHECK_EQUAL(manager.cleanup(now + 5), 1);
+  BOOST_CHECK_EQUAL(manager.size(), 2);
+
+  /* the other ones have been closed by the remote end */
+  otherServer.closeAll();
+  BOOST_CHECK_EQUAL(manager.cleanup(now + 5), 2);
+  BOOST_CHECK_EQUAL(manager.size(), 0);
+  BOOST_CHECK(manager.get(auth1, now + 5).d_socket == nullptr);
+  BOOST_CHECK(manager.get(auth2, now + 5).d_socket == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(test_TCPOutNoReuseAfterError) {
+  TCPOutSettings settings;
+  TCPOutTestServer server;
+  TCPOutTestServer otherServer;
+  TCPOutConnectionManager manager;
+  const ComboAddress auth("192.0.2.1:53");
+  const time_t now = time(nullptr);
+
+  auto usable = server.connect();
+  const int usableHandle = usable.d_socket->getHandle();
+  manager.store(auth, std::move(usable), now);
+  manager.store(auth, otherServer.connect(), now);
+  BOOST_CHECK_EQUAL(manager.size(), 2);
+
+  /* the remote end closed the most recent connection after it had been stored,
+     so the next query gets the older one instead */
+  otherServer.closeAll();
+  auto connection = manager.get(auth, now);
+  BOOST_REQUIRE(connection.d_socket != nullptr);
+  BOOST_CHECK_EQUAL(connection.d_socket->getHandle(), usableHandle);
+  BOOST_CHECK_EQUAL(manager.size(), 0);
+
+  /* and once that one is gone too, a new connection has to be opened */
+  server.closeAll();
+  manager.store(auth, std::move(connection), now);
+  BOOST_CHECK_EQUAL(manager.size(), 1);
+  BOOST_CHECK(manager.get(auth, now).d_socket == nullptr);
+  BOOST_CHECK_EQUAL(manager.size(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
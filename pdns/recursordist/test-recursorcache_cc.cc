@@ -7,6 +7,8 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/test/floating_point_comparison.hpp>
 
+#include <thread>
+
 #include "iputils.hh"
 #include "recursor_cache.hh"
 
@@ -341,7 +343,8 @@ BOOST_AUTO_TEST_CASE(test_RecursorCacheSimple) {
 }
 
 BOOST_AUTO_TEST_CASE(test_RecursorCache_ExpungingExpiredEntries) {
-  MemRecursorCache MRC;
+  /* a single shard, since we check the order in which entries are expunged */
+  MemRecursorCache MRC(1);
 
   std::vector<DNSRecord> records;
   std::vector<std::shared_ptr<RRSIGRecordContent>> signatures;
@@ -430,7 +433,8 @@ BOOST_AUTO_TEST_CASE(test_RecursorCache_ExpungingExpiredEntries) {
 }
 
 BOOST_AUTO_TEST_CASE(test_RecursorCache_ExpungingValidEntries) {
-  MemRecursorCache MRC;
+  /* a single shard, since we check the order in which entries are expunged */
+  MemRecursorCache MRC(1);
 
   std::vector<DNSRecord> records;
   std::vector<std::shared_ptr<RRSIGRecordContent>> signatures;
@@ -772,4 +776,118 @@ BOOST_AUTO_TEST_CASE(test_RecursorCacheECSIndex) {
   BOOST_CHECK_EQUAL(MRC.ecsIndexSize(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(test_RecursorCacheSharded) {
+  MemRecursorCache MRC(16);
+
+  std::vector<DNSRecord> records;
+  std::vector<std::shared_ptr<DNSRecord>> authRecords;
+  std::vector<std::shared_ptr<RRSIGRecordContent>> signatures;
+  const time_t now = time(nullptr);
+  const ComboAddress who("192.0.2.1");
+
+  DNSRecord dr;
+  dr.d_type = QType::A;
+  dr.d_class = QClass::IN;
+  dr.d_content = std::make_shared<ARecordContent>(ComboAddress("192.0.2.2"));
+  dr.d_ttl = static_cast<uint32_t>(now + 30);
+  dr.d_place = DNSResourceRecord::ANSWER;
+  records.push_back(dr);
+
+  /* names are spread over the shards, but a name and its subdomains can still be wiped */
+  for (size_t idx = 0; idx < 1000; idx++) {
+    MRC.replace(now, DNSName("www" + std::to_string(idx) + ".powerdns.com."), QType(QType::A), records, signatures, authRecords, true, boost::none);
+    MRC.replace(now, DNSName("www" + std::to_string(idx) + ".powerdns.org."), QType(QType::A), records, signatures, authRecords, true, boost::none);
+  }
+  BOOST_CHECK_EQUAL(MRC.size(), 2000);
+
+  /* the case of the name does not matter to select the shard */
+  std::vector<DNSRecord> retrieved;
+  BOOST_CHECK_EQUAL(MRC.get(now, DNSName("WwW42.PowerDNS.com."), QType(QType::A), false, &retrieved, who), 30);
+  BOOST_CHECK_EQUAL(retrieved.size(), 1);
+
+  BOOST_CHECK_EQUAL(MRC.doWipeCache(DNSName("powerdns.com."), true), 1000);
+  BOOST_CHECK_EQUAL(MRC.size(), 1000);
+  BOOST_CHECK_EQUAL(MRC.get(now, DNSName("www42.powerdns.com."), QType(QType::A), false, &retrieved, who), -1);
+  BOOST_CHECK_EQUAL(MRC.get(now, DNSName("www42.powerdns.org."), QType(QType::A), false, &retrieved, who), 30);
+
+  /* pruning keeps the requested number of entries over all the shards, give or take the rounding */
+  MRC.doPrune(500);
+  BOOST_CHECK_LE(MRC.size(), 500);
+  BOOST_CHECK_GE(MRC.size(), 500 - 16);
+
+  BOOST_CHECK_GT(MRC.getAcquired(), 0);
+  BOOST_CHECK_LE(MRC.getContended(), MRC.getAcquired());
+}
+
+/* Not really a test, but a benchmark showing how the shared cache scales with the
+   number of threads depending on the number of shards. It only checks that every
+   thread got the expected results, and reports the timings and lock contention.
+   It takes a while and is noisy on a busy machine, so it is only run when
+   PDNS_TEST_BENCHMARKS is set. */
+BOOST_AUTO_TEST_CASE(test_RecursorCacheShardedBenchmark) {
+  if (!getenv("PDNS_TEST_BENCHMARKS")) {
+    BOOST_TEST_MESSAGE("skipping the record cache benchmark, set PDNS_TEST_BENCHMARKS to run it");
+    return;
+  }
+
+  const size_t numberOfNames = 10000;
+  const size_t numberOfLookups = 100000;
+  const time_t now = time(nullptr);
+  const ComboAddress who("192.0.2.1");
+
+  std::vector<DNSName> names;
+  for (size_t idx = 0; idx < numberOfNames; idx++) {
+    names.push_back(DNSName("name" + std::to_string(idx) + ".powerdns.com."));
+  }
+
+  DNSRecord dr;
+  dr.d_type = QType::A;
+  dr.d_class = QClass::IN;
+  dr.d_content = std::make_shared<ARecordContent>(ComboAddress("192.0.2.2"));
+  dr.d_ttl = static_cast<uint32_t>(now + 3600);
+  dr.d_place = DNSResourceRecord::ANSWER;
+  const std::vector<DNSRecord> records{dr};
+  const std::vector<std::shared_ptr<DNSRecord>> authRecords;
+  const std::vector<std::shared_ptr<RRSIGRecordContent>> signatures;
+
+  for (const size_t shards : { 1, 1024 }) {
+    for (const size_t numberOfThreads : { 1, 4, 16 }) {
+      MemRecursorCache MRC(shards);
+      for (const auto& name : names) {
+        MRC.replace(now, name, QType(QType::A), records, signatures, authRecords, true, boost::none);
+      }
+
+      std::vector<std::thread> threads;
+      std::vector<size_t> hits(numberOfThreads, 0);
+      DTime dt;
+      dt.set();
+      for (size_t thread = 0; thread < numberOfThreads; thread++) {
+        threads.push_back(std::thread([&, thread]() {
+              std::vector<DNSRecord> retrieved;
+              for (size_t idx = 0; idx < numberOfLookups; idx++) {
+                const auto& name = names.at((idx * 7919 + thread) % numberOfNames);
+                if (MRC.get(now, name, QType(QType::A), false, &retrieved, who) > 0) {
+                  hits.at(thread)++;
+                }
+                /* one refresh every 100 lookups */
+                if (idx % 100 == 0) {
+                  MRC.replace(now, name, QType(QType::A), records, signatures, authRecords, true, boost::none);
+                }
+              }
+            }));
+      }
+      for (auto& thread : threads) {
+        thread.join();
+      }
+      const auto elapsed = std::max(dt.udiff(), 1);
+
+      for (const auto threadHits : hits) {
+        BOOST_CHECK_EQUAL(threadHits, numberOfLookups);
+      }
+      BOOST_CHECK_EQUAL(MRC.size(), numberOfNames);
+      BOOST_TEST_MESSAGE("record cache with " << shards << " shard(s), " << numberOfThreads << " thread(s): " << (numberOfThreads * numberOfLookups * 1000000.0 / elapsed) << " lookups/s, " << MRC.getContended() << " contended out of " << MRC.getAcquired() << " lock acquisitions");
+    }
+  }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1 @@
+../test-spsc-ring_hh.cc
\ No newline at end of file
@@ -1,6 +1,8 @@
+#include <climits>
 #include <unistd.h>
 #include "remote_logger.hh"
 #include "config.h"
+#include "misc.hh"
 #ifdef PDNS_CONFIG_ARGS
 #include "logger.hh"
 #define WE_ARE_RECURSOR
@@ -8,6 +10,147 @@
 #include "dolog.hh"
 #endif
 
+static size_t roundUpToPowerOfTwo(size_t value)
+{
+  size_t result = 1;
+  while (result < value) {
+    result <<= 1;
+  }
+  return result;
+}
+
+RemoteLoggerRing::RemoteLoggerRing(size_t capacity): d_capacity(roundUpToPowerOfTwo(std::max(capacity, static_cast<size_t>(64))))
+{
+  if (d_capacity > s_sizeMask) {
+    throw std::runtime_error("The capacity of a RemoteLoggerRing cannot exceed " + std::to_string(s_sizeMask) + " bytes");
+  }
+  d_mask = d_capacity - 1;
+  /* value-initialized, so every header starts uncommitted */
+  d_headers = std::unique_ptr<std::atomic<uint32_t>[]>(new std::atomic<uint32_t>[d_capacity / sizeof(uint32_t)]());
+}
+
+bool RemoteLoggerRing::write(size_t size, const std::function<void(char*)>& writer)
+{
+  if (size == 0 || size > getMaxRecordSize()) {
+    return false;
+  }
+
+  const uint64_t needed = getRecordSize(size);
+  uint64_t head = d_head.load(std::memory_order_relaxed);
+  uint64_t padding;
+  do {
+    /* a record is never split, if it does not fit before the end of
+       the buffer we skip the remaining bytes and start over at 0 */
+    const uint64_t contiguous = d_capacity - (head & d_mask);
+    padding = needed <= contiguous ? 0 : contiguous;
+    /* acquire so that we see the consumer zeroing the space it released */
+    if (head + padding + needed - d_tail.load(std::memory_order_acquire) > d_capacity) {
+      return false;
+    }
+  }
+  while (!d_head.compare_exchange_weak(head, head + padding + needed, std::memory_order_relaxed));
+
+  if (padding > 0) {
+    getHeader(head).store(s_committed | s_padding | padding, std::memory_order_release);
+    head += padding;
+  }
+
+  try {
+    writer(getData(head));
+  }
+  catch (...) {
+    /* we can't leave an uncommitted record behind, the consumer would be stuck on it forever */
+    getHeader(head).store(s_committed | s_padding | needed, std::memory_order_release);
+    throw;
+  }
+
+  getHeader(head).store(s_committed | size, std::memory_order_release);
+
+  /* pairs with the fence in waitForData(): either the consumer sees our record,
+     or we see that it is waiting and wake it up */
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (d_consumerWaiting.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(d_waitMutex);
+    d_waitCond.notify_one();
+  }
+
+  return true;
+}
+
+bool RemoteLoggerRing::hasCommittedData()
+{
+  const uint64_t tail = d_tail.load(std::memory_order_relaxed);
+  if (tail == d_head.load(std::memory_order_acquire)) {
+    return false;
+  }
+  return getHeader(tail).load(std::memory_order_acquire) & s_committed;
+}
+
+size_t RemoteLoggerRing::peek(std::vector<struct iovec>& iovs, size_t maxRecords)
+{
+  uint64_t pos = d_tail.load(std::memory_order_relaxed);
+  const uint64_t head = d_head.load(std::memory_order_acquire);
+  size_t count = 0;
+
+  while (pos < head && count < maxRecords) {
+    const uint32_t header = getHeader(pos).load(std::memory_order_acquire);
+    if (!(header & s_committed)) {
+      /* still being written, the records after this one will have to wait */
+      break;
+    }
+
+    const size_t size = header & s_sizeMask;
+    if (header & s_padding) {
+      pos += size;
+      continue;
+    }
+
+    struct iovec iov;
+    iov.iov_base = getData(pos);
+    iov.iov_len = size;
+    iovs.push_back(iov);
+    pos += getRecordSize(size);
+    count++;
+  }
+
+  d_pendingEnd = pos;
+  return count;
+}
+
+void RemoteLoggerRing::release()
+{
+  uint64_t tail = d_tail.load(std::memory_order_relaxed);
+  char* buffer = reinterpret_cast<char*>(d_headers.get());
+
+  /* zero the released space, so that producers find uncommitted headers there,
+     wherever their records start */
+  while (tail < d_pendingEnd) {
+    const uint64_t offset = tail & d_mask;
+    const uint64_t toClear = std::min(d_pendingEnd - tail, d_capacity - offset);
+    memset(buffer + offset, 0, toClear);
+    tail += toClear;
+  }
+
+  d_tail.store(tail, std::memory_order_release);
+}
+
+void RemoteLoggerRing::waitForData(unsigned int timeoutMS)
+{
+  std::unique_lock<std::mutex> lock(d_waitMutex);
+  d_consumerWaiting.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!hasCommittedData()) {
+    d_waitCond.wait_for(lock, std::chrono::milliseconds(timeoutMS));
+  }
+  d_consumerWaiting.store(false, std::memory_order_relaxed);
+}
+
+void RemoteLoggerRing::wakeUp()
+{
+  std::lock_guard<std::mutex> lock(d_waitMutex);
+  d_waitCond.notify_one();
+}
+
 bool RemoteLogger::reconnect()
 {
   if (d_socket >= 0) {
@@ -34,23 +177,63 @@ bool RemoteLogger::reconnect()
 
 void RemoteLogger::busyReconnectLoop()
 {
-  while (!reconnect()) {
+  while (!d_exiting && !reconnect()) {
     sleep(d_reconnectWaitTime);
   }
 }
 
+void RemoteLogger::writeBatch(std::vector<struct iovec>& iovs)
+{
+  size_t pos = 0;
+  while (pos < iovs.size()) {
+    ssize_t res = writev(d_socket, &iovs.at(pos), std::min(iovs.size() - pos, static_cast<size_t>(IOV_MAX)));
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        throw std::runtime_error("Error writing to remote logger: " + stringerror());
+      }
+      if (waitForRWData(d_socket, false, d_timeout, 0) <= 0) {
+        throw std::runtime_error("Timeout writing to remote logger");
+      }
+      continue;
+    }
+
+    /* skip what has been written, possibly ending in the middle of a record */
+    size_t written = static_cast<size_t>(res);
+    while (pos < iovs.size() && written >= iovs.at(pos).iov_len) {
+      written -= iovs.at(pos).iov_len;
+      pos++;
+    }
+    if (written > 0) {
+      iovs.at(pos).iov_base = reinterpret_cast<char*>(iovs.at(pos).iov_base) + written;
+      iovs.at(pos).iov_len -= written;
+    }
+  }
+}
+
 void RemoteLogger::worker()
 {
+  std::vector<struct iovec> iovs;
+  iovs.reserve(s_maxBatchSize);
+
   while(true) {
-    std::string data;
-    {
-      std::unique_lock<std::mutex> lock(d_writeMutex);
-      d_queueCond.wait(lock, [this]{return (!d_writeQueue.empty()) || d_exiting;});
-      if (d_exiting) {
-        return;
-      }
-      data = d_writeQueue.front();
-      d_writeQueue.pop();
+    d_ring.waitForData(1000);
+    if (d_exiting) {
+      return;
+    }
+
+    iovs.clear();
+    const size_t count = d_ring.peek(iovs, s_maxBatchSize);
+    if (count == 0) {
+      continue;
+    }
+
+    /* records hold the 16-bit size prefix followed by the message */
+    size_t bytes = 0;
+    for (const auto& iov : iovs) {
+      bytes += iov.iov_len - sizeof(uint16_t);
     }
 
     if (!d_connected) {
@@ -58,8 +241,8 @@ void RemoteLogger::worker()
     }
 
     try {
-      uint16_t len = static_cast<uint16_t>(data.length());
-      sendSizeAndMsgWithTimeout(d_socket, len, data.c_str(), static_cast<int>(d_timeout), nullptr, nullptr, 0, 0, 0);
+      writeBatch(iovs);
+      d_flushedBytes += bytes;
     }
     catch(const std::runtime_error& e) {
 #ifdef WE_ARE_RECURSOR
@@ -67,24 +250,30 @@ void RemoteLogger::worker()
 #else
       vinfolog("Error sending data to remote logger (%s): %s", d_remote.toStringWithPort(), e.what());
 #endif
+      d_droppedBytes += bytes;
       busyReconnectLoop();
     }
+
+    d_ring.release();
   }
 }
 
-void RemoteLogger::queueData(const std::string& data)
+bool RemoteLogger::queueData(size_t size, const std::function<void(char*)>& writer)
 {
-  {
-    std::unique_lock<std::mutex> lock(d_writeMutex);
-    if (d_writeQueue.size() >= d_maxQueuedEntries) {
-      d_writeQueue.pop();
-    }
-    d_writeQueue.push(data);
+  if (size > std::numeric_limits<uint16_t>::max() || !d_ring.write(size + sizeof(uint16_t), [&writer, size](char* out) {
+        const uint16_t len = htons(static_cast<uint16_t>(size));
+        memcpy(out, &len, sizeof(len));
+        writer(out + sizeof(len));
+      })) {
+    d_droppedBytes += size;
+    return false;
   }
-  d_queueCond.notify_one();
+
+  d_queuedBytes += size;
+  return true;
 }
 
-RemoteLogger::RemoteLogger(const ComboAddress& remote, uint16_t timeout, uint64_t maxQueuedEntries, uint8_t reconnectWaitTime, bool asyncConnect): d_remote(remote), d_maxQueuedEntries(maxQueuedEntries), d_timeout(timeout), d_reconnectWaitTime(reconnectWaitTime), d_asyncConnect(asyncConnect), d_thread(&RemoteLogger::worker, this)
+RemoteLogger::RemoteLogger(const ComboAddress& remote, uint16_t timeout, uint64_t maxQueuedEntries, uint8_t reconnectWaitTime, bool asyncConnect): d_remote(remote), d_ring(std::max(maxQueuedEntries * s_averageEntrySize, static_cast<uint64_t>(s_minRingSize))), d_timeout(timeout), d_reconnectWaitTime(reconnectWaitTime), d_asyncConnect(asyncConnect), d_thread(&RemoteLogger::worker, this)
 {
   if (!d_asyncConnect) {
     reconnect();
@@ -94,11 +283,11 @@ RemoteLogger::RemoteLogger(const ComboAddress& remote, uint16_t timeout, uint64_
 RemoteLogger::~RemoteLogger()
 {
   d_exiting = true;
+  d_ring.wakeUp();
+  d_thread.join();
   if (d_socket >= 0) {
     close(d_socket);
     d_socket = -1;
     d_connected = false;
   }
-  d_queueCond.notify_one();
-  d_thread.join();
 }
@@ -26,17 +26,127 @@
 
 #include <atomic>
 #include <condition_variable>
-#include <queue>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
+#include <sys/uio.h>
+#include <boost/noncopyable.hpp>
 
 #include "iputils.hh"
 
+/* A preallocated, lock-free, multiple-producers single-consumer ring of
+   variable-sized records. Producers reserve room for a record with a single
+   CAS, serialize directly into the ring then commit the record. The consumer
+   walks the committed records in order, hands them over to writev() and only
+   then releases the space. */
+class RemoteLoggerRing : public boost::noncopyable
+{
+public:
+  /* the capacity is rounded up to the next power of two */
+  RemoteLoggerRing(size_t capacity);
+
+  /* returns false, without calling writer, if there is not enough room left */
+  bool write(size_t size, const std::function<void(char*)>& writer);
+
+  /* consumer side: append up to maxRecords committed records to iovs, and
+     remember them so that they can be released by a subsequent release() */
+  size_t peek(std::vector<struct iovec>& iovs, size_t maxRecords);
+  void release();
+  /* consumer side: wait until there is at least one committed record, a wakeUp() call
+     or the timeout expires */
+  void waitForData(unsigned int timeoutMS);
+  void wakeUp();
+
+  size_t getCapacity() const
+  {
+    return d_capacity;
+  }
+  size_t getMaxRecordSize() const
+  {
+    return d_capacity / 2 - sizeof(uint32_t);
+  }
+  size_t getUsedBytes() const
+  {
+    return d_head.load(std::memory_order_relaxed) - d_tail.load(std::memory_order_relaxed);
+  }
+
+private:
+  static const uint32_t s_committed = (1U << 31);
+  static const uint32_t s_padding = (1U << 30);
+  static const uint32_t s_sizeMask = s_padding - 1;
+  static const size_t s_cacheLineSize = 64;
+
+  static size_t getRecordSize(size_t size)
+  {
+    /* header, then data, aligned so that the next header is too */
+    return (sizeof(uint32_t) + size + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+  }
+  std::atomic<uint32_t>& getHeader(uint64_t pos)
+  {
+    return d_headers[(pos & d_mask) / sizeof(uint32_t)];
+  }
+  char* getData(uint64_t pos)
+  {
+    return reinterpret_cast<char*>(d_headers.get()) + (pos & d_mask) + sizeof(uint32_t);
+  }
+  bool hasCommittedData();
+
+  /* the buffer is made of uint32_t-sized atomic words so that record headers can be
+     accessed atomically, the data itself is written as plain bytes */
+  std::unique_ptr<std::atomic<uint32_t>[]> d_headers;
+  std::mutex d_waitMutex;
+  std::condition_variable d_waitCond;
+  size_t d_capacity;
+  uint64_t d_mask;
+  uint64_t d_pendingEnd{0};
+  /* producers only touch d_head, the consumer only writes to d_tail,
+     keep them on different cache lines. This is done with explicit padding
+     since the ring is allocated with new, which does not honour over-aligned types */
+  char d_headPadding[s_cacheLineSize];
+  std::atomic<uint64_t> d_head{0};
+  char d_tailPadding[s_cacheLineSize - sizeof(std::atomic<uint64_t>)];
+  std::atomic<uint64_t> d_tail{0};
+  std::atomic<bool> d_consumerWaiting{false};
+};
+
 class RemoteLoggerInterface
 {
 public:
   virtual ~RemoteLoggerInterface() {};
-  virtual void queueData(const std::string& data) = 0;
+  void queueData(const std::string& data)
+  {
+    queueData(data.size(), [&data](char* out) { memcpy(out, data.data(), data.size()); });
+  }
+  /* serialize a message (DNSProtoBufMessage, DnstapMessage) directly into the queue,
+     without going through an intermediate string */
+  template<typename T> bool queueMessage(const T& message)
+  {
+    const size_t size = message.serializedSize();
+    return queueData(size, [&message, size](char* out) { message.serialize(out, size); });
+  }
+  /* reserve size bytes in the queue, writer being called to fill them */
+  virtual bool queueData(size_t size, const std::function<void(char*)>& writer) = 0;
   virtual std::string toString() = 0;
+
+  uint64_t getQueuedBytes() const
+  {
+    return d_queuedBytes.load(std::memory_order_relaxed);
+  }
+  uint64_t getDroppedBytes() const
+  {
+    return d_droppedBytes.load(std::memory_order_relaxed);
+  }
+  uint64_t getFlushedBytes() const
+  {
+    return d_flushedBytes.load(std::memory_order_relaxed);
+  }
+protected:
+  std::atomic<uint64_t> d_queuedBytes{0};
+  std::atomic<uint64_t> d_droppedBytes{0};
+  std::atomic<uint64_t> d_flushedBytes{0};
 };
 
 class RemoteLogger : public RemoteLoggerInterface
@@ -44,7 +154,8 @@ class RemoteLogger : public RemoteLoggerInterface
 public:
   RemoteLogger(const ComboAddress& remote, uint16_t timeout=2, uint64_t maxQueuedEntries=100, uint8_t reconnectWaitTime=1, bool asyncConnect=false);
   virtual ~RemoteLogger();
-  virtual void queueData(const std::string& data) override;
+  using RemoteLoggerInterface::queueData;
+  virtual bool queueData(size_t size, const std::function<void(char*)>& writer) override;
   virtual std::string toString() override
   {
     return "RemoteLogger to " + d_remote.toStringWithPort();
@@ -53,12 +164,16 @@ private:
   void busyReconnectLoop();
   bool reconnect();
   void worker();
+  void writeBatch(std::vector<struct iovec>& iovs);
+
+  /* the ring holds about maxQueuedEntries messages of that size */
+  static const size_t s_averageEntrySize = 1024;
+  /* large enough for the biggest message we can send, since the size is sent over 16 bits */
+  static const size_t s_minRingSize = 256 * 1024;
+  static const size_t s_maxBatchSize = 512;
 
-  std::queue<std::string> d_writeQueue;
-  std::mutex d_writeMutex;
-  std::condition_variable d_queueCond;
   ComboAddress d_remote;
-  uint64_t d_maxQueuedEntries;
+  RemoteLoggerRing d_ring;
   int d_socket{-1};
   uint16_t d_timeout;
   uint8_t d_reconnectWaitTime;
@@ -0,0 +1,126 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <new>
+
+/* A counter that is incremented very often by several threads and read from
+   time to time, for statistics. Instead of a single std::atomic, whose cache line
+   would bounce between all the CPUs incrementing it, each thread increments its own
+   shard, living in its own cache line, and readers sum all the shards.
+
+   A thread gets assigned a shard the first time it updates any counter, and keeps
+   using the same shard index for all counters. If there are more threads than
+   shards, some threads share a shard, which is still correct, just slower.
+
+   Reading the value is not a snapshot: increments done concurrently with load()
+   may or may not be accounted for, which is fine for statistics. */
+class ShardedCounter
+{
+public:
+  ShardedCounter(uint64_t value = 0): d_storage(new char[(s_numberOfShards + 1) * s_cacheLineSize])
+  {
+    /* new[] only guarantees the alignment of max_align_t, make sure that the shards
+       start on a cache line boundary */
+    const auto address = reinterpret_cast<uintptr_t>(d_storage.get());
+    d_shards = reinterpret_cast<Shard*>((address + s_cacheLineSize - 1) & ~(static_cast<uintptr_t>(s_cacheLineSize) - 1));
+    for (size_t idx = 0; idx < s_numberOfShards; idx++) {
+      new (&d_shards[idx]) Shard();
+    }
+    d_shards[0].value.store(value, std::memory_order_relaxed);
+  }
+
+  ShardedCounter(const ShardedCounter&) = delete;
+  ShardedCounter& operator=(const ShardedCounter&) = delete;
+
+  /* the increment operators do not return the new value, since the value of
+     the shard of the current thread is meaningless and computing the sum
+     defeats the purpose */
+  void operator++()
+  {
+    getLocalShard().fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void operator++(int)
+  {
+    getLocalShard().fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void operator+=(uint64_t value)
+  {
+    getLocalShard().fetch_add(value, std::memory_order_relaxed);
+  }
+
+  uint64_t load() const
+  {
+    uint64_t result = 0;
+    for (size_t idx = 0; idx < s_numberOfShards; idx++) {
+      result += d_shards[idx].value.load(std::memory_order_relaxed);
+    }
+    return result;
+  }
+
+  operator uint64_t() const
+  {
+    return load();
+  }
+
+  /* increments done concurrently with store() might be lost */
+  void store(uint64_t value)
+  {
+    for (size_t idx = 1; idx < s_numberOfShards; idx++) {
+      d_shards[idx].value.store(0, std::memory_order_relaxed);
+    }
+    d_shards[0].value.store(value, std::memory_order_relaxed);
+  }
+
+  static const size_t s_numberOfShards = 32;
+
+private:
+  static const size_t s_cacheLineSize = 64;
+
+  struct Shard
+  {
+    std::atomic<uint64_t> value{0};
+    char padding[s_cacheLineSize - sizeof(std::atomic<uint64_t>)];
+  };
+  static_assert(sizeof(Shard) == s_cacheLineSize, "a shard should fill exactly one cache line");
+
+  static size_t getShardIndex()
+  {
+    static std::atomic<size_t> s_nextShard{0};
+    /* assigned the first time a given thread updates a counter */
+    static thread_local size_t t_shardIndex = s_nextShard++ % s_numberOfShards;
+    return t_shardIndex;
+  }
+
+  std::atomic<uint64_t>& getLocalShard()
+  {
+    return d_shards[getShardIndex()].value;
+  }
+
+  std::unique_ptr<char[]> d_storage;
+  Shard* d_shards{nullptr};
+};
@@ -7,6 +7,11 @@
 #include "dnswriter.hh"
 #include "dnsrecords.hh"
 #include <fstream>
+#ifdef HAVE_PROTOBUF
+#include <boost/uuid/uuid_generators.hpp>
+#include "protobuf.hh"
+#include "protobuf-encoder.hh"
+#endif
 
 #ifndef RECURSOR
 #include "statbag.hh"
@@ -779,6 +784,107 @@ struct B64DecodeTest
 };
 
 
+#ifdef HAVE_PROTOBUF
+vector<uint8_t> makeProtoBufResponse()
+{
+  vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, DNSName("www.powerdns.com"), QType::A);
+  pw.getHeader()->qr = 1;
+
+  pw.startRecord(DNSName("www.powerdns.com"), QType::CNAME, 3600, 1, DNSResourceRecord::ANSWER);
+  auto drc = DNSRecordContent::makeunique(QType::CNAME, 1, "powerdns.com.");
+  drc->toPacket(pw);
+
+  for (unsigned int idx = 1; idx <= 8; idx++) {
+    pw.startRecord(DNSName("powerdns.com"), QType::A, 300, 1, DNSResourceRecord::ANSWER);
+    drc = DNSRecordContent::makeunique(QType::A, 1, "192.0.2." + std::to_string(idx));
+    drc->toPacket(pw);
+  }
+
+  pw.commit();
+  return packet;
+}
+
+/* both fill a PBDNSMessage for the same response as dnsdist's RemoteLogResponseAction does,
+   the first one via libprotobuf, the second one via PBDNSMessageEncoder */
+static const ComboAddress s_pbRequestor("192.0.2.42:53000");
+static const ComboAddress s_pbResponder("192.0.2.1:53");
+static const boost::uuids::uuid s_pbUUID = boost::uuids::random_generator()();
+
+static void makeProtoBufResponseLibProtoBuf(const vector<uint8_t>& packet, std::string& out)
+{
+  DNSProtoBufMessage message(DNSProtoBufMessage::Response, s_pbUUID, &s_pbRequestor, &s_pbResponder, DNSName("www.powerdns.com"), QType::A, QClass::IN, htons(42), false, packet.size());
+  /* fixed, so that both outputs can be compared */
+  message.setTime(1500000000, 42);
+  message.setQueryTime(1500000000, 41);
+  message.setResponseCode(RCode::NoError);
+  message.addRRsFromPacket(reinterpret_cast<const char*>(packet.data()), packet.size(), true);
+  message.serialize(out);
+}
+
+static void makeProtoBufResponseEncoder(const vector<uint8_t>& packet, std::string& out)
+{
+  PBDNSMessageEncoder encoder(out);
+  encoder.setType(PBDNSMessageEncoder::MessageType::Response);
+  encoder.setMessageId(s_pbUUID);
+  encoder.setSocketFamily(s_pbRequestor);
+  encoder.setSocketProtocol(false);
+  encoder.setRequestor(s_pbRequestor);
+  encoder.setResponder(s_pbResponder);
+  encoder.setBytes(packet.size());
+  encoder.setTime(1500000000, 42);
+  encoder.setId(42);
+  encoder.setQuestion(DNSName("www.powerdns.com"), QType::A, QClass::IN);
+  encoder.startResponse();
+  encoder.setResponseCode(RCode::NoError);
+  encoder.addRRsFromPacket(reinterpret_cast<const char*>(packet.data()), packet.size(), true);
+  encoder.setQueryTime(1500000000, 41);
+  encoder.endResponse();
+}
+
+struct ProtoBufResponseLibProtoBufTest
+{
+  explicit ProtoBufResponseLibProtoBufTest(const vector<uint8_t>& packet): d_packet(packet)
+  {
+  }
+
+  string getName() const
+  {
+    return "protobuf response serialization via libprotobuf";
+  }
+
+  void operator()() const
+  {
+    std::string out;
+    makeProtoBufResponseLibProtoBuf(d_packet, out);
+  }
+
+  const vector<uint8_t>& d_packet;
+};
+
+struct ProtoBufResponseEncoderTest
+{
+  explicit ProtoBufResponseEncoderTest(const vector<uint8_t>& packet): d_packet(packet)
+  {
+  }
+
+  string getName() const
+  {
+    return "protobuf response serialization via PBDNSMessageEncoder";
+  }
+
+  void operator()() const
+  {
+    /* the buffer is reused, as in dnsdist and the recursor */
+    static std::string out;
+    out.clear();
+    makeProtoBufResponseEncoder(d_packet, out);
+  }
+
+  const vector<uint8_t>& d_packet;
+};
+#endif /* HAVE_PROTOBUF */
+
 struct NOPTest
 {
   string getName() const
@@ -877,6 +983,16 @@ try
   doRun(DNSNameParseTest());
   doRun(DNSNameRootTest());
 
+#ifdef HAVE_PROTOBUF
+  packet = makeProtoBufResponse();
+  std::string libProtoBufOut, encoderOut;
+  makeProtoBufResponseLibProtoBuf(packet, libProtoBufOut);
+  makeProtoBufResponseEncoder(packet, encoderOut);
+  cerr<<"protobuf response size: "<<encoderOut.size()<<", identical to libprotobuf: "<<(encoderOut == libProtoBufOut ? "yes" : "NO")<<endl;
+  doRun(ProtoBufResponseLibProtoBufTest(packet));
+  doRun(ProtoBufResponseEncoderTest(packet));
+#endif
+
   cerr<<"Total runs: " << g_totalRuns<<endl;
 
 }
@@ -0,0 +1,117 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+/* A bounded, lock-free queue with exactly one producer thread and one consumer thread.
+   The slots are allocated once, when the ring is created, and then reused: the producer
+   fills the slot returned by getWriteSlot() in place then publishes it with commit(),
+   the consumer reads the one returned by getReadSlot() then hands it back with release().
+   Each side only writes its own index, and keeps a cached copy of the other one so that
+   it does not need to touch the other side's cache line unless the ring looks full
+   (resp. empty). */
+template <typename T>
+class SPSCRing
+{
+public:
+  /* the capacity is rounded up to the next power of two */
+  explicit SPSCRing(size_t capacity)
+  {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    d_mask = size - 1;
+    d_slots = std::unique_ptr<T[]>(new T[size]);
+  }
+
+  SPSCRing(const SPSCRing&) = delete;
+  SPSCRing& operator=(const SPSCRing&) = delete;
+
+  /* producer side, returns nullptr if the ring is full */
+  T* getWriteSlot()
+  {
+    const size_t tail = d_tail.load(std::memory_order_relaxed);
+    if (tail - d_cachedHead > d_mask) {
+      d_cachedHead = d_head.load(std::memory_order_acquire);
+      if (tail - d_cachedHead > d_mask) {
+        return nullptr;
+      }
+    }
+    return &d_slots[tail & d_mask];
+  }
+
+  /* producer side, publishes the slot returned by the last call to getWriteSlot() */
+  void commit()
+  {
+    d_tail.store(d_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /* consumer side, returns nullptr if the ring is empty */
+  T* getReadSlot()
+  {
+    const size_t head = d_head.load(std::memory_order_relaxed);
+    if (head == d_cachedTail) {
+      d_cachedTail = d_tail.load(std::memory_order_acquire);
+      if (head == d_cachedTail) {
+        return nullptr;
+      }
+    }
+    return &d_slots[head & d_mask];
+  }
+
+  /* consumer side, gives back the slot returned by the last call to getReadSlot() */
+  void release()
+  {
+    d_head.store(d_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  size_t capacity() const
+  {
+    return d_mask + 1;
+  }
+
+  /* only exact when called from the producer or the consumer while the other side is idle */
+  size_t size() const
+  {
+    return d_tail.load(std::memory_order_acquire) - d_head.load(std::memory_order_acquire);
+  }
+
+private:
+  static const size_t s_cacheLineSize = 64;
+
+  std::unique_ptr<T[]> d_slots;
+  size_t d_mask;
+  /* keep the fields written by each side on their own cache lines. This is done
+     with explicit padding rather than alignas since rings are allocated with new,
+     which does not honour over-aligned types before C++17 */
+  char d_consumerPadding[s_cacheLineSize];
+  /* written by the consumer */
+  std::atomic<size_t> d_head{0};
+  size_t d_cachedTail{0};
+  char d_producerPadding[s_cacheLineSize];
+  /* written by the producer */
+  std::atomic<size_t> d_tail{0};
+  size_t d_cachedHead{0};
+};
@@ -644,6 +644,11 @@ public:
 
   void setQuerySource(const ComboAddress& requestor, boost::optional<const EDNSSubnetOpts&> incomingECS);
 
+  const boost::optional<Netmask>& getOutgoingECSNetwork() const
+  {
+    return d_outgoingECSNetwork;
+  }
+
 #ifdef HAVE_PROTOBUF
   void setInitialRequestId(boost::optional<const boost::uuids::uuid&> initialRequestId)
   {
@@ -873,7 +878,7 @@ struct PacketIDBirthdayCompare: public std::binary_function<PacketID, PacketID,
     return a.domain < b.domain;
   }
 };
-extern thread_local std::unique_ptr<MemRecursorCache> t_RC;
+extern std::unique_ptr<MemRecursorCache> g_recCache;
 extern thread_local std::unique_ptr<RecursorPacketCache> t_packetCache;
 typedef MTasker<PacketID,string> MT_t;
 MT_t* getMT();
@@ -912,6 +917,11 @@ struct RecursorStats
   std::atomic<uint64_t> noPingOutQueries, noEdnsOutQueries;
   std::atomic<uint64_t> packetCacheHits;
   std::atomic<uint64_t> noPacketError;
+  std::atomic<uint64_t> distributionQueueDrops;
+  std::atomic<uint64_t> tcpOutConnectionsOpened;
+  std::atomic<uint64_t> tcpOutConnectionsReused;
+  std::atomic<uint64_t> coalescedQueries;
+  std::atomic<uint64_t> coalescedTimeouts;
   std::atomic<uint64_t> ignoredCount;
   time_t startupTime;
   std::atomic<uint64_t> dnssecQueries;
@@ -973,7 +983,6 @@ ComboAddress parseIPAndPort(const std::string& input, uint16_t port);
 ComboAddress getQueryLocalAddress(int family, uint16_t port);
 typedef boost::function<void*(void)> pipefunc_t;
 void broadcastFunction(const pipefunc_t& func, bool skipSelf = false);
-void distributeAsyncFunction(const std::string& question, const pipefunc_t& func);
 
 int directResolve(const DNSName& qname, const QType& qtype, int qclass, vector<DNSRecord>& ret);
 
@@ -981,15 +990,11 @@ template<class T> T broadcastAccFunction(const boost::function<T*()>& func, bool
 
 std::shared_ptr<SyncRes::domainmap_t> parseAuthAndForwards();
 uint64_t* pleaseGetNsSpeedsSize();
-uint64_t* pleaseGetCacheSize();
 uint64_t* pleaseGetNegCacheSize();
-uint64_t* pleaseGetCacheHits();
-uint64_t* pleaseGetCacheMisses();
 uint64_t* pleaseGetConcurrentQueries();
 uint64_t* pleaseGetThrottleSize();
 uint64_t* pleaseGetPacketCacheHits();
 uint64_t* pleaseGetPacketCacheSize();
-uint64_t* pleaseWipeCache(const DNSName& canon, bool subtree=false);
 uint64_t* pleaseWipePacketCache(const DNSName& canon, bool subtree);
 uint64_t* pleaseWipeAndCountNegCache(const DNSName& canon, bool subtree=false);
 void doCarbonDump(void*);
@@ -0,0 +1,163 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_MODULE allocations
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist.hh"
+#include "dnsdist-cache.hh"
+#include "dnsdist-dynblocks.hh"
+#include "dnswriter.hh"
+#include "gettime.hh"
+
+/* This is built as a separate test program, 'testrunner-allocations', because it
+   replaces the global operator new to count the allocations done by the current thread,
+   which we don't want to do in the main testrunner. */
+
+bool g_console{true};
+bool g_syslog{true};
+bool g_verbose{true};
+
+static thread_local uint64_t t_allocationsCount{0};
+
+void* operator new(std::size_t size)
+{
+  t_allocationsCount++;
+  void* ptr = malloc(size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+  free(ptr);
+}
+
+BOOST_AUTO_TEST_SUITE(dnsdist_allocations)
+
+/* Goes through the same steps as processUDPQuery() does for a query answered from the
+   packet cache, from the point where the query has been received to the point where
+   the response is ready to be sent: parsing the qname, building the DNSQuestion,
+   inserting the query into the ring buffers, looking up the dynamic blocks, computing
+   the cache key and the view of the qname in wire format, copying the response and
+   building the DNSResponse. None of these should allocate once the per-thread state
+   has been set up. */
+BOOST_AUTO_TEST_CASE(test_UDPCacheHitDoesNotAllocate) {
+  DNSDistPacketCache PC(1000);
+  DNSDistPacketCache PCCompact(1000, 86400, 0, 60, 60, false, 1, true, 512);
+  DNSDistPacketCache PCL1(1000, 86400, 0, 60, 60, false, 1, true, 512, 0, 16);
+
+  Rings rings(100, 2);
+  PersistentNetmaskTree<DynBlock> dynNMGBlock;
+  DynBlock block;
+  block.reason = "test";
+  dynNMGBlock.insert(Netmask("192.0.2.0/24"), block);
+  /* dynamic blocks based on the qname are usually empty */
+  SuffixMatchTree<DynBlock> dynSMTBlock;
+
+  struct timespec queryTime;
+  gettime(&queryTime);  // does not have to be accurate ("realTime") in tests
+  const ComboAddress local("127.0.0.1:53");
+  const ComboAddress remote("198.51.100.42:4242");
+  /* short enough for the storage of the DNSName to fit in the object itself,
+     but not for a copy of it in wire format to fit in a std::string */
+  DNSName name("www.powerdns.com.");
+
+  vector<uint8_t> query;
+  DNSPacketWriter pwQ(query, name, QType::A, QClass::IN, 0);
+  pwQ.getHeader()->rd = 1;
+
+  vector<uint8_t> response;
+  DNSPacketWriter pwR(response, name, QType::A, QClass::IN, 0);
+  pwR.getHeader()->rd = 1;
+  pwR.getHeader()->ra = 1;
+  pwR.getHeader()->qr = 1;
+  pwR.getHeader()->id = pwQ.getHeader()->id;
+  pwR.startRecord(name, QType::A, 3600, QClass::IN, DNSResourceRecord::ANSWER);
+  pwR.xfr32BitInt(0x01020304);
+  pwR.commit();
+
+  /* like dnsdist does, the response is written over the query */
+  char packet[4096];
+  uint16_t packetSize = sizeof(packet);
+  uint32_t key = 0;
+
+  for (auto cache : { &PC, &PCCompact, &PCL1 }) {
+    DNSQuestion dq(&name, QType::A, QClass::IN, &local, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false, &queryTime);
+    BOOST_CHECK_EQUAL(cache->get(dq, name.wirelength(), 0, packet, &packetSize, &key), false);
+    cache->insert(key, name, QType::A, QClass::IN, (const char*) response.data(), response.size(), false, 0, boost::none);
+    /* fills the L1 cache, and the per-thread state */
+    packetSize = sizeof(packet);
+    BOOST_CHECK_EQUAL(cache->get(dq, name.wirelength(), 0, packet, &packetSize, &key), true);
+    rings.insertQuery(queryTime, remote, name, QType::A, query.size(), *dq.dh);
+
+    const uint64_t allocationsBefore = t_allocationsCount;
+    size_t hits = 0;
+    size_t blocked = 0;
+    for (size_t idx = 0; idx < 100; idx++) {
+      /* what recvmmsg() would have done */
+      memcpy(packet, query.data(), query.size());
+      const uint16_t len = query.size();
+
+      struct dnsheader* dh = reinterpret_cast<struct dnsheader*>(packet);
+      uint16_t qtype, qclass;
+      unsigned int consumed = 0;
+      DNSName qname(packet, len, sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+      DNSQuestion hitDQ(&qname, qtype, qclass, &local, &remote, dh, sizeof(packet), len, false, &queryTime);
+
+      /* processQuery() */
+      rings.insertQuery(queryTime, *hitDQ.remote, *hitDQ.qname, hitDQ.qtype, hitDQ.len, *hitDQ.dh);
+      if (dynNMGBlock.lookup(*hitDQ.remote) != nullptr || dynSMTBlock.lookup(*hitDQ.qname) != nullptr) {
+        blocked++;
+        continue;
+      }
+
+      uint16_t cachedResponseSize = hitDQ.size;
+      if (!cache->get(hitDQ, consumed, hitDQ.dh->id, packet, &cachedResponseSize, &key)) {
+        continue;
+      }
+
+      DNSResponse dr(hitDQ.qname, hitDQ.qtype, hitDQ.qclass, hitDQ.local, hitDQ.remote, reinterpret_cast<struct dnsheader*>(packet), hitDQ.size, cachedResponseSize, false, &queryTime);
+      dr.qTag = hitDQ.qTag;
+      packetSize = dr.len;
+      hits++;
+    }
+    const uint64_t allocations = t_allocationsCount - allocationsBefore;
+
+    BOOST_CHECK_EQUAL(hits, 100);
+    BOOST_CHECK_EQUAL(blocked, 0);
+    BOOST_CHECK_EQUAL(allocations, 0);
+    BOOST_REQUIRE_EQUAL(packetSize, response.size());
+    BOOST_CHECK_EQUAL(memcmp(packet, response.data(), packetSize), 0);
+  }
+  BOOST_CHECK_EQUAL(PCL1.getL1Hits(), 100);
+  BOOST_CHECK_EQUAL(rings.getQueries().size(), 100);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,154 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist-dynblocks.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdistdynblocks_cc)
+
+BOOST_AUTO_TEST_CASE(test_PersistentNetmaskTree_Lookup) {
+  PersistentNetmaskTree<int> tree;
+  BOOST_CHECK(tree.empty());
+  BOOST_CHECK(tree.lookup(ComboAddress("192.0.2.1")) == nullptr);
+
+  tree.insert(Netmask("192.0.2.0/24"), 24);
+  tree.insert(Netmask("192.0.2.128/25"), 25);
+  tree.insert(Netmask("192.0.2.42/32"), 32);
+  tree.insert(Netmask("0.0.0.0/0"), 0);
+  tree.insert(Netmask("2001:db8::/32"), 632);
+  tree.insert(Netmask("2001:db8::1/128"), 6128);
+  BOOST_CHECK_EQUAL(tree.size(), 6);
+
+  auto got = tree.lookup(ComboAddress("192.0.2.1"));
+  BOOST_REQUIRE(got != nullptr);
+  BOOST_CHECK_EQUAL(got->first.toString(), "192.0.2.0/24");
+  BOOST_CHECK_EQUAL(got->second, 24);
+  BOOST_CHECK_EQUAL(tree.lookup(ComboAddress("192.0.2.200"))->second, 25);
+  BOOST_CHECK_EQUAL(tree.lookup(ComboAddress("192.0.2.42"))->second, 32);
+  BOOST_CHECK_EQUAL(tree.lookup(ComboAddress("192.0.2.43"))->second, 24);
+  BOOST_CHECK_EQUAL(tree.lookup(ComboAddress("198.51.100.1"))->second, 0);
+  /* the IPv4 catch-all does not match IPv6 addresses */
+  BOOST_CHECK_EQUAL(tree.lookup(ComboAddress("2001:db8::1"))->second, 6128);
+  BOOST_CHECK_EQUAL(tree.lookup(ComboAddress("2001:db8::2"))->second, 632);
+  BOOST_CHECK(tree.lookup(ComboAddress("2001:db9::1")) == nullptr);
+
+  /* lookups by netmask only consider entries at most as specific */
+  BOOST_CHECK_EQUAL(tree.lookup(Netmask("192.0.2.42/32"))->second, 32);
+  BOOST_CHECK_EQUAL(tree.lookup(Netmask("192.0.2.42/30"))->second, 24);
+  BOOST_CHECK_EQUAL(tree.lookup(Netmask("2001:db8::1/64"))->second, 632);
+
+  /* replacing a value does not change the size */
+  tree.insert(Netmask("192.0.2.0/24"), 42);
+  BOOST_CHECK_EQUAL(tree.size(), 6);
+  BOOST_CHECK_EQUAL(tree.lookup(ComboAddress("192.0.2.1"))->second, 42);
+
+  size_t visited = 0;
+  tree.visit([&visited](const PersistentNetmaskTree<int>::node_type& node) {
+      visited++;
+      BOOST_CHECK(node.first.match(node.first.getNetwork()));
+    });
+  BOOST_CHECK_EQUAL(visited, tree.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_PersistentNetmaskTree_Erase) {
+  PersistentNetmaskTree<int> tree;
+  for (size_t idx = 0; idx < 256; idx++) {
+    tree.insert(Netmask(ComboAddress("10.0.0." + std::to_string(idx))), idx);
+  }
+  tree.insert(Netmask("10.0.0.0/8"), 8);
+  BOOST_CHECK_EQUAL(tree.size(), 257);
+
+  BOOST_CHECK(!tree.erase(Netmask("10.0.0.0/16")));
+  BOOST_CHECK(!tree.erase(Netmask("11.0.0.1/32")));
+  BOOST_CHECK_EQUAL(tree.size(), 257);
+
+  for (size_t idx = 0; idx < 256; idx += 2) {
+    BOOST_CHECK(tree.erase(Netmask(ComboAddress("10.0.0." + std::to_string(idx)))));
+  }
+  BOOST_CHECK_EQUAL(tree.size(), 129);
+  BOOST_CHECK_EQUAL(tree.lookup(ComboAddress("10.0.0.1"))->second, 1);
+  BOOST_CHECK_EQUAL(tree.lookup(ComboAddress("10.0.0.2"))->second, 8);
+
+  BOOST_CHECK(tree.erase(Netmask("10.0.0.0/8")));
+  BOOST_CHECK(tree.lookup(ComboAddress("10.0.0.2")) == nullptr);
+  BOOST_CHECK_EQUAL(tree.lookup(ComboAddress("10.0.0.255"))->second, 255);
+
+  for (size_t idx = 1; idx < 256; idx += 2) {
+    BOOST_CHECK(tree.erase(Netmask(ComboAddress("10.0.0." + std::to_string(idx)))));
+  }
+  BOOST_CHECK(tree.empty());
+  size_t visited = 0;
+  tree.visit([&visited](const PersistentNetmaskTree<int>::node_type&) { visited++; });
+  BOOST_CHECK_EQUAL(visited, 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_PersistentNetmaskTree_Copies) {
+  PersistentNetmaskTree<int> tree;
+  tree.insert(Netmask("192.0.2.0/24"), 1);
+  tree.insert(Netmask("2001:db8::/32"), 2);
+
+  /* changes made to a copy are not visible in the original one, and the other way around */
+  auto copy = tree;
+  copy.insert(Netmask("192.0.2.1/32"), 3);
+  copy.erase(Netmask("2001:db8::/32"));
+  tree.insert(Netmask("192.0.2.0/24"), 4);
+
+  BOOST_CHECK_EQUAL(tree.size(), 2);
+  BOOST_CHECK_EQUAL(tree.lookup(ComboAddress("192.0.2.1"))->second, 4);
+  BOOST_CHECK_EQUAL(tree.lookup(ComboAddress("2001:db8::1"))->second, 2);
+
+  BOOST_CHECK_EQUAL(copy.size(), 2);
+  BOOST_CHECK_EQUAL(copy.lookup(ComboAddress("192.0.2.1"))->second, 3);
+  BOOST_CHECK_EQUAL(copy.lookup(ComboAddress("192.0.2.2"))->second, 1);
+  BOOST_CHECK(copy.lookup(ComboAddress("2001:db8::1")) == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(test_DynBlockExpiryWheel) {
+  DynBlockExpiryWheel wheel;
+  std::vector<std::pair<Netmask, time_t>> expired;
+  const time_t now = time(nullptr);
+
+  wheel.getExpired(now, expired);
+  BOOST_CHECK(expired.empty());
+
+  wheel.add(Netmask("192.0.2.1/32"), now + 1);
+  wheel.add(Netmask("192.0.2.2/32"), now + 10);
+  /* more than a full round ahead */
+  wheel.add(Netmask("192.0.2.3/32"), now + DynBlockExpiryWheel::s_numberOfSlots + 1);
+  /* already expired */
+  wheel.add(Netmask("192.0.2.4/32"), now - 5);
+  BOOST_CHECK_EQUAL(wheel.size(), 4);
+
+  /* entries expire once their second is over */
+  wheel.getExpired(now + 1, expired);
+  BOOST_REQUIRE_EQUAL(expired.size(), 1);
+  BOOST_CHECK_EQUAL(expired.at(0).first.toString(), "192.0.2.4/32");
+  expired.clear();
+
+  wheel.getExpired(now + 2, expired);
+  BOOST_REQUIRE_EQUAL(expired.size(), 1);
+  BOOST_CHECK_EQUAL(expired.at(0).first.toString(), "192.0.2.1/32");
+  BOOST_CHECK_EQUAL(expired.at(0).second, now + 1);
+  expired.clear();
+
+  /* calling it again for the same second does nothing */
+  wheel.getExpired(now + 2, expired);
+  BOOST_CHECK(expired.empty());
+
+  wheel.getExpired(now + 20, expired);
+  BOOST_REQUIRE_EQUAL(expired.size(), 1);
+  BOOST_CHECK_EQUAL(expired.at(0).first.toString(), "192.0.2.2/32");
+  expired.clear();
+
+  /* its slot was visited one round earlier without expiring it, it only expires now */
+  wheel.getExpired(now + DynBlockExpiryWheel::s_numberOfSlots + 1, expired);
+  BOOST_CHECK(expired.empty());
+  BOOST_CHECK_EQUAL(wheel.size(), 1);
+  wheel.getExpired(now + DynBlockExpiryWheel::s_numberOfSlots + 2, expired);
+  BOOST_REQUIRE_EQUAL(expired.size(), 1);
+  BOOST_CHECK_EQUAL(expired.at(0).first.toString(), "192.0.2.3/32");
+  BOOST_CHECK_EQUAL(wheel.size(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
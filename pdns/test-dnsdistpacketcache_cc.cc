@@ -9,6 +9,8 @@
 #include "dnsdist-cache.hh"
 #include "gettime.hh"
 
+#include <thread>
+
 BOOST_AUTO_TEST_SUITE(dnsdistpacketcache_cc)
 
 BOOST_AUTO_TEST_CASE(test_PacketCacheSimple) {
@@ -160,6 +162,380 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheServFailTTL) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(test_PacketCacheCompactSimple) {
+  const size_t maxEntries = 150000;
+  DNSDistPacketCache PC(maxEntries, 86400, 1, 60, 60, false, 10, true, 512);
+  BOOST_CHECK_EQUAL(PC.getSize(), 0);
+  BOOST_CHECK_EQUAL(PC.getInlineEntrySize(), 512);
+  struct timespec queryTime;
+  gettime(&queryTime);  // does not have to be accurate ("realTime") in tests
+
+  size_t counter=0;
+  size_t skipped=0;
+  ComboAddress remote;
+  try {
+    for(counter = 0; counter < 100000; ++counter) {
+      DNSName a=DNSName(std::to_string(counter))+DNSName(" hello");
+
+      vector<uint8_t> query;
+      DNSPacketWriter pwQ(query, a, QType::A, QClass::IN, 0);
+      pwQ.getHeader()->rd = 1;
+
+      vector<uint8_t> response;
+      DNSPacketWriter pwR(response, a, QType::A, QClass::IN, 0);
+      pwR.getHeader()->rd = 1;
+      pwR.getHeader()->ra = 1;
+      pwR.getHeader()->qr = 1;
+      pwR.getHeader()->id = pwQ.getHeader()->id;
+      pwR.startRecord(a, QType::A, 100, QClass::IN, DNSResourceRecord::ANSWER);
+      pwR.xfr32BitInt(0x01020304);
+      pwR.commit();
+      uint16_t responseLen = response.size();
+
+      char responseBuf[4096];
+      uint16_t responseBufSize = sizeof(responseBuf);
+      uint32_t key = 0;
+      DNSQuestion dq(&a, QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false, &queryTime);
+      bool found = PC.get(dq, a.wirelength(), 0, responseBuf, &responseBufSize, &key);
+      BOOST_CHECK_EQUAL(found, false);
+
+      PC.insert(key, a, QType::A, QClass::IN, (const char*) response.data(), responseLen, false, 0, boost::none);
+
+      found = PC.get(dq, a.wirelength(), pwR.getHeader()->id, responseBuf, &responseBufSize, &key, 0, true);
+      if (found == true) {
+        BOOST_CHECK_EQUAL(responseBufSize, responseLen);
+        int match = memcmp(responseBuf, response.data(), responseLen);
+        BOOST_CHECK_EQUAL(match, 0);
+      }
+      else {
+        skipped++;
+      }
+
+      /* same name but different type, should not match */
+      DNSQuestion dqAAAA(&a, QType::AAAA, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false, &queryTime);
+      responseBufSize = sizeof(responseBuf);
+      found = PC.get(dqAAAA, a.wirelength(), 0, responseBuf, &responseBufSize, nullptr, 0, true);
+      BOOST_CHECK_EQUAL(found, false);
+    }
+
+    BOOST_CHECK_EQUAL(skipped, PC.getInsertCollisions() + PC.getFullInserts());
+    BOOST_CHECK_EQUAL(PC.getSize(), counter - skipped);
+
+    PC.expungeByName(DNSName("0") + DNSName(" hello"));
+    BOOST_CHECK_EQUAL(PC.getSize(), counter - skipped - 1);
+
+    /* responses larger than the inline size are not cached */
+    DNSName large("large.hello.");
+    vector<uint8_t> query;
+    DNSPacketWriter pwQ(query, large, QType::TXT, QClass::IN, 0);
+    vector<uint8_t> response;
+    DNSPacketWriter pwR(response, large, QType::TXT, QClass::IN, 0);
+    pwR.getHeader()->qr = 1;
+    pwR.startRecord(large, QType::TXT, 100, QClass::IN, DNSResourceRecord::ANSWER);
+    pwR.xfrText("\"" + std::string(250, 'a') + "\" \"" + std::string(250, 'b') + "\"");
+    pwR.commit();
+    BOOST_CHECK_GT(response.size(), 512);
+    char responseBuf[4096];
+    uint16_t responseBufSize = sizeof(responseBuf);
+    uint32_t key = 0;
+    DNSQuestion dq(&large, QType::TXT, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false, &queryTime);
+    BOOST_CHECK_EQUAL(PC.get(dq, large.wirelength(), 0, responseBuf, &responseBufSize, &key), false);
+    PC.insert(key, large, QType::TXT, QClass::IN, (const char*) response.data(), response.size(), false, 0, boost::none);
+    BOOST_CHECK_EQUAL(PC.getInlineTooLarges(), 1);
+    BOOST_CHECK_EQUAL(PC.get(dq, large.wirelength(), 0, responseBuf, &responseBufSize, &key), false);
+
+    PC.expungeByName(DNSName(" hello"), QType::ANY, true);
+    BOOST_CHECK_EQUAL(PC.getSize(), 0);
+  }
+  catch(PDNSException& e) {
+    cerr<<"Had error: "<<e.reason<<endl;
+    throw;
+  }
+}
+
+static void fillPacketCache(DNSDistPacketCache& PC, size_t count)
+{
+  struct timespec queryTime;
+  gettime(&queryTime);
+  ComboAddress remote;
+
+  for (size_t counter = 0; counter < count; counter++) {
+    DNSName a = DNSName(std::to_string(counter)) + DNSName("full");
+
+    vector<uint8_t> query;
+    DNSPacketWriter pwQ(query, a, QType::A, QClass::IN, 0);
+
+    vector<uint8_t> response;
+    DNSPacketWriter pwR(response, a, QType::A, QClass::IN, 0);
+    pwR.getHeader()->qr = 1;
+    pwR.startRecord(a, QType::A, 3600, QClass::IN, DNSResourceRecord::ANSWER);
+    pwR.xfr32BitInt(0x01020304);
+    pwR.commit();
+
+    char responseBuf[4096];
+    uint16_t responseBufSize = sizeof(responseBuf);
+    uint32_t key = 0;
+    DNSQuestion dq(&a, QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false, &queryTime);
+    PC.get(dq, a.wirelength(), 0, responseBuf, &responseBufSize, &key);
+    PC.insert(key, a, QType::A, QClass::IN, (const char*) response.data(), response.size(), false, 0, boost::none);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheFullInserts) {
+  /* inserting into a full cache is not a collision */
+  DNSDistPacketCache PC(4, 86400, 1);
+  fillPacketCache(PC, 10);
+  BOOST_CHECK_EQUAL(PC.getSize(), 4);
+  BOOST_CHECK_EQUAL(PC.getInsertCollisions(), 0);
+  BOOST_CHECK_EQUAL(PC.getFullInserts(), 6);
+
+  DNSDistPacketCache PCCompact(4, 86400, 1, 60, 60, false, 1, true, 512);
+  fillPacketCache(PCCompact, 10);
+  BOOST_CHECK_LE(PCCompact.getSize(), 4);
+  BOOST_CHECK_EQUAL(PCCompact.getInsertCollisions(), 0);
+  BOOST_CHECK_EQUAL(PCCompact.getSize() + PCCompact.getFullInserts(), 10);
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCachePrefetch) {
+  /* refresh entries once they are in the last 90% of their TTL, with both shard layouts */
+  DNSDistPacketCache PC(1000, 86400, 0, 60, 60, false, 1, true, 0, 90);
+  DNSDistPacketCache PCCompact(1000, 86400, 0, 60, 60, false, 1, true, 512, 90);
+  BOOST_CHECK_EQUAL(PC.getPrefetchPercentage(), 90);
+  BOOST_CHECK_THROW(DNSDistPacketCache(1000, 86400, 0, 60, 60, false, 1, true, 0, 100), std::runtime_error);
+
+  struct timespec queryTime;
+  gettime(&queryTime);  // does not have to be accurate ("realTime") in tests
+  ComboAddress remote;
+  DNSName name("prefetch.powerdns.com.");
+
+  vector<uint8_t> query;
+  DNSPacketWriter pwQ(query, name, QType::A, QClass::IN, 0);
+  pwQ.getHeader()->rd = 1;
+
+  vector<uint8_t> response;
+  DNSPacketWriter pwR(response, name, QType::A, QClass::IN, 0);
+  pwR.getHeader()->rd = 1;
+  pwR.getHeader()->ra = 1;
+  pwR.getHeader()->qr = 1;
+  pwR.getHeader()->id = pwQ.getHeader()->id;
+  pwR.startRecord(name, QType::A, 3, QClass::IN, DNSResourceRecord::ANSWER);
+  pwR.xfr32BitInt(0x01020304);
+  pwR.commit();
+
+  DNSQuestion dq(&name, QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false, &queryTime);
+  char responseBuf[4096];
+  uint16_t responseBufSize = sizeof(responseBuf);
+  uint32_t key = 0;
+  bool prefetch = true;
+
+  for (auto cache : { &PC, &PCCompact }) {
+    BOOST_CHECK_EQUAL(cache->get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, false, &prefetch), false);
+    BOOST_CHECK_EQUAL(prefetch, false);
+    cache->insert(key, name, QType::A, QClass::IN, (const char*) response.data(), response.size(), false, 0, boost::none);
+
+    /* fresh entry, no refresh needed */
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(cache->get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, false, &prefetch), true);
+    BOOST_CHECK_EQUAL(prefetch, false);
+  }
+
+  /* the entries now have at most one second left out of three */
+  sleep(2);
+
+  for (auto cache : { &PC, &PCCompact }) {
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(cache->get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, false, &prefetch), true);
+    BOOST_CHECK_EQUAL(prefetch, true);
+    BOOST_CHECK_EQUAL(cache->getPrefetches(), 1);
+    BOOST_CHECK_EQUAL(cache->getPrefetchesInFlight(), 1);
+
+    /* a refresh is already in flight, we should not send another one */
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(cache->get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, false, &prefetch), true);
+    BOOST_CHECK_EQUAL(prefetch, false);
+    BOOST_CHECK_EQUAL(cache->getPrefetches(), 1);
+    BOOST_CHECK_EQUAL(cache->getPrefetchDeduplicated(), 1);
+
+    /* the refreshed response comes in */
+    cache->insert(key, name, QType::A, QClass::IN, (const char*) response.data(), response.size(), false, 0, boost::none);
+    BOOST_CHECK_EQUAL(cache->getPrefetchHits(), 1);
+    BOOST_CHECK_EQUAL(cache->getPrefetchesInFlight(), 0);
+    BOOST_CHECK_EQUAL(cache->getPrefetchMisses(), 0);
+
+    /* and the entry is fresh again */
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(cache->get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, false, &prefetch), true);
+    BOOST_CHECK_EQUAL(prefetch, false);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheL1) {
+  /* a per-thread cache of 3 entries, rounded up to 4, in front of both shard layouts */
+  DNSDistPacketCache PC(1000, 86400, 0, 60, 60, false, 1, true, 0, 0, 3);
+  DNSDistPacketCache PCCompact(1000, 86400, 0, 60, 60, false, 1, true, 512, 0, 3);
+  BOOST_CHECK_EQUAL(PC.getL1Entries(), 4);
+  BOOST_CHECK_THROW(DNSDistPacketCache(1000, 86400, 0, 60, 60, false, 1, true, 0, 0, 16, 4), std::runtime_error);
+
+  struct timespec queryTime;
+  gettime(&queryTime);  // does not have to be accurate ("realTime") in tests
+  ComboAddress remote;
+  DNSName name("l1.powerdns.com.");
+
+  vector<uint8_t> query;
+  DNSPacketWriter pwQ(query, name, QType::A, QClass::IN, 0);
+  pwQ.getHeader()->rd = 1;
+
+  vector<uint8_t> response;
+  DNSPacketWriter pwR(response, name, QType::A, QClass::IN, 0);
+  pwR.getHeader()->rd = 1;
+  pwR.getHeader()->ra = 1;
+  pwR.getHeader()->qr = 1;
+  pwR.getHeader()->id = pwQ.getHeader()->id;
+  pwR.startRecord(name, QType::A, 3600, QClass::IN, DNSResourceRecord::ANSWER);
+  pwR.xfr32BitInt(0x01020304);
+  pwR.commit();
+
+  DNSQuestion dq(&name, QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false, &queryTime);
+  char responseBuf[4096];
+  uint16_t responseBufSize = sizeof(responseBuf);
+  uint32_t key = 0;
+
+  for (auto cache : { &PC, &PCCompact }) {
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(cache->get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key), false);
+    BOOST_CHECK_EQUAL(cache->getL1Misses(), 1);
+    cache->insert(key, name, QType::A, QClass::IN, (const char*) response.data(), response.size(), false, 0, boost::none);
+
+    /* served from the shared cache, then copied into the L1 one */
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(cache->get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key), true);
+    BOOST_CHECK_EQUAL(cache->getL1Hits(), 0);
+    BOOST_CHECK_EQUAL(cache->getHits(), 1);
+
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(cache->get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key), true);
+    BOOST_CHECK_EQUAL(cache->getL1Hits(), 1);
+    BOOST_CHECK_EQUAL(cache->getHits(), 2);
+    BOOST_REQUIRE_EQUAL(responseBufSize, response.size());
+    BOOST_CHECK_EQUAL(memcmp(responseBuf, response.data(), responseBufSize), 0);
+
+    /* the query ID and the case of the qname come from the query */
+    DNSName mixedCase("L1.PowerDNS.com.");
+    vector<uint8_t> mixedQuery;
+    DNSPacketWriter pwMixed(mixedQuery, mixedCase, QType::A, QClass::IN, 0);
+    pwMixed.getHeader()->rd = 1;
+    DNSQuestion mixedDQ(&mixedCase, QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) mixedQuery.data(), mixedQuery.size(), mixedQuery.size(), false, &queryTime);
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(cache->get(mixedDQ, mixedCase.wirelength(), 4242, responseBuf, &responseBufSize, &key), true);
+    BOOST_CHECK_EQUAL(cache->getL1Hits(), 2);
+    BOOST_CHECK_EQUAL(reinterpret_cast<const dnsheader*>(responseBuf)->id, 4242);
+    BOOST_CHECK_EQUAL(DNSName(responseBuf, responseBufSize, sizeof(dnsheader), false).toString(), mixedCase.toString());
+
+    /* TCP queries never use the L1 cache */
+    DNSQuestion tcpDQ(&name, QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), true, &queryTime);
+    responseBufSize = sizeof(responseBuf);
+    uint32_t tcpKey = 0;
+    BOOST_CHECK_EQUAL(cache->get(tcpDQ, name.wirelength(), 0, responseBuf, &responseBufSize, &tcpKey), false);
+    BOOST_CHECK_EQUAL(cache->getL1Hits(), 2);
+
+    /* removing the entry from the shared cache invalidates the L1 copy */
+    cache->expungeByName(name);
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(cache->get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key), false);
+    BOOST_CHECK_EQUAL(cache->getL1Hits(), 2);
+
+    cache->insert(key, name, QType::A, QClass::IN, (const char*) response.data(), response.size(), false, 0, boost::none);
+    for (size_t idx = 0; idx < 2; idx++) {
+      responseBufSize = sizeof(responseBuf);
+      BOOST_CHECK_EQUAL(cache->get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key), true);
+    }
+    BOOST_CHECK_EQUAL(cache->getL1Hits(), 3);
+
+    cache->expunge(0);
+    BOOST_CHECK_EQUAL(cache->getSize(), 0);
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(cache->get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key), false);
+    BOOST_CHECK_EQUAL(cache->getL1Hits(), 3);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheSharedMemory) {
+  char path[] = "/tmp/dnsdist-test-packetcache.XXXXXX";
+  int fd = mkstemp(path);
+  BOOST_REQUIRE(fd >= 0);
+  close(fd);
+
+  /* the shared memory storage requires the compact layout */
+  BOOST_CHECK_THROW(DNSDistPacketCache(1000, 86400, 0, 60, 60, false, 1, true, 0, 0, 0, 512, path), std::runtime_error);
+
+  struct timespec queryTime;
+  gettime(&queryTime);  // does not have to be accurate ("realTime") in tests
+  ComboAddress remote;
+  DNSName name("shared.powerdns.com.");
+
+  vector<uint8_t> query;
+  DNSPacketWriter pwQ(query, name, QType::A, QClass::IN, 0);
+  pwQ.getHeader()->rd = 1;
+
+  vector<uint8_t> response;
+  DNSPacketWriter pwR(response, name, QType::A, QClass::IN, 0);
+  pwR.getHeader()->rd = 1;
+  pwR.getHeader()->ra = 1;
+  pwR.getHeader()->qr = 1;
+  pwR.getHeader()->id = pwQ.getHeader()->id;
+  pwR.startRecord(name, QType::A, 3600, QClass::IN, DNSResourceRecord::ANSWER);
+  pwR.xfr32BitInt(0x01020304);
+  pwR.commit();
+
+  DNSQuestion dq(&name, QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false, &queryTime);
+  char responseBuf[4096];
+  uint16_t responseBufSize = sizeof(responseBuf);
+  uint32_t key = 0;
+
+  {
+    /* the file is empty, so it gets initialized */
+    DNSDistPacketCache first(1000, 86400, 0, 60, 60, false, 4, true, 512, 0, 0, 512, path);
+    BOOST_CHECK_EQUAL(first.getSize(), 0);
+    BOOST_CHECK_EQUAL(first.get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key), false);
+    first.insert(key, name, QType::A, QClass::IN, (const char*) response.data(), response.size(), false, 0, boost::none);
+    BOOST_CHECK_EQUAL(first.getSize(), 1);
+
+    /* a second cache, like a second process, sees the same entries */
+    DNSDistPacketCache second(1000, 86400, 0, 60, 60, false, 4, true, 512, 0, 0, 512, path);
+    BOOST_CHECK_EQUAL(second.getSize(), 1);
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(second.get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key), true);
+    BOOST_REQUIRE_EQUAL(responseBufSize, response.size());
+    BOOST_CHECK_EQUAL(memcmp(responseBuf, response.data(), responseBufSize), 0);
+
+    /* and the removals are visible from both */
+    second.expungeByName(name);
+    BOOST_CHECK_EQUAL(first.getSize(), 0);
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(first.get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key), false);
+
+    first.insert(key, name, QType::A, QClass::IN, (const char*) response.data(), response.size(), false, 0, boost::none);
+  }
+
+  {
+    /* the entries survive a "restart" */
+    DNSDistPacketCache restarted(1000, 86400, 0, 60, 60, false, 4, true, 512, 0, 0, 512, path);
+    BOOST_CHECK_EQUAL(restarted.getSize(), 1);
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(restarted.get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key), true);
+  }
+
+  {
+    /* but not a change of layout, the file is then replaced */
+    DNSDistPacketCache resized(2000, 86400, 0, 60, 60, false, 4, true, 512, 0, 0, 512, path);
+    BOOST_CHECK_EQUAL(resized.getSize(), 0);
+    responseBufSize = sizeof(responseBuf);
+    BOOST_CHECK_EQUAL(resized.get(dq, name.wirelength(), 0, responseBuf, &responseBufSize, &key), false);
+  }
+
+  unlink(path);
+}
+
 static DNSDistPacketCache PC(500000);
 
 static void *threadMangler(void* off)
@@ -262,4 +638,86 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheThreaded) {
 
 }
 
+static DNSDistPacketCache PCCompact(500000, 86400, 0, 60, 60, false, 16, false, 512);
+static std::atomic<bool> s_compactWritersDone{false};
+
+static void compactThreadMangler(unsigned int offset)
+{
+  struct timespec queryTime;
+  gettime(&queryTime);  // does not have to be accurate ("realTime") in tests
+  ComboAddress remote;
+  for(unsigned int counter=0; counter < 50000; ++counter) {
+    DNSName a=DNSName("hello ")+DNSName(std::to_string(counter+offset));
+    vector<uint8_t> query;
+    DNSPacketWriter pwQ(query, a, QType::A, QClass::IN, 0);
+
+    vector<uint8_t> response;
+    DNSPacketWriter pwR(response, a, QType::A, QClass::IN, 0);
+    pwR.getHeader()->qr = 1;
+    pwR.startRecord(a, QType::A, 3600, QClass::IN, DNSResourceRecord::ANSWER);
+    pwR.xfr32BitInt(counter+offset);
+    pwR.commit();
+
+    char responseBuf[4096];
+    uint16_t responseBufSize = sizeof(responseBuf);
+    uint32_t key = 0;
+    DNSQuestion dq(&a, QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false, &queryTime);
+    PCCompact.get(dq, a.wirelength(), 0, responseBuf, &responseBufSize, &key);
+    PCCompact.insert(key, a, QType::A, QClass::IN, (const char*) response.data(), response.size(), false, 0, boost::none);
+  }
+}
+
+static void compactThreadReader(unsigned int offset, std::atomic<uint64_t>* corrupted)
+{
+  struct timespec queryTime;
+  gettime(&queryTime);  // does not have to be accurate ("realTime") in tests
+  ComboAddress remote;
+  do {
+    for(unsigned int counter=0; counter < 50000; ++counter) {
+      DNSName a=DNSName("hello ")+DNSName(std::to_string(counter+offset));
+      vector<uint8_t> query;
+      DNSPacketWriter pwQ(query, a, QType::A, QClass::IN, 0);
+
+      char responseBuf[4096];
+      uint16_t responseBufSize = sizeof(responseBuf);
+      uint32_t key = 0;
+      DNSQuestion dq(&a, QType::A, QClass::IN, &remote, &remote, (struct dnsheader*) query.data(), query.size(), query.size(), false, &queryTime);
+      if (!PCCompact.get(dq, a.wirelength(), 0, responseBuf, &responseBufSize, &key, 0, true)) {
+        continue;
+      }
+
+      /* the last 4 bytes are the content of the A record, which should match the name */
+      uint32_t content;
+      memcpy(&content, responseBuf + responseBufSize - sizeof(content), sizeof(content));
+      if (ntohl(content) != counter+offset) {
+        (*corrupted)++;
+      }
+    }
+  }
+  while (!s_compactWritersDone);
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheCompactThreaded) {
+  std::atomic<uint64_t> corrupted{0};
+  vector<std::thread> readers;
+  vector<std::thread> writers;
+
+  for (unsigned int idx = 0; idx < 4; idx++) {
+    writers.push_back(std::thread(compactThreadMangler, idx * 1000000));
+    readers.push_back(std::thread(compactThreadReader, idx * 1000000, &corrupted));
+  }
+
+  for (auto& t : writers) {
+    t.join();
+  }
+  s_compactWritersDone = true;
+  for (auto& t : readers) {
+    t.join();
+  }
+
+  BOOST_CHECK_EQUAL(corrupted, 0);
+  BOOST_CHECK_EQUAL(PCCompact.getSize() + PCCompact.getDeferredInserts() + PCCompact.getInsertCollisions() + PCCompact.getFullInserts(), 200000);
+  BOOST_CHECK_SMALL(1.0*(PCCompact.getInsertCollisions() + PCCompact.getFullInserts()), 10000.0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,143 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist.hh"
+#include "dnsdist-qpstable.hh"
+
+#include <thread>
+
+BOOST_AUTO_TEST_SUITE(dnsdistqpstable_cc)
+
+BOOST_AUTO_TEST_CASE(test_QPSTable_Simple) {
+  const unsigned int rate = 10;
+  const unsigned int burst = 20;
+  QPSTable table(rate, burst, 60, 100000);
+  const ComboAddress first("192.0.2.1");
+  const ComboAddress second("2001:db8::1");
+  uint64_t now = 1000000;
+
+  /* the bucket starts full */
+  for (size_t idx = 0; idx < burst; idx++) {
+    BOOST_CHECK(table.check(first, now));
+  }
+  BOOST_CHECK(!table.check(first, now));
+  /* but the other clients are not affected */
+  BOOST_CHECK(table.check(second, now));
+  BOOST_CHECK_EQUAL(table.getEntriesCount(), 2);
+
+  /* half a second later, we got 5 more tokens */
+  now += 500000;
+  for (size_t idx = 0; idx < rate / 2; idx++) {
+    BOOST_CHECK(table.check(first, now));
+  }
+  BOOST_CHECK(!table.check(first, now));
+
+  /* never more than the burst */
+  now += 3600 * 1000000ULL;
+  for (size_t idx = 0; idx < burst; idx++) {
+    BOOST_CHECK(table.check(first, now));
+  }
+  BOOST_CHECK(!table.check(first, now));
+
+  /* the second client has not been seen for more than a minute */
+  table.purgeExpired(now);
+  BOOST_CHECK_EQUAL(table.getEntriesCount(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_QPSTable_Bounded) {
+  const size_t maxEntries = 10000;
+  QPSTable table(1, 1, 60, maxEntries);
+  uint64_t now = 1000000;
+
+  /* way more clients than the table can hold, every new one
+     starts with a full bucket */
+  for (size_t idx = 0; idx < 100 * maxEntries; idx++) {
+    ComboAddress addr("10.0.0.0");
+    addr.sin4.sin_addr.s_addr = htonl(0x0a000000 + idx);
+    BOOST_CHECK(table.check(addr, now));
+  }
+  BOOST_CHECK_LE(table.getEntriesCount(), maxEntries);
+  BOOST_CHECK_GT(table.getEntriesCount(), maxEntries / 2);
+
+  /* the most recent ones are still there */
+  ComboAddress last("10.0.0.0");
+  last.sin4.sin_addr.s_addr = htonl(0x0a000000 + 100 * maxEntries - 1);
+  BOOST_CHECK(!table.check(last, now));
+}
+
+BOOST_AUTO_TEST_CASE(test_QPSTable_SmallTables) {
+  /* small tables don't allocate more slots than maxEntries */
+  for (const size_t maxEntries : { 8, 10, 64, 100, 1000, 2048, 5000 }) {
+    QPSTable table(1, 1, 60, maxEntries);
+    BOOST_CHECK_LE(table.getCapacity(), maxEntries);
+  }
+  /* but we need at least one probe window */
+  QPSTable tiny(1, 1, 60, 1);
+  BOOST_CHECK_EQUAL(tiny.getCapacity(), 8);
+  BOOST_CHECK(tiny.check(ComboAddress("192.0.2.1"), 1000000));
+}
+
+BOOST_AUTO_TEST_CASE(test_QPSTable_PurgeAllExpired) {
+  QPSTable first(1, 1, 60, 1000);
+  QPSTable second(1, 1, 120, 1000);
+  uint64_t now = 1000000;
+  BOOST_CHECK(first.check(ComboAddress("192.0.2.1"), now));
+  BOOST_CHECK(second.check(ComboAddress("192.0.2.1"), now));
+
+  now += 90 * 1000000ULL;
+  QPSTable::purgeAllExpired(now);
+  BOOST_CHECK_EQUAL(first.getEntriesCount(), 0);
+  BOOST_CHECK_EQUAL(second.getEntriesCount(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_QPSLimiter_Threaded) {
+  const unsigned int rate = 1000;
+  const size_t numberOfThreads = 8;
+  const size_t queriesPerThread = 10000;
+  /* every thread uses the same, frozen, time so that the result does not
+     depend on how long the threads take to start or to run */
+  struct timespec start;
+  gettime(&start);
+  CoarseClock::set(start);
+  QPSLimiter limiter(rate, rate);
+  std::atomic<uint64_t> passed{0};
+
+  auto run = [&limiter, &passed, numberOfThreads, queriesPerThread](const struct timespec& now) {
+    std::vector<std::thread> threads;
+    for (size_t idx = 0; idx < numberOfThreads; idx++) {
+      threads.push_back(std::thread([&limiter, &passed, &now, queriesPerThread]() {
+            CoarseClock::set(now);
+            for (size_t count = 0; count < queriesPerThread; count++) {
+              if (limiter.check()) {
+                passed++;
+              }
+            }
+          }));
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  };
+
+  /* exactly the burst is handed out: a thread only stops getting tokens once the
+     shared bucket is empty, after having used all the ones it had taken in advance */
+  run(start);
+  BOOST_CHECK_EQUAL(passed.load(), rate);
+
+  /* half a second later, half the rate has been added to the bucket */
+  struct timespec later = start;
+  later.tv_nsec += 500000000;
+  if (later.tv_nsec >= 1000000000) {
+    later.tv_sec++;
+    later.tv_nsec -= 1000000000;
+  }
+  run(later);
+  BOOST_CHECK_EQUAL(passed.load(), rate + rate / 2);
+
+  BOOST_CHECK_EQUAL(limiter.getPassed(), passed.load());
+  BOOST_CHECK_EQUAL(limiter.getPassed() + limiter.getBlocked(), 2 * numberOfThreads * queriesPerThread);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,145 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist.hh"
+#include "gettime.hh"
+
+#include <thread>
+
+BOOST_AUTO_TEST_SUITE(dnsdistrings_cc)
+
+BOOST_AUTO_TEST_CASE(test_Rings_Simple) {
+  const size_t capacity = 100;
+  const size_t numberOfShards = 10;
+  Rings rings(capacity, numberOfShards);
+  BOOST_CHECK_EQUAL(rings.getNumberOfShards(), numberOfShards);
+  BOOST_CHECK_EQUAL(rings.getQueries().size(), 0);
+  BOOST_CHECK_EQUAL(rings.getResponses().size(), 0);
+  BOOST_CHECK_THROW(rings.setCapacity(capacity, 0), std::runtime_error);
+
+  struct timespec now;
+  gettime(&now);
+  ComboAddress requestor("192.0.2.1");
+  ComboAddress server("192.0.2.42:53");
+  struct dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+
+  /* even though a single thread inserts, and thus a single shard is used,
+     we keep the last 'capacity' ones. Insert twice as many to wrap around. */
+  for (size_t idx = 0; idx < 2 * capacity; idx++) {
+    DNSName name(std::to_string(idx) + ".powerdns.com.");
+    struct timespec when = now;
+    when.tv_sec += idx;
+    rings.insertQuery(when, requestor, name, QType::A, 42, dh);
+    rings.insertResponse(when, requestor, name, QType::A, 1000, 100, dh, server);
+  }
+
+  const auto queries = rings.getQueries();
+  BOOST_REQUIRE_EQUAL(queries.size(), capacity);
+  for (size_t idx = 0; idx < queries.size(); idx++) {
+    const auto& query = queries.at(idx);
+    BOOST_CHECK_EQUAL(query.requestor.toStringWithPort(), requestor.toStringWithPort());
+    BOOST_CHECK_EQUAL(query.qtype, QType::A);
+    BOOST_CHECK_EQUAL(query.size, 42);
+    /* merged back in time order */
+    BOOST_CHECK_EQUAL(query.when.tv_sec, now.tv_sec + static_cast<time_t>(capacity + idx));
+    BOOST_CHECK_EQUAL(query.getName(), DNSName(std::to_string(capacity + idx) + ".powerdns.com."));
+  }
+
+  const auto responses = rings.getResponses();
+  BOOST_REQUIRE_EQUAL(responses.size(), capacity);
+  for (size_t idx = 0; idx < responses.size(); idx++) {
+    const auto& response = responses.at(idx);
+    BOOST_CHECK_EQUAL(response.ds.toStringWithPort(), server.toStringWithPort());
+    BOOST_CHECK_EQUAL(response.usec, 1000);
+    BOOST_CHECK_EQUAL(response.size, 100);
+    BOOST_CHECK_EQUAL(response.when.tv_sec, now.tv_sec + static_cast<time_t>(capacity + idx));
+  }
+
+  size_t counted = 0;
+  rings.forEachQuery([&counted](const Rings::Query& q) {
+      counted++;
+    });
+  BOOST_CHECK_EQUAL(counted, capacity);
+  BOOST_CHECK_EQUAL(rings.numDistinctRequestors(), 1);
+
+  /* the root and the longest possible name are stored inline as well */
+  rings.insertQuery(now, requestor, g_rootdnsname, QType::NS, 17, dh);
+  DNSName longest;
+  for (size_t idx = 0; idx < 4; idx++) {
+    longest.appendRawLabel(std::string(idx < 3 ? 63 : 61, 'a'));
+  }
+  BOOST_REQUIRE_EQUAL(longest.wirelength(), 255);
+  rings.insertQuery(now, requestor, longest, QType::A, 300, dh);
+
+  std::set<DNSName> names;
+  rings.forEachQuery([&names](const Rings::Query& q) {
+      names.insert(q.getName());
+    });
+  BOOST_CHECK_EQUAL(names.count(g_rootdnsname), 1);
+  BOOST_CHECK_EQUAL(names.count(longest), 1);
+}
+
+static void ringWriterThread(Rings* rings, unsigned int offset, size_t numberOfEntries)
+{
+  struct timespec now;
+  gettime(&now);
+  ComboAddress requestor("192.0.2." + std::to_string(offset));
+  struct dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+
+  for (size_t idx = 0; idx < numberOfEntries; idx++) {
+    /* the size holds the thread and the qtype the index, so that readers can check the name */
+    DNSName name(std::to_string(offset) + "." + std::to_string(idx % 65536) + ".powerdns.com.");
+    rings->insertQuery(now, requestor, name, idx % 65536, offset, dh);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_Rings_Threaded) {
+  const size_t numberOfThreads = 8;
+  const size_t numberOfEntries = 100000;
+  Rings rings(10000, numberOfThreads);
+  std::atomic<bool> done{false};
+  std::atomic<uint64_t> inconsistent{0};
+  std::atomic<uint64_t> seen{0};
+
+  /* read concurrently with the writers, every entry we see should be consistent */
+  std::thread reader([&rings, &done, &inconsistent, &seen]() {
+      while (!done) {
+        rings.forEachQuery([&inconsistent, &seen](const Rings::Query& q) {
+            const DNSName expected(std::to_string(q.size) + "." + std::to_string(q.qtype) + ".powerdns.com.");
+            if (q.getName() != expected || q.requestor.toString() != "192.0.2." + std::to_string(q.size)) {
+              inconsistent++;
+            }
+            seen++;
+          });
+      }
+    });
+
+  std::vector<std::thread> writers;
+  for (size_t idx = 0; idx < numberOfThreads; idx++) {
+    writers.push_back(std::thread(ringWriterThread, &rings, idx + 1, numberOfEntries));
+  }
+  for (auto& writer : writers) {
+    writer.join();
+  }
+  done = true;
+  reader.join();
+
+  BOOST_CHECK_EQUAL(inconsistent, 0);
+  BOOST_CHECK_GT(seen, 0);
+  /* every shard is full, but we only look at the last 'capacity' entries */
+  BOOST_CHECK_EQUAL(rings.getQueries().size(), 10000);
+  size_t counted = 0;
+  rings.forEachQuery([&counted](const Rings::Query& q) {
+      counted++;
+    });
+  BOOST_CHECK_EQUAL(counted, 10000);
+  /* only the threads that inserted the last entries are still there */
+  BOOST_CHECK_GE(rings.numDistinctRequestors(), 1);
+  BOOST_CHECK_LE(rings.numDistinctRequestors(), numberOfThreads);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
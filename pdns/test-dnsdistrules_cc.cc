@@ -0,0 +1,191 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist.hh"
+#include "dnsdist-rules.hh"
+#include "dnswriter.hh"
+#include "gettime.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdistrules_cc)
+
+/* a rule the chain can't merge, matching on the qtype */
+class TestQTypeRule : public DNSRule
+{
+public:
+  TestQTypeRule(uint16_t qtype) : d_qtype(qtype)
+  {
+  }
+  bool matches(const DNSQuestion* dq) const override
+  {
+    return dq->qtype == d_qtype;
+  }
+  string toString() const override
+  {
+    return "qtype==" + QType(d_qtype).getName();
+  }
+private:
+  uint16_t d_qtype;
+};
+
+static std::shared_ptr<DNSRule> makeSMNRule(const std::vector<std::string>& names)
+{
+  SuffixMatchNode smn;
+  for (const auto& name : names) {
+    smn.add(DNSName(name));
+  }
+  return std::make_shared<SuffixMatchNodeRule>(smn);
+}
+
+static std::shared_ptr<DNSRule> makeNMGRule(const std::vector<std::string>& masks, bool src)
+{
+  NetmaskGroup nmg;
+  for (const auto& mask : masks) {
+    nmg.addMask(mask);
+  }
+  return std::make_shared<NetmaskGroupRule>(nmg, src);
+}
+
+static std::vector<DNSDistRuleAction> makeRuleActions(const std::vector<std::shared_ptr<DNSRule>>& rules)
+{
+  std::vector<DNSDistRuleAction> result;
+  for (const auto& rule : rules) {
+    /* the chain never calls the actions, the visitor does */
+    result.push_back({rule, nullptr, boost::uuids::uuid()});
+  }
+  return result;
+}
+
+/* returns the indexes of the rules matched by the chain, stopping after 'stopAfter' matches */
+static std::vector<size_t> getChainMatches(const DNSRuleChain& chain, const std::vector<DNSDistRuleAction>& rules, const DNSName& qname, uint16_t qtype, const ComboAddress& local, const ComboAddress& remote, size_t stopAfter=std::numeric_limits<size_t>::max())
+{
+  vector<uint8_t> query;
+  DNSPacketWriter pw(query, qname, qtype, QClass::IN, 0);
+  struct timespec queryTime;
+  gettime(&queryTime);
+  DNSQuestion dq(&qname, qtype, QClass::IN, &local, &remote, reinterpret_cast<struct dnsheader*>(query.data()), query.size(), query.size(), false, &queryTime);
+
+  std::vector<size_t> matches;
+  auto visitor = [&matches, &rules, stopAfter](const DNSDistRuleAction& ra) {
+    for (size_t idx = 0; idx < rules.size(); idx++) {
+      if (rules.at(idx).d_rule == ra.d_rule) {
+        matches.push_back(idx);
+        break;
+      }
+    }
+    return matches.size() < stopAfter;
+  };
+  chain.forEachMatch(&dq, visitor);
+  return matches;
+}
+
+static std::vector<size_t> getLinearMatches(const std::vector<DNSDistRuleAction>& rules, const DNSName& qname, uint16_t qtype, const ComboAddress& local, const ComboAddress& remote)
+{
+  vector<uint8_t> query;
+  DNSPacketWriter pw(query, qname, qtype, QClass::IN, 0);
+  struct timespec queryTime;
+  gettime(&queryTime);
+  DNSQuestion dq(&qname, qtype, QClass::IN, &local, &remote, reinterpret_cast<struct dnsheader*>(query.data()), query.size(), query.size(), false, &queryTime);
+
+  std::vector<size_t> matches;
+  for (size_t idx = 0; idx < rules.size(); idx++) {
+    if (rules.at(idx).d_rule->matches(&dq)) {
+      matches.push_back(idx);
+    }
+  }
+  return matches;
+}
+
+BOOST_AUTO_TEST_CASE(test_RuleChain_Suffixes) {
+  const auto rules = makeRuleActions({
+      makeSMNRule({"powerdns.com."}),
+      makeSMNRule({"com.", "org."}),
+      makeSMNRule({"www.powerdns.com.", "powerdns.org."}),
+      makeSMNRule({"sub.www.powerdns.com."}),
+      std::make_shared<TestQTypeRule>(QType::AAAA),
+      makeSMNRule({"."}),
+      makeSMNRule({"net."}),
+      makeSMNRule({"example.net."})
+    });
+  DNSRuleChain chain(rules);
+  /* the first four suffix rules, the qtype one, then the last three */
+  BOOST_CHECK_EQUAL(chain.getGroupsCount(), 3);
+
+  const ComboAddress local("192.0.2.1:53");
+  const ComboAddress remote("192.0.2.2:4242");
+  for (const auto& name : {"powerdns.com.", "www.powerdns.com.", "a.sub.www.powerdns.com.", "images.powerdns.com.", "example.com.", "powerdns.org.", "www.powerdns.org.", "org.", "example.net.", "www.example.net.", "example.org.uk.", "."}) {
+    for (const auto qtype : {QType::A, QType::AAAA}) {
+      const DNSName qname(name);
+      BOOST_CHECK(getChainMatches(chain, rules, qname, qtype, local, remote) == getLinearMatches(rules, qname, qtype, local, remote));
+    }
+  }
+
+  const auto matches = getChainMatches(chain, rules, DNSName("sub.www.powerdns.com."), QType::A, local, remote);
+  BOOST_CHECK(matches == std::vector<size_t>({0, 1, 2, 3, 5}));
+}
+
+BOOST_AUTO_TEST_CASE(test_RuleChain_Netmasks) {
+  const auto rules = makeRuleActions({
+      makeNMGRule({"192.0.2.0/24", "!192.0.2.128/25", "2001:db8::/32"}, true),
+      makeNMGRule({"192.0.2.128/26", "!2001:db8:1::/48"}, true),
+      makeNMGRule({"0.0.0.0/0", "!192.0.2.0/24", "192.0.2.192/27", "::/0"}, true),
+      makeNMGRule({"198.51.100.0/24"}, false),
+      makeNMGRule({"192.0.2.1"}, true),
+      std::make_shared<TestQTypeRule>(QType::AAAA),
+      makeNMGRule({"192.0.2.0/25"}, true),
+    });
+  DNSRuleChain chain(rules);
+  /* the first three source rules, then the destination rule, the fifth source rule, the qtype one and the last source rule */
+  BOOST_CHECK_EQUAL(chain.getGroupsCount(), 5);
+
+  const ComboAddress local("198.51.100.1:53");
+  const ComboAddress otherLocal("203.0.113.1:53");
+  const DNSName qname("powerdns.com.");
+  for (const auto& addr : {"192.0.2.1", "192.0.2.2", "192.0.2.127", "192.0.2.128", "192.0.2.150", "192.0.2.193", "192.0.2.230", "192.0.3.1", "10.0.0.1", "2001:db8::1", "2001:db8:1::1", "2001:db8:2::1", "2001:db9::1"}) {
+    const ComboAddress remote(addr, 4242);
+    BOOST_CHECK(getChainMatches(chain, rules, qname, QType::A, local, remote) == getLinearMatches(rules, qname, QType::A, local, remote));
+    BOOST_CHECK(getChainMatches(chain, rules, qname, QType::AAAA, otherLocal, remote) == getLinearMatches(rules, qname, QType::AAAA, otherLocal, remote));
+  }
+
+  const auto matches = getChainMatches(chain, rules, qname, QType::A, local, ComboAddress("192.0.2.200", 4242));
+  BOOST_CHECK(matches == std::vector<size_t>({2, 3}));
+}
+
+BOOST_AUTO_TEST_CASE(test_RuleChain_StopAndCounters) {
+  const auto rules = makeRuleActions({
+      makeSMNRule({"com."}),
+      makeSMNRule({"powerdns.com."}),
+      makeSMNRule({"org."}),
+      std::make_shared<TestQTypeRule>(QType::A),
+      makeSMNRule({"www.powerdns.com."})
+    });
+  DNSRuleChain chain(rules);
+
+  const ComboAddress local("192.0.2.1:53");
+  const ComboAddress remote("192.0.2.2:4242");
+  const DNSName qname("www.powerdns.com.");
+
+  /* the visitor stops after the second match, as a terminal action would */
+  auto matches = getChainMatches(chain, rules, qname, QType::A, local, remote, 2);
+  BOOST_CHECK(matches == std::vector<size_t>({0, 1}));
+  BOOST_CHECK_EQUAL(rules.at(0).d_rule->d_matches, 1);
+  BOOST_CHECK_EQUAL(rules.at(1).d_rule->d_matches, 1);
+  BOOST_CHECK_EQUAL(rules.at(2).d_rule->d_matches, 0);
+  BOOST_CHECK_EQUAL(rules.at(3).d_rule->d_matches, 0);
+  BOOST_CHECK_EQUAL(rules.at(4).d_rule->d_matches, 0);
+
+  matches = getChainMatches(chain, rules, qname, QType::A, local, remote);
+  BOOST_CHECK(matches == std::vector<size_t>({0, 1, 3, 4}));
+  BOOST_CHECK_EQUAL(rules.at(0).d_rule->d_matches, 2);
+  BOOST_CHECK_EQUAL(rules.at(1).d_rule->d_matches, 2);
+  BOOST_CHECK_EQUAL(rules.at(2).d_rule->d_matches, 0);
+  BOOST_CHECK_EQUAL(rules.at(3).d_rule->d_matches, 1);
+  BOOST_CHECK_EQUAL(rules.at(4).d_rule->d_matches, 1);
+
+  /* an empty chain never calls the visitor */
+  DNSRuleChain empty;
+  BOOST_CHECK(getChainMatches(empty, {}, qname, QType::A, local, remote).empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
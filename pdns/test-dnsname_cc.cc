@@ -558,6 +558,11 @@ BOOST_AUTO_TEST_CASE(test_suffixmatch_tree) {
   BOOST_CHECK_EQUAL(*smt.lookup(examplenet), examplenet);
   BOOST_REQUIRE(smt.lookup(net));
   BOOST_CHECK_EQUAL(*smt.lookup(net), net);
+
+  /* the descent stops on the non-terminal bbc.co.uk. node, the closest enclosing suffix should still be returned */
+  smt.add(DNSName("co.uk."), DNSName("co.uk."));
+  BOOST_REQUIRE(smt.lookup(DNSName("images.bbc.co.uk.")));
+  BOOST_CHECK_EQUAL(*smt.lookup(DNSName("images.bbc.co.uk.")), DNSName("co.uk."));
 }
 
 
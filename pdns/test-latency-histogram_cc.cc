@@ -0,0 +1,87 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "latency-histogram.hh"
+
+BOOST_AUTO_TEST_SUITE(latencyhistogram_cc)
+
+BOOST_AUTO_TEST_CASE(test_LatencyHistogram_Buckets) {
+  /* one bucket per value below 16 us */
+  for (uint64_t value = 0; value < 16; value++) {
+    BOOST_CHECK_EQUAL(LatencyHistogram::getBucketIndex(value), value);
+    BOOST_CHECK_EQUAL(LatencyHistogram::getBucketLowerBound(value), value);
+    BOOST_CHECK_EQUAL(LatencyHistogram::getBucketWidth(value), 1);
+  }
+
+  BOOST_CHECK_EQUAL(LatencyHistogram::getBucketIndex(16), 16);
+  BOOST_CHECK_EQUAL(LatencyHistogram::getBucketIndex(31), 31);
+  /* from 32 us, buckets are 2 us wide */
+  BOOST_CHECK_EQUAL(LatencyHistogram::getBucketIndex(32), 32);
+  BOOST_CHECK_EQUAL(LatencyHistogram::getBucketIndex(33), 32);
+  BOOST_CHECK_EQUAL(LatencyHistogram::getBucketIndex(34), 33);
+  BOOST_CHECK_EQUAL(LatencyHistogram::getBucketWidth(32), 2);
+
+  /* every value falls in the bucket covering it, and the buckets are contiguous */
+  uint64_t expectedLowerBound = 0;
+  for (size_t idx = 0; idx < LatencyHistogram::s_numberOfBuckets; idx++) {
+    const uint64_t lowerBound = LatencyHistogram::getBucketLowerBound(idx);
+    const uint64_t width = LatencyHistogram::getBucketWidth(idx);
+    BOOST_REQUIRE_EQUAL(lowerBound, expectedLowerBound);
+    BOOST_CHECK_EQUAL(LatencyHistogram::getBucketIndex(lowerBound), idx);
+    BOOST_CHECK_EQUAL(LatencyHistogram::getBucketIndex(lowerBound + width - 1), idx);
+    /* the relative error stays below 1/16th */
+    BOOST_CHECK_LE(width * 16, std::max(lowerBound, static_cast<uint64_t>(16)));
+    expectedLowerBound = lowerBound + width;
+  }
+
+  /* very large values end up in the last bucket */
+  BOOST_CHECK_EQUAL(LatencyHistogram::getBucketIndex(1 << 27), LatencyHistogram::s_numberOfBuckets - 1);
+  BOOST_CHECK_EQUAL(LatencyHistogram::getBucketIndex(std::numeric_limits<uint64_t>::max()), LatencyHistogram::s_numberOfBuckets - 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_LatencyHistogram_Percentiles) {
+  LatencyHistogram histogram;
+
+  /* not enough samples yet */
+  histogram.updatePercentiles();
+  BOOST_CHECK_EQUAL(histogram.getPercentiles().p50, 0.0);
+
+  /* 1000 values, 988 of them at 100 us, 10 at 10 ms and two at 1s */
+  for (size_t idx = 0; idx < 988; idx++) {
+    histogram.record(100);
+  }
+  for (size_t idx = 0; idx < 10; idx++) {
+    histogram.record(10000);
+  }
+  histogram.record(1000000);
+  histogram.record(1000000);
+  BOOST_CHECK_EQUAL(histogram.getCount(), 1000);
+
+  histogram.updatePercentiles();
+  auto percentiles = histogram.getPercentiles();
+  BOOST_CHECK_CLOSE(percentiles.p50, 100.0, 100.0 / 16);
+  BOOST_CHECK_CLOSE(percentiles.p99, 10000.0, 100.0 / 16);
+  BOOST_CHECK_CLOSE(percentiles.p999, 1000000.0, 100.0 / 16);
+
+  /* without new samples, the old ones keep the same distribution */
+  histogram.updatePercentiles();
+  percentiles = histogram.getPercentiles();
+  BOOST_CHECK_CLOSE(percentiles.p50, 100.0, 100.0 / 16);
+  BOOST_CHECK_CLOSE(percentiles.p999, 1000000.0, 100.0 / 16);
+
+  /* the backend got slower, after a few updates the recent samples dominate */
+  for (size_t update = 0; update < 20; update++) {
+    for (size_t idx = 0; idx < 1000; idx++) {
+      histogram.record(5000);
+    }
+    histogram.updatePercentiles();
+  }
+  percentiles = histogram.getPercentiles();
+  BOOST_CHECK_CLOSE(percentiles.p50, 5000.0, 100.0 / 16);
+  BOOST_CHECK_CLOSE(percentiles.p99, 5000.0, 100.0 / 16);
+  BOOST_CHECK_EQUAL(histogram.getCount(), 21000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
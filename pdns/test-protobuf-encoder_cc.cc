@@ -0,0 +1,98 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "protobuf-encoder.hh"
+
+BOOST_AUTO_TEST_SUITE(protobufencoder_cc)
+
+BOOST_AUTO_TEST_CASE(test_PBDNSMessageEncoder_Query) {
+  std::string buffer;
+  PBDNSMessageEncoder encoder(buffer);
+  encoder.setType(PBDNSMessageEncoder::MessageType::Query);
+  encoder.setSocketFamily(ComboAddress("192.0.2.1"));
+  encoder.setSocketProtocol(false);
+  encoder.setRequestor(ComboAddress("192.0.2.1"));
+  encoder.setBytes(300);
+  encoder.setId(42);
+  encoder.setQuestion(DNSName("a."), QType::A, QClass::IN);
+  encoder.setDeviceId("");
+
+  const std::string expected(
+    "\x08\x01"                   /* type = 1 */
+    "\x20\x01"                   /* socketFamily = INET */
+    "\x28\x01"                   /* socketProtocol = UDP */
+    "\x32\x04\xc0\x00\x02\x01"   /* from = 192.0.2.1 */
+    "\x40\xac\x02"               /* inBytes = 300, on two bytes */
+    "\x58\x2a"                   /* id = 42 */
+    "\x62\x08"                   /* question, 8 bytes */
+    "\x0a\x02" "a."              /* qName */
+    "\x10\x01"                   /* qType */
+    "\x18\x01"                   /* qClass */
+    "\x8a\x01\x00",              /* deviceId, field 17 needs a two-byte key, empty but present */
+    30);
+  BOOST_CHECK_EQUAL(buffer.size(), expected.size());
+  BOOST_CHECK(buffer == expected);
+}
+
+BOOST_AUTO_TEST_CASE(test_PBDNSMessageEncoder_LargeSubMessage) {
+  std::string buffer("prefix");
+  PBDNSMessageEncoder encoder(buffer);
+  encoder.startResponse();
+  encoder.setResponseCode(3);
+  encoder.addTags({std::string(200, 'x')});
+  encoder.setQueryTime(1, 2);
+  encoder.endResponse();
+
+  /* 2 bytes for the rcode, 3 + 200 for the tag, 4 for the query time: the size of the response
+     does not fit in one byte and the content had to be moved */
+  const size_t responseSize = 2 + 3 + 200 + 4;
+  BOOST_REQUIRE_EQUAL(buffer.size(), 6 + 1 + 2 + responseSize);
+  BOOST_CHECK_EQUAL(buffer.substr(0, 6), "prefix");
+  BOOST_CHECK_EQUAL(static_cast<uint8_t>(buffer.at(6)), 0x6a);
+  BOOST_CHECK_EQUAL(static_cast<uint8_t>(buffer.at(7)), (responseSize & 0x7f) | 0x80);
+  BOOST_CHECK_EQUAL(static_cast<uint8_t>(buffer.at(8)), responseSize >> 7);
+  BOOST_CHECK_EQUAL(buffer.substr(9, 2), std::string("\x08\x03", 2));
+  BOOST_CHECK_EQUAL(buffer.substr(11, 3), std::string("\x22\xc8\x01", 3));
+  BOOST_CHECK_EQUAL(buffer.substr(14, 200), std::string(200, 'x'));
+  BOOST_CHECK_EQUAL(buffer.substr(214), std::string("\x28\x01\x30\x02", 4));
+}
+
+BOOST_AUTO_TEST_CASE(test_PBDNSMessageEncoder_RRsFromPacket) {
+  /* www.powerdns.com. IN A, answered by a CNAME to powerdns.com. and an A record */
+  const std::string packet(
+    "\x00\x2a\x81\x80\x00\x01\x00\x02\x00\x00\x00\x00"
+    "\x03www\x08powerdns\x03" "com\x00\x00\x01\x00\x01"
+    "\xc0\x0c\x00\x05\x00\x01\x00\x00\x0e\x10\x00\x02\xc0\x10"
+    "\xc0\x10\x00\x01\x00\x01\x00\x00\x01\x2c\x00\x04\xc0\x00\x02\x01",
+    12 + 22 + 14 + 16);
+
+  std::string withoutCNAME;
+  PBDNSMessageEncoder(withoutCNAME).addRRsFromPacket(packet.c_str(), packet.size(), false);
+  const std::string expectedA(
+    "\x12\x1c"
+    "\x0a\x0d" "powerdns.com."
+    "\x10\x01\x18\x01\x20\xac\x02"
+    "\x2a\x04\xc0\x00\x02\x01",
+    30);
+  BOOST_CHECK(withoutCNAME == expectedA);
+
+  std::string withCNAME;
+  PBDNSMessageEncoder(withCNAME).addRRsFromPacket(packet.c_str(), packet.size(), true);
+  const std::string expectedCNAME(
+    "\x12\x29"
+    "\x0a\x11" "www.powerdns.com."
+    "\x10\x05\x18\x01\x20\x90\x1c"
+    "\x2a\x0d" "powerdns.com.",
+    43);
+  BOOST_CHECK(withCNAME == expectedCNAME + expectedA);
+
+  /* truncated packets stop the parsing, without throwing */
+  for (size_t len = 0; len < packet.size(); len++) {
+    std::string truncated;
+    BOOST_CHECK_NO_THROW(PBDNSMessageEncoder(truncated).addRRsFromPacket(packet.c_str(), len, true));
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,138 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "remote_logger.hh"
+
+#include <thread>
+
+BOOST_AUTO_TEST_SUITE(remote_logger_cc)
+
+static std::string getRecord(const struct iovec& iov)
+{
+  return std::string(reinterpret_cast<const char*>(iov.iov_base), iov.iov_len);
+}
+
+BOOST_AUTO_TEST_CASE(test_RemoteLoggerRing_Simple) {
+  /* rounded up to the next power of two */
+  RemoteLoggerRing ring(1000);
+  BOOST_CHECK_EQUAL(ring.getCapacity(), 1024);
+  BOOST_CHECK_EQUAL(ring.getMaxRecordSize(), 508);
+
+  std::vector<struct iovec> iovs;
+  BOOST_CHECK_EQUAL(ring.peek(iovs, 100), 0);
+
+  /* empty and too large records are refused */
+  BOOST_CHECK(!ring.write(0, [](char*) { BOOST_FAIL("writer called for an empty record"); }));
+  BOOST_CHECK(!ring.write(509, [](char*) { BOOST_FAIL("writer called for a record too large"); }));
+
+  const std::string first("first record");
+  const std::string second("second");
+  BOOST_CHECK(ring.write(first.size(), [&first](char* out) { memcpy(out, first.data(), first.size()); }));
+  BOOST_CHECK(ring.write(second.size(), [&second](char* out) { memcpy(out, second.data(), second.size()); }));
+
+  /* only one record requested */
+  BOOST_REQUIRE_EQUAL(ring.peek(iovs, 1), 1);
+  BOOST_CHECK_EQUAL(getRecord(iovs.at(0)), first);
+  ring.release();
+
+  iovs.clear();
+  BOOST_REQUIRE_EQUAL(ring.peek(iovs, 100), 1);
+  BOOST_CHECK_EQUAL(getRecord(iovs.at(0)), second);
+  ring.release();
+  BOOST_CHECK_EQUAL(ring.getUsedBytes(), 0);
+
+  /* a writer throwing does not block the records after it */
+  BOOST_CHECK_THROW(ring.write(10, [](char*) { throw std::runtime_error("oops"); }), std::runtime_error);
+  BOOST_CHECK(ring.write(first.size(), [&first](char* out) { memcpy(out, first.data(), first.size()); }));
+  iovs.clear();
+  BOOST_REQUIRE_EQUAL(ring.peek(iovs, 100), 1);
+  BOOST_CHECK_EQUAL(getRecord(iovs.at(0)), first);
+  ring.release();
+}
+
+BOOST_AUTO_TEST_CASE(test_RemoteLoggerRing_FullAndWrap) {
+  RemoteLoggerRing ring(1024);
+  std::vector<struct iovec> iovs;
+
+  /* 4 bytes of header + 96 bytes of data, 10 of them fit */
+  size_t written = 0;
+  for (char idx = 0; idx < 20; idx++) {
+    if (ring.write(96, [idx](char* out) { memset(out, 'a' + idx, 96); })) {
+      written++;
+    }
+  }
+  BOOST_CHECK_EQUAL(written, 10);
+  BOOST_CHECK_EQUAL(ring.getUsedBytes(), 1000);
+
+  BOOST_REQUIRE_EQUAL(ring.peek(iovs, 100), 10);
+  for (size_t idx = 0; idx < iovs.size(); idx++) {
+    BOOST_CHECK_EQUAL(getRecord(iovs.at(idx)), std::string(96, 'a' + idx));
+  }
+  ring.release();
+  BOOST_CHECK_EQUAL(ring.getUsedBytes(), 0);
+
+  /* only 24 bytes left before the end, this one has to wrap */
+  const std::string record(200, 'z');
+  BOOST_REQUIRE(ring.write(record.size(), [&record](char* out) { memcpy(out, record.data(), record.size()); }));
+  BOOST_CHECK_EQUAL(ring.getUsedBytes(), 24 + 204);
+  iovs.clear();
+  BOOST_REQUIRE_EQUAL(ring.peek(iovs, 100), 1);
+  BOOST_CHECK_EQUAL(getRecord(iovs.at(0)), record);
+  ring.release();
+  BOOST_CHECK_EQUAL(ring.getUsedBytes(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_RemoteLoggerRing_Threaded) {
+  const size_t numberOfThreads = 4;
+  const size_t numberOfEntries = 100000;
+  RemoteLoggerRing ring(64 * 1024);
+  std::atomic<size_t> writersDone{0};
+  std::atomic<uint64_t> dropped{0};
+  uint64_t received = 0;
+  uint64_t inconsistent = 0;
+
+  std::vector<std::thread> writers;
+  for (size_t thread = 0; thread < numberOfThreads; thread++) {
+    writers.push_back(std::thread([&ring, &writersDone, &dropped, thread, numberOfEntries]() {
+          for (size_t idx = 0; idx < numberOfEntries; idx++) {
+            /* records of various sizes, filled with a character identifying the writer */
+            const size_t size = 1 + (idx % 300);
+            if (!ring.write(size, [thread, size](char* out) { memset(out, 'a' + thread, size); })) {
+              dropped++;
+            }
+          }
+          writersDone++;
+        }));
+  }
+
+  std::vector<struct iovec> iovs;
+  while (true) {
+    const bool done = writersDone == numberOfThreads;
+    iovs.clear();
+    ring.waitForData(10);
+    ring.peek(iovs, 512);
+    for (const auto& iov : iovs) {
+      const std::string record = getRecord(iov);
+      if (record.empty() || record.find_first_not_of(record.at(0)) != std::string::npos || record.at(0) < 'a' || record.at(0) >= static_cast<char>('a' + numberOfThreads)) {
+        inconsistent++;
+      }
+      received++;
+    }
+    ring.release();
+    if (done && iovs.empty()) {
+      break;
+    }
+  }
+
+  for (auto& writer : writers) {
+    writer.join();
+  }
+
+  BOOST_CHECK_EQUAL(inconsistent, 0);
+  BOOST_CHECK_EQUAL(received + dropped, numberOfThreads * numberOfEntries);
+  BOOST_CHECK_GT(received, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
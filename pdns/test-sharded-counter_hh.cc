@@ -0,0 +1,55 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "sharded-counter.hh"
+
+#include <thread>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(shardedcounter_hh)
+
+BOOST_AUTO_TEST_CASE(test_ShardedCounter_Simple) {
+  ShardedCounter counter;
+  BOOST_CHECK_EQUAL(counter.load(), 0);
+
+  counter++;
+  ++counter;
+  counter += 40;
+  BOOST_CHECK_EQUAL(counter.load(), 42);
+  BOOST_CHECK_EQUAL(static_cast<uint64_t>(counter), 42);
+
+  counter.store(1000);
+  BOOST_CHECK_EQUAL(counter.load(), 1000);
+
+  ShardedCounter initialized{12};
+  BOOST_CHECK_EQUAL(initialized.load(), 12);
+}
+
+BOOST_AUTO_TEST_CASE(test_ShardedCounter_Threaded) {
+  /* more threads than shards, so that some of them have to share one */
+  const size_t numberOfThreads = ShardedCounter::s_numberOfShards + 8;
+  const size_t numberOfIncrements = 100000;
+  ShardedCounter counter;
+  ShardedCounter other;
+
+  std::vector<std::thread> threads;
+  for (size_t idx = 0; idx < numberOfThreads; idx++) {
+    threads.push_back(std::thread([&counter, &other, numberOfIncrements]() {
+          for (size_t inc = 0; inc < numberOfIncrements; inc++) {
+            counter++;
+            other += 2;
+          }
+        }));
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  BOOST_CHECK_EQUAL(counter.load(), numberOfThreads * numberOfIncrements);
+  BOOST_CHECK_EQUAL(other.load(), 2 * numberOfThreads * numberOfIncrements);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
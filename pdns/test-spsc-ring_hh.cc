@@ -0,0 +1,94 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <thread>
+#include <boost/test/unit_test.hpp>
+
+#include "spsc-ring.hh"
+
+BOOST_AUTO_TEST_SUITE(spsc_ring_hh)
+
+BOOST_AUTO_TEST_CASE(test_SPSCRing_Basic) {
+  SPSCRing<int> ring(5);
+  /* rounded up to a power of two */
+  BOOST_CHECK_EQUAL(ring.capacity(), 8);
+  BOOST_CHECK_EQUAL(ring.size(), 0);
+  BOOST_CHECK(ring.getReadSlot() == nullptr);
+
+  for (int idx = 0; idx < 8; idx++) {
+    int* slot = ring.getWriteSlot();
+    BOOST_REQUIRE(slot != nullptr);
+    *slot = idx;
+    ring.commit();
+  }
+  BOOST_CHECK_EQUAL(ring.size(), 8);
+  /* full */
+  BOOST_CHECK(ring.getWriteSlot() == nullptr);
+
+  for (int idx = 0; idx < 3; idx++) {
+    int* slot = ring.getReadSlot();
+    BOOST_REQUIRE(slot != nullptr);
+    BOOST_CHECK_EQUAL(*slot, idx);
+    ring.release();
+  }
+  BOOST_CHECK_EQUAL(ring.size(), 5);
+
+  /* the released slots can be reused, and we wrap around */
+  for (int idx = 8; idx < 11; idx++) {
+    int* slot = ring.getWriteSlot();
+    BOOST_REQUIRE(slot != nullptr);
+    *slot = idx;
+    ring.commit();
+  }
+  BOOST_CHECK(ring.getWriteSlot() == nullptr);
+
+  for (int idx = 3; idx < 11; idx++) {
+    int* slot = ring.getReadSlot();
+    BOOST_REQUIRE(slot != nullptr);
+    BOOST_CHECK_EQUAL(*slot, idx);
+    ring.release();
+  }
+  BOOST_CHECK(ring.getReadSlot() == nullptr);
+  BOOST_CHECK_EQUAL(ring.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_SPSCRing_Threaded) {
+  SPSCRing<uint64_t> ring(64);
+  const uint64_t count = 1000000;
+
+  std::thread producer([&ring, count]() {
+      for (uint64_t idx = 0; idx < count; idx++) {
+        uint64_t* slot;
+        while ((slot = ring.getWriteSlot()) == nullptr) {
+          std::this_thread::yield();
+        }
+        *slot = idx;
+        ring.commit();
+      }
+    });
+
+  uint64_t expected = 0;
+  bool inOrder = true;
+  while (expected < count) {
+    uint64_t* slot = ring.getReadSlot();
+    if (slot == nullptr) {
+      std::this_thread::yield();
+      continue;
+    }
+    if (*slot != expected) {
+      inOrder = false;
+    }
+    ring.release();
+    expected++;
+  }
+  producer.join();
+
+  BOOST_CHECK(inOrder);
+  BOOST_CHECK(ring.getReadSlot() == nullptr);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
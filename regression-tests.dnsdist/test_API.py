@@ -97,27 +97,39 @@ class TestAPIBasics(DNSDistTest):
 
         for server in content['servers']:
             for key in ['id', 'latency', 'name', 'weight', 'outstanding', 'qpsLimit',
-                        'reuseds', 'state', 'address', 'pools', 'qps', 'queries', 'order', 'sendErrors']:
+                        'reuseds', 'state', 'address', 'pools', 'qps', 'queries', 'order', 'sendErrors',
+                        'tcpCurrentConnections', 'tcpDiedSendingQuery', 'tcpDiedReadingResponse',
+                        'tcpGaveUp', 'tcpReadTimeouts', 'tcpWriteTimeouts', 'tcpNewConnections',
+                        'tcpReusedConnections', 'tcpTooManyConcurrentConnections', 'latencyP50', 'latencyP99',
+                        'latencyP999']:
                 self.assertIn(key, server)
 
             for key in ['id', 'latency', 'weight', 'outstanding', 'qpsLimit', 'reuseds',
-                        'qps', 'queries', 'order']:
+                        'qps', 'queries', 'order', 'tcpCurrentConnections', 'tcpDiedSendingQuery',
+                        'tcpDiedReadingResponse', 'tcpGaveUp', 'tcpReadTimeouts', 'tcpWriteTimeouts',
+                        'tcpNewConnections', 'tcpReusedConnections', 'tcpTooManyConcurrentConnections', 'latencyP50',
+                        'latencyP99', 'latencyP999']:
                 self.assertTrue(server[key] >= 0)
 
             self.assertTrue(server['state'] in ['up', 'down', 'UP', 'DOWN'])
 
         for frontend in content['frontends']:
-            for key in ['id', 'address', 'udp', 'tcp', 'queries']:
+            for key in ['id', 'address', 'udp', 'tcp', 'queries', 'tcpCurrentConnections',
+                        'tcpDiedReadingQuery', 'tcpDiedSendingResponse', 'tcpGaveUp', 'tcpClientTimeouts',
+                        'tcpDownstreamTimeouts', 'tcpAvgQueriesPerConnection', 'tcpAvgConnectionDuration',
+                        'latencyP50', 'latencyP99', 'latencyP999']:
                 self.assertIn(key, frontend)
 
-            for key in ['id', 'queries']:
+            for key in ['id', 'queries', 'tcpCurrentConnections', 'tcpDiedReadingQuery',
+                        'tcpDiedSendingResponse', 'tcpGaveUp', 'tcpClientTimeouts', 'tcpDownstreamTimeouts',
+                        'tcpAvgQueriesPerConnection', 'tcpAvgConnectionDuration', 'latencyP50', 'latencyP99', 'latencyP999']:
                 self.assertTrue(frontend[key] >= 0)
 
         for pool in content['pools']:
-            for key in ['id', 'name', 'cacheSize', 'cacheEntries', 'cacheHits', 'cacheMisses', 'cacheDeferredInserts', 'cacheDeferredLookups', 'cacheLookupCollisions', 'cacheInsertCollisions', 'cacheTTLTooShorts']:
+            for key in ['id', 'name', 'cacheSize', 'cacheEntries', 'cacheHits', 'cacheMisses', 'cacheDeferredInserts', 'cacheDeferredLookups', 'cacheLookupCollisions', 'cacheInsertCollisions', 'cacheTTLTooShorts', 'latencyP50', 'latencyP99', 'latencyP999']:
                 self.assertIn(key, pool)
 
-            for key in ['id', 'cacheSize', 'cacheEntries', 'cacheHits', 'cacheMisses', 'cacheDeferredInserts', 'cacheDeferredLookups', 'cacheLookupCollisions', 'cacheInsertCollisions', 'cacheTTLTooShorts']:
+            for key in ['id', 'cacheSize', 'cacheEntries', 'cacheHits', 'cacheMisses', 'cacheDeferredInserts', 'cacheDeferredLookups', 'cacheLookupCollisions', 'cacheInsertCollisions', 'cacheTTLTooShorts', 'latencyP50', 'latencyP99', 'latencyP999']:
                 self.assertTrue(pool[key] >= 0)
 
     def testServersIDontExist(self):
@@ -222,7 +234,8 @@ class TestAPIBasics(DNSDistTest):
                     'latency-avg1000000', 'uptime', 'real-memory-usage', 'noncompliant-queries',
                     'noncompliant-responses', 'rdqueries', 'empty-queries', 'cache-hits',
                     'cache-misses', 'cpu-user-msec', 'cpu-sys-msec', 'fd-usage', 'dyn-blocked',
-                    'dyn-block-nmg-size', 'rule-servfail']
+                    'dyn-block-nmg-size', 'rule-servfail', 'tcp-current-connections',
+                    'tcp-queued-connections']
 
         for key in expected:
             self.assertIn(key, values)
@@ -252,7 +265,7 @@ class TestAPIBasics(DNSDistTest):
                     'noncompliant-responses', 'rdqueries', 'empty-queries', 'cache-hits',
                     'cache-misses', 'cpu-user-msec', 'cpu-sys-msec', 'fd-usage', 'dyn-blocked',
                     'dyn-block-nmg-size', 'packetcache-hits', 'packetcache-misses', 'over-capacity-drops',
-                    'too-old-drops']
+                    'too-old-drops', 'tcp-current-connections', 'tcp-queued-connections']
 
         for key in expected:
             self.assertIn(key, content)
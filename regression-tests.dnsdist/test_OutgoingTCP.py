@@ -0,0 +1,290 @@
+#!/usr/bin/env python
+import socket
+import struct
+import threading
+import time
+import dns
+import requests
+from dnsdisttests import DNSDistTest, range
+
+class OutgoingTCPTest(DNSDistTest):
+    """
+    Base class for the tests of the TCP connections from dnsdist to the backend.
+    Contrary to the regular TCP responder, the backend used here keeps the connections
+    open and answers as many queries as it gets over them, and records the connection
+    every query was received over.
+    Queries for a name starting with 'pipelined' are held until a second one has been
+    received over the same connection, then both are answered in reverse order.
+    Queries for a name starting with 'slow' are answered after a second.
+    """
+
+    _webTimeout = 2.0
+    _webServerPort = 8084
+    _webServerBasicAuthPassword = 'secret'
+    _webServerAPIKey = 'apisecret'
+
+    @classmethod
+    def startResponders(cls):
+        print("Launching responders..")
+        cls._backendLock = threading.Lock()
+        cls._backendConnections = 0
+        cls._backendClosedConnections = set()
+        cls._backendQueries = {}
+
+        cls._UDPResponder = threading.Thread(name='UDP Responder', target=cls.UDPResponder, args=[cls._testServerPort, cls._toResponderQueue, cls._fromResponderQueue])
+        cls._UDPResponder.setDaemon(True)
+        cls._UDPResponder.start()
+        cls._TCPResponder = threading.Thread(name='TCP Responder', target=cls.PersistentTCPResponder, args=[cls._testServerPort])
+        cls._TCPResponder.setDaemon(True)
+        cls._TCPResponder.start()
+
+    @classmethod
+    def PersistentTCPResponder(cls, port):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+        sock.bind(("127.0.0.1", port))
+        sock.listen(100)
+        while True:
+            (conn, _) = sock.accept()
+            with cls._backendLock:
+                cls._backendConnections = cls._backendConnections + 1
+                connectionID = cls._backendConnections
+            thread = threading.Thread(name='TCP Connection Handler', target=cls.handleBackendConnection, args=[conn, connectionID])
+            thread.setDaemon(True)
+            thread.start()
+
+    @classmethod
+    def recvExactly(cls, conn, size):
+        data = b''
+        while len(data) < size:
+            chunk = conn.recv(size - len(data))
+            if not chunk:
+                return None
+            data = data + chunk
+        return data
+
+    @classmethod
+    def sendBackendResponse(cls, conn, request):
+        response = dns.message.make_response(request)
+        name = request.question[0].name
+        if request.question[0].rdtype == dns.rdatatype.AXFR:
+            soa = dns.rrset.from_text(name, 60, dns.rdataclass.IN, dns.rdatatype.SOA,
+                                      'ns.' + str(name) + ' hostmaster.' + str(name) + ' 1 3600 3600 3600 60')
+            response.answer.append(soa)
+            response.answer.append(dns.rrset.from_text(name, 60, dns.rdataclass.IN, dns.rdatatype.A, '192.0.2.1'))
+            response.answer.append(soa)
+        else:
+            response.answer.append(dns.rrset.from_text(name, 60, dns.rdataclass.IN, dns.rdatatype.A, '192.0.2.1'))
+        wire = response.to_wire()
+        conn.send(struct.pack("!H", len(wire)) + wire)
+
+    @classmethod
+    def handleBackendConnection(cls, conn, connectionID):
+        pending = []
+        while True:
+            try:
+                data = cls.recvExactly(conn, 2)
+                if data:
+                    (datalen,) = struct.unpack("!H", data)
+                    data = cls.recvExactly(conn, datalen)
+            except socket.error:
+                data = None
+
+            if not data:
+                with cls._backendLock:
+                    cls._backendClosedConnections.add(connectionID)
+                conn.close()
+                return
+
+            request = dns.message.from_wire(data)
+            name = str(request.question[0].name)
+            with cls._backendLock:
+                cls._backendQueries[name] = connectionID
+
+            try:
+                if name.startswith('pipelined'):
+                    pending.append(request)
+                    if len(pending) == 2:
+                        for held in reversed(pending):
+                            cls.sendBackendResponse(conn, held)
+                        pending = []
+                    continue
+
+                if name.startswith('slow'):
+                    time.sleep(1)
+
+                cls.sendBackendResponse(conn, request)
+            except socket.error:
+                pass
+
+    def getBackendConnectionForName(self, name):
+        with self._backendLock:
+            return self._backendQueries.get(name)
+
+    def getServerStats(self):
+        headers = {'x-api-key': self._webServerAPIKey}
+        url = 'http://127.0.0.1:' + str(self._webServerPort) + '/api/v1/servers/localhost'
+        r = requests.get(url, headers=headers, timeout=self._webTimeout)
+        self.assertTrue(r)
+        self.assertEquals(r.status_code, 200)
+        return r.json()['servers'][0]
+
+    def checkResponse(self, query, response, rdtype=dns.rdatatype.A):
+        self.assertTrue(response)
+        self.assertEquals(response.id, query.id)
+        self.assertEquals(response.question, query.question)
+        self.assertEquals(response.answer[0].rdtype, rdtype)
+
+class TestOutgoingTCPReuse(OutgoingTCPTest):
+
+    _testServerPort = 5380
+    _config_params = ['_testServerPort', '_webServerPort', '_webServerBasicAuthPassword', '_webServerAPIKey']
+    _config_template = """
+    s = newServer{address="127.0.0.1:%s"}
+    s:setUp()
+    webserver("127.0.0.1:%s", "%s", "%s")
+    """
+
+    def testReuseAcrossClients(self):
+        """
+        Outgoing TCP: The connection to the backend is reused for a different client connection
+        """
+        before = self.getServerStats()
+
+        for idx in range(3):
+            name = '%d.reuse.outgoing-tcp.tests.powerdns.com.' % (idx)
+            query = dns.message.make_query(name, 'A', 'IN')
+            conn = self.openTCPConnection(2.0)
+            self.sendTCPQueryOverConnection(conn, query)
+            self.checkResponse(query, self.recvTCPResponseOverConnection(conn))
+            conn.close()
+            # make sure that dnsdist is done with the client connection
+            time.sleep(0.1)
+
+        first = self.getBackendConnectionForName('0.reuse.outgoing-tcp.tests.powerdns.com.')
+        self.assertTrue(first)
+        for idx in range(1, 3):
+            self.assertEquals(self.getBackendConnectionForName('%d.reuse.outgoing-tcp.tests.powerdns.com.' % (idx)), first)
+
+        after = self.getServerStats()
+        self.assertEquals(after['tcpNewConnections'] - before['tcpNewConnections'], 1)
+        self.assertEquals(after['tcpReusedConnections'] - before['tcpReusedConnections'], 2)
+
+class TestOutgoingTCPPipelining(OutgoingTCPTest):
+
+    _testServerPort = 5381
+    _config_params = ['_testServerPort', '_webServerPort', '_webServerBasicAuthPassword', '_webServerAPIKey']
+    _config_template = """
+    -- a single worker, so that queries from different client connections can be pipelined
+    setMaxTCPClientThreads(1)
+    s = newServer{address="127.0.0.1:%s", maxInFlight=10}
+    s:setUp()
+    webserver("127.0.0.1:%s", "%s", "%s")
+    """
+
+    def testOutOfOrderResponses(self):
+        """
+        Outgoing TCP: Responses received out of order over a pipelined connection go back to the right client
+        """
+        name1 = 'pipelined1.outgoing-tcp.tests.powerdns.com.'
+        name2 = 'pipelined2.outgoing-tcp.tests.powerdns.com.'
+        query1 = dns.message.make_query(name1, 'A', 'IN')
+        query2 = dns.message.make_query(name2, 'A', 'IN')
+        # use the same ID for both queries, so that dnsdist has to rewrite at least one of them
+        query2.id = query1.id
+
+        conn1 = self.openTCPConnection(2.0)
+        conn2 = self.openTCPConnection(2.0)
+        self.sendTCPQueryOverConnection(conn1, query1)
+        time.sleep(0.2)
+        self.sendTCPQueryOverConnection(conn2, query2)
+
+        # the backend answers the second query first
+        self.checkResponse(query2, self.recvTCPResponseOverConnection(conn2))
+        self.checkResponse(query1, self.recvTCPResponseOverConnection(conn1))
+        conn1.close()
+        conn2.close()
+
+        # both queries went over the same connection to the backend
+        self.assertTrue(self.getBackendConnectionForName(name1))
+        self.assertEquals(self.getBackendConnectionForName(name1), self.getBackendConnectionForName(name2))
+
+    def testXFRGetsItsOwnConnection(self):
+        """
+        Outgoing TCP: An AXFR is not sent over a connection used by other queries, which is closed afterwards
+        """
+        slowName = 'slow.xfr.outgoing-tcp.tests.powerdns.com.'
+        xfrName = 'xfr.outgoing-tcp.tests.powerdns.com.'
+        afterName = 'after.xfr.outgoing-tcp.tests.powerdns.com.'
+        slowQuery = dns.message.make_query(slowName, 'A', 'IN')
+        xfrQuery = dns.message.make_query(xfrName, 'AXFR', 'IN')
+        afterQuery = dns.message.make_query(afterName, 'A', 'IN')
+
+        # keep a query in flight, so that the connection could have been used for the AXFR
+        conn1 = self.openTCPConnection(2.0)
+        self.sendTCPQueryOverConnection(conn1, slowQuery)
+        time.sleep(0.2)
+
+        conn2 = self.openTCPConnection(2.0)
+        self.sendTCPQueryOverConnection(conn2, xfrQuery)
+        self.checkResponse(xfrQuery, self.recvTCPResponseOverConnection(conn2), dns.rdatatype.SOA)
+        conn2.close()
+
+        self.checkResponse(slowQuery, self.recvTCPResponseOverConnection(conn1))
+        conn1.close()
+
+        xfrConnection = self.getBackendConnectionForName(xfrName)
+        self.assertTrue(xfrConnection)
+        self.assertNotEquals(xfrConnection, self.getBackendConnectionForName(slowName))
+
+        # the connection used for the AXFR is not reused
+        time.sleep(0.5)
+        with self._backendLock:
+            self.assertIn(xfrConnection, self._backendClosedConnections)
+
+        conn = self.openTCPConnection(2.0)
+        self.sendTCPQueryOverConnection(conn, afterQuery)
+        self.checkResponse(afterQuery, self.recvTCPResponseOverConnection(conn))
+        conn.close()
+        self.assertNotEquals(self.getBackendConnectionForName(afterName), xfrConnection)
+
+class TestOutgoingTCPMaxConcurrentConnections(OutgoingTCPTest):
+
+    _testServerPort = 5382
+    _config_params = ['_testServerPort', '_webServerPort', '_webServerBasicAuthPassword', '_webServerAPIKey']
+    _config_template = """
+    s = newServer{address="127.0.0.1:%s", maxConcurrentTCPConnections=1}
+    s:setUp()
+    webserver("127.0.0.1:%s", "%s", "%s")
+    """
+
+    def testMaxConcurrentConnections(self):
+        """
+        Outgoing TCP: Queries are refused once maxConcurrentTCPConnections connections to the backend are busy
+        """
+        slowQuery = dns.message.make_query('slow.maxconcurrent.outgoing-tcp.tests.powerdns.com.', 'A', 'IN')
+        query = dns.message.make_query('refused.maxconcurrent.outgoing-tcp.tests.powerdns.com.', 'A', 'IN')
+        before = self.getServerStats()
+
+        conn1 = self.openTCPConnection(2.0)
+        self.sendTCPQueryOverConnection(conn1, slowQuery)
+        time.sleep(0.2)
+
+        # the only connection allowed is busy, dnsdist gives up on that query and closes the client connection
+        conn2 = self.openTCPConnection(2.0)
+        self.sendTCPQueryOverConnection(conn2, query)
+        self.assertEquals(self.recvTCPResponseOverConnection(conn2), None)
+        conn2.close()
+
+        self.checkResponse(slowQuery, self.recvTCPResponseOverConnection(conn1))
+        conn1.close()
+
+        after = self.getServerStats()
+        self.assertEquals(after['tcpTooManyConcurrentConnections'] - before['tcpTooManyConcurrentConnections'], 1)
+        self.assertEquals(after['tcpGaveUp'] - before['tcpGaveUp'], 1)
+
+        # once the connection is idle again, it can be used
+        conn = self.openTCPConnection(2.0)
+        self.sendTCPQueryOverConnection(conn, query)
+        self.checkResponse(query, self.recvTCPResponseOverConnection(conn))
+        conn.close()
@@ -1,4 +1,6 @@
 #!/usr/bin/env python
+import base64
+import socket
 import threading
 import time
 import dns
@@ -290,6 +292,175 @@ class TestRoutingOrder(DNSDistTest):
             self.assertEquals(self._responsesCounter['TCP Responder'], 0)
         self.assertEquals(self._responsesCounter['TCP Responder 2'], numberOfQueries)
 
+class TestRoutingConsistentHashing(DNSDistTest):
+
+    _consoleKey = DNSDistTest.generateConsoleKey()
+    _consoleKeyB64 = base64.b64encode(_consoleKey).decode('ascii')
+    _testServer2Port = 5351
+    _config_params = ['_consoleKeyB64', '_consolePort', '_testServerPort', '_testServer2Port']
+    _config_template = """
+    setKey("%s")
+    controlSocket("127.0.0.1:%s")
+    setServerPolicy(chashed)
+    s1 = newServer{address="127.0.0.1:%s"}
+    s1:setUp()
+    s2 = newServer{address="127.0.0.1:%s"}
+    s2:setUp()
+    """
+
+    @classmethod
+    def startResponders(cls):
+        print("Launching responders..")
+        cls._UDPResponder = threading.Thread(name='UDP Responder', target=cls.UDPResponder, args=[cls._testServerPort, cls._toResponderQueue, cls._fromResponderQueue])
+        cls._UDPResponder.setDaemon(True)
+        cls._UDPResponder.start()
+        cls._UDPResponder2 = threading.Thread(name='UDP Responder 2', target=cls.UDPResponder, args=[cls._testServer2Port, cls._toResponderQueue, cls._fromResponderQueue])
+        cls._UDPResponder2.setDaemon(True)
+        cls._UDPResponder2.start()
+
+        cls._TCPResponder = threading.Thread(name='TCP Responder', target=cls.TCPResponder, args=[cls._testServerPort, cls._toResponderQueue, cls._fromResponderQueue])
+        cls._TCPResponder.setDaemon(True)
+        cls._TCPResponder.start()
+
+        cls._TCPResponder2 = threading.Thread(name='TCP Responder 2', target=cls.TCPResponder, args=[cls._testServer2Port, cls._toResponderQueue, cls._fromResponderQueue])
+        cls._TCPResponder2.setDaemon(True)
+        cls._TCPResponder2.start()
+
+    def getBackendForName(self, name):
+        """
+        Sends a query for name and returns the name of the responder thread it was routed to
+        """
+        before = dict(self._responsesCounter)
+        query = dns.message.make_query(name, 'A', 'IN')
+        response = dns.message.make_response(query)
+        (receivedQuery, receivedResponse) = self.sendUDPQuery(query, response)
+        self.assertTrue(receivedQuery)
+        self.assertEquals(response, receivedResponse)
+        for key in self._responsesCounter:
+            if self._responsesCounter[key] != before.get(key, 0):
+                return key
+        return None
+
+    def testCHashedDistribution(self):
+        """
+        Routing: Consistent hashing distributes names over all the backends
+
+        Send A queries for 100 different names, check that each backend gets
+        a reasonable share of them.
+        """
+        numberOfNames = 100
+        for idx in range(numberOfNames):
+            name = '%d.distribution.chashed.routing.tests.powerdns.com.' % (idx)
+            self.assertTrue(self.getBackendForName(name))
+
+        self.assertEquals(self._responsesCounter.get('UDP Responder', 0) + self._responsesCounter.get('UDP Responder 2', 0), numberOfNames)
+        self.assertGreaterEqual(self._responsesCounter.get('UDP Responder', 0), numberOfNames / 4)
+        self.assertGreaterEqual(self._responsesCounter.get('UDP Responder 2', 0), numberOfNames / 4)
+
+    def testCHashedStickiness(self):
+        """
+        Routing: Consistent hashing keeps a name on the same backend
+
+        Send A queries for 50 different names twice, check that a given name is
+        always routed to the same backend. Then double the weight of the first
+        backend and check that the names it had are not moved, and that only
+        names from the second one moved to it.
+        """
+        numberOfNames = 50
+        names = ['%d.stickiness.chashed.routing.tests.powerdns.com.' % (idx) for idx in range(numberOfNames)]
+        backends = {}
+        for name in names:
+            backends[name] = self.getBackendForName(name)
+            self.assertTrue(backends[name])
+
+        for name in names:
+            self.assertEquals(self.getBackendForName(name), backends[name])
+
+        self.sendConsoleCommand('s1.weight = 2')
+        try:
+            self.assertEquals(self.sendConsoleCommand('s1.weight').strip(), '2')
+            moved = 0
+            for name in names:
+                backend = self.getBackendForName(name)
+                if backend != backends[name]:
+                    self.assertEquals(backends[name], 'UDP Responder 2')
+                    self.assertEquals(backend, 'UDP Responder')
+                    moved = moved + 1
+            # the second backend gives up a third of its share, so about a sixth of the names move
+            self.assertGreater(moved, 0)
+            self.assertLess(moved, numberOfNames / 2)
+        finally:
+            self.sendConsoleCommand('s1.weight = 1')
+
+        for name in names:
+            self.assertEquals(self.getBackendForName(name), backends[name])
+
+class TestRoutingConsistentHashingBoundedLoad(DNSDistTest):
+
+    _testServer2Port = 5351
+    _config_params = ['_testServerPort', '_testServer2Port']
+    _config_template = """
+    setServerPolicy(chashed)
+    setConsistentHashingBalancingFactor(1.5)
+    s1 = newServer{address="127.0.0.1:%s"}
+    s1:setUp()
+    s2 = newServer{address="127.0.0.1:%s"}
+    s2:setUp()
+    """
+
+    @classmethod
+    def UDPBlackhole(cls, port):
+        """
+        Counts the queries it receives but never answers them,
+        so that they stay outstanding in dnsdist until they time out
+        """
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+        sock.bind(("127.0.0.1", port))
+        while True:
+            data, _ = sock.recvfrom(4096)
+            request = dns.message.from_wire(data)
+            if len(request.question) == 1 and str(request.question[0].name).endswith('tests.powerdns.com.'):
+                cls._ResponderIncrementCounter()
+        sock.close()
+
+    @classmethod
+    def startResponders(cls):
+        print("Launching responders..")
+        cls._UDPResponder = threading.Thread(name='UDP Blackhole', target=cls.UDPBlackhole, args=[cls._testServerPort])
+        cls._UDPResponder.setDaemon(True)
+        cls._UDPResponder.start()
+        cls._UDPResponder2 = threading.Thread(name='UDP Responder 2', target=cls.UDPResponder, args=[cls._testServer2Port, cls._toResponderQueue, cls._fromResponderQueue])
+        cls._UDPResponder2.setDaemon(True)
+        cls._UDPResponder2.start()
+
+    def testCHashedBoundedLoad(self):
+        """
+        Routing: Consistent hashing with bounded load
+
+        The first backend never answers. Send A queries for 100 different names
+        without waiting for the responses, check that once the first backend has
+        more than 1.5 times the average number of outstanding queries, the names
+        that should have been routed to it go to the second backend instead.
+        """
+        numberOfNames = 100
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        for idx in range(numberOfNames):
+            name = '%d.boundedload.chashed.routing.tests.powerdns.com.' % (idx)
+            query = dns.message.make_query(name, 'A', 'IN')
+            sock.sendto(query.to_wire(), ("127.0.0.1", self._dnsDistPort))
+        sock.close()
+
+        # the blackholed queries do not time out for 2s
+        time.sleep(1)
+
+        blackholed = self._responsesCounter.get('UDP Blackhole', 0)
+        answered = self._responsesCounter.get('UDP Responder 2', 0)
+        self.assertEquals(blackholed + answered, numberOfNames)
+        # without a balancing factor, about half of the names would have been sent to the first backend
+        self.assertGreater(blackholed, 0)
+        self.assertLess(blackholed, numberOfNames / 4)
+
 class TestRoutingNoServer(DNSDistTest):
 
     _config_template = """
@@ -0,0 +1,214 @@
+#!/usr/bin/env python
+import socket
+import struct
+import threading
+import time
+import dns
+import requests
+from dnsdisttests import DNSDistTest, range
+
+class TCPWorkersTest(DNSDistTest):
+    """
+    Base class for the tests of the TCP workers state machine. A single worker
+    is used, so a client or a backend blocking it would delay every other query.
+    """
+
+    _webTimeout = 2.0
+    _webServerPort = 8085
+    _webServerBasicAuthPassword = 'secret'
+    _webServerAPIKey = 'apisecret'
+
+    def getStats(self):
+        headers = {'x-api-key': self._webServerAPIKey}
+        url = 'http://127.0.0.1:' + str(self._webServerPort) + '/api/v1/servers/localhost'
+        r = requests.get(url, headers=headers, timeout=self._webTimeout)
+        self.assertTrue(r)
+        self.assertEquals(r.status_code, 200)
+        return r.json()
+
+    def getTCPFrontendStats(self):
+        for frontend in self.getStats()['frontends']:
+            if frontend['tcp']:
+                return frontend
+        return None
+
+    def checkQueryIsAnswered(self, name):
+        query = dns.message.make_query(name, 'A', 'IN')
+        conn = self.openTCPConnection(2.0)
+        start = time.time()
+        self.sendTCPQueryOverConnection(conn, query)
+        response = self.recvTCPResponseOverConnection(conn)
+        end = time.time()
+        conn.close()
+        self.assertTrue(response)
+        self.assertEquals(response.id, query.id)
+        self.assertEquals(response.question, query.question)
+        return end - start
+
+class TestTCPWorkersClients(TCPWorkersTest):
+
+    _tcpRecvTimeout = 2
+    _config_params = ['_testServerPort', '_tcpRecvTimeout', '_webServerPort', '_webServerBasicAuthPassword', '_webServerAPIKey']
+    _config_template = """
+    newServer{address="127.0.0.1:%s"}
+    setMaxTCPClientThreads(1)
+    setTCPRecvTimeout(%s)
+    webserver("127.0.0.1:%s", "%s", "%s")
+    """
+
+    def testPartialQuery(self):
+        """
+        TCP Workers: A query received in several pieces is answered
+        """
+        name = 'partial.tcp-workers.tests.powerdns.com.'
+        query = dns.message.make_query(name, 'A', 'IN')
+        wire = query.to_wire()
+        payload = struct.pack("!H", len(wire)) + wire
+
+        conn = self.openTCPConnection(2.0)
+        # the size, split in two, then the query itself in three parts
+        for chunk in [payload[:1], payload[1:2], payload[2:10], payload[10:20], payload[20:]]:
+            conn.send(chunk)
+            time.sleep(0.1)
+
+        response = self.recvTCPResponseOverConnection(conn)
+        conn.close()
+        self.assertTrue(response)
+        self.assertEquals(response.id, query.id)
+        self.assertEquals(response.question, query.question)
+
+    def testStalledClient(self):
+        """
+        TCP Workers: A client stalled in the middle of a query does not block other clients and is closed after the timeout
+        """
+        before = self.getTCPFrontendStats()
+
+        stalled = self.openTCPConnection(5.0)
+        start = time.time()
+        # only the first byte of the size
+        stalled.send(b'\x00')
+        time.sleep(0.2)
+
+        # another client is served right away by the same worker
+        self.assertLess(self.checkQueryIsAnswered('notstalled.tcp-workers.tests.powerdns.com.'), 1.0)
+
+        # the stalled one is closed once the read timeout has expired
+        data = stalled.recv(2)
+        end = time.time()
+        stalled.close()
+        self.assertFalse(data)
+        self.assertGreaterEqual(end - start, self._tcpRecvTimeout - 0.5)
+        self.assertLess(end - start, self._tcpRecvTimeout + 2)
+
+        after = self.getTCPFrontendStats()
+        self.assertEquals(after['tcpClientTimeouts'] - before['tcpClientTimeouts'], 1)
+
+    def testSlowReader(self):
+        """
+        TCP Workers: A large response sent to a client reading it slowly does not block other clients
+        """
+        name = 'slowreader.tcp-workers.tests.powerdns.com.'
+        query = dns.message.make_query(name, 'TXT', 'IN')
+        response = dns.message.make_response(query)
+        # distinct records, close to the maximum size of a DNS message over TCP
+        records = ['"%03d%s"' % (idx, 'A' * 196) for idx in range(280)]
+        response.answer.append(dns.rrset.from_text_list(name, 60, dns.rdataclass.IN, dns.rdatatype.TXT, records))
+        expected = response.to_wire()
+        self.assertGreater(len(expected), 50000)
+
+        conn = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        # a small receive buffer so that dnsdist cannot write the whole response at once
+        conn.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        conn.settimeout(2.0)
+        conn.connect(("127.0.0.1", self._dnsDistPort))
+        self.sendTCPQueryOverConnection(conn, query, response=response)
+
+        data = conn.recv(2)
+        self.assertEquals(len(data), 2)
+        (datalen,) = struct.unpack("!H", data)
+        self.assertEquals(datalen, len(expected))
+        received = conn.recv(1024)
+        # stop reading for a while, leaving dnsdist with a partially written response
+        time.sleep(0.5)
+
+        self.assertLess(self.checkQueryIsAnswered('notslowreader.tcp-workers.tests.powerdns.com.'), 1.0)
+
+        while len(received) < datalen:
+            chunk = conn.recv(4096)
+            if not chunk:
+                break
+            received = received + chunk
+            time.sleep(0.01)
+        conn.close()
+
+        self.assertEquals(len(received), datalen)
+        receivedResponse = dns.message.from_wire(received)
+        receivedResponse.id = response.id
+        self.assertEquals(receivedResponse, response)
+
+class TestTCPWorkersBackendTimeout(TCPWorkersTest):
+
+    _testServerPort = 5383
+    _backendRecvTimeout = 1
+    _config_params = ['_testServerPort', '_backendRecvTimeout', '_webServerPort', '_webServerBasicAuthPassword', '_webServerAPIKey']
+    _config_template = """
+    s = newServer{address="127.0.0.1:%s", tcpRecvTimeout=%s, retries=0}
+    s:setUp()
+    setMaxTCPClientThreads(1)
+    webserver("127.0.0.1:%s", "%s", "%s")
+    """
+
+    @classmethod
+    def startResponders(cls):
+        print("Launching responders..")
+
+        cls._TCPResponder = threading.Thread(name='TCP Blackhole', target=cls.TCPBlackhole, args=[cls._testServerPort])
+        cls._TCPResponder.setDaemon(True)
+        cls._TCPResponder.start()
+
+    @classmethod
+    def TCPBlackhole(cls, port):
+        """
+        Accepts connections, but never reads from them nor answers
+        """
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+        sock.bind(("127.0.0.1", port))
+        sock.listen(100)
+        conns = []
+        while True:
+            (conn, _) = sock.accept()
+            # keep a reference so the connection is not closed
+            conns.append(conn)
+
+    def testBackendTimeout(self):
+        """
+        TCP Workers: Queries sent to a backend not answering are given up after the timeout, without blocking the worker
+        """
+        name = 'backendtimeout.tcp-workers.tests.powerdns.com.'
+        query = dns.message.make_query(name, 'A', 'IN')
+        before = self.getStats()['servers'][0]
+
+        conn = self.openTCPConnection(5.0)
+        start = time.time()
+        self.sendTCPQueryOverConnection(conn, query)
+        time.sleep(0.2)
+
+        # the worker is still reading queries from other clients in the meantime
+        other = self.openTCPConnection(5.0)
+        self.sendTCPQueryOverConnection(other, query)
+
+        for sock in [conn, other]:
+            response = None
+            try:
+                response = self.recvTCPResponseOverConnection(sock)
+            except socket.timeout:
+                pass
+            sock.close()
+            self.assertFalse(response)
+        end = time.time()
+        self.assertLess(end - start, self._backendRecvTimeout + 3)
+
+        after = self.getStats()['servers'][0]
+        self.assertEquals(after['tcpReadTimeouts'] - before['tcpReadTimeouts'], 2)
+        self.assertEquals(after['tcpGaveUp'] - before['tcpGaveUp'], 2)
@@ -0,0 +1,151 @@
+#!/usr/bin/env python
+import base64
+import binascii
+import os
+import subprocess
+import sys
+import unittest
+import dns
+from dnsdisttests import DNSDistTest
+
+# Attaching an XDP program requires root privileges and a dnsdist built with eBPF support,
+# so these tests are only run when DNSDIST_XDP_TESTS is set.
+# Queries are sent over a pair of virtual ethernet interfaces, from a separate network
+# namespace, since XDP does not see the traffic going over the loopback interface.
+@unittest.skipUnless('DNSDIST_XDP_TESTS' in os.environ, 'XDP tests are disabled')
+class TestXDP(DNSDistTest):
+
+    _namespace = 'dnsdistxdp'
+    _interface = 'dnsdistxdp0'
+    _peerInterface = 'dnsdistxdp1'
+    _localAddress = '192.0.2.1'
+    _clientAddress = '192.0.2.2'
+    _acl = ['127.0.0.1/32', '192.0.2.0/24']
+    _consoleKey = DNSDistTest.generateConsoleKey()
+    _consoleKeyB64 = base64.b64encode(_consoleKey).decode('ascii')
+    _config_params = ['_consoleKeyB64', '_consolePort', '_localAddress', '_dnsDistPort', '_interface']
+    _config_template = """
+    setKey("%s")
+    controlSocket("127.0.0.1:%s")
+    addLocal("%s:%d")
+    addAction(AllRule(), SpoofAction("192.0.2.42"))
+    bpf = newBPFFilter(1024, 1024, 1024)
+    setDefaultBPFFilter(bpf)
+    bpf:blockQName(newDNSName("blocked.xdp.tests.powerdns.com."), 1)
+    xdpAttached = bpf:attachXDP("%s", "generic")
+    """
+
+    # sends the query from the network namespace, prints the response in hex if any
+    _clientScript = """
+import binascii, socket, sys
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+sock.settimeout(1.0)
+sock.sendto(binascii.unhexlify(sys.argv[1]), (sys.argv[2], int(sys.argv[3])))
+try:
+    sys.stdout.write(binascii.hexlify(sock.recv(4096)).decode('ascii'))
+except socket.timeout:
+    pass
+"""
+
+    @classmethod
+    def setUpInterfaces(cls):
+        commands = [
+            ['ip', 'netns', 'add', cls._namespace],
+            ['ip', 'link', 'add', cls._interface, 'type', 'veth', 'peer', 'name', cls._peerInterface],
+            ['ip', 'link', 'set', cls._peerInterface, 'netns', cls._namespace],
+            ['ip', 'addr', 'add', cls._localAddress + '/24', 'dev', cls._interface],
+            ['ip', 'link', 'set', cls._interface, 'up'],
+            ['ip', 'netns', 'exec', cls._namespace, 'ip', 'addr', 'add', cls._clientAddress + '/24', 'dev', cls._peerInterface],
+            ['ip', 'netns', 'exec', cls._namespace, 'ip', 'link', 'set', cls._peerInterface, 'up'],
+        ]
+        for command in commands:
+            subprocess.check_call(command)
+
+    @classmethod
+    def tearDownInterfaces(cls):
+        # removing one end of the pair removes the other one, and the XDP program with it
+        subprocess.call(['ip', 'link', 'del', cls._interface])
+        subprocess.call(['ip', 'netns', 'del', cls._namespace])
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tearDownInterfaces()
+        cls.setUpInterfaces()
+        super(TestXDP, cls).setUpClass()
+
+    @classmethod
+    def tearDownClass(cls):
+        super(TestXDP, cls).tearDownClass()
+        cls.tearDownInterfaces()
+
+    def sendQueryFromNamespace(self, query):
+        wire = binascii.hexlify(query.to_wire()).decode('ascii')
+        output = subprocess.check_output(['ip', 'netns', 'exec', self._namespace, sys.executable, '-c', self._clientScript, wire, self._localAddress, str(self._dnsDistPort)])
+        if not output:
+            return None
+        return dns.message.from_wire(binascii.unhexlify(output.strip()))
+
+    def getXDPDrops(self, table):
+        return int(self.sendConsoleCommand('bpf:getXDPDrops("%s")' % (table)))
+
+    def testXDPAttached(self):
+        """
+        XDP: The program has been attached to the interface
+        """
+        self.assertEquals(self.sendConsoleCommand('xdpAttached').strip(), 'true')
+
+    def testXDPPass(self):
+        """
+        XDP: Queries not matching any block are passed to dnsdist
+        """
+        name = 'pass.xdp.tests.powerdns.com.'
+        query = dns.message.make_query(name, 'A', 'IN')
+        receivedResponse = self.sendQueryFromNamespace(query)
+        self.assertTrue(receivedResponse)
+        self.assertEquals(receivedResponse.id, query.id)
+        self.assertEquals(len(receivedResponse.answer), 1)
+
+        # only the A type is blocked for that name
+        name = 'blocked.xdp.tests.powerdns.com.'
+        query = dns.message.make_query(name, 'AAAA', 'IN')
+        receivedResponse = self.sendQueryFromNamespace(query)
+        self.assertTrue(receivedResponse)
+        self.assertEquals(receivedResponse.id, query.id)
+
+    def testXDPQNameDrop(self):
+        """
+        XDP: Queries for a blocked qname are dropped by the XDP program
+        """
+        name = 'blocked.xdp.tests.powerdns.com.'
+        query = dns.message.make_query(name, 'A', 'IN')
+        dropsBefore = self.getXDPDrops('qnames')
+
+        receivedResponse = self.sendQueryFromNamespace(query)
+        self.assertEquals(receivedResponse, None)
+        self.assertEquals(self.getXDPDrops('qnames'), dropsBefore + 1)
+
+        # over the loopback interface, the socket filter drops it instead
+        (_, receivedResponse) = self.sendUDPQuery(query, response=None, useQueue=False)
+        self.assertEquals(receivedResponse, None)
+        self.assertEquals(self.getXDPDrops('qnames'), dropsBefore + 1)
+
+    def testXDPv4Drop(self):
+        """
+        XDP: Queries from a blocked IPv4 source are dropped by the XDP program
+        """
+        name = 'v4.xdp.tests.powerdns.com.'
+        query = dns.message.make_query(name, 'A', 'IN')
+        dropsBefore = self.getXDPDrops('v4')
+
+        self.sendConsoleCommand('bpf:block(newCA("%s"))' % (self._clientAddress))
+        try:
+            receivedResponse = self.sendQueryFromNamespace(query)
+            self.assertEquals(receivedResponse, None)
+            self.assertEquals(self.getXDPDrops('v4'), dropsBefore + 1)
+        finally:
+            self.sendConsoleCommand('bpf:unblock(newCA("%s"))' % (self._clientAddress))
+
+        receivedResponse = self.sendQueryFromNamespace(query)
+        self.assertTrue(receivedResponse)
+        self.assertEquals(receivedResponse.id, query.id)
+        self.assertEquals(self.getXDPDrops('v4'), dropsBefore + 1)